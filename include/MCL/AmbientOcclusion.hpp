@@ -0,0 +1,240 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Ambient occlusion at the vertices of a triangle mesh, e.g. for contact
+// shading without a GPU. Rays leave each vertex in cosine-weighted
+// directions about its normal (sample::cosine_hemisphere), and the
+// visibility is the fraction that hit nothing within max_dist. Rays stop
+// at the first hit (RayAnyHit on a WideBVH). Samples add up over calls to
+// sample, so the estimate can be refined progressively:
+//
+//	bvh::AmbientOcclusion<float> ao;
+//	ao.init( verts, num_verts, faces, num_faces );
+//	ao.sample( 32 );
+//	ao.get_colors( colors ); // e.g. for RenderMesh::set_colors
+//	ao.sample( 32 ); // now 64 per vertex
+//
+// For a deforming mesh, refit keeps the last frame's visibility as a
+// starting point, counted as at most max_history samples, so a few
+// samples per frame refine it instead of starting over.
+//
+// The directions at a vertex follow a randomly shifted R2 sequence
+// (Roberts, "The Unreasonable Effectiveness of Quasirandom Sequences"),
+// so results don't depend on the number of threads.
+//
+// The verts and faces are not copied, so they must outlive the object.
+//
+
+#ifndef MCL_AMBIENTOCCLUSION_H
+#define MCL_AMBIENTOCCLUSION_H 1
+
+#include "WideBVH.hpp"
+
+namespace mcl {
+namespace bvh {
+
+template <typename T>
+class AmbientOcclusion {
+public:
+	// Hits farther than this don't count. If <= 0 at init, it's
+	// set to a quarter of the mesh's bounding box diagonal.
+	T max_dist;
+
+	AmbientOcclusion() : max_dist(0), verts(nullptr), inds(nullptr), num_verts(0), num_tris(0),
+		offset(0), sequence(0) {}
+
+	// Builds the tree and vertex normals and clears the visibility.
+	// Throws if the mesh is empty.
+	void init( const T *verts, int num_verts, const int *inds, int num_tris,
+		const Settings &settings = Settings() );
+
+	// New vertex positions, same faces. Refits the tree (rebuilding it if
+	// refit suggests so) and recomputes the normals. The current visibility
+	// is kept and counts as at most max_history samples.
+	void refit( const T *verts, int max_history = 32 );
+
+	// Traces num_samples more rays from every vertex, in parallel
+	void sample( int num_samples );
+
+	// Per vertex, 1 if unoccluded and 0 if every ray hit something
+	const std::vector<T> &get_visibility() const { return visibility; }
+
+	// Samples behind the visibility of each vertex
+	const std::vector<int> &get_num_samples() const { return num_samples; }
+
+	// Visibility times color, one per vertex
+	void get_colors( std::vector<Vec3f> &colors, const Vec3f &color = Vec3f(1,1,1) ) const;
+
+	const AABBTree<T,3> &get_tree() const { return tree; }
+
+private:
+	// Area-weighted vertex normals
+	void compute_normals();
+
+	Vec3<T> vert( int idx ) const { return Vec3<T>( verts[idx*3], verts[idx*3+1], verts[idx*3+2] ); }
+
+	// Hashes a vertex index to [0,1) to shift its sequence
+	static T shift( unsigned int i, unsigned int seed );
+
+	AABBTree<T,3> tree;
+	WideBVH<T,3,4> wide_tree;
+	Settings settings;
+	const T *verts;
+	const int *inds;
+	int num_verts, num_tris;
+	T offset; // rays start this far off the surface
+	long sequence; // samples traced from every vertex since init
+	std::vector< Vec3<T> > normals;
+	std::vector<T> visibility;
+	std::vector<int> num_samples;
+
+}; // end class AmbientOcclusion
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T>
+void bvh::AmbientOcclusion<T>::init( const T *verts_, int num_verts_, const int *inds_, int num_tris_,
+	const Settings &settings ){
+
+	if( num_verts_ <= 0 || num_tris_ <= 0 ){
+		throw std::runtime_error("AmbientOcclusion::init Error: No triangles");
+	}
+	verts = verts_;
+	inds = inds_;
+	num_verts = num_verts_;
+	num_tris = num_tris_;
+	this->settings = settings;
+	tree.init( inds, verts, num_tris, settings );
+	wide_tree.init( tree );
+
+	const T diag = tree.get_nodes()[0].aabb.sizes().norm();
+	if( max_dist <= T(0) ){ max_dist = diag*T(0.25); }
+	offset = diag*T(1e-5);
+	sequence = 0;
+	visibility.assign( num_verts, T(1) );
+	num_samples.assign( num_verts, 0 );
+	compute_normals();
+
+} // end init
+
+
+template <typename T>
+void bvh::AmbientOcclusion<T>::refit( const T *verts_, int max_history ){
+
+	verts = verts_;
+	if( tree.refit( verts ) ){ tree.init( inds, verts, num_tris, settings ); }
+	wide_tree.init( tree );
+	compute_normals();
+	for( int i=0; i<num_verts; ++i ){ num_samples[i] = std::min( num_samples[i], std::max( 0, max_history ) ); }
+
+} // end refit
+
+
+template <typename T>
+void bvh::AmbientOcclusion<T>::compute_normals(){
+
+	normals.assign( num_verts, Vec3<T>::Zero() );
+	for( int i=0; i<num_tris; ++i ){
+		const int *f = &inds[i*3];
+		const Vec3<T> n = ( vert(f[1]) - vert(f[0]) ).cross( vert(f[2]) - vert(f[0]) );
+		for( int j=0; j<3; ++j ){ normals[ f[j] ] += n; }
+	}
+	#pragma omp parallel for
+	for( int i=0; i<num_verts; ++i ){
+		const T len = normals[i].norm();
+		if( len > T(0) ){ normals[i] /= len; }
+	}
+
+} // end compute normals
+
+
+template <typename T>
+T bvh::AmbientOcclusion<T>::shift( unsigned int i, unsigned int seed ){
+	unsigned int h = i*0x9E3779B1u + seed;
+	h ^= h >> 16; h *= 0x85EBCA6Bu;
+	h ^= h >> 13; h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return T( h >> 8 ) / T( 1u << 24 );
+}
+
+
+template <typename T>
+void bvh::AmbientOcclusion<T>::sample( int n ){
+
+	if( n <= 0 || num_verts == 0 ){ return; }
+	const long start = sequence;
+	sequence += n;
+
+	// R2 sequence
+	const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int i=0; i<num_verts; ++i ){
+
+		// Unreferenced vertices have no normal
+		const Vec3<T> &normal = normals[i];
+		if( normal.squaredNorm() == T(0) ){ continue; }
+
+		// Basis about the normal
+		const Vec3<T> a = std::abs( normal[0] ) > T(0.9) ? Vec3<T>(0,1,0) : Vec3<T>(1,0,0);
+		const Vec3<T> tangent = a.cross( normal ).normalized();
+		const Vec3<T> bitangent = normal.cross( tangent );
+		const Vec3<T> origin = vert(i) + normal*offset;
+		const double s1 = shift( i, 0 ), s2 = shift( i, 1 );
+
+		int n_open = 0;
+		for( long j=start; j<start+n; ++j ){
+			// The fraction is taken in double, since j keeps growing
+			// across calls and T may not resolve it next to j*a
+			double v1 = s1 + a1*double(j+1), v2 = s2 + a2*double(j+1);
+			v1 -= std::floor( v1 );
+			v2 -= std::floor( v2 );
+			const T u1 = T( v1 ), u2 = T( v2 );
+			const Vec3<T> d = sample::cosine_hemisphere( u1, u2 );
+			const Vec3<T> dir = tangent*d[0] + bitangent*d[1] + normal*d[2];
+			RayAnyHit<T> visitor( raycast::Ray<T>( origin, dir, T(0) ), verts, inds );
+			visitor.payload.t_max = max_dist;
+			n_open += int( !wide_tree.traverse_ray( visitor ) );
+		}
+
+		const int n_prev = num_samples[i];
+		visibility[i] = ( visibility[i]*T(n_prev) + T(n_open) ) / T( n_prev + n );
+		num_samples[i] = n_prev + n;
+	}
+
+} // end sample
+
+
+template <typename T>
+void bvh::AmbientOcclusion<T>::get_colors( std::vector<Vec3f> &colors, const Vec3f &color ) const {
+	colors.resize( num_verts );
+	for( int i=0; i<num_verts; ++i ){ colors[i] = color * float( visibility[i] ); }
+}
+
+} // end ns mcl
+
+#endif
@@ -23,53 +23,366 @@
 #define MCL_BVH_H 1
 
 #include "Visitor.hpp"
-#include <memory>
+#include "BVHStats.hpp"
+#include <vector>
 #include <numeric>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace mcl {
 namespace bvh {
 
+// Options for AABBTree::init
+struct Settings {
+	enum {
+		MIDPOINT = 0, // split at the centroid midpoint of the longest axis (fastest build)
+		SAH = 1, // binned surface area heuristic (slower build, faster queries)
+		LBVH = 2, // sorted Morton codes, O(n) and parallel, for per-frame rebuilds
+	};
+	int method;
+	int sah_bins; // number of bins tested per axis with SAH, 2-32 (16 is typical)
+	int parallel_threshold; // subtrees with fewer prims are built by a single thread
+	int max_leaf_size; // max prims per leaf (SAH may still split smaller leaves)
+	double rebuild_ratio; // refit() suggests a rebuild once the SAH cost grows by this factor
+	int optimize_passes; // treelet optimization after the build, see AABBTree::optimize
+	Settings() : method(SAH), sah_bins(16), parallel_threshold(4096),
+		max_leaf_size(4), rebuild_ratio(1.5), optimize_passes(0) {}
+};
+
+// Morton code of a point normalized to the bounds. Uses 10 bits
+// per axis (30 total) for float and 21 bits per axis (63 total) for double.
+template <typename T>
+static inline uint64_t morton_code( const Vec3<T> &p, const Eigen::AlignedBox<T,3> &bounds );
+
+// Number of bits used by morton_code<T>
+template <typename T>
+static inline int morton_bits(){ return sizeof(T) > 4 ? 63 : 30; }
+
+// Calls the visitor functions of V without virtual dispatch
+template <typename V> struct StaticVisitor {
+	V &v;
+	StaticVisitor( V &v_ ) : v(v_) {}
+	template <typename AABB> bool hit_aabb( const AABB &aabb ){ return v.V::hit_aabb( aabb ); }
+	bool hit_prim( int prim ){ return v.V::hit_prim( prim ); }
+	template <typename AABB> bool check_left_first( const AABB &left, const AABB &right ){ return v.V::check_left_first( left, right ); }
+};
+
+// Read-only view of an array owned by a std::vector or a memory mapped file
+template <typename T> class ArrayView {
+public:
+	ArrayView() : ptr(nullptr), n(0) {}
+	ArrayView( const T *ptr_, size_t n_ ) : ptr(ptr_), n(n_) {}
+	ArrayView( const std::vector<T> &v ) : ptr(v.data()), n(v.size()) {}
+	size_t size() const { return n; }
+	bool empty() const { return n == 0; }
+	const T &operator[]( size_t i ) const { return ptr[i]; }
+	const T *data() const { return ptr; }
+	const T *begin() const { return ptr; }
+	const T *end() const { return ptr+n; }
+private:
+	const T *ptr;
+	size_t n;
+};
+
+// Stable parallel LSD radix sort of keys (and their values) using the
+// lowest n_bits of the key.
+static inline void radix_sort( std::vector<uint64_t> &keys, std::vector<int> &vals, int n_bits );
+
 // Binary AABB Tree
 // PDIM is the dimension of the primitive,
 // i.e. 1=verts, 2=edges, 3=tris, 4=tets
+//
+// Nodes are stored in a single array in depth-first order.
+// The left child of an interior node is always the next node
+// in the array, so only the index of the right child is stored.
+//
+// A built tree can be saved to disk and memory mapped back in later
+// (e.g. for static obstacles), which skips the build:
+//
+//	if( !tree.load_mmap( "obstacle.bvh", inds, verts, num_prims ) ){
+//		tree.init( inds, verts, num_prims );
+//		tree.save( "obstacle.bvh", verts );
+//	}
 template <typename T, short PDIM>
 class AABBTree {
 typedef Eigen::AlignedBox<T,3> AABB;
 public:
+	struct Node {
+		AABB aabb;
+		int offset; // right child if interior, index into prims if leaf
+		int num_prims; // zero for interior nodes
+		Node() : offset(-1), num_prims(0) {}
+		bool is_leaf() const { return num_prims > 0; }
+	};
+
 	AABBTree();
 
 	// Create a tree from a list of primitives
-	void init( const int *inds, const T *verts, int num_prims );
+	void init( const int *inds, const T *verts, int num_prims,
+		const Settings &settings = Settings() ) {
+		init( inds, verts, verts, num_prims, settings );
+	}
+
+	// Create a tree over primitives that move linearly from verts0 to verts1,
+	// i.e. each leaf bounds the primitive at both positions (swept bounds).
+	// Used for continuous collision queries, see ccd::.
+	void init( const int *inds, const T *verts0, const T *verts1, int num_prims,
+		const Settings &settings = Settings() );
+
+	// Recomputes the bounds of every node for new vertex positions, keeping
+	// the tree structure. The primitives must have the same indices as they
+	// did in init. Leaves are updated first, then interior nodes level by level.
+	// Returns true if the tree has degraded enough (see sah_ratio) that a
+	// rebuild with init is worthwhile.
+	bool refit( const T *verts ){ return refit( verts, verts ); }
+
+	// Refit with swept bounds, see init
+	bool refit( const T *verts0, const T *verts1 );
+
+	// Lowers the SAH cost of the tree by rearranging small treelets of up
+	// to TREELET_SIZE subtrees into their optimal topology (Karras and Aila,
+	// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies").
+	// Subtrees with at most max_leaf_size prims may also be collapsed into
+	// a leaf, but leaves are never split. It can be used between refits to
+	// win back some of the quality lost to deformation for less than a
+	// rebuild. Each pass optimizes every interior node once, from the
+	// bottom up. Returns the same as refit.
+	//
+	// Settings::optimize_passes runs it as part of init. LBVH trees are then
+	// built with one primitive per leaf, which gives close to SAH quality.
+	bool optimize( int passes = 3 );
+
+	// SAH cost of the tree (unit cost per node visit and primitive test)
+	// divided by the summed areas of the primitive boxes. Unlike the usual
+	// normalization by the root area it doesn't change if the root box
+	// grows, so it tracks how much the tree has degraded after refits.
+	T sah_cost() const;
+
+	// SAH cost at the last refit or optimize over the SAH cost at the last init
+	T sah_ratio() const { return build_cost > T(0) ? curr_cost / build_cost : T(1); }
 
 	// Traverse the tree with a visitor.
 	// Returns the result of Visitor::hit_<whatever>()
 	// See MCL/Visitor.hpp
 	bool traverse( Visitor<T,PDIM> &visitor ) const {
-		return traverse_children( root_node.get(), visitor );
+		return traverse_counted( visitor );
+	}
+
+	// Traverse with a visitor whose type is known at compile time.
+	// Its hit_aabb, hit_prim, and check_left_first are called directly
+	// instead of through the vtable, so they can be inlined. VisitorT
+	// doesn't need to derive from Visitor, but if it does it must be the
+	// most derived type of the object. traverse() always uses the vtable.
+	template <typename VisitorT>
+	bool traverse_static( VisitorT &visitor ) const {
+		StaticVisitor<VisitorT> static_visitor( visitor );
+		return traverse_counted( static_visitor );
+	}
+
+	// Traverse and add counts for the query to stats, see BVHStats.hpp
+	bool traverse( Visitor<T,PDIM> &visitor, TraversalStats &stats ) const {
+		return traverse_stack( visitor, stats );
+	}
+
+	template <typename VisitorT>
+	bool traverse_static( VisitorT &visitor, TraversalStats &stats ) const {
+		StaticVisitor<VisitorT> static_visitor( visitor );
+		return traverse_stack( static_visitor, stats );
+	}
+
+	// Counts of every traversal since the last reset_stats. Only
+	// counted if compiled with MCL_BVH_STATS, otherwise zero.
+	TraversalStats get_stats() const { return stats; }
+	void reset_stats(){ stats.reset(); }
+
+	// Writes the tree to a binary file, with a hash of the inds given to
+	// init and the verts the tree was built or refit with. The file is only
+	// readable on machines with the same endianness and type sizes.
+	// An existing file is replaced, not overwritten, so it is safe to save
+	// over a file that is mapped. Returns false on failure.
+	bool save( const std::string &path, const T *verts ) const;
+
+	// Memory maps a file written by save. The nodes and prims are used
+	// in place, without copies, so a loaded tree can't be refit. Returns
+	// false and leaves the tree unchanged if the file is missing, from a
+	// different version or type, was saved for different inds or verts, or
+	// its nodes and prims don't form a valid tree.
+	bool load_mmap( const std::string &path, const int *inds, const T *verts, int num_prims );
+
+	// True if the nodes are in a memory mapped file (see load_mmap)
+	bool is_mapped() const { return mapped.data != nullptr; }
+
+	// Flattened nodes, root at index 0
+	ArrayView<Node> get_nodes() const {
+		return is_mapped() ? ArrayView<Node>( mapped.nodes, mapped.num_nodes ) : ArrayView<Node>( nodes );
+	}
+
+	// Primitive indices in leaf order, see Node::offset
+	ArrayView<int> get_prims() const {
+		return is_mapped() ? ArrayView<int>( mapped.prims, mapped.num_prims ) : ArrayView<int>( prims );
+	}
+
+	// Depth of the deepest leaf, the root is at depth 0
+	int get_max_depth() const { return max_depth; }
+
+	// FNV-1a hash of the inds and the verts they use, stored by save
+	static uint64_t content_hash( const int *inds, const T *verts, int num_prims );
+
+	// Surface area of a box, zero if empty
+	static T surface_area( const AABB &aabb ){
+		if( aabb.isEmpty() ){ return T(0); }
+		Vec3<T> d = aabb.sizes();
+		return T(2)*( d[0]*d[1] + d[1]*d[2] + d[2]*d[0] );
 	}
 
 private:
-	struct Node {
-		AABB aabb;
-		Node *left, *right;
-		int prim;
-		Node() : left(nullptr), right(nullptr), prim(-1) {}
-		~Node(){
-			if( left != nullptr ){ delete left; }
-			if( right != nullptr ){ delete right; }
-		}
+	enum { MAX_BINS = 32 };
+
+	// Per-primitive data used during construction
+	struct BuildData {
+		std::vector< AABB > leaves;
+		std::vector< Vec3<T> > centroids;
+		Settings settings;
+	};
+
+	// Binned leaf bounds and counts for each axis
+	struct SAHBins {
+		AABB aabb[3][MAX_BINS];
+		int count[3][MAX_BINS];
+	};
+
+	// Builds the subtree over prims[begin,end) rooted at nodes[node_idx].
+	// A subtree over n prims may use nodes [node_idx, node_idx+2n-1),
+	// which is all of them if every leaf has one primitive.
+	void create_children( int node_idx, int begin, int end, const BuildData &data );
+
+	// Bounds of the leaves and centroids of prims[begin,end)
+	void compute_bounds( int begin, int end, const BuildData &data,
+		AABB &aabb, AABB &cent_aabb ) const;
+
+	// Partition prims[begin,end) and return the first index of the
+	// right child, or -1 if no split could be found.
+	// The SAH split also returns its cost (sum of child area * count).
+	int split_midpoint( int begin, int end, const AABB &cent_aabb, const BuildData &data );
+	int split_sah( int begin, int end, const AABB &cent_aabb, const BuildData &data, T &split_cost );
+
+	// Removes the node slots that were reserved but not used
+	// by leaves with more than one primitive
+	void compact_nodes();
+
+	// Builds the subtree over prims[begin,end), which are sorted by
+	// Morton code, and sets node bounds from the bottom up.
+	void create_lbvh( int node_idx, int begin, int end,
+		const std::vector<uint64_t> &codes, const BuildData &data );
+
+	// Stores the data needed by refit and the initial SAH cost
+	void finish_build( const int *inds, int num_prims );
+
+	// Finds the depth of each node and fills leaf_nodes and level_nodes
+	void compute_levels();
+
+	// Nodes with explicit children, used while optimizing
+	struct OptimizeData {
+		std::vector<int> left, right; // children, -1 for leaves
+		std::vector<int> num_prims; // in the subtree
+		std::vector<T> cost; // SAH cost of the subtree, not normalized
+		std::vector<char> collapsed; // interior nodes that are now leaves
+		int max_leaf_size;
+		bool is_leaf( int idx ) const { return left[idx] < 0 || collapsed[idx]; }
+	};
+
+	// Cost and prims of an interior node from its children
+	void update_cost( int idx, OptimizeData &data ) const;
+
+	// Replaces the treelet rooted at interior node root with its optimal
+	// topology if that lowers the SAH cost. Returns true if it changed.
+	enum { TREELET_SIZE = 7 };
+	bool optimize_treelet( int root, OptimizeData &data );
+
+	// Start of a file written by save. The nodes and prims follow
+	// at 64 byte aligned offsets.
+	enum { FILE_VERSION = 1, FILE_ALIGN = 64 };
+	struct FileHeader {
+		char magic[8]; // "MCLBVH"
+		uint32_t version;
+		uint32_t endian; // 0x01020304
+		uint32_t scalar_bytes, pdim, node_bytes;
+		int32_t num_prims, num_nodes, max_depth;
+		uint64_t content_hash;
+		uint64_t nodes_offset, prims_offset;
+		double prim_area, build_cost;
 	};
 
-	static void create_children(
-		Node *node,
-		std::vector<int> &queue,
-		const std::vector< AABB > &leaves,
-		const std::vector< Vec3<T> > &centroids );
+	// True if mapped nodes and prims form a tree load_mmap can trust: every
+	// node is the child of exactly one earlier node, child indices and leaf
+	// ranges are in bounds, prims index into num_prims, and the deepest leaf
+	// is at max_depth (which sizes the traversal stack).
+	static bool check_file_tree( const Node *nodes, int num_nodes,
+		const int *prims, int num_prims, int max_depth );
+
+	// Nodes and prims in a file mapped by load_mmap,
+	// which is unmapped when the last copy of the tree goes.
+	struct MappedFile {
+		std::shared_ptr<void> data;
+		const Node *nodes;
+		const int *prims;
+		int num_nodes, num_prims;
+		MappedFile() : nodes(nullptr), prims(nullptr), num_nodes(0), num_prims(0) {}
+	};
+
+	// Number of chunks a range is broken into for parallel reductions
+	static int num_chunks( int n, int grain ){ return std::max( 1, std::min( 64, n/std::max(1,grain) ) ); }
+
+	// Depth-first traversal with an explicit stack. The nearer child
+	// (by check_left_first) is visited next and the other is pushed.
+	enum { STACK_SIZE = 64 };
+	template <typename V, typename S> bool traverse_stack( V &visitor, S &query_stats ) const;
+
+	// Adds to stats if MCL_BVH_STATS is defined
+	template <typename V> bool traverse_counted( V &visitor ) const {
+#ifdef MCL_BVH_STATS
+		TraversalStats query_stats;
+		bool result = traverse_stack( visitor, query_stats );
+		#pragma omp critical(mcl_bvh_stats)
+		stats.add( query_stats );
+		return result;
+#else
+		NoStats no_stats;
+		return traverse_stack( visitor, no_stats );
+#endif
+	}
+
+	std::vector<Node> nodes;
+	std::vector<int> prims;
+
+	// Used by refit
+	Settings settings;
+	std::vector<int> prim_inds; // copy of the inds given to init
+	std::vector<int> level_nodes; // interior nodes sorted by depth
+	std::vector<int> level_offsets; // start of each depth in level_nodes
+	std::vector<int> leaf_nodes;
+	int max_depth;
+	T prim_area; // sum of primitive box areas at the last init/refit
+	T build_cost, curr_cost;
 
-	static bool traverse_children( const Node *node,
-		Visitor<T,PDIM> &visitor );
+	// Used instead of nodes and prims if loaded with load_mmap
+	MappedFile mapped;
 
-	std::unique_ptr<Node> root_node;
+	// Summed over all traversals, see traverse_counted
+	mutable TraversalStats stats;
 
 }; // class aabbtree
 
@@ -81,8 +394,7 @@ private:
 
 
 template <typename T, short PDIM>
-AABBTree<T,PDIM>::AABBTree(){
-	root_node.reset( new Node() );
+AABBTree<T,PDIM>::AABBTree() : max_depth(0), prim_area(0), build_cost(0), curr_cost(0) {
 	if( PDIM < 1 ){
 		throw std::runtime_error("AABBTree Error: PDIM must be larger than 0");
 	}
@@ -90,152 +402,1077 @@ AABBTree<T,PDIM>::AABBTree(){
 
 
 template <typename T, short PDIM>
-void AABBTree<T,PDIM>::init( const int *inds, const T *verts, int num_prims ){
+void AABBTree<T,PDIM>::init( const int *inds, const T *verts0, const T *verts1, int num_prims,
+	const Settings &settings ){
 
 	// Deletes the old tree
-	root_node.reset( new Node() );
+	nodes.clear();
+	prims.clear();
+	mapped = MappedFile();
+	if( num_prims <= 0 ){
+		throw std::runtime_error("AABBTree::init Error: No primitives");
+	}
+	if( settings.method < Settings::MIDPOINT || settings.method > Settings::LBVH ){
+		throw std::runtime_error("AABBTree::init Error: Unknown build method");
+	}
 
 	// Leaf nodes are copied into the tree, but we'll create
-	// them here to make processing faster.
-	std::vector< AABB > leaf_aabb( num_prims );
-	std::vector< Vec3<T> > leaf_centroids( num_prims, Vec3<T>(0,0,0) );
+	// them here to make processing faster. Optimized LBVH trees
+	// start with one prim per leaf, see optimize.
+	BuildData data;
+	data.settings = settings;
+	if( settings.method == Settings::LBVH && settings.optimize_passes > 0 ){ data.settings.max_leaf_size = 1; }
+	data.leaves.resize( num_prims );
+	data.centroids.resize( num_prims, Vec3<T>(0,0,0) );
 
 	// Create leaf AABBS
+	const bool swept = verts0 != verts1;
 	#pragma omp parallel for
 	for( int i=0; i<num_prims; ++i ){
 		for( int j=0; j<PDIM; ++j ){
 			int prim_id = inds[i*PDIM+j];
-			Vec3<T> p( verts[prim_id*3], verts[prim_id*3+1], verts[prim_id*3+2] );
-			leaf_aabb[i].extend( p );
-			leaf_centroids[i] += p;
+			Vec3<T> p( verts0[prim_id*3], verts0[prim_id*3+1], verts0[prim_id*3+2] );
+			data.leaves[i].extend( p );
+			data.centroids[i] += p;
+			if( swept ){
+				Vec3<T> p1( verts1[prim_id*3], verts1[prim_id*3+1], verts1[prim_id*3+2] );
+				data.leaves[i].extend( p1 );
+				data.centroids[i] += p1;
+			}
 		}
-		leaf_centroids[i] /= T(PDIM);
+		data.centroids[i] /= T( swept ? 2*PDIM : PDIM );
 	}
 
-	for( int i=0; i<num_prims; ++i ){ root_node->aabb.extend( leaf_aabb[i] ); }
+	// A binary tree with one primitive per leaf has 2n-1 nodes,
+	// so every subtree knows where its nodes go before it is built.
+	// That lets large subtrees be built as independent tasks.
+	// Slots left over by larger leaves are removed after the build.
+	nodes.resize( 2*num_prims-1 );
+
+	// Now do a recursive top down creation. The prims array
+	// is partitioned in place so that leaves index a range of it.
+	prims.resize( num_prims );
+	std::iota( prims.begin(), prims.end(), 0 );
+
+	if( settings.method == Settings::LBVH ){
+
+		// Sort the primitives by the Morton code of their centroid
+		AABB cent_aabb;
+		#pragma omp parallel
+		{
+			AABB local_aabb;
+			#pragma omp for nowait
+			for( int i=0; i<num_prims; ++i ){ local_aabb.extend( data.centroids[i] ); }
+			#pragma omp critical
+			cent_aabb.extend( local_aabb );
+		}
+
+		std::vector<uint64_t> codes( num_prims );
+		#pragma omp parallel for
+		for( int i=0; i<num_prims; ++i ){ codes[i] = morton_code( data.centroids[i], cent_aabb ); }
+		radix_sort( codes, prims, morton_bits<T>() );
+
+		#pragma omp parallel
+		{
+			#pragma omp single
+			create_lbvh( 0, 0, num_prims, codes, data );
+		}
+	}
+	else {
+		#pragma omp parallel
+		{
+			#pragma omp single
+			create_children( 0, 0, num_prims, data );
+		}
+	}
 
-	// Now do a recursive top down creation
-	std::vector<int> queue(num_prims);
-	std::iota(queue.begin(), queue.end(), 0);
-	create_children(root_node.get(), queue, leaf_aabb, leaf_centroids);
+	if( data.settings.max_leaf_size > 1 ){ compact_nodes(); }
+	T area = 0;
+	#pragma omp parallel for reduction(+:area)
+	for( int i=0; i<num_prims; ++i ){ area += surface_area( data.leaves[i] ); }
+	prim_area = area;
+	this->settings = settings;
+	finish_build( inds, num_prims );
+	if( settings.optimize_passes > 0 ){
+		optimize( settings.optimize_passes );
+		build_cost = curr_cost;
+	}
 
 } // end init
 
 
 template <typename T, short PDIM>
-bool AABBTree<T,PDIM>::traverse_children( const Node *node, Visitor<T,PDIM> &visitor ){
+void AABBTree<T,PDIM>::finish_build( const int *inds, int num_prims ){
+
+	prim_inds.assign( inds, inds + num_prims*PDIM );
+	compute_levels();
+	build_cost = sah_cost();
+	curr_cost = build_cost;
+
+} // end finish build
+
+
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::compute_levels(){
 
-	if( !visitor.hit_aabb( node->aabb ) ){ return false; }
+	// Nodes are in depth-first order so a parent always comes
+	// before its children, and depths can be found in one pass.
+	const int n_nodes = nodes.size();
+	std::vector<int> depth( n_nodes, 0 );
+	max_depth = 0;
+	leaf_nodes.clear();
+	for( int i=0; i<n_nodes; ++i ){
+		max_depth = std::max( max_depth, depth[i] );
+		if( nodes[i].is_leaf() ){ leaf_nodes.emplace_back(i); continue; }
+		depth[i+1] = depth[i]+1;
+		depth[ nodes[i].offset ] = depth[i]+1;
+	}
 
-	// If it has two children, see which one we should traverse first
-	if( node->left != nullptr && node->right != nullptr ){
-		bool check_left_first = visitor.check_left_first( node->left->aabb, node->right->aabb );
-		if( check_left_first ){
-			if( traverse_children( node->left, visitor ) ){ return true; }
-			else { return traverse_children( node->right, visitor ); }
-		} else {
-			if( traverse_children( node->right, visitor ) ){ return true; }
-			else { return traverse_children( node->left, visitor ); }
-		}	
+	// Bucket the interior nodes by depth
+	level_offsets.assign( max_depth+2, 0 );
+	for( int i=0; i<n_nodes; ++i ){
+		if( !nodes[i].is_leaf() ){ level_offsets[ depth[i]+1 ]++; }
+	}
+	for( int d=0; d<=max_depth; ++d ){ level_offsets[d+1] += level_offsets[d]; }
+	level_nodes.resize( level_offsets.back() );
+	std::vector<int> fill( level_offsets.begin(), level_offsets.end()-1 );
+	for( int i=0; i<n_nodes; ++i ){
+		if( !nodes[i].is_leaf() ){ level_nodes[ fill[depth[i]]++ ] = i; }
 	}
 
-	// If we just have a left child
-	if( node->left != nullptr ){ return traverse_children( node->left, visitor ); }
+} // end compute levels
 
-	// If we just have a right child
-	if( node->right != nullptr ){ return traverse_children( node->right, visitor ); }
 
-	// Otherwise we're a leaf!
-	if( node->prim == -1 ){
-		throw std::runtime_error("AABBTree::traverse Error: Leaf has no primitive");
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::compact_nodes(){
+
+	// Unused slots are still default nodes (no prims, no right child).
+	// Removing them keeps the depth-first order, and since a left child
+	// always directly follows its parent only right children need new indices.
+	const int n_nodes = nodes.size();
+	std::vector<int> new_idx( n_nodes );
+	int n_used = 0;
+	for( int i=0; i<n_nodes; ++i ){
+		new_idx[i] = n_used;
+		if( nodes[i].is_leaf() || nodes[i].offset > 0 ){ n_used++; }
 	}
-	return visitor.hit_prim( node->prim );
-}
+
+	for( int i=0; i<n_nodes; ++i ){
+		Node &node = nodes[i];
+		if( node.is_leaf() ){ nodes[ new_idx[i] ] = node; }
+		else if( node.offset > 0 ){
+			node.offset = new_idx[ node.offset ];
+			nodes[ new_idx[i] ] = node;
+		}
+	}
+	nodes.resize( n_used );
+	nodes.shrink_to_fit();
+
+} // end compact nodes
+
+
+template <typename T, short PDIM>
+bool AABBTree<T,PDIM>::refit( const T *verts0, const T *verts1 ){
+
+	if( is_mapped() ){
+		throw std::runtime_error("AABBTree::refit Error: Can't refit a memory mapped tree");
+	}
+	if( nodes.size() == 0 ){ return false; }
+
+	// Leaf bounds from the primitives
+	const bool swept = verts0 != verts1;
+	const int n_leaves = leaf_nodes.size();
+	T area = 0;
+	#pragma omp parallel for schedule(static) reduction(+:area)
+	for( int i=0; i<n_leaves; ++i ){
+		Node &node = nodes[ leaf_nodes[i] ];
+		node.aabb.setEmpty();
+		for( int j=0; j<node.num_prims; ++j ){
+			const int *prim = &prim_inds[ prims[node.offset+j]*PDIM ];
+			AABB prim_aabb;
+			for( int k=0; k<PDIM; ++k ){
+				prim_aabb.extend( Vec3<T>( verts0[prim[k]*3], verts0[prim[k]*3+1], verts0[prim[k]*3+2] ) );
+				if( swept ){ prim_aabb.extend( Vec3<T>( verts1[prim[k]*3], verts1[prim[k]*3+1], verts1[prim[k]*3+2] ) ); }
+			}
+			area += surface_area( prim_aabb );
+			node.aabb.extend( prim_aabb );
+		}
+	}
+	prim_area = area;
+
+	// Then interior nodes from the deepest level up. Every node on a
+	// level has its children on deeper levels, so a level can be
+	// updated in parallel.
+	const int n_levels = level_offsets.size()-1;
+	for( int d=n_levels-1; d>=0; --d ){
+		const int begin = level_offsets[d];
+		const int end = level_offsets[d+1];
+		#pragma omp parallel for schedule(static) if(end-begin > 1024)
+		for( int i=begin; i<end; ++i ){
+			int idx = level_nodes[i];
+			Node &node = nodes[idx];
+			node.aabb = nodes[idx+1].aabb;
+			node.aabb.extend( nodes[node.offset].aabb );
+		}
+	}
+
+	curr_cost = sah_cost();
+	return sah_ratio() > T(settings.rebuild_ratio);
+
+} // end refit
+
+
+template <typename T, short PDIM>
+bool AABBTree<T,PDIM>::optimize( int passes ){
+
+	if( is_mapped() ){
+		throw std::runtime_error("AABBTree::optimize Error: Can't optimize a memory mapped tree");
+	}
+	const int n_nodes = nodes.size();
+	if( n_nodes < 5 ){ return sah_ratio() > T(settings.rebuild_ratio); }
+
+	// Treelets move subtrees around, so the children are stored
+	// explicitly until the nodes are put back in depth-first order.
+	OptimizeData data;
+	data.left.assign( n_nodes, -1 );
+	data.right.assign( n_nodes, -1 );
+	data.num_prims.assign( n_nodes, 0 );
+	data.cost.assign( n_nodes, 0 );
+	data.collapsed.assign( n_nodes, 0 );
+	data.max_leaf_size = std::max( 1, settings.max_leaf_size );
+	for( int i=0; i<n_nodes; ++i ){
+		if( nodes[i].is_leaf() ){
+			data.num_prims[i] = nodes[i].num_prims;
+			data.cost[i] = surface_area( nodes[i].aabb ) * T( nodes[i].num_prims );
+			continue;
+		}
+		data.left[i] = i+1;
+		data.right[i] = nodes[i].offset;
+	}
+
+	for( int pass=0; pass<passes; ++pass ){
+
+		// Treelets of nodes on the same level are in disjoint subtrees, so
+		// a level can be done in parallel. Going from the deepest level up
+		// means a restructured treelet never changes a level still to come.
+		std::vector< std::vector<int> > levels( 1, std::vector<int>( 1, 0 ) );
+		while( true ){
+			std::vector<int> next;
+			const std::vector<int> &level = levels.back();
+			for( size_t i=0; i<level.size(); ++i ){
+				if( data.is_leaf( level[i] ) ){ continue; }
+				next.emplace_back( data.left[ level[i] ] );
+				next.emplace_back( data.right[ level[i] ] );
+			}
+			if( next.empty() ){ break; }
+			levels.emplace_back( next );
+		}
+		for( int d=levels.size()-1; d>=0; --d ){
+			for( size_t i=0; i<levels[d].size(); ++i ){
+				if( !data.is_leaf( levels[d][i] ) ){ update_cost( levels[d][i], data ); }
+			}
+		}
+
+		// A treelet only reads the costs of nodes below it, which
+		// are up to date once the deeper levels are done.
+		int n_changed = 0;
+		for( int d=levels.size()-1; d>=0; --d ){
+			const std::vector<int> &level = levels[d];
+			const int n_level = level.size();
+			#pragma omp parallel for schedule(dynamic,16) reduction(+:n_changed) if(n_level > 64)
+			for( int i=0; i<n_level; ++i ){
+				if( data.is_leaf( level[i] ) ){ continue; }
+				n_changed += optimize_treelet( level[i], data );
+				update_cost( level[i], data );
+			}
+		}
+		if( n_changed == 0 ){ break; }
+	}
+
+	// Back to depth-first order, with prims in leaf order
+	std::vector<Node> new_nodes;
+	new_nodes.reserve( n_nodes );
+	std::vector<int> new_prims;
+	new_prims.reserve( prims.size() );
+	std::vector< std::pair<int,int> > stack; // node, and the new index of its parent if a right child
+	std::vector<int> leaf_stack;
+	stack.emplace_back( 0, -1 );
+	while( !stack.empty() ){
+		const int idx = stack.back().first;
+		const int parent = stack.back().second;
+		stack.pop_back();
+		if( parent >= 0 ){ new_nodes[parent].offset = new_nodes.size(); }
+		Node node = nodes[idx];
+		if( data.is_leaf( idx ) ){
+			// Collapsed nodes take the prims of every leaf below them
+			const int offset = new_prims.size();
+			leaf_stack.assign( 1, idx );
+			while( !leaf_stack.empty() ){
+				const int leaf = leaf_stack.back();
+				leaf_stack.pop_back();
+				if( data.left[leaf] >= 0 ){
+					leaf_stack.emplace_back( data.right[leaf] );
+					leaf_stack.emplace_back( data.left[leaf] );
+					continue;
+				}
+				new_prims.insert( new_prims.end(), prims.begin()+nodes[leaf].offset,
+					prims.begin()+nodes[leaf].offset+nodes[leaf].num_prims );
+			}
+			node.offset = offset;
+			node.num_prims = new_prims.size() - offset;
+			new_nodes.emplace_back( node );
+			continue;
+		}
+		stack.emplace_back( data.right[idx], new_nodes.size() );
+		stack.emplace_back( data.left[idx], -1 );
+		new_nodes.emplace_back( node );
+	}
+	nodes.swap( new_nodes );
+	prims.swap( new_prims );
+
+	compute_levels();
+	curr_cost = sah_cost();
+	return sah_ratio() > T(settings.rebuild_ratio);
+
+} // end optimize
+
+
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::update_cost( int idx, OptimizeData &data ) const {
+
+	const int left = data.left[idx], right = data.right[idx];
+	data.num_prims[idx] = data.num_prims[left] + data.num_prims[right];
+	const T area = surface_area( nodes[idx].aabb );
+	data.cost[idx] = data.collapsed[idx] ? area * T( data.num_prims[idx] ) :
+		area + data.cost[left] + data.cost[right];
+
+} // end update cost
 
 
 template <typename T, short PDIM>
-void AABBTree<T,PDIM>::create_children(
-	Node *node,
-	std::vector<int> &queue,
-	const std::vector< AABB > &leaves,
-	const std::vector< Vec3<T> > &centroids ){
+bool AABBTree<T,PDIM>::optimize_treelet( int root, OptimizeData &data ){
+
+	// Grow the treelet by opening the leaf with the largest area
+	int leaves[ TREELET_SIZE ], interior[ TREELET_SIZE-1 ];
+	leaves[0] = data.left[root];
+	leaves[1] = data.right[root];
+	interior[0] = root;
+	int n_leaves = 2;
+	while( n_leaves < TREELET_SIZE ){
+		int open = -1;
+		T open_area = -1;
+		for( int i=0; i<n_leaves; ++i ){
+			if( data.is_leaf( leaves[i] ) ){ continue; }
+			T area = surface_area( nodes[ leaves[i] ].aabb );
+			if( area > open_area ){ open = i; open_area = area; }
+		}
+		if( open < 0 ){ break; }
+		const int idx = leaves[open];
+		interior[ n_leaves-1 ] = idx;
+		leaves[open] = data.left[idx];
+		leaves[ n_leaves++ ] = data.right[idx];
+	}
 
-	int n_queue = queue.size();
-	if( n_queue == 0 ){
+	// The cost of a set of leaves is the least SAH cost of a subtree over
+	// them. That's either one leaf with all of their prims, or the best
+	// split of the set into two (trying sets with the lowest leaf first,
+	// to skip mirrored splits). 0 in split means a leaf.
+	const int n_sets = 1 << n_leaves;
+	AABB set_aabb[ 1 << TREELET_SIZE ];
+	T cost[ 1 << TREELET_SIZE ];
+	int split[ 1 << TREELET_SIZE ], set_prims[ 1 << TREELET_SIZE ];
+	for( int set=1; set<n_sets; ++set ){
+		const int low = set & -set;
+		const int rest = set ^ low;
+		if( rest == 0 ){
+			int leaf = 0;
+			while( ( 1 << leaf ) != low ){ leaf++; }
+			const int idx = leaves[leaf];
+			set_aabb[set] = nodes[idx].aabb;
+			set_prims[set] = data.num_prims[idx];
+			cost[set] = data.cost[idx];
+			split[set] = 0;
+			if( !data.is_leaf( idx ) && set_prims[set] <= data.max_leaf_size ){
+				cost[set] = std::min( cost[set], surface_area( set_aabb[set] ) * T( set_prims[set] ) );
+			}
+			continue;
+		}
+		set_aabb[set] = set_aabb[low].merged( set_aabb[rest] );
+		set_prims[set] = set_prims[low] + set_prims[rest];
+		T best = std::numeric_limits<T>::max();
+		for( int sub = (rest-1) & rest; ; sub = (sub-1) & rest ){
+			const int part = low | sub;
+			const T c = cost[part] + cost[ set ^ part ];
+			if( c < best ){ best = c; split[set] = part; }
+			if( sub == 0 ){ break; }
+		}
+		const T area = surface_area( set_aabb[set] );
+		cost[set] = area + best;
+		if( set_prims[set] <= data.max_leaf_size && area * T( set_prims[set] ) <= cost[set] ){
+			cost[set] = area * T( set_prims[set] );
+			split[set] = -split[set];
+		}
+	}
+
+	// Small differences are rounding, not a better treelet
+	if( !( cost[n_sets-1] < data.cost[root]*T(0.9999) ) ){ return false; }
+
+	// Rebuild the treelet top down, reusing its interior nodes. A set that
+	// becomes a leaf is still split the same way below a collapsed node, so
+	// its prims can be found. Bounds are then set in reverse, so children
+	// come before their parents.
+	int order[ TREELET_SIZE-1 ], sets[ TREELET_SIZE-1 ];
+	char collapse[ TREELET_SIZE-1 ];
+	order[0] = root;
+	sets[0] = n_sets-1;
+	collapse[0] = 0;
+	int n_order = 1;
+	for( int i=0; i<n_order; ++i ){
+		const int idx = order[i];
+		const int set = sets[i];
+		const int part = std::abs( split[set] );
+		const bool is_collapsed = collapse[i] || split[set] < 0;
+		data.collapsed[idx] = is_collapsed;
+		const int parts[2] = { part, set ^ part };
+		int kids[2];
+		for( int c=0; c<2; ++c ){
+			if( ( parts[c] & (parts[c]-1) ) == 0 ){
+				int leaf = 0;
+				while( ( 1 << leaf ) != parts[c] ){ leaf++; }
+				kids[c] = leaves[leaf];
+				// A single subtree can be collapsed on its own
+				if( !is_collapsed && !data.is_leaf( kids[c] ) && cost[ parts[c] ] < data.cost[ kids[c] ] ){
+					data.collapsed[ kids[c] ] = 1;
+					data.cost[ kids[c] ] = cost[ parts[c] ];
+				}
+			}
+			else {
+				kids[c] = interior[n_order];
+				order[n_order] = kids[c];
+				sets[n_order] = parts[c];
+				collapse[n_order++] = is_collapsed;
+			}
+		}
+		data.left[idx] = kids[0];
+		data.right[idx] = kids[1];
+	}
+	for( int i=n_order-1; i>=0; --i ){
+		const int idx = order[i];
+		nodes[idx].aabb = nodes[ data.left[idx] ].aabb.merged( nodes[ data.right[idx] ].aabb );
+		update_cost( idx, data );
+	}
+	return true;
+
+} // end optimize treelet
+
+
+template <typename T, short PDIM>
+T AABBTree<T,PDIM>::sah_cost() const {
+
+	const ArrayView<Node> tree_nodes = get_nodes();
+	const int n_nodes = tree_nodes.size();
+	T cost = 0;
+	#pragma omp parallel for reduction(+:cost)
+	for( int i=0; i<n_nodes; ++i ){
+		const Node &node = tree_nodes[i];
+		cost += surface_area( node.aabb ) * T( node.is_leaf() ? node.num_prims : 1 );
+	}
+	return prim_area > T(0) ? cost / prim_area : T(0);
+
+} // end sah cost
+
+
+template <typename T, short PDIM>
+template <typename V, typename S>
+bool AABBTree<T,PDIM>::traverse_stack( V &visitor, S &query_stats ) const {
+
+	const ArrayView<Node> tree_nodes = get_nodes();
+	const ArrayView<int> tree_prims = get_prims();
+	query_stats.query();
+	if( tree_nodes.size() == 0 ){ return false; }
+
+	// Every node on the stack is the sibling of a different ancestor of the
+	// current node, so the stack never holds more than max_depth nodes.
+	int local_stack[ STACK_SIZE ];
+	std::vector<int> heap_stack;
+	int *stack = local_stack;
+	if( max_depth >= STACK_SIZE ){
+		heap_stack.resize( max_depth+1 );
+		stack = &heap_stack[0];
+	}
+
+	int n_stack = 0;
+	int node_idx = 0;
+	while( true ){
+
+		const Node &node = tree_nodes[node_idx];
+		query_stats.aabb_test();
+		if( visitor.hit_aabb( node.aabb ) ){
+			query_stats.node_visit();
+
+			// If we're a leaf, check the primitives
+			if( node.is_leaf() ){
+				for( int i=0; i<node.num_prims; ++i ){
+					query_stats.prim_test();
+					if( visitor.hit_prim( tree_prims[ node.offset+i ] ) ){
+						query_stats.early_exit();
+						return true;
+					}
+				}
+			}
+
+			// Otherwise, see which child we should traverse first
+			else {
+				int left = node_idx+1;
+				int right = node.offset;
+				if( visitor.check_left_first( tree_nodes[left].aabb, tree_nodes[right].aabb ) ){
+					stack[ n_stack++ ] = right;
+					node_idx = left;
+				} else {
+					stack[ n_stack++ ] = left;
+					node_idx = right;
+				}
+				query_stats.stack_depth( n_stack );
+				continue;
+			}
+		}
+
+		if( n_stack == 0 ){ break; }
+		node_idx = stack[ --n_stack ];
+	}
+
+	return false;
+
+} // end traverse
+
+
+template <typename T, short PDIM>
+uint64_t AABBTree<T,PDIM>::content_hash( const int *inds, const T *verts, int num_prims ){
+
+	uint64_t hash = 14695981039346656037ull;
+	auto hash_bytes = [&hash]( const void *data, size_t n_bytes ){
+		const unsigned char *bytes = static_cast<const unsigned char*>( data );
+		for( size_t i=0; i<n_bytes; ++i ){
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+	};
+
+	const int n_inds = std::max( 0, num_prims )*PDIM;
+	int num_verts = 0;
+	for( int i=0; i<n_inds; ++i ){ num_verts = std::max( num_verts, inds[i]+1 ); }
+	hash_bytes( &num_prims, sizeof(int) );
+	hash_bytes( inds, n_inds*sizeof(int) );
+	hash_bytes( verts, size_t(num_verts)*3*sizeof(T) );
+	return hash;
+
+} // end content hash
+
+
+template <typename T, short PDIM>
+bool AABBTree<T,PDIM>::save( const std::string &path, const T *verts ) const {
+
+	if( is_mapped() || nodes.size() == 0 ){
+		std::cerr << "\n**mcl::bvh::AABBTree::save Error: Only built trees can be saved" << std::endl;
+		return false;
+	}
+
+	const int num_prims = prims.size();
+	FileHeader header;
+	std::memset( &header, 0, sizeof(header) );
+	std::memcpy( header.magic, "MCLBVH", 6 );
+	header.version = FILE_VERSION;
+	header.endian = 0x01020304;
+	header.scalar_bytes = sizeof(T);
+	header.pdim = PDIM;
+	header.node_bytes = sizeof(Node);
+	header.num_prims = num_prims;
+	header.num_nodes = nodes.size();
+	header.max_depth = max_depth;
+	header.content_hash = content_hash( &prim_inds[0], verts, num_prims );
+	auto align = []( uint64_t x ){ return ( x + FILE_ALIGN-1 ) / FILE_ALIGN * FILE_ALIGN; };
+	header.nodes_offset = align( sizeof(FileHeader) );
+	header.prims_offset = align( header.nodes_offset + nodes.size()*sizeof(Node) );
+	header.prim_area = prim_area;
+	header.build_cost = build_cost;
+
+	// Written to a temporary file and then renamed, so trees that
+	// have the old file mapped keep their copy.
+	const std::string tmp_path = path + ".tmp";
+	std::ofstream fs( tmp_path.c_str(), std::ios::binary | std::ios::trunc );
+	if( !fs.is_open() ){
+		std::cerr << "\n**mcl::bvh::AABBTree::save Error: Could not open file " << tmp_path << std::endl;
+		return false;
+	}
+	const char zeros[ FILE_ALIGN ] = {};
+	fs.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+	fs.write( zeros, header.nodes_offset - sizeof(header) );
+	fs.write( reinterpret_cast<const char*>( &nodes[0] ), nodes.size()*sizeof(Node) );
+	fs.write( zeros, header.prims_offset - ( header.nodes_offset + nodes.size()*sizeof(Node) ) );
+	fs.write( reinterpret_cast<const char*>( &prims[0] ), num_prims*sizeof(int) );
+	fs.close();
+	if( fs.fail() || std::rename( tmp_path.c_str(), path.c_str() ) != 0 ){
+		std::cerr << "\n**mcl::bvh::AABBTree::save Error: Failed to write " << path << std::endl;
+		std::remove( tmp_path.c_str() );
+		return false;
+	}
+	return true;
+
+} // end save
+
+
+template <typename T, short PDIM>
+bool AABBTree<T,PDIM>::load_mmap( const std::string &path, const int *inds, const T *verts, int num_prims ){
+
+	int fd = open( path.c_str(), O_RDONLY );
+	if( fd < 0 ){ return false; }
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || size_t(st.st_size) < sizeof(FileHeader) ){ close( fd ); return false; }
+	const size_t file_bytes = st.st_size;
+	void *addr = mmap( nullptr, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( addr == MAP_FAILED ){ return false; }
+	std::shared_ptr<void> data( addr, [file_bytes]( void *p ){ munmap( p, file_bytes ); } );
+
+	// Check the header before trusting any of the offsets
+	const char *bytes = static_cast<const char*>( addr );
+	const FileHeader &header = *reinterpret_cast<const FileHeader*>( bytes );
+	if( std::memcmp( header.magic, "MCLBVH", 6 ) != 0 || header.version != FILE_VERSION ||
+		header.endian != 0x01020304 || header.scalar_bytes != sizeof(T) || header.pdim != uint32_t(PDIM) ||
+		header.node_bytes != sizeof(Node) ){ return false; }
+	if( header.num_prims != num_prims || header.num_nodes <= 0 || header.max_depth < 0 ||
+		header.nodes_offset % FILE_ALIGN != 0 || header.prims_offset % FILE_ALIGN != 0 ||
+		header.nodes_offset + uint64_t(header.num_nodes)*sizeof(Node) > file_bytes ||
+		header.prims_offset + uint64_t(header.num_prims)*sizeof(int) > file_bytes ){ return false; }
+	if( header.content_hash != content_hash( inds, verts, num_prims ) ){ return false; }
+	if( !check_file_tree( reinterpret_cast<const Node*>( bytes + header.nodes_offset ), header.num_nodes,
+		reinterpret_cast<const int*>( bytes + header.prims_offset ), header.num_prims, header.max_depth ) ){
+		return false;
+	}
+
+	// Release the built tree, if any
+	std::vector<Node>().swap( nodes );
+	std::vector<int>().swap( prims );
+	std::vector<int>().swap( prim_inds );
+	std::vector<int>().swap( level_nodes );
+	std::vector<int>().swap( level_offsets );
+	std::vector<int>().swap( leaf_nodes );
+
+	mapped.data = data;
+	mapped.nodes = reinterpret_cast<const Node*>( bytes + header.nodes_offset );
+	mapped.prims = reinterpret_cast<const int*>( bytes + header.prims_offset );
+	mapped.num_nodes = header.num_nodes;
+	mapped.num_prims = header.num_prims;
+	max_depth = header.max_depth;
+	prim_area = header.prim_area;
+	build_cost = header.build_cost;
+	curr_cost = build_cost;
+	return true;
+
+} // end load mmap
+
+
+template <typename T, short PDIM>
+bool AABBTree<T,PDIM>::check_file_tree( const Node *file_nodes, int num_nodes,
+	const int *file_prims, int num_prims, int file_max_depth ){
+
+	// Parents come before their children (see compute_levels), so the
+	// depth of a node is known by the time it's reached, or it's unused.
+	std::vector<int> depth( num_nodes, -1 );
+	depth[0] = 0;
+	int deepest = 0;
+	for( int i=0; i<num_nodes; ++i ){
+		if( depth[i] < 0 ){ return false; }
+		deepest = std::max( deepest, depth[i] );
+		const Node &node = file_nodes[i];
+		if( node.is_leaf() ){
+			if( node.offset < 0 || node.num_prims > num_prims - node.offset ){ return false; }
+			continue;
+		}
+		const int left = i+1, right = node.offset;
+		if( node.num_prims != 0 || right <= left || right >= num_nodes ){ return false; }
+		if( depth[left] >= 0 || depth[right] >= 0 ){ return false; }
+		depth[left] = depth[i]+1;
+		depth[right] = depth[i]+1;
+	}
+	if( deepest != file_max_depth ){ return false; }
+
+	for( int i=0; i<num_prims; ++i ){
+		if( file_prims[i] < 0 || file_prims[i] >= num_prims ){ return false; }
+	}
+	return true;
+
+} // end check file tree
+
+
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::create_children( int node_idx, int begin, int end, const BuildData &data ){
+
+	int n_prims = end-begin;
+	if( n_prims <= 0 ){
 		throw std::runtime_error("AABBTree::init Error: Empty queue");
 	}
 
-	// One element means we are a leaf
-	if( n_queue == 1 ){
-		int qidx = queue[0];
-		node->prim = qidx;
-		node->aabb = leaves[qidx];
+	Node &node = nodes[node_idx];
+	AABB cent_aabb;
+	compute_bounds( begin, end, data, node.aabb, cent_aabb );
+
+	// Few enough elements means we are a leaf
+	const int max_leaf_size = std::max( 1, data.settings.max_leaf_size );
+	if( n_prims == 1 || ( n_prims <= max_leaf_size && data.settings.method == Settings::MIDPOINT ) ){
+		node.offset = begin;
+		node.num_prims = n_prims;
 		return;
 	}
 
-	// Compute the splitting plane
-	AABB tempAABB;
-	for( int i=0; i<n_queue; ++i ){ tempAABB.extend( centroids[ queue[i] ] ); }	
-	Vec3<T> sides = tempAABB.sizes();
-	int split = 0;
-	if( sides[1] >= sides[0] && sides[1] >= sides[2] ){ split = 1; }
-	else if( sides[2] >= sides[0] && sides[2] >= sides[1] ){ split = 2; }
-
-	// If two elements, make left and right
-	if( n_queue == 2 ){
-
-		node->left = new Node();
-		node->right = new Node();
-		int idx0 = queue[0];
-		int idx1 = queue[1];
-		const Vec3<T> &cent0 = centroids[idx0];
-		const Vec3<T> &cent1 = centroids[idx1];
-
-		if( cent0[split] < cent1[split] ){
-			node->left->prim = idx0;
-			node->left->aabb = leaves[idx0];
-			node->right->prim = idx1;
-			node->right->aabb = leaves[idx1];
-		} else {
-			node->left->prim = idx1;
-			node->left->aabb = leaves[idx1];
-			node->right->prim = idx0;
-			node->right->aabb = leaves[idx0];
+	int mid = -1;
+	switch( data.settings.method ){
+		case Settings::MIDPOINT: { mid = split_midpoint( begin, end, cent_aabb, data ); } break;
+		case Settings::SAH: {
+			T split_cost = std::numeric_limits<T>::max();
+			mid = split_sah( begin, end, cent_aabb, data, split_cost );
+
+			// With unit cost for a node visit and for a primitive test, a
+			// leaf costs n and a split costs 1 + (nL*AL + nR*AR)/A.
+			T area = surface_area( node.aabb );
+			if( n_prims <= max_leaf_size && T(n_prims)*area <= area + split_cost ){
+				node.offset = begin;
+				node.num_prims = n_prims;
+				return;
+			}
+		} break;
+	}
+
+	// If the centroids could not be separated (e.g. many of them
+	// coincide) just split the range in half along the longest axis.
+	if( mid <= begin || mid >= end ){
+		int axis = 0;
+		cent_aabb.sizes().maxCoeff( &axis );
+		mid = begin + n_prims/2;
+		const std::vector< Vec3<T> > &centroids = data.centroids;
+		std::nth_element( prims.begin()+begin, prims.begin()+mid, prims.begin()+end,
+			[&centroids,axis]( int a, int b ){ return centroids[a][axis] < centroids[b][axis]; } );
+	}
+
+	// The left child immediately follows this node,
+	// and the right child follows the left subtree.
+	int left = node_idx+1;
+	int right = node_idx + 2*(mid-begin);
+	node.offset = right;
+
+	// Large subtrees are handed off to other threads
+	if( n_prims > data.settings.parallel_threshold ){
+		#pragma omp task shared(data) firstprivate(left,begin,mid)
+		create_children( left, begin, mid, data );
+		#pragma omp task shared(data) firstprivate(right,mid,end)
+		create_children( right, mid, end, data );
+		#pragma omp taskwait
+	}
+	else {
+		create_children( left, begin, mid, data );
+		create_children( right, mid, end, data );
+	}
+
+} // end create childrens
+
+
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::compute_bounds( int begin, int end, const BuildData &data,
+	AABB &aabb, AABB &cent_aabb ) const {
+
+	aabb.setEmpty();
+	cent_aabb.setEmpty();
+	int n_chunks = num_chunks( end-begin, data.settings.parallel_threshold );
+	if( n_chunks == 1 ){
+		for( int i=begin; i<end; ++i ){
+			aabb.extend( data.leaves[ prims[i] ] );
+			cent_aabb.extend( data.centroids[ prims[i] ] );
 		}
 		return;
 	}
 
-	// Split the queue into left and right
-	T center = tempAABB.center()[split];
-	AABB left_aabb, right_aabb;
-	std::vector<int> left_queue, right_queue;
-	for( int i=0; i<n_queue; ++i ){
-		int idx = queue[i];
-		const Vec3<T> &cent = centroids[idx];
-		if( cent[split] < center ){
-			left_queue.push_back(idx);
-			left_aabb.extend(leaves[idx]);
-		} else {
-			right_queue.push_back(idx);
-			right_aabb.extend(leaves[idx]);
+	// Reduce over chunks for the top levels of the tree
+	std::vector<AABB> chunk_aabb( n_chunks ), chunk_cent( n_chunks );
+	int chunk_size = (end-begin + n_chunks-1)/n_chunks;
+	for( int c=0; c<n_chunks; ++c ){
+		#pragma omp task shared(data,chunk_aabb,chunk_cent) firstprivate(c)
+		{
+			int c_end = std::min( end, begin+(c+1)*chunk_size );
+			for( int i=begin+c*chunk_size; i<c_end; ++i ){
+				chunk_aabb[c].extend( data.leaves[ prims[i] ] );
+				chunk_cent[c].extend( data.centroids[ prims[i] ] );
+			}
 		}
 	}
+	#pragma omp taskwait
+	for( int c=0; c<n_chunks; ++c ){
+		aabb.extend( chunk_aabb[c] );
+		cent_aabb.extend( chunk_cent[c] );
+	}
+
+} // end compute bounds
+
+
+template <typename T, short PDIM>
+int AABBTree<T,PDIM>::split_midpoint( int begin, int end, const AABB &cent_aabb, const BuildData &data ){
+
+	// Split at the center of the longest axis
+	int axis = 0;
+	cent_aabb.sizes().maxCoeff( &axis );
+	T center = cent_aabb.center()[axis];
+	const std::vector< Vec3<T> > &centroids = data.centroids;
+	int *mid = std::partition( &prims[0]+begin, &prims[0]+end,
+		[&centroids,axis,center]( int p ){ return centroids[p][axis] < center; } );
+	return mid - &prims[0];
+
+} // end split midpoint
+
+
+template <typename T, short PDIM>
+int AABBTree<T,PDIM>::split_sah( int begin, int end, const AABB &cent_aabb, const BuildData &data,
+	T &split_cost ){
+
+	const int n_bins = std::max( 2, std::min( int(MAX_BINS), data.settings.sah_bins ) );
+	const Vec3<T> cmin = cent_aabb.min();
+	const Vec3<T> extent = cent_aabb.sizes();
+	Vec3<T> scale( 0, 0, 0 );
+	for( int axis=0; axis<3; ++axis ){
+		if( extent[axis] > T(0) ){ scale[axis] = T(n_bins) / extent[axis]; }
+	}
 
-	if( left_queue.size()==0 || right_queue.size()==0 ){
-		throw std::runtime_error("AABBTree::init Error: problem splitting geometry");
+	// Bin the primitives by centroid along all three axes
+	// at once. Large ranges are binned in chunks by multiple threads.
+	int n_chunks = num_chunks( end-begin, data.settings.parallel_threshold );
+	int chunk_size = (end-begin + n_chunks-1)/n_chunks;
+	std::vector<SAHBins> chunk_bins( n_chunks );
+	for( int c=0; c<n_chunks; ++c ){
+		#pragma omp task shared(data,chunk_bins,cmin,scale) firstprivate(c) if(n_chunks>1)
+		{
+			SAHBins &bins = chunk_bins[c];
+			for( int axis=0; axis<3; ++axis ){
+				for( int b=0; b<n_bins; ++b ){ bins.aabb[axis][b].setEmpty(); bins.count[axis][b] = 0; }
+			}
+			int c_end = std::min( end, begin+(c+1)*chunk_size );
+			for( int i=begin+c*chunk_size; i<c_end; ++i ){
+				int p = prims[i];
+				for( int axis=0; axis<3; ++axis ){
+					int b = std::min( n_bins-1, int( scale[axis]*(data.centroids[p][axis]-cmin[axis]) ) );
+					bins.aabb[axis][b].extend( data.leaves[p] );
+					bins.count[axis][b]++;
+				}
+			}
+		}
+	}
+	#pragma omp taskwait
+	SAHBins &bins = chunk_bins[0];
+	for( int c=1; c<n_chunks; ++c ){
+		for( int axis=0; axis<3; ++axis ){
+			for( int b=0; b<n_bins; ++b ){
+				bins.aabb[axis][b].extend( chunk_bins[c].aabb[axis][b] );
+				bins.count[axis][b] += chunk_bins[c].count[axis][b];
+			}
+		}
 	}
 
-	// Create the left child
-	node->left = new Node();
-	node->left->aabb = left_aabb;
-	create_children( node->left, left_queue, leaves, centroids );
+	T best_cost = std::numeric_limits<T>::max();
+	int best_axis = -1;
+	int best_bin = -1;
+	T right_area[MAX_BINS];
+	int right_count[MAX_BINS];
+	for( int axis=0; axis<3; ++axis ){
+		if( extent[axis] <= T(0) ){ continue; }
+
+		// Sweep from the right to get the area/count right of each plane
+		AABB accum;
+		int count = 0;
+		for( int i=n_bins-1; i>0; --i ){
+			accum.extend( bins.aabb[axis][i] );
+			count += bins.count[axis][i];
+			right_area[i] = surface_area( accum );
+			right_count[i] = count;
+		}
 
-	// Create the right child
-	node->right = new Node();
-	node->right->aabb = right_aabb;
-	create_children( node->right, right_queue, leaves, centroids );
+		// Then sweep from the left and evaluate the cost of each plane,
+		// where plane i puts bins [0,i) on the left.
+		accum.setEmpty();
+		count = 0;
+		for( int i=1; i<n_bins; ++i ){
+			accum.extend( bins.aabb[axis][i-1] );
+			count += bins.count[axis][i-1];
+			if( count == 0 || right_count[i] == 0 ){ continue; }
+			T cost = T(count)*surface_area( accum ) + T(right_count[i])*right_area[i];
+			if( cost < best_cost ){
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = i;
+			}
+		}
+	} // end loop axes
 
-} // end create childrens
+	if( best_axis < 0 ){ return -1; }
+	split_cost = best_cost;
+
+	const std::vector< Vec3<T> > &centroids = data.centroids;
+	int *mid = std::partition( &prims[0]+begin, &prims[0]+end,
+		[&]( int p ){
+			int b = std::min( n_bins-1, int( scale[best_axis]*(centroids[p][best_axis]-cmin[best_axis]) ) );
+			return b < best_bin;
+		} );
+	return mid - &prims[0];
+
+} // end split sah
+
+
+template <typename T, short PDIM>
+void AABBTree<T,PDIM>::create_lbvh( int node_idx, int begin, int end,
+	const std::vector<uint64_t> &codes, const BuildData &data ){
+
+	Node &node = nodes[node_idx];
+	int n_prims = end-begin;
+	if( n_prims <= std::max( 1, data.settings.max_leaf_size ) ){
+		node.aabb.setEmpty();
+		for( int i=begin; i<end; ++i ){ node.aabb.extend( data.leaves[ prims[i] ] ); }
+		node.offset = begin;
+		node.num_prims = n_prims;
+		return;
+	}
+
+	// Split where the highest bit that differs in the range changes.
+	// If all codes are the same, split the range in half.
+	int mid = begin + n_prims/2;
+	uint64_t first = codes[begin];
+	uint64_t diff = first ^ codes[end-1];
+	if( diff != 0 ){
+		int high_bit = 63;
+		while( !( (diff >> high_bit) & 1 ) ){ --high_bit; }
+		uint64_t mask = uint64_t(1) << high_bit;
+		mid = std::upper_bound( codes.begin()+begin, codes.begin()+end, first | (mask-1) ) - codes.begin();
+	}
+
+	int left = node_idx+1;
+	int right = node_idx + 2*(mid-begin);
+	node.offset = right;
+	if( n_prims > data.settings.parallel_threshold ){
+		#pragma omp task shared(codes,data) firstprivate(left,begin,mid)
+		create_lbvh( left, begin, mid, codes, data );
+		#pragma omp task shared(codes,data) firstprivate(right,mid,end)
+		create_lbvh( right, mid, end, codes, data );
+		#pragma omp taskwait
+	}
+	else {
+		create_lbvh( left, begin, mid, codes, data );
+		create_lbvh( right, mid, end, codes, data );
+	}
+
+	node.aabb = nodes[left].aabb;
+	node.aabb.extend( nodes[right].aabb );
+
+} // end create lbvh
+
+
+//
+//	Morton codes
+//
+
+// Spreads the lowest 10 bits of x so there are two zeros between each
+static inline uint64_t morton_expand_10( uint64_t x ){
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+// Spreads the lowest 21 bits of x so there are two zeros between each
+static inline uint64_t morton_expand_21( uint64_t x ){
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x1f00000000ffffull;
+	x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+template <typename T>
+static inline uint64_t morton_code( const Vec3<T> &p, const Eigen::AlignedBox<T,3> &bounds ){
+	const int bits = morton_bits<T>()/3;
+	const T max_val = T( (uint64_t(1) << bits) - 1 );
+	Vec3<T> extent = bounds.sizes();
+	uint64_t c[3];
+	for( int i=0; i<3; ++i ){
+		T x = extent[i] > T(0) ? ( p[i]-bounds.min()[i] ) / extent[i] : T(0);
+		c[i] = uint64_t( std::min( max_val, std::max( T(0), x*max_val ) ) );
+	}
+	if( bits == 10 ){
+		return ( morton_expand_10(c[0]) << 2 ) | ( morton_expand_10(c[1]) << 1 ) | morton_expand_10(c[2]);
+	}
+	return ( morton_expand_21(c[0]) << 2 ) | ( morton_expand_21(c[1]) << 1 ) | morton_expand_21(c[2]);
+}
+
+
+static inline void radix_sort( std::vector<uint64_t> &keys, std::vector<int> &vals, int n_bits ){
+
+	const int n = keys.size();
+	if( (int)vals.size() != n ){
+		throw std::runtime_error("radix_sort Error: keys and values differ in size");
+	}
+	const int n_passes = (n_bits+7)/8;
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = std::max( 1, std::min( omp_get_max_threads(), n/4096 ) );
+#endif
+	std::vector<uint64_t> tmp_keys( n );
+	std::vector<int> tmp_vals( n );
+	std::vector<int> hist( n_threads*256 );
+
+	for( int pass=0; pass<n_passes; ++pass ){
+		const int shift = pass*8;
+		std::fill( hist.begin(), hist.end(), 0 );
+
+		#pragma omp parallel num_threads(n_threads)
+		{
+			// The team can be smaller than asked for, e.g. when nested
+			// in another parallel region, so chunk by its actual size.
+			int tid = 0, n_team = 1;
+#ifdef _OPENMP
+			tid = omp_get_thread_num();
+			n_team = omp_get_num_threads();
+#endif
+			// Each thread sorts a contiguous chunk so the result is stable
+			int chunk = (n + n_team-1)/n_team;
+			int begin = std::min( n, tid*chunk );
+			int end = std::min( n, begin+chunk );
+			int *h = &hist[tid*256];
+			for( int i=begin; i<end; ++i ){ h[ (keys[i] >> shift) & 0xff ]++; }
+
+			#pragma omp barrier
+			#pragma omp single
+			{
+				// Offsets ordered by digit, then thread
+				int sum = 0;
+				for( int d=0; d<256; ++d ){
+					for( int t=0; t<n_team; ++t ){
+						int c = hist[t*256+d];
+						hist[t*256+d] = sum;
+						sum += c;
+					}
+				}
+			}
+
+			for( int i=begin; i<end; ++i ){
+				int dst = h[ (keys[i] >> shift) & 0xff ]++;
+				tmp_keys[dst] = keys[i];
+				tmp_vals[dst] = vals[i];
+			}
+		}
+
+		keys.swap( tmp_keys );
+		vals.swap( tmp_vals );
+	}
+
+} // end radix sort
 
 
 } // end ns bvh
@@ -0,0 +1,197 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// Counters for AABBTree traversals and a report on the quality of a tree,
+// both of which can be written as JSON.
+//
+// Per query, pass a TraversalStats to traverse. Counts are added to it,
+// so the same one can be reused to sum over many queries:
+//
+//	bvh::TraversalStats stats;
+//	tree.traverse( visitor, stats );
+//	std::cout << stats.to_json() << std::endl;
+//
+// To count every traversal of a tree, compile with MCL_BVH_STATS defined and
+// read AABBTree::get_stats(). Without it, traverse(visitor) counts nothing
+// and costs nothing extra.
+//
+
+#ifndef MCL_BVHSTATS_H
+#define MCL_BVHSTATS_H 1
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+namespace mcl {
+namespace bvh {
+
+template <typename T, short PDIM> class AABBTree;
+
+// Counts from one or more traversals
+struct TraversalStats {
+	long queries; // calls to traverse
+	long nodes_visited; // nodes whose box was hit
+	long aabb_tests; // calls to hit_aabb
+	long prim_tests; // calls to hit_prim
+	long early_exits; // traversals stopped by hit_prim returning true
+	int max_stack; // deepest the traversal stack got
+	TraversalStats(){ reset(); }
+	void reset(){ queries = 0; nodes_visited = 0; aabb_tests = 0; prim_tests = 0; early_exits = 0; max_stack = 0; }
+	void add( const TraversalStats &s ){
+		queries += s.queries;
+		nodes_visited += s.nodes_visited;
+		aabb_tests += s.aabb_tests;
+		prim_tests += s.prim_tests;
+		early_exits += s.early_exits;
+		max_stack = std::max( max_stack, s.max_stack );
+	}
+
+	// Called by the traversal
+	void query(){ queries++; }
+	void aabb_test(){ aabb_tests++; }
+	void node_visit(){ nodes_visited++; }
+	void prim_test(){ prim_tests++; }
+	void early_exit(){ early_exits++; }
+	void stack_depth( int n ){ max_stack = std::max( max_stack, n ); }
+
+	// Totals and per-query averages
+	std::string to_json() const;
+};
+
+// Does nothing, used when stats are compiled out
+struct NoStats {
+	void query(){}
+	void aabb_test(){}
+	void node_visit(){}
+	void prim_test(){}
+	void early_exit(){}
+	void stack_depth( int ){}
+};
+
+// Structure of a built tree
+struct TreeQuality {
+	double sah_cost; // see AABBTree::sah_cost
+	int num_nodes, num_leaves, num_prims, max_depth;
+	std::vector<int> depth_histogram; // number of leaves at each depth
+	std::vector<int> leaf_size_histogram; // number of leaves with each number of prims
+	// Surface area of the overlap of two sibling boxes over the
+	// area of their parent, averaged over and max of the interior nodes.
+	double mean_overlap, max_overlap;
+	TreeQuality() : sah_cost(0), num_nodes(0), num_leaves(0), num_prims(0), max_depth(0),
+		mean_overlap(0), max_overlap(0) {}
+	std::string to_json() const;
+};
+
+template <typename T, short PDIM>
+static inline TreeQuality tree_quality( const AABBTree<T,PDIM> &tree );
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+namespace bvh {
+
+static inline std::string json_array( const std::vector<int> &v ){
+	std::stringstream ss;
+	ss << "[";
+	for( size_t i=0; i<v.size(); ++i ){ ss << ( i > 0 ? ", " : "" ) << v[i]; }
+	ss << "]";
+	return ss.str();
+}
+
+inline std::string TraversalStats::to_json() const {
+	const double n = std::max( 1.0, double(queries) );
+	std::stringstream ss;
+	ss << "{\"queries\": " << queries <<
+		", \"nodes_visited\": " << nodes_visited <<
+		", \"aabb_tests\": " << aabb_tests <<
+		", \"prim_tests\": " << prim_tests <<
+		", \"early_exits\": " << early_exits <<
+		", \"max_stack\": " << max_stack <<
+		", \"nodes_per_query\": " << double(nodes_visited)/n <<
+		", \"aabb_tests_per_query\": " << double(aabb_tests)/n <<
+		", \"prim_tests_per_query\": " << double(prim_tests)/n << "}";
+	return ss.str();
+}
+
+inline std::string TreeQuality::to_json() const {
+	std::stringstream ss;
+	ss << "{\"sah_cost\": " << sah_cost <<
+		", \"num_nodes\": " << num_nodes <<
+		", \"num_leaves\": " << num_leaves <<
+		", \"num_prims\": " << num_prims <<
+		", \"max_depth\": " << max_depth <<
+		", \"depth_histogram\": " << json_array( depth_histogram ) <<
+		", \"leaf_size_histogram\": " << json_array( leaf_size_histogram ) <<
+		", \"mean_overlap\": " << mean_overlap <<
+		", \"max_overlap\": " << max_overlap << "}";
+	return ss.str();
+}
+
+template <typename T, short PDIM>
+static inline TreeQuality tree_quality( const AABBTree<T,PDIM> &tree ){
+
+	typedef typename AABBTree<T,PDIM>::Node Node;
+	TreeQuality q;
+	const auto nodes = tree.get_nodes();
+	q.num_nodes = nodes.size();
+	q.num_prims = tree.get_prims().size();
+	if( nodes.size() == 0 ){ return q; }
+	q.sah_cost = tree.sah_cost();
+
+	// Nodes are depth-first, so a parent comes before its children
+	std::vector<int> depth( nodes.size(), 0 );
+	int n_interior = 0;
+	for( size_t i=0; i<nodes.size(); ++i ){
+		const Node &node = nodes[i];
+		if( node.is_leaf() ){
+			q.num_leaves++;
+			q.max_depth = std::max( q.max_depth, depth[i] );
+			if( (int)q.depth_histogram.size() <= depth[i] ){ q.depth_histogram.resize( depth[i]+1, 0 ); }
+			q.depth_histogram[ depth[i] ]++;
+			if( (int)q.leaf_size_histogram.size() <= node.num_prims ){ q.leaf_size_histogram.resize( node.num_prims+1, 0 ); }
+			q.leaf_size_histogram[ node.num_prims ]++;
+			continue;
+		}
+		depth[i+1] = depth[i]+1;
+		depth[ node.offset ] = depth[i]+1;
+
+		T area = AABBTree<T,PDIM>::surface_area( node.aabb );
+		T overlap = AABBTree<T,PDIM>::surface_area( nodes[i+1].aabb.intersection( nodes[ node.offset ].aabb ) );
+		double ratio = area > T(0) ? double( overlap/area ) : 0.0;
+		q.mean_overlap += ratio;
+		q.max_overlap = std::max( q.max_overlap, ratio );
+		n_interior++;
+	}
+	if( n_interior > 0 ){ q.mean_overlap /= double(n_interior); }
+	return q;
+
+} // end tree quality
+
+} // end ns bvh
+} // end ns mcl
+
+#endif
@@ -0,0 +1,311 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// Runs many queries on an AABBTree at once. The queries are spread over
+// threads and, by default, processed in Morton order so that neighboring
+// queries share the upper levels of the tree in cache.
+//
+// Example:
+//
+//	std::vector<int> hit( n );
+//	std::vector<float> px( n ), py( n ), pz( n ), dist( n );
+//	bvh::QueryResults<float> results;
+//	results.prim = &hit[0];
+//	results.x = &px[0]; results.y = &py[0]; results.z = &pz[0];
+//	results.dist = &dist[0];
+//	bvh::nearest_triangle( tree, verts, faces, points, n, results );
+//
+
+#ifndef MCL_BATCHQUERY_H
+#define MCL_BATCHQUERY_H 1
+
+#include "BVH.hpp"
+#include <limits>
+
+namespace mcl {
+namespace bvh {
+
+	// Per-query results in structure-of-arrays form. Each array is owned
+	// by the caller and holds one entry per query. Arrays left as nullptr
+	// are not written.
+	template <typename T>
+	struct QueryResults {
+		int *prim; // hit primitive, or -1 if none
+		T *x, *y, *z; // nearest point on the hit primitive
+		T *dist; // distance from the query point to (x,y,z)
+		QueryResults() : prim(nullptr), x(nullptr), y(nullptr), z(nullptr), dist(nullptr) {}
+	};
+
+	// Nearest triangle to each point. Points are xyz interleaved like verts.
+	// If no triangle is found (empty tree), prim is -1 and dist is max().
+	template <typename T>
+	static inline void nearest_triangle( const AABBTree<T,3> &tree, const T *verts, const int *inds,
+		const T *points, int num_points, QueryResults<T> &results, bool morton_order=true );
+
+	// Tet containing each point. The nearest point is the query point itself,
+	// with a distance of zero if it's inside a tet and max() if not.
+	// If inverse is not nullptr, the tets are tested with it (see TetInverse).
+	template <typename T>
+	static inline void point_in_tet( const AABBTree<T,4> &tree, const T *verts, const int *inds,
+		const T *points, int num_points, QueryResults<T> &results, bool morton_order=true,
+		const projection::TetInverse<T> *inverse=nullptr );
+
+	// k nearest verts, edges, or triangles to each point, see KNearest.
+	// prims and dists hold k entries per point, nearest first, padded with
+	// -1 and max() if fewer are found within max_dist. If self is true the
+	// points are the verts, and primitives that use the point are skipped.
+	template <typename T, short PDIM>
+	static inline void k_nearest( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+		const T *points, int num_points, int k, int *prims, T *dists,
+		T max_dist = std::numeric_limits<T>::max(), bool self=false, bool morton_order=true );
+
+	// All verts, edges, or triangles within radius of each point. Those of
+	// point i, nearest first, are prims[j] and dists[j] for j in offsets[i]
+	// to offsets[i+1]-1. See k_nearest for self.
+	template <typename T, short PDIM>
+	static inline void radius_search( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+		const T *points, int num_points, T radius, std::vector<int> &offsets, std::vector<int> &prims,
+		std::vector<T> &dists, bool self=false, bool morton_order=true );
+
+	// Earliest time of impact of each moving point (x0 at t=0 to x1 at t=1)
+	// with the triangles of a tree built with swept bounds over verts0 and
+	// verts1. toi is set to 1 and hit to -1 for points that don't hit anything.
+	// If self is true the points are the verts of the triangles, and
+	// triangles that use the point are skipped.
+	template <typename T>
+	static inline void vertex_triangle_toi( const AABBTree<T,3> &tree, const T *verts0, const T *verts1,
+		const int *inds, const T *x0, const T *x1, int num_points, T eps, T *toi, int *hit, bool self=false );
+
+	// Earliest time of impact of each moving query edge (query_inds into x0
+	// and x1) with the edges of a tree built with swept bounds, see above.
+	// If self is true the query edges are the edges of the tree, and edges
+	// that share a vertex with the query edge are skipped.
+	template <typename T>
+	static inline void edge_edge_toi( const AABBTree<T,2> &tree, const T *verts0, const T *verts1,
+		const int *inds, const T *x0, const T *x1, const int *query_inds, int num_edges, T eps,
+		T *toi, int *hit, bool self=false );
+
+	// Order in which to process the points: sorted by Morton code,
+	// or as given if morton_order is false.
+	template <typename T>
+	static inline void query_order( const T *points, int num_points, bool morton_order, std::vector<int> &order );
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T>
+static inline void bvh::query_order( const T *points, int num_points, bool morton_order, std::vector<int> &order ){
+
+	order.resize( num_points );
+	std::iota( order.begin(), order.end(), 0 );
+	if( !morton_order || num_points < 2 ){ return; }
+
+	Eigen::AlignedBox<T,3> aabb;
+	for( int i=0; i<num_points; ++i ){
+		aabb.extend( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ) );
+	}
+
+	std::vector<uint64_t> codes( num_points );
+	#pragma omp parallel for
+	for( int i=0; i<num_points; ++i ){
+		codes[i] = morton_code( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ), aabb );
+	}
+	radix_sort( codes, order, morton_bits<T>() );
+
+} // end query order
+
+
+template <typename T>
+static inline void bvh::nearest_triangle( const AABBTree<T,3> &tree, const T *verts, const int *inds,
+	const T *points, int num_points, QueryResults<T> &results, bool morton_order ){
+
+	std::vector<int> order;
+	query_order( points, num_points, morton_order, order );
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int j=0; j<num_points; ++j ){
+		const int i = order[j];
+		NearestTriangle<T> visitor( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ), verts, inds );
+		tree.traverse_static( visitor );
+		if( results.prim ){ results.prim[i] = visitor.hit_tri; }
+		if( results.x ){ results.x[i] = visitor.proj[0]; }
+		if( results.y ){ results.y[i] = visitor.proj[1]; }
+		if( results.z ){ results.z[i] = visitor.proj[2]; }
+		if( results.dist ){
+			results.dist[i] = visitor.hit_tri < 0 ? std::numeric_limits<T>::max() : std::sqrt( visitor.curr_nearest );
+		}
+	}
+
+} // end nearest triangle
+
+
+template <typename T>
+static inline void bvh::point_in_tet( const AABBTree<T,4> &tree, const T *verts, const int *inds,
+	const T *points, int num_points, QueryResults<T> &results, bool morton_order,
+	const projection::TetInverse<T> *inverse ){
+
+	std::vector<int> order;
+	query_order( points, num_points, morton_order, order );
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int j=0; j<num_points; ++j ){
+		const int i = order[j];
+		PointInTet<T> visitor( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ), verts, inds );
+		visitor.inverse = inverse;
+		tree.traverse_static( visitor );
+		if( results.prim ){ results.prim[i] = visitor.hit_tet; }
+		if( results.x ){ results.x[i] = visitor.point[0]; }
+		if( results.y ){ results.y[i] = visitor.point[1]; }
+		if( results.z ){ results.z[i] = visitor.point[2]; }
+		if( results.dist ){
+			results.dist[i] = visitor.hit_tet < 0 ? std::numeric_limits<T>::max() : T(0);
+		}
+	}
+
+} // end point in tet
+
+
+template <typename T, short PDIM>
+static inline void bvh::k_nearest( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+	const T *points, int num_points, int k, int *prims, T *dists, T max_dist, bool self, bool morton_order ){
+
+	std::vector<int> order;
+	query_order( points, num_points, morton_order, order );
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int j=0; j<num_points; ++j ){
+		const int i = order[j];
+		KNearest<T,PDIM> visitor( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ), k, verts, inds, max_dist );
+		if( self ){ visitor.skip_vert_idx.emplace_back( i ); }
+		tree.traverse_static( visitor );
+		visitor.sort();
+		const int n = visitor.neighbors.size();
+		for( int m=0; m<k; ++m ){
+			prims[i*k+m] = m < n ? visitor.neighbors[m].prim : -1;
+			dists[i*k+m] = m < n ? std::sqrt( visitor.neighbors[m].dist2 ) : std::numeric_limits<T>::max();
+		}
+	}
+
+} // end k nearest
+
+
+template <typename T, short PDIM>
+static inline void bvh::radius_search( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+	const T *points, int num_points, T radius, std::vector<int> &offsets, std::vector<int> &prims,
+	std::vector<T> &dists, bool self, bool morton_order ){
+
+	std::vector<int> order;
+	query_order( points, num_points, morton_order, order );
+
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = omp_get_max_threads();
+#endif
+
+	// Results go into a buffer per thread, then are copied out
+	// once the number for each point is known.
+	std::vector< std::vector< Neighbor<T> > > thread_neighbors( n_threads );
+	std::vector<int> owner( num_points ), start( num_points );
+	offsets.assign( num_points+1, 0 );
+	#pragma omp parallel num_threads(n_threads)
+	{
+		int tid = 0;
+#ifdef _OPENMP
+		tid = omp_get_thread_num();
+#endif
+		std::vector< Neighbor<T> > &local_neighbors = thread_neighbors[tid];
+
+		#pragma omp for schedule(dynamic,64)
+		for( int j=0; j<num_points; ++j ){
+			const int i = order[j];
+			RadiusSearch<T,PDIM> visitor( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ), radius, verts, inds );
+			if( self ){ visitor.skip_vert_idx.emplace_back( i ); }
+			tree.traverse_static( visitor );
+			visitor.sort();
+			owner[i] = tid;
+			start[i] = local_neighbors.size();
+			offsets[i+1] = visitor.neighbors.size();
+			local_neighbors.insert( local_neighbors.end(), visitor.neighbors.begin(), visitor.neighbors.end() );
+		}
+	}
+
+	for( int i=0; i<num_points; ++i ){ offsets[i+1] += offsets[i]; }
+	prims.resize( offsets.back() );
+	dists.resize( offsets.back() );
+	#pragma omp parallel for
+	for( int i=0; i<num_points; ++i ){
+		const Neighbor<T> *n = thread_neighbors[ owner[i] ].data() + start[i];
+		for( int j=offsets[i]; j<offsets[i+1]; ++j, ++n ){
+			prims[j] = n->prim;
+			dists[j] = std::sqrt( n->dist2 );
+		}
+	}
+
+} // end radius search
+
+
+template <typename T>
+static inline void bvh::vertex_triangle_toi( const AABBTree<T,3> &tree, const T *verts0, const T *verts1,
+	const int *inds, const T *x0, const T *x1, int num_points, T eps, T *toi, int *hit, bool self ){
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int i=0; i<num_points; ++i ){
+		VertexTriangleTOI<T> visitor( Vec3<T>( x0[i*3], x0[i*3+1], x0[i*3+2] ),
+			Vec3<T>( x1[i*3], x1[i*3+1], x1[i*3+2] ), verts0, verts1, inds, eps );
+		if( self ){ visitor.skip_vert_idx.emplace_back( i ); }
+		tree.traverse_static( visitor );
+		toi[i] = visitor.toi;
+		hit[i] = visitor.hit_tri;
+	}
+
+} // end vertex triangle toi
+
+
+template <typename T>
+static inline void bvh::edge_edge_toi( const AABBTree<T,2> &tree, const T *verts0, const T *verts1,
+	const int *inds, const T *x0, const T *x1, const int *query_inds, int num_edges, T eps,
+	T *toi, int *hit, bool self ){
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int i=0; i<num_edges; ++i ){
+		const int p = query_inds[i*2], q = query_inds[i*2+1];
+		EdgeEdgeTOI<T> visitor(
+			Vec3<T>( x0[p*3], x0[p*3+1], x0[p*3+2] ), Vec3<T>( x0[q*3], x0[q*3+1], x0[q*3+2] ),
+			Vec3<T>( x1[p*3], x1[p*3+1], x1[p*3+2] ), Vec3<T>( x1[q*3], x1[q*3+1], x1[q*3+2] ),
+			verts0, verts1, inds, eps );
+		if( self ){
+			visitor.skip_vert_idx.emplace_back( p );
+			visitor.skip_vert_idx.emplace_back( q );
+		}
+		tree.traverse_static( visitor );
+		toi[i] = visitor.toi;
+		hit[i] = visitor.hit_edge;
+	}
+
+} // end edge edge toi
+
+} // end ns mcl
+
+#endif
@@ -0,0 +1,278 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// Broadphase collision pairs from a simultaneous traversal of two trees
+// (or one tree against itself). Primitives are paired if their boxes are
+// within thickness of each other. The trees must be up to date with the
+// verts, i.e. call refit after the verts move.
+//
+// Example, cloth verts against obstacle triangles:
+//
+//	std::vector<bvh::PrimPair> pairs;
+//	bvh::overlap_pairs( cloth_tree, cloth_verts, cloth_inds,
+//		obstacle_tree, obstacle_verts, obstacle_tris, thickness, pairs );
+//
+
+#ifndef MCL_BROADPHASE_H
+#define MCL_BROADPHASE_H 1
+
+#include "BVH.hpp"
+
+namespace mcl {
+namespace bvh {
+
+	// (prim in tree A, prim in tree B), or (smaller, larger) in the self case
+	typedef std::pair<int,int> PrimPair;
+
+	// All pairs of primitives in tree_a and tree_b with overlapping boxes.
+	// The order of the pairs is unspecified.
+	template <typename T, short DA, short DB>
+	static inline void overlap_pairs(
+		const AABBTree<T,DA> &tree_a, const T *verts_a, const int *inds_a,
+		const AABBTree<T,DB> &tree_b, const T *verts_b, const int *inds_b,
+		T thickness, std::vector<PrimPair> &pairs );
+
+	// All pairs of primitives in the tree with overlapping boxes, except
+	// those that share a vertex. The order of the pairs is unspecified.
+	template <typename T, short PDIM>
+	static inline void self_overlap_pairs( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+		T thickness, std::vector<PrimPair> &pairs );
+
+	// Traverses pairs of nodes, descending into the larger node of a pair
+	// until both are leaves. The first few levels are expanded serially into
+	// a frontier of node pairs, which are then traversed in parallel with
+	// a buffer of primitive pairs for each thread.
+	template <typename T, short DA, short DB>
+	class DualTraversal {
+	typedef Eigen::AlignedBox<T,3> AABB;
+	typedef std::pair<int,int> NodePair;
+	public:
+		// If self is true, tree_b must be tree_a
+		DualTraversal( const AABBTree<T,DA> &tree_a, const T *verts_a, const int *inds_a,
+			const AABBTree<T,DB> &tree_b, const T *verts_b, const int *inds_b, T thickness, bool self );
+
+		void run( std::vector<PrimPair> &pairs ) const;
+
+	private:
+		// Pushes the children of a node pair, or nothing if the nodes don't overlap.
+		// Returns false if both are leaves.
+		bool expand( const NodePair &p, std::vector<NodePair> &stack ) const;
+
+		// Tests the primitives of two leaves
+		void test_leaves( const NodePair &p, std::vector<PrimPair> &pairs ) const;
+
+		bool overlap( const AABB &a, const AABB &b ) const {
+			for( int i=0; i<3; ++i ){
+				if( a.min()[i] > b.max()[i]+thickness || b.min()[i] > a.max()[i]+thickness ){ return false; }
+			}
+			return true;
+		}
+
+		// True if the primitives share a vertex (self case)
+		bool adjacent( int pa, int pb ) const {
+			for( int i=0; i<DA; ++i ){
+				for( int j=0; j<DA; ++j ){
+					if( inds_a[pa*DA+i] == inds_a[pb*DA+j] ){ return true; }
+				}
+			}
+			return false;
+		}
+
+		template <short PDIM>
+		static void prim_boxes( const T *verts, const int *inds, int num_prims, std::vector<AABB> &boxes );
+
+		const AABBTree<T,DA> &tree_a;
+		const AABBTree<T,DB> &tree_b;
+		const int *inds_a;
+		T thickness;
+		bool self;
+		std::vector<AABB> boxes_a, boxes_b; // primitive bounds
+	};
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T, short DA, short DB>
+static inline void bvh::overlap_pairs(
+	const AABBTree<T,DA> &tree_a, const T *verts_a, const int *inds_a,
+	const AABBTree<T,DB> &tree_b, const T *verts_b, const int *inds_b,
+	T thickness, std::vector<PrimPair> &pairs ){
+	DualTraversal<T,DA,DB> dt( tree_a, verts_a, inds_a, tree_b, verts_b, inds_b, thickness, false );
+	dt.run( pairs );
+}
+
+
+template <typename T, short PDIM>
+static inline void bvh::self_overlap_pairs( const AABBTree<T,PDIM> &tree, const T *verts, const int *inds,
+	T thickness, std::vector<PrimPair> &pairs ){
+	DualTraversal<T,PDIM,PDIM> dt( tree, verts, inds, tree, verts, inds, thickness, true );
+	dt.run( pairs );
+}
+
+
+template <typename T, short DA, short DB>
+bvh::DualTraversal<T,DA,DB>::DualTraversal( const AABBTree<T,DA> &tree_a_, const T *verts_a, const int *inds_a_,
+	const AABBTree<T,DB> &tree_b_, const T *verts_b, const int *inds_b, T thickness_, bool self_ ) :
+	tree_a(tree_a_), tree_b(tree_b_), inds_a(inds_a_), thickness(thickness_), self(self_) {
+	prim_boxes<DA>( verts_a, inds_a, tree_a.get_prims().size(), boxes_a );
+	if( !self ){ prim_boxes<DB>( verts_b, inds_b, tree_b.get_prims().size(), boxes_b ); }
+}
+
+
+template <typename T, short DA, short DB>
+template <short PDIM>
+void bvh::DualTraversal<T,DA,DB>::prim_boxes( const T *verts, const int *inds, int num_prims, std::vector<AABB> &boxes ){
+	boxes.resize( num_prims );
+	#pragma omp parallel for
+	for( int i=0; i<num_prims; ++i ){
+		AABB box;
+		for( int j=0; j<PDIM; ++j ){
+			int v = inds[i*PDIM+j];
+			box.extend( Vec3<T>( verts[v*3], verts[v*3+1], verts[v*3+2] ) );
+		}
+		boxes[i] = box;
+	}
+}
+
+
+template <typename T, short DA, short DB>
+void bvh::DualTraversal<T,DA,DB>::run( std::vector<PrimPair> &pairs ) const {
+
+	pairs.clear();
+	if( tree_a.get_nodes().size() == 0 || tree_b.get_nodes().size() == 0 ){ return; }
+
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = omp_get_max_threads();
+#endif
+
+	// Expand level by level until there's enough work to go around
+	std::vector<NodePair> frontier( 1, NodePair(0,0) );
+	std::vector<NodePair> next;
+	const int min_frontier = 16*n_threads;
+	while( n_threads > 1 && (int)frontier.size() < min_frontier ){
+		next.clear();
+		bool expanded = false;
+		for( size_t i=0; i<frontier.size(); ++i ){
+			if( expand( frontier[i], next ) ){ expanded = true; }
+			else { next.emplace_back( frontier[i] ); }
+		}
+		frontier.swap( next );
+		if( !expanded ){ break; }
+	}
+
+	std::vector< std::vector<PrimPair> > thread_pairs( n_threads );
+	const int n_frontier = frontier.size();
+	#pragma omp parallel num_threads(n_threads)
+	{
+		int tid = 0;
+#ifdef _OPENMP
+		tid = omp_get_thread_num();
+#endif
+		std::vector<PrimPair> &local_pairs = thread_pairs[tid];
+		std::vector<NodePair> stack;
+
+		#pragma omp for schedule(dynamic,1)
+		for( int i=0; i<n_frontier; ++i ){
+			stack.emplace_back( frontier[i] );
+			while( stack.size() > 0 ){
+				NodePair p = stack.back();
+				stack.pop_back();
+				if( !expand( p, stack ) ){ test_leaves( p, local_pairs ); }
+			}
+		}
+	}
+
+	size_t n_pairs = 0;
+	for( int i=0; i<n_threads; ++i ){ n_pairs += thread_pairs[i].size(); }
+	pairs.reserve( n_pairs );
+	for( int i=0; i<n_threads; ++i ){
+		pairs.insert( pairs.end(), thread_pairs[i].begin(), thread_pairs[i].end() );
+	}
+
+} // end run
+
+
+template <typename T, short DA, short DB>
+bool bvh::DualTraversal<T,DA,DB>::expand( const NodePair &p, std::vector<NodePair> &stack ) const {
+
+	const typename AABBTree<T,DA>::Node &na = tree_a.get_nodes()[p.first];
+	const typename AABBTree<T,DB>::Node &nb = tree_b.get_nodes()[p.second];
+
+	// A node against itself: both children against themselves and each other
+	if( self && p.first == p.second ){
+		if( na.is_leaf() ){ return false; }
+		int left = p.first+1, right = na.offset;
+		stack.emplace_back( left, left );
+		stack.emplace_back( right, right );
+		stack.emplace_back( left, right );
+		return true;
+	}
+
+	if( !overlap( na.aabb, nb.aabb ) ){ return true; }
+	if( na.is_leaf() && nb.is_leaf() ){ return false; }
+
+	bool split_a = nb.is_leaf() || ( !na.is_leaf() &&
+		AABBTree<T,DA>::surface_area( na.aabb ) >= AABBTree<T,DB>::surface_area( nb.aabb ) );
+	if( split_a ){
+		stack.emplace_back( p.first+1, p.second );
+		stack.emplace_back( na.offset, p.second );
+	} else {
+		stack.emplace_back( p.first, p.second+1 );
+		stack.emplace_back( p.first, nb.offset );
+	}
+	return true;
+
+} // end expand
+
+
+template <typename T, short DA, short DB>
+void bvh::DualTraversal<T,DA,DB>::test_leaves( const NodePair &p, std::vector<PrimPair> &pairs ) const {
+
+	const typename AABBTree<T,DA>::Node &na = tree_a.get_nodes()[p.first];
+	const typename AABBTree<T,DB>::Node &nb = tree_b.get_nodes()[p.second];
+	const ArrayView<int> prims_a = tree_a.get_prims();
+	const ArrayView<int> prims_b = tree_b.get_prims();
+	const std::vector<AABB> &bb = self ? boxes_a : boxes_b;
+	const bool same_leaf = self && p.first == p.second;
+
+	for( int i=0; i<na.num_prims; ++i ){
+		int pa = prims_a[ na.offset+i ];
+		for( int j = same_leaf ? i+1 : 0; j<nb.num_prims; ++j ){
+			int pb = prims_b[ nb.offset+j ];
+			if( !overlap( boxes_a[pa], bb[pb] ) ){ continue; }
+			if( self ){
+				if( adjacent( pa, pb ) ){ continue; }
+				pairs.emplace_back( std::min(pa,pb), std::max(pa,pb) );
+			}
+			else { pairs.emplace_back( pa, pb ); }
+		}
+	}
+
+} // end test leaves
+
+} // end ns mcl
+
+#endif
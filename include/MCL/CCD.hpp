@@ -0,0 +1,256 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// Continuous collision detection between primitives whose vertices move
+// linearly over a time step, from x0 at t=0 to x1 at t=1. The four points
+// of a vertex-triangle or edge-edge pair cross through each other only
+// when they are coplanar, at the roots of a cubic. The step is split at
+// those roots, and each piece is searched for the first time the distance
+// (from the static projections) is within eps. The distance changes no
+// faster than the largest relative speed of the vertices, which bounds it
+// between two sampled times, so pieces that stay apart are skipped and the
+// rest are bisected.
+//
+
+#ifndef MCL_CCD_H
+#define MCL_CCD_H 1
+
+#include "Projection.hpp"
+
+namespace mcl {
+namespace ccd {
+
+	// Times in [0,1] at which the moving points a, b, c, d are coplanar, in
+	// increasing order. Returns the number of times (at most 3). If the points
+	// stay coplanar for the whole step (every coefficient of the cubic is
+	// within rounding of zero), returns 1 with a time of 0.
+	template <typename T> static int coplanar_times(
+		const Vec3<T> &a0, const Vec3<T> &b0, const Vec3<T> &c0, const Vec3<T> &d0,
+		const Vec3<T> &a1, const Vec3<T> &b1, const Vec3<T> &c1, const Vec3<T> &d1, T *times );
+
+	// Earliest time the point p comes within eps of the triangle (a,b,c).
+	// Returns false if it doesn't during the step.
+	template <typename T> static bool vertex_triangle(
+		const Vec3<T> &p0, const Vec3<T> &a0, const Vec3<T> &b0, const Vec3<T> &c0,
+		const Vec3<T> &p1, const Vec3<T> &a1, const Vec3<T> &b1, const Vec3<T> &c1,
+		T eps, T &toi );
+
+	// Earliest time the edge (p,q) comes within eps of the edge (a,b).
+	// Returns false if it doesn't during the step.
+	template <typename T> static bool edge_edge(
+		const Vec3<T> &p0, const Vec3<T> &q0, const Vec3<T> &a0, const Vec3<T> &b0,
+		const Vec3<T> &p1, const Vec3<T> &q1, const Vec3<T> &a1, const Vec3<T> &b1,
+		T eps, T &toi );
+
+	// Earliest time in [0,1] that dist(t) <= eps, where dist changes no faster
+	// than speed. The step is first split at the given times (e.g. from
+	// coplanar_times). A piece is skipped if the bound shows it stays beyond
+	// eps, otherwise it is bisected. Once a piece is too short to tell (the
+	// distance changes by at most eps/32 over it, or it's a few ulps long)
+	// its start is returned, so a pair that only gets within eps*(1+1/32)
+	// may be reported, but one that gets within eps is never missed.
+	template <typename T, typename DistFunc> static bool first_within(
+		const DistFunc &dist, T speed, const T *times, int n_times, T eps, T &toi );
+
+} // end namespace ccd
+
+//
+//	Implementation
+//
+
+template <typename T>
+int ccd::coplanar_times(
+	const Vec3<T> &a0, const Vec3<T> &b0, const Vec3<T> &c0, const Vec3<T> &d0,
+	const Vec3<T> &a1, const Vec3<T> &b1, const Vec3<T> &c1, const Vec3<T> &d1, T *times ){
+
+	// Volume of the tet (a,b,c,d) as a cubic in t
+	const Vec3<T> e0 = b0-a0, f0 = c0-a0, g0 = d0-a0;
+	const Vec3<T> ev = (b1-a1)-e0, fv = (c1-a1)-f0, gv = (d1-a1)-g0;
+	const Vec3<T> n0 = e0.cross( f0 );
+	const Vec3<T> n1 = e0.cross( fv ) + ev.cross( f0 );
+	const Vec3<T> n2 = ev.cross( fv );
+	const T k[4] = { n0.dot(g0), n1.dot(g0) + n0.dot(gv), n2.dot(g0) + n1.dot(gv), n2.dot(gv) };
+
+	// Each coefficient is a sum of triple products, so its rounding error is
+	// relative to the product of the lengths in each of those terms.
+	const T le = e0.norm(), lf = f0.norm(), lg = g0.norm();
+	const T lev = ev.norm(), lfv = fv.norm(), lgv = gv.norm();
+	const T eps = std::numeric_limits<T>::epsilon();
+	const T tol[4] = {
+		T(64)*eps*( le*lf*lg ),
+		T(64)*eps*( (le*lfv + lev*lf)*lg + le*lf*lgv ),
+		T(64)*eps*( lev*lfv*lg + (le*lfv + lev*lf)*lgv ),
+		T(64)*eps*( lev*lfv*lgv ) };
+	bool coplanar = true;
+	for( int i=0; i<4; ++i ){ coplanar = coplanar && std::abs(k[i]) <= tol[i]; }
+	if( coplanar ){ times[0] = 0; return 1; }
+	auto f = [&k]( T t ){ return ((k[3]*t + k[2])*t + k[1])*t + k[0]; };
+
+	// Split [0,1] where the derivative is zero so f is monotone on each piece
+	T split[4] = { 0, 1, 1, 1 };
+	int n_split = 1;
+	const T qa = 3*k[3], qb = 2*k[2], qc = k[1];
+	if( std::abs(k[3]) > tol[3] ){
+		T disc = qb*qb - 4*qa*qc;
+		if( disc >= 0 ){
+			T sq = std::sqrt( disc );
+			T r0 = (-qb - sq)/(2*qa), r1 = (-qb + sq)/(2*qa);
+			if( r0 > r1 ){ std::swap( r0, r1 ); }
+			if( r0 > 0 && r0 < 1 ){ split[n_split++] = r0; }
+			if( r1 > 0 && r1 < 1 ){ split[n_split++] = r1; }
+		}
+	}
+	else if( std::abs(k[2]) > tol[2] ){
+		T r = -qc/qb;
+		if( r > 0 && r < 1 ){ split[n_split++] = r; }
+	}
+	split[n_split] = 1;
+
+	// Bisect each piece that changes sign
+	int n_times = 0;
+	for( int i=0; i<n_split; ++i ){
+		T lo = split[i], hi = split[i+1];
+		T flo = f(lo), fhi = f(hi);
+		if( flo == 0 ){
+			if( n_times == 0 || times[n_times-1] < lo ){ times[n_times++] = lo; }
+			continue;
+		}
+		if( (flo < 0) == (fhi < 0) && fhi != 0 ){ continue; }
+		for( int j=0; j<64 && hi-lo > eps; ++j ){
+			T mid = T(0.5)*(lo+hi);
+			T fmid = f(mid);
+			if( (fmid < 0) == (flo < 0) ){ lo = mid; flo = fmid; }
+			else { hi = mid; fhi = fmid; }
+		}
+		// The bracket is at most eps wide but can be many ulps from a small
+		// root, so finish with a secant step inside it
+		T root = flo == fhi ? lo : lo - flo*(hi-lo)/(fhi-flo);
+		root = std::min( std::max( root, lo ), hi );
+		if( n_times == 0 || times[n_times-1] < root ){ times[n_times++] = root; }
+	}
+	return n_times;
+
+} // end coplanar times
+
+
+template <typename T>
+bool ccd::vertex_triangle(
+	const Vec3<T> &p0, const Vec3<T> &a0, const Vec3<T> &b0, const Vec3<T> &c0,
+	const Vec3<T> &p1, const Vec3<T> &a1, const Vec3<T> &b1, const Vec3<T> &c1,
+	T eps, T &toi ){
+
+	T times[3];
+	int n_times = coplanar_times( p0, a0, b0, c0, p1, a1, b1, c1, times );
+
+	// A point on the triangle moves with a weighted average of the corners
+	const Vec3<T> vp = p1-p0;
+	const T speed = std::max( (vp-(a1-a0)).norm(), std::max( (vp-(b1-b0)).norm(), (vp-(c1-c0)).norm() ) );
+	auto dist = [&]( T t ){
+		Vec3<T> p = p0 + t*(p1-p0);
+		Vec3<T> proj = projection::point_on_triangle( p,
+			Vec3<T>( a0 + t*(a1-a0) ), Vec3<T>( b0 + t*(b1-b0) ), Vec3<T>( c0 + t*(c1-c0) ) );
+		return (proj-p).norm();
+	};
+	return first_within( dist, speed, times, n_times, eps, toi );
+
+} // end vertex triangle
+
+
+template <typename T>
+bool ccd::edge_edge(
+	const Vec3<T> &p0, const Vec3<T> &q0, const Vec3<T> &a0, const Vec3<T> &b0,
+	const Vec3<T> &p1, const Vec3<T> &q1, const Vec3<T> &a1, const Vec3<T> &b1,
+	T eps, T &toi ){
+
+	T times[3];
+	int n_times = coplanar_times( p0, q0, a0, b0, p1, q1, a1, b1, times );
+
+	// Points on the edges move with weighted averages of their ends
+	const Vec3<T> v[4] = { p1-p0, q1-q0, a1-a0, b1-b0 };
+	T speed = 0;
+	for( int i=0; i<2; ++i ){
+		for( int j=2; j<4; ++j ){ speed = std::max( speed, (v[i]-v[j]).norm() ); }
+	}
+	auto dist = [&]( T t ){
+		Vec3<T> p = p0 + t*(p1-p0), q = q0 + t*(q1-q0);
+		Vec3<T> a = a0 + t*(a1-a0), b = b0 + t*(b1-b0);
+		T s = 0, u = 0;
+		projection::segment_segment( p, q, a, b, s, u );
+		return ( (p + s*(q-p)) - (a + u*(b-a)) ).norm();
+	};
+	return first_within( dist, speed, times, n_times, eps, toi );
+
+} // end edge edge
+
+
+template <typename T, typename DistFunc>
+bool ccd::first_within( const DistFunc &dist, T speed, const T *times, int n_times, T eps, T &toi ){
+
+	// Pieces between the split times, checked in order
+	T split[5];
+	int n_split = 0;
+	split[n_split++] = 0;
+	for( int i=0; i<n_times && n_split<4; ++i ){
+		if( times[i] > split[n_split-1] && times[i] < 1 ){ split[n_split++] = times[i]; }
+	}
+	split[n_split++] = 1;
+
+	T d_lo = dist( T(0) );
+	if( d_lo <= eps ){ toi = 0; return true; }
+
+	// Bisection stack, at most one entry per level
+	struct Piece { T lo, hi, d_lo, d_hi; };
+	const int max_levels = std::numeric_limits<T>::digits + 2;
+	Piece stack[ std::numeric_limits<T>::digits + 3 ];
+	const T min_len = T(4)*std::numeric_limits<T>::epsilon();
+	for( int i=1; i<n_split; ++i ){
+		const T d_hi = dist( split[i] );
+		int n_stack = 0;
+		stack[n_stack++] = Piece{ split[i-1], split[i], d_lo, d_hi };
+		while( n_stack > 0 ){
+			const Piece piece = stack[--n_stack];
+			if( piece.d_lo <= eps ){ toi = piece.lo; return true; }
+			const T len = piece.hi - piece.lo;
+
+			// The distance in the piece is at least this
+			const T bound = T(0.5)*( piece.d_lo + piece.d_hi - speed*len );
+			if( piece.d_hi > eps && bound > eps ){ continue; }
+			if( speed*len <= eps/T(32) || len <= min_len || n_stack >= max_levels ){
+				toi = piece.lo;
+				return true;
+			}
+
+			// Left half is popped first
+			const T mid = piece.lo + T(0.5)*len;
+			const T d_mid = dist( mid );
+			stack[n_stack++] = Piece{ mid, piece.hi, d_mid, piece.d_hi };
+			stack[n_stack++] = Piece{ piece.lo, mid, piece.d_lo, d_mid };
+		}
+		d_lo = d_hi;
+	}
+	return false;
+
+} // end first within
+
+} // end namespace mcl
+
+#endif
@@ -0,0 +1,404 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// An AABB tree that primitives can be added to and removed from one at a
+// time, for scenes where objects come and go. Each leaf holds one primitive
+// with its box grown by a margin, so a primitive that moves a little stays
+// inside its leaf and update() does nothing. Otherwise the leaf is removed
+// and reinserted, which costs O(log n):
+//
+//	- A new leaf goes next to a node found by a greedy SAH descent from
+//	  the root: at each node it goes into the child that adds the least
+//	  surface area, and stops when pairing with the node itself is cheaper.
+//	  This is not guaranteed to find the best sibling in the tree.
+//	- Going back up, the taller child of any node whose children differ
+//	  in height by more than one is rotated up (as in an AVL tree), which
+//	  keeps the height close to log2(n).
+//
+// Nodes live in a pool, and nodes that are removed go onto a free list
+// to be reused. Traversal takes the same visitors as AABBTree, with the
+// primitive index given to insert.
+//
+// Example, obstacles added and moved during a simulation:
+//
+//	bvh::DynamicTree<float,3> tree( 0.01f );
+//	tree.insert( tri, tri_box );
+//	...
+//	tree.update( tri, new_tri_box );
+//	tree.remove( tri );
+//
+
+#ifndef MCL_DYNAMICTREE_H
+#define MCL_DYNAMICTREE_H 1
+
+#include "BVH.hpp"
+
+namespace mcl {
+namespace bvh {
+
+template <typename T, short PDIM>
+class DynamicTree {
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	struct Node {
+		AABB aabb; // for leaves, the primitive box grown by the margin
+		int parent; // or the next free node if on the free list
+		int child[2]; // -1 for leaves
+		int prim; // primitive of a leaf, -1 for interior nodes
+		int height; // 0 for leaves, -1 if free
+		Node() : parent(-1), prim(-1), height(-1) { child[0] = -1; child[1] = -1; }
+		bool is_leaf() const { return child[0] < 0; }
+	};
+
+	// Leaf boxes are grown by margin on each side
+	DynamicTree( T margin_=T(0) );
+
+	// Adds a primitive with the given bounds. Throws if it's already in the tree.
+	void insert( int prim, const AABB &box );
+
+	// Removes a primitive. Throws if it isn't in the tree.
+	void remove( int prim );
+
+	// New bounds for a primitive. If they're outside its leaf box
+	// the leaf is reinserted and true is returned.
+	bool update( int prim, const AABB &box );
+
+	// Removes all primitives
+	void clear();
+
+	bool contains( int prim ) const { return prim >= 0 && prim < (int)prim_leaf.size() && prim_leaf[prim] >= 0; }
+	int num_prims() const { return n_prims; }
+
+	// Height of the root, -1 if empty
+	int height() const { return root < 0 ? -1 : nodes[root].height; }
+
+	// Traverse the tree with a visitor, see AABBTree::traverse(_static)
+	bool traverse( Visitor<T,PDIM> &visitor ) const {
+		return traverse_stack( visitor );
+	}
+
+	template <typename VisitorT>
+	bool traverse_static( VisitorT &visitor ) const {
+		StaticVisitor<VisitorT> static_visitor( visitor );
+		return traverse_stack( static_visitor );
+	}
+
+	// Node pool, including free nodes. The root is at get_root() (-1 if empty).
+	const std::vector<Node> &get_nodes() const { return nodes; }
+	int get_root() const { return root; }
+
+	T margin;
+
+private:
+	enum { STACK_SIZE = 64 };
+
+	int alloc_node();
+	void free_node( int idx );
+
+	// Links a leaf into the tree, or unlinks it without freeing it
+	void insert_leaf( int leaf );
+	void remove_leaf( int leaf );
+
+	// Rebalances, then refits boxes and heights from idx to the root
+	void fix_upwards( int idx );
+
+	// Rotates the taller child of idx up if the children's heights differ
+	// by more than one. Returns the node now in the place of idx.
+	int balance( int idx );
+
+	// Bounds and height from the children
+	void refit_node( int idx ){
+		Node &node = nodes[idx];
+		const Node &c0 = nodes[ node.child[0] ], &c1 = nodes[ node.child[1] ];
+		node.aabb = c0.aabb.merged( c1.aabb );
+		node.height = 1 + std::max( c0.height, c1.height );
+	}
+
+	void replace_child( int parent, int old_child, int new_child ){
+		if( parent < 0 ){ root = new_child; return; }
+		Node &p = nodes[parent];
+		p.child[ p.child[0] == old_child ? 0 : 1 ] = new_child;
+	}
+
+	template <typename V> bool traverse_stack( V &visitor ) const;
+
+	std::vector<Node> nodes;
+	std::vector<int> prim_leaf; // leaf of each primitive, -1 if not in the tree
+	int root;
+	int free_list;
+	int n_prims;
+
+}; // end class DynamicTree
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T, short PDIM>
+bvh::DynamicTree<T,PDIM>::DynamicTree( T margin_ ) : margin(margin_), root(-1), free_list(-1), n_prims(0) {
+	if( PDIM < 1 ){
+		throw std::runtime_error("DynamicTree Error: PDIM must be larger than 0");
+	}
+}
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::clear(){
+	nodes.clear();
+	prim_leaf.clear();
+	root = -1;
+	free_list = -1;
+	n_prims = 0;
+}
+
+
+template <typename T, short PDIM>
+int bvh::DynamicTree<T,PDIM>::alloc_node(){
+	if( free_list < 0 ){
+		nodes.emplace_back( Node() );
+		nodes.back().height = 0;
+		return nodes.size()-1;
+	}
+	int idx = free_list;
+	free_list = nodes[idx].parent;
+	nodes[idx] = Node();
+	nodes[idx].height = 0;
+	return idx;
+}
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::free_node( int idx ){
+	nodes[idx] = Node();
+	nodes[idx].parent = free_list;
+	free_list = idx;
+}
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::insert( int prim, const AABB &box ){
+
+	if( prim < 0 ){ throw std::runtime_error("DynamicTree::insert Error: Negative primitive index"); }
+	if( contains( prim ) ){ throw std::runtime_error("DynamicTree::insert Error: Primitive is already in the tree"); }
+	if( prim >= (int)prim_leaf.size() ){ prim_leaf.resize( prim+1, -1 ); }
+
+	int leaf = alloc_node();
+	nodes[leaf].aabb = AABB( box.min().array() - margin, box.max().array() + margin );
+	nodes[leaf].prim = prim;
+	prim_leaf[prim] = leaf;
+	insert_leaf( leaf );
+	n_prims++;
+
+} // end insert
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::remove( int prim ){
+
+	if( !contains( prim ) ){ throw std::runtime_error("DynamicTree::remove Error: Primitive is not in the tree"); }
+	int leaf = prim_leaf[prim];
+	remove_leaf( leaf );
+	free_node( leaf );
+	prim_leaf[prim] = -1;
+	n_prims--;
+
+} // end remove
+
+
+template <typename T, short PDIM>
+bool bvh::DynamicTree<T,PDIM>::update( int prim, const AABB &box ){
+
+	if( !contains( prim ) ){ throw std::runtime_error("DynamicTree::update Error: Primitive is not in the tree"); }
+	int leaf = prim_leaf[prim];
+	if( nodes[leaf].aabb.contains( box ) ){ return false; }
+	remove_leaf( leaf );
+	nodes[leaf].aabb = AABB( box.min().array() - margin, box.max().array() + margin );
+	insert_leaf( leaf );
+	return true;
+
+} // end update
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::insert_leaf( int leaf ){
+
+	if( root < 0 ){
+		root = leaf;
+		nodes[leaf].parent = -1;
+		return;
+	}
+
+	// Descend toward the cheapest sibling. Every node on the way down grows
+	// to contain the leaf (the inherited cost), so stop once that plus making
+	// a new parent here is cheaper than going into either child.
+	const AABB leaf_box = nodes[leaf].aabb;
+	int idx = root;
+	while( !nodes[idx].is_leaf() ){
+		const Node &node = nodes[idx];
+		T area = AABBTree<T,PDIM>::surface_area( node.aabb );
+		T merged_area = AABBTree<T,PDIM>::surface_area( node.aabb.merged( leaf_box ) );
+		T cost = T(2)*merged_area;
+		T inherited = T(2)*( merged_area - area );
+
+		T child_cost[2];
+		for( int c=0; c<2; ++c ){
+			const Node &child = nodes[ node.child[c] ];
+			T grown = AABBTree<T,PDIM>::surface_area( child.aabb.merged( leaf_box ) );
+			if( !child.is_leaf() ){ grown -= AABBTree<T,PDIM>::surface_area( child.aabb ); }
+			child_cost[c] = grown + inherited;
+		}
+		if( cost < child_cost[0] && cost < child_cost[1] ){ break; }
+		idx = child_cost[0] < child_cost[1] ? node.child[0] : node.child[1];
+	}
+
+	// New parent for the sibling and the leaf
+	const int sibling = idx;
+	const int old_parent = nodes[sibling].parent;
+	const int new_parent = alloc_node();
+	Node &p = nodes[new_parent];
+	p.parent = old_parent;
+	p.child[0] = sibling;
+	p.child[1] = leaf;
+	p.aabb = nodes[sibling].aabb.merged( leaf_box );
+	p.height = nodes[sibling].height + 1;
+	replace_child( old_parent, sibling, new_parent );
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	fix_upwards( new_parent );
+
+} // end insert leaf
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::remove_leaf( int leaf ){
+
+	if( leaf == root ){
+		root = -1;
+		return;
+	}
+
+	// The sibling takes the place of the parent
+	const int parent = nodes[leaf].parent;
+	const int grand_parent = nodes[parent].parent;
+	const int sibling = nodes[parent].child[ nodes[parent].child[0] == leaf ? 1 : 0 ];
+	replace_child( grand_parent, parent, sibling );
+	nodes[sibling].parent = grand_parent;
+	nodes[leaf].parent = -1;
+	free_node( parent );
+
+	fix_upwards( grand_parent );
+
+} // end remove leaf
+
+
+template <typename T, short PDIM>
+void bvh::DynamicTree<T,PDIM>::fix_upwards( int idx ){
+	while( idx >= 0 ){
+		idx = balance( idx );
+		refit_node( idx );
+		idx = nodes[idx].parent;
+	}
+}
+
+
+template <typename T, short PDIM>
+int bvh::DynamicTree<T,PDIM>::balance( int a ){
+
+	Node &node_a = nodes[a];
+	if( node_a.is_leaf() ){ return a; }
+
+	// The taller child c is rotated up into the place of a. Its taller
+	// child stays with it, and the shorter one moves under a.
+	const int diff = nodes[ node_a.child[1] ].height - nodes[ node_a.child[0] ].height;
+	if( diff >= -1 && diff <= 1 ){ return a; }
+	const int side = diff > 1 ? 1 : 0;
+	const int c = node_a.child[side];
+	Node &node_c = nodes[c];
+	const int f = node_c.child[0], g = node_c.child[1];
+	const int taller = nodes[f].height > nodes[g].height ? f : g;
+	const int shorter = taller == f ? g : f;
+
+	node_c.parent = node_a.parent;
+	replace_child( node_a.parent, a, c );
+	node_c.child[0] = a;
+	node_c.child[1] = taller;
+	node_a.parent = c;
+	node_a.child[side] = shorter;
+	nodes[shorter].parent = a;
+	refit_node( a );
+	refit_node( c );
+	return c;
+
+} // end balance
+
+
+template <typename T, short PDIM>
+template <typename V>
+bool bvh::DynamicTree<T,PDIM>::traverse_stack( V &visitor ) const {
+
+	if( root < 0 ){ return false; }
+
+	// As in AABBTree, the stack holds at most one node per level
+	int local_stack[ STACK_SIZE ];
+	std::vector<int> heap_stack;
+	int *stack = local_stack;
+	if( nodes[root].height >= STACK_SIZE ){
+		heap_stack.resize( nodes[root].height+1 );
+		stack = &heap_stack[0];
+	}
+
+	int n_stack = 0;
+	int idx = root;
+	while( true ){
+
+		const Node &node = nodes[idx];
+		if( visitor.hit_aabb( node.aabb ) ){
+			if( node.is_leaf() ){
+				if( visitor.hit_prim( node.prim ) ){ return true; }
+			}
+			else {
+				const int left = node.child[0], right = node.child[1];
+				if( visitor.check_left_first( nodes[left].aabb, nodes[right].aabb ) ){
+					stack[ n_stack++ ] = right;
+					idx = left;
+				} else {
+					stack[ n_stack++ ] = left;
+					idx = right;
+				}
+				continue;
+			}
+		}
+
+		if( n_stack == 0 ){ break; }
+		idx = stack[ --n_stack ];
+	}
+
+	return false;
+
+} // end traverse
+
+} // end ns mcl
+
+#endif
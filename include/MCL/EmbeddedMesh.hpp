@@ -25,6 +25,8 @@
 #include "TetMesh.hpp"
 #include "TriangleMesh.hpp"
 #include "Projection.hpp"
+#include "TetInverse.hpp"
+#include "BatchQuery.hpp"
 
 namespace mcl {
 
@@ -56,6 +58,7 @@ public:
 	// Computes barycoords and vert_to_tet by mapping embedded
 	// vertices into the lattice. Assumes a lattice has already been created.
 	// Unlike update_embedded, you don't need to call this more than once.
+	// Returns false if a vertex is outside the lattice.
 	inline bool update_lattice();
 
 	// Generates a lattice around the embedded triangle mesh.
@@ -79,6 +82,9 @@ public:
 private:
 	static inline void gen_tets( Vec3f min, Vec3f max, std::vector<Vec3f> &verts, std::vector<Vec4i> &tets );
 
+	// Sets vert_to_tet (-1 if outside) and barycoords of the embedded verts in the tets
+	inline void embed_verts( const std::vector<Vec3f> &verts, const std::vector<Vec4i> &tets );
+
 	static inline float baryweight( short i, const Vec4f &bary ){ return bary[i] / ( bary.dot(bary) ); }
 
 }; // end class EmbeddedMesh
@@ -151,34 +157,12 @@ inline bool EmbeddedMesh::gen_lattice( int tess ){
 	} // end loop grid
 
 	// Compute bary coords and remove any tet that doesn't contain a vertex
-	barycoords.resize( nv, Vec4f(-1,-1,-1,-1) ); // barys within the tet
-	vert_to_tet.resize( nv, -1 ); // vertex to tet mapping
+	embed_verts( verts, tets );
 	std::vector<int> num_v_in_t( tets.size(), 0 ); // num verts in a tet
-
-	omp_lock_t writelock;
-	omp_init_lock(&writelock);
-
-	#pragma omp parallel for
 	for( int i=0; i<nv; ++i ){
-		Vec3f point = embedded->vertices[i];
-		const int nt = tets.size();
-		for( int j=0; j<nt; ++j ){ // TODO accel structure
-			Vec4i tet = tets[j];
-			if( !mcl::projection::point_in_tet( point,
-				verts[tet[0]], verts[tet[1]], verts[tet[2]], verts[tet[3]] ) ){ continue; }
-			barycoords[i] = mcl::vec::barycoords( point,
-				verts[tet[0]], verts[tet[1]], verts[tet[2]], verts[tet[3]] );
-			vert_to_tet[i] = j;
-		}
-		if( vert_to_tet[i] < 0 ){ continue; }
-
-		omp_set_lock(&writelock);
-		num_v_in_t[ vert_to_tet[i] ]++;
-		omp_unset_lock(&writelock);
+		if( vert_to_tet[i] >= 0 ){ num_v_in_t[ vert_to_tet[i] ]++; }
 	}
 
-	omp_destroy_lock(&writelock);
-
 	// Remove any tets that do not contain vertices
 	int n_tets = tets.size();
 	lattice->clear();
@@ -198,45 +182,7 @@ inline bool EmbeddedMesh::gen_lattice( int tess ){
 	lattice->refine();
 
 	// Update embedded verts again
-	#pragma omp parallel for
-	for( int i=0; i<nv; ++i ){
-		Vec3f point = embedded->vertices[i];
-		const int nt = lattice->tets.size();
-		for( int j=0; j<nt; ++j ){ // TODO accel structure
-			Vec4i tet = lattice->tets[j];
-			if( !mcl::projection::point_in_tet( point,
-				lattice->vertices[tet[0]],
-				lattice->vertices[tet[1]],
-				lattice->vertices[tet[2]],
-				lattice->vertices[tet[3]] ) ){ continue; }
-			barycoords[i] = mcl::vec::barycoords( point,
-				lattice->vertices[tet[0]],
-				lattice->vertices[tet[1]],
-				lattice->vertices[tet[2]],
-				lattice->vertices[tet[3]] );
-			if( barycoords[i].minCoeff() < 0 || barycoords[i].sum()-1e-3 > 1 ){
-				std::stringstream ss;
-				ss << "BAD BARYS: tet(" << vert_to_tet[i] << "), sum(" << barycoords[i].sum() <<
-					"), coords(" << barycoords[i].transpose() << ")" << std::endl;
-				printf("%s", ss.str().c_str() );
-				vert_to_tet[i] = -1;
-				continue;
-			}
-			vert_to_tet[i] = j;
-		}
-	}
-
-	// Double check values
-	n_tets = lattice->tets.size();
-	for( int i=0; i<nv; ++i ){
-		int v2t = vert_to_tet[i];
-		if( v2t < 0 || v2t >= n_tets ){
-			std::cerr << "Emb vert " << i << " has tet index " << v2t << ", with " << n_tets << " tets" << std::endl;
-			return false;
-		}
-	}
-
-	return true;
+	return update_lattice();
 
 } // end gen lattice
 
@@ -332,48 +278,62 @@ inline void EmbeddedMesh::gen_tets( Vec3f min, Vec3f max, std::vector<Vec3f> &ve
 
 
 inline bool EmbeddedMesh::update_lattice(){
-throw std::runtime_error("**EmbeddedMesh TODO: update_lattice");
-/*
-	const int nv = embedded->vertices.size();
-	vert_to_tet.resize( nv, -1 );
-	barycoords.resize( nv, Vec4f(0,0,0,0) );
-	std::vector<int> num_v_in_t( lattice->tets.size(), 0 ); // num verts in a tet
 
-	omp_lock_t writelock;
-	omp_init_lock(&writelock);
+	embed_verts( lattice->vertices, lattice->tets );
 
-	#pragma omp parallel for
+	// Double check values
+	const int nv = embedded->vertices.size();
+	const int n_tets = lattice->tets.size();
 	for( int i=0; i<nv; ++i ){
-		const Vec3f &point = embedded->vertices[i];
-		const int nt = lattice->tets.size();
-		for( int j=0; j<nt; ++j ){
-			const Vec4i &tet = lattice->tets[j];
-			if( !mcl::projection::point_in_tet( point,
-				lattice->vertices[tet[0]],
-				lattice->vertices[tet[1]],
-				lattice->vertices[tet[2]],
-				lattice->vertices[tet[3]] ) ){ continue; }
-			barycoords[i] = mcl::vec::barycoords( point,
-				lattice->vertices[tet[0]],
-				lattice->vertices[tet[1]],
-				lattice->vertices[tet[2]],
-				lattice->vertices[tet[3]] );
-			vert_to_tet[i] = j;
+		int v2t = vert_to_tet[i];
+		if( v2t < 0 || v2t >= n_tets ){
+			std::cerr << "Emb vert " << i << " has tet index " << v2t << ", with " << n_tets << " tets" << std::endl;
+			return false;
+		}
+		if( barycoords[i].minCoeff() < 0 || barycoords[i].sum()-1e-3 > 1 ){
+			std::stringstream ss;
+			ss << "BAD BARYS: tet(" << v2t << "), sum(" << barycoords[i].sum() <<
+				"), coords(" << barycoords[i].transpose() << ")" << std::endl;
+			printf("%s", ss.str().c_str() );
+			return false;
 		}
-		if( vert_to_tet[i] < 0 ){ continue; }
-
-		omp_set_lock(&writelock);
-		num_v_in_t[ vert_to_tet[i] ]++;
-		omp_unset_lock(&writelock);
 	}
 
-	omp_destroy_lock(&writelock);
-*/
 	return true;
 
 } // end compute barys and vert to tet
 
 
+inline void EmbeddedMesh::embed_verts( const std::vector<Vec3f> &verts, const std::vector<Vec4i> &tets ){
+
+	const int nv = embedded->vertices.size();
+	vert_to_tet.assign( nv, -1 );
+	barycoords.assign( nv, Vec4f(-1,-1,-1,-1) );
+	if( nv == 0 || tets.empty() ){ return; }
+
+	// The tets only share faces, so a vert is in more than one tet only if it
+	// is on a shared face, and rounding may put it in either or both. Any of
+	// them has the vert on its boundary, so whichever the tree finds first
+	// is kept.
+	const int nt = tets.size();
+	bvh::AABBTree<float,4> tree;
+	tree.init( &tets[0][0], &verts[0][0], nt );
+	projection::TetInverse<float> inverse;
+	inverse.init( &verts[0][0], &tets[0][0], nt );
+
+	bvh::QueryResults<float> results;
+	results.prim = &vert_to_tet[0];
+	bvh::point_in_tet( tree, &verts[0][0], &tets[0][0], &embedded->vertices[0][0], nv, results, true, &inverse );
+
+	#pragma omp parallel for
+	for( int i=0; i<nv; ++i ){
+		if( vert_to_tet[i] < 0 ){ continue; }
+		barycoords[i] = inverse.barycoords( vert_to_tet[i], embedded->vertices[i] );
+	}
+
+} // end embed verts
+
+
 
 } // namespace mcl
 
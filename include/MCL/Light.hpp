@@ -0,0 +1,79 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#ifndef MCL_LIGHT_H
+#define MCL_LIGHT_H 1
+
+#include "Vec.hpp"
+#include <vector>
+#include <algorithm>
+
+namespace mcl {
+
+// 0 = point (TODO add more later), and a nice class
+// that manages things like sampling and whatnot
+class Light {
+public:
+	short type;
+	Vec3f color;
+	Vec3f pos;
+	Vec3f dir;
+	float rad;
+
+	static inline Light create_point( const Vec3f &p, const Vec3f &c=Vec3f(1,1,1) ){
+		return Light( 0, c, p, Vec3f(0,0,0), 0 );
+	}
+
+	// Three-point lighting for a scene with
+	// camera position (eye) and bounds (aabb).
+	static inline std::vector<Light> create_3pt( const Vec3f &eye, const Eigen::AlignedBox<float,3> &aabb );
+
+	Light( short type_, const Vec3f &color_, const Vec3f &pos_, const Vec3f &dir_, float rad_ ) :
+		type(type_), color(color_), pos(pos_), dir(dir_), rad(rad_) {}
+};
+
+inline std::vector<Light> Light::create_3pt( const Vec3f &eye, const Eigen::AlignedBox<float,3> &aabb ){
+
+	const Vec3f center = aabb.center();
+	const float top = aabb.max()[1] - center[1];
+	const Vec3f up(0,1,0);
+
+	Vec3f w = eye-center;
+	float dist = std::max( 0.1f, w.norm() );
+	w /= dist;
+	Vec3f u = up.cross(w); // right
+	u.normalize();
+
+	Vec3f key = center + w*dist + up*eye[1] - u*dist; // left of camera
+	Vec3f fill = center + w*(dist*0.5f) + up*top + u*dist; // right of camera
+	Vec3f back = center - w*dist + up*top + u*(dist*0.5f); // opposite of key
+
+	std::vector<Light> lights;
+	lights.emplace_back( Light::create_point( key, Vec3f(1.f,1.f,1.f) ) );
+	lights.emplace_back( Light::create_point( fill, Vec3f(0.8,0.8,0.8) ) );
+	lights.emplace_back( Light::create_point( back, Vec3f(0.6,0.6,0.6) ) );
+	return lights;
+}
+
+} // ns mcl
+
+#endif
@@ -37,12 +37,24 @@ namespace projection {
 	//	Projection on Triangle
 	template <typename T> static Vec3<T> point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3 );
 
+	//	Projection on Triangle, also returning the nearest point as p1 + s*(p2-p1) + t*(p3-p1).
+	//	On an edge or vertex, s and t are exactly 0 or 1 (or s+t is 1), so the feature can be found.
+	template <typename T> static Vec3<T> point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3, T &s, T &t );
+
 	//	Projection on Sphere
 	template <typename T> static Vec3<T> point_on_sphere( const Vec3<T> &point, const Vec3<T> &center, const T &rad );
 
 	//	Projection on a Box
 	template <typename T> static Vec3<T> point_on_box( const Vec3<T> &point, const Vec3<T> &bmin, const Vec3<T> &bmax );
 
+	//	Projection on a Segment
+	template <typename T> static Vec3<T> point_on_segment( const Vec3<T> &point, const Vec3<T> &p0, const Vec3<T> &p1 );
+
+	//	Nearest points between segments (p0,p1) and (q0,q1), returned as
+	//	p0 + s*(p1-p0) and q0 + t*(q1-q0) with s and t in [0,1].
+	template <typename T> static void segment_segment( const Vec3<T> &p0, const Vec3<T> &p1,
+		const Vec3<T> &q0, const Vec3<T> &q1, T &s, T &t );
+
 	//	Point in tet
 	template <typename T> static bool point_in_tet( const Vec3<T> &point, const Vec3<T> &p0, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3 );
 
@@ -57,6 +69,13 @@ namespace projection {
 
 template <typename T>
 Vec3<T> projection::point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3 ){
+	T s, t;
+	return point_on_triangle( point, p1, p2, p3, s, t );
+}
+
+
+template <typename T>
+Vec3<T> projection::point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3, T &s, T &t ){
 
 	Vec3<T> edge0 = p2 - p1;
 	Vec3<T> edge1 = p3 - p1;
@@ -68,8 +87,8 @@ Vec3<T> projection::point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1,
 	T d = edge0.dot( v0 );
 	T e = edge1.dot( v0 );
 	T det = a*c - b*b;
-	T s = b*e - c*d;
-	T t = b*d - a*e;
+	s = b*e - c*d;
+	t = b*d - a*e;
 
 	const T zero(0);
 	const T one(1);
@@ -124,7 +143,7 @@ Vec3<T> projection::point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1,
 			t = one-s;
 		    }
 		    else {
-			s = myclamp( -e/c );
+			s = myclamp( -d/a );
 			t = zero;
 		    }
 		}
@@ -141,6 +160,16 @@ Vec3<T> projection::point_on_triangle( const Vec3<T> &point, const Vec3<T> &p1,
 } // end project triangle
 
 
+template <typename T>
+Vec3<T> projection::point_on_segment( const Vec3<T> &point, const Vec3<T> &p0, const Vec3<T> &p1 ){
+	Vec3<T> d = p1-p0;
+	T len2 = d.squaredNorm();
+	if( len2 <= T(0) ){ return p0; }
+	T s = myclamp( T( (point-p0).dot(d) / len2 ) );
+	return ( p0 + s*d );
+} // end project segment
+
+
 template <typename T>
 Vec3<T> projection::point_on_sphere( const Vec3<T> &point, const Vec3<T> &center, const T &rad ){
 	Vec3<T> dir = point-center;
@@ -172,6 +201,50 @@ Vec3<T> projection::point_on_box( const Vec3<T> &point, const Vec3<T> &bmin, con
 } // end project box
 
 
+template <typename T>
+void projection::segment_segment( const Vec3<T> &p0, const Vec3<T> &p1,
+	const Vec3<T> &q0, const Vec3<T> &q1, T &s, T &t ){
+
+	const Vec3<T> d1 = p1 - p0;
+	const Vec3<T> d2 = q1 - q0;
+	const Vec3<T> r = p0 - q0;
+	const T a = d1.dot( d1 );
+	const T e = d2.dot( d2 );
+	const T f = d2.dot( r );
+	const T eps = std::numeric_limits<T>::epsilon();
+
+	// Either or both segments degenerate into points
+	if( a <= eps && e <= eps ){ s = t = 0; return; }
+	if( a <= eps ){
+		s = 0;
+		t = myclamp( f/e );
+		return;
+	}
+	const T c = d1.dot( r );
+	if( e <= eps ){
+		t = 0;
+		s = myclamp( -c/a );
+		return;
+	}
+
+	// Nearest points on the lines, clamped to the first segment,
+	// then the second, then the first again.
+	const T b = d1.dot( d2 );
+	const T denom = a*e - b*b;
+	s = denom > eps*a*e ? myclamp( (b*f - c*e)/denom ) : T(0);
+	t = (b*s + f)/e;
+	if( t < T(0) ){
+		t = 0;
+		s = myclamp( -c/a );
+	}
+	else if( t > T(1) ){
+		t = 1;
+		s = myclamp( (b-c)/a );
+	}
+
+} // end segment segment
+
+
 template <typename T>
 bool check_norm( const Vec3<T> &point,
 	const Vec3<T> &p0, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3 ){
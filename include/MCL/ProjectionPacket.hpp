@@ -0,0 +1,220 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Point-triangle projection on W = 4 or 8 lanes at once: many points on
+// one triangle, or one point on many triangles. Points and triangles are
+// given as structure-of-arrays (x, y, and z arrays), and n can be any
+// size. Lanes are the same as RayPacket.hpp: SSE or AVX for float when the
+// compiler targets them, a loop over the lanes otherwise.
+//
+// Instead of branching on the region of the point like
+// projection::point_on_triangle, every lane finds the nearest point on
+// each edge, keeps the closest, and takes the point inside the triangle
+// instead if that's where it projects. The edge and interior formulas
+// are the same as the scalar version, so results match it up to rounding:
+//
+//	typedef projection::PacketProjection<float,8> Proj;
+//	Proj::points_triangle( n, px, py, pz, p1, p2, p3, qx, qy, qz, dist2 );
+//
+// Degenerate (zero area) triangles give the nearest point on their edges.
+//
+
+#ifndef MCL_PROJECTIONPACKET_H
+#define MCL_PROJECTIONPACKET_H 1
+
+#include "Projection.hpp"
+#include "RayPacket.hpp"
+
+namespace mcl {
+namespace projection {
+
+	template <typename T, int W>
+	struct PacketProjection {
+		typedef raycast::Lanes<T,W> L;
+		static const char *name(){ return L::name(); }
+
+		// Projects n points (px[i],py[i],pz[i]) on the triangle (p1,p2,p3). Writes the
+		// nearest points to qx, qy, and qz, and the squared distances to dist2.
+		static void points_triangle( int n, const T *px, const T *py, const T *pz,
+			const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3,
+			T *qx, T *qy, T *qz, T *dist2 );
+
+		// Projects one point on n triangles, with corners p1[axis][i], p2[axis][i],
+		// and p3[axis][i]. Writes the nearest point on each triangle to qx, qy, and qz,
+		// and the squared distances to dist2.
+		static void point_triangles( int n, const Vec3<T> &point,
+			const T *const p1[3], const T *const p2[3], const T *const p3[3],
+			T *qx, T *qy, T *qz, T *dist2 );
+
+		// Projection of point_on_triangle on every lane
+		static void triangle_lanes( const L *point, const L *p1, const L *p2, const L *p3, L *q, L &dist2 );
+	};
+
+} // end ns projection
+
+//
+//	Implementation
+//
+
+template <typename T, int W>
+void projection::PacketProjection<T,W>::triangle_lanes( const L *point, const L *p1, const L *p2, const L *p3, L *q, L &dist2 ){
+
+	const L zero(0), one(1), two(2);
+	L edge0[3], edge1[3], v0[3];
+	for( int i=0; i<3; ++i ){
+		edge0[i] = p2[i] - p1[i];
+		edge1[i] = p3[i] - p1[i];
+		v0[i] = p1[i] - point[i];
+	}
+	const L a = edge0[0]*edge0[0] + edge0[1]*edge0[1] + edge0[2]*edge0[2];
+	const L b = edge0[0]*edge1[0] + edge0[1]*edge1[1] + edge0[2]*edge1[2];
+	const L c = edge1[0]*edge1[0] + edge1[1]*edge1[1] + edge1[2]*edge1[2];
+	const L d = edge0[0]*v0[0] + edge0[1]*v0[1] + edge0[2]*v0[2];
+	const L e = edge1[0]*v0[0] + edge1[1]*v0[1] + edge1[2]*v0[2];
+	const L det = a*c - b*b;
+	const L s = b*e - c*d;
+	const L t = b*d - a*e;
+
+	// Nearest point on each edge, as in point_on_triangle. Clamping with
+	// min/max also turns the NaN of a zero length edge into 1.
+	const L s0 = L::max( L::min( (zero-d)/a, one ), zero ); // t = 0
+	const L t1 = L::max( L::min( (zero-e)/c, one ), zero ); // s = 0
+	const L s2 = L::max( L::min( (c+e-b-d)/(a-two*b+c), one ), zero ); // t = 1-s
+	const L t2 = one - s2;
+
+	// Keep the closest, comparing squared distance minus |v0|^2
+	const L g0 = s0*( a*s0 + two*d );
+	const L g1 = t1*( c*t1 + two*e );
+	const L g2 = s2*( a*s2 + two*( b*t2 + d ) ) + t2*( c*t2 + two*e );
+	L g = g0, s_out = s0, t_out = zero;
+	s_out = L::select_lt( g1, g, zero, s_out );
+	t_out = L::select_lt( g1, g, t1, t_out );
+	g = L::min( g1, g );
+	s_out = L::select_lt( g2, g, s2, s_out );
+	t_out = L::select_lt( g2, g, t2, t_out );
+
+	// Inside if s >= 0, t >= 0, and s+t < det
+	const L inv_det = one / det;
+	const L outside = L::max( zero-s, zero-t );
+	const L s_in = L::select_le( outside, zero, s*inv_det, s_out );
+	const L t_in = L::select_le( outside, zero, t*inv_det, t_out );
+	s_out = L::select_lt( s+t, det, s_in, s_out );
+	t_out = L::select_lt( s+t, det, t_in, t_out );
+
+	dist2 = zero;
+	for( int i=0; i<3; ++i ){
+		q[i] = p1[i] + edge0[i]*s_out + edge1[i]*t_out;
+		const L diff = q[i] - point[i];
+		dist2 = dist2 + diff*diff;
+	}
+
+} // end triangle lanes
+
+
+template <typename T, int W>
+void projection::PacketProjection<T,W>::points_triangle( int n, const T *px, const T *py, const T *pz,
+	const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3,
+	T *qx, T *qy, T *qz, T *dist2 ){
+
+	L tri[3][3];
+	for( int i=0; i<3; ++i ){
+		tri[0][i] = L( p1[i] );
+		tri[1][i] = L( p2[i] );
+		tri[2][i] = L( p3[i] );
+	}
+	const T *p[3] = { px, py, pz };
+	T *q_out[3] = { qx, qy, qz };
+	L point[3], q[3], d2;
+
+	int i = 0;
+	for( ; i+W <= n; i += W ){
+		for( int j=0; j<3; ++j ){ point[j] = L::load( p[j]+i ); }
+		triangle_lanes( point, tri[0], tri[1], tri[2], q, d2 );
+		for( int j=0; j<3; ++j ){ q[j].store( q_out[j]+i ); }
+		d2.store( dist2+i );
+	}
+
+	// The rest are padded with the last point
+	if( i < n ){
+		const int rem = n-i;
+		T buf[3][W], q_buf[3][W], d2_buf[W];
+		for( int j=0; j<3; ++j ){
+			for( int k=0; k<W; ++k ){ buf[j][k] = p[j][ i + std::min( k, rem-1 ) ]; }
+			point[j] = L::load( buf[j] );
+		}
+		triangle_lanes( point, tri[0], tri[1], tri[2], q, d2 );
+		for( int j=0; j<3; ++j ){ q[j].store( q_buf[j] ); }
+		d2.store( d2_buf );
+		for( int k=0; k<rem; ++k ){
+			for( int j=0; j<3; ++j ){ q_out[j][i+k] = q_buf[j][k]; }
+			dist2[i+k] = d2_buf[k];
+		}
+	}
+
+} // end points triangle
+
+
+template <typename T, int W>
+void projection::PacketProjection<T,W>::point_triangles( int n, const Vec3<T> &point_,
+	const T *const p1[3], const T *const p2[3], const T *const p3[3],
+	T *qx, T *qy, T *qz, T *dist2 ){
+
+	const L point[3] = { L( point_[0] ), L( point_[1] ), L( point_[2] ) };
+	const T *const *corners[3] = { p1, p2, p3 };
+	T *q_out[3] = { qx, qy, qz };
+	L tri[3][3], q[3], d2;
+
+	int i = 0;
+	for( ; i+W <= n; i += W ){
+		for( int c=0; c<3; ++c ){
+			for( int j=0; j<3; ++j ){ tri[c][j] = L::load( corners[c][j]+i ); }
+		}
+		triangle_lanes( point, tri[0], tri[1], tri[2], q, d2 );
+		for( int j=0; j<3; ++j ){ q[j].store( q_out[j]+i ); }
+		d2.store( dist2+i );
+	}
+
+	// The rest are padded with the last triangle
+	if( i < n ){
+		const int rem = n-i;
+		T buf[W], q_buf[3][W], d2_buf[W];
+		for( int c=0; c<3; ++c ){
+			for( int j=0; j<3; ++j ){
+				for( int k=0; k<W; ++k ){ buf[k] = corners[c][j][ i + std::min( k, rem-1 ) ]; }
+				tri[c][j] = L::load( buf );
+			}
+		}
+		triangle_lanes( point, tri[0], tri[1], tri[2], q, d2 );
+		for( int j=0; j<3; ++j ){ q[j].store( q_buf[j] ); }
+		d2.store( d2_buf );
+		for( int k=0; k<rem; ++k ){
+			for( int j=0; j<3; ++j ){ q_out[j][i+k] = q_buf[j][k]; }
+			dist2[i+k] = d2_buf[k];
+		}
+	}
+
+} // end point triangles
+
+} // end ns mcl
+
+#endif
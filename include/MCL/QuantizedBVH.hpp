@@ -0,0 +1,286 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// A compressed copy of an AABBTree for large meshes. Each node stores the
+// bounds of its two children quantized to 8 or 16 bits (Q = uint8_t or
+// uint16_t) relative to its own box, which is decoded on the way down from
+// the full precision root box. Leaves are folded into their parents, so
+// there is one node per interior node of the binary tree:
+//
+//	Q = uint8_t: 20 bytes per node
+//	Q = uint16_t: 32 bytes per node
+//
+// compared to 32 (float) or 56 (double) bytes for both the interior and
+// leaf nodes of AABBTree. Decoded boxes always contain the original ones,
+// so queries give the same results, but visit a few more nodes.
+//
+// Traversal takes the same visitors as AABBTree.
+//
+
+#ifndef MCL_QUANTIZEDBVH_H
+#define MCL_QUANTIZEDBVH_H 1
+
+#include "BVH.hpp"
+#include <type_traits>
+
+namespace mcl {
+namespace bvh {
+
+template <typename T, short PDIM, typename Q=uint16_t>
+class QuantizedTree {
+static_assert( std::is_same<Q,uint8_t>::value || std::is_same<Q,uint16_t>::value,
+	"QuantizedTree bounds must be uint8_t or uint16_t" );
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	struct Node {
+		Q qmin[2][3], qmax[2][3]; // left and right child bounds within this node's box
+		int child[2]; // node index if >= 0, else a leaf (see leaf_code)
+	};
+
+	// Leaves hold at most this many primitives
+	enum { MAX_LEAF_SIZE = 16 };
+
+	QuantizedTree() : root_code(0), max_depth(0) {}
+
+	// Compresses a tree. Throws if it has leaves larger than MAX_LEAF_SIZE.
+	void init( const AABBTree<T,PDIM> &tree );
+
+	// Traverse the tree with a visitor, see AABBTree::traverse(_static)
+	bool traverse( Visitor<T,PDIM> &visitor ) const {
+		return traverse_stack( visitor );
+	}
+
+	template <typename VisitorT>
+	bool traverse_static( VisitorT &visitor ) const {
+		StaticVisitor<VisitorT> static_visitor( visitor );
+		return traverse_stack( static_visitor );
+	}
+
+	const std::vector<Node> &get_nodes() const { return nodes; }
+	const std::vector<int> &get_prims() const { return prims; }
+	const AABB &get_root_aabb() const { return root_aabb; }
+
+	// Memory used by the nodes and root box
+	size_t node_bytes() const { return nodes.size()*sizeof(Node) + sizeof(AABB); }
+
+private:
+	enum { QMAX = (1 << (8*sizeof(Q)))-1, STACK_SIZE = 64 };
+
+	// A leaf is stored as -1 - (prim offset * MAX_LEAF_SIZE + num_prims-1)
+	static int leaf_code( int offset, int num_prims ){ return -1 - ( offset*MAX_LEAF_SIZE + num_prims-1 ); }
+	static int leaf_offset( int code ){ return (-1-code) / MAX_LEAF_SIZE; }
+	static int leaf_num_prims( int code ){ return (-1-code) % MAX_LEAF_SIZE + 1; }
+
+	// Child bounds are decoded from the min of the parent box for the min
+	// and from the max for the max, so 0 and QMAX give the parent bounds exactly.
+	static T decode_min( Q q, T lo, T hi ){ return lo + T(q)*( (hi-lo)/T(QMAX) ); }
+	static T decode_max( Q q, T lo, T hi ){ return hi - T(QMAX-q)*( (hi-lo)/T(QMAX) ); }
+	static AABB decode( const Node &node, int c, const AABB &box ){
+		AABB child;
+		for( int i=0; i<3; ++i ){
+			child.min()[i] = decode_min( node.qmin[c][i], box.min()[i], box.max()[i] );
+			child.max()[i] = decode_max( node.qmax[c][i], box.min()[i], box.max()[i] );
+		}
+		return child;
+	}
+
+	// Rounds out, then checks against decode so the box never shrinks
+	static void encode( const AABB &child_box, const AABB &box, Node &node, int c );
+
+	// Compresses the binary node bin_idx with decoded box and returns its index
+	int build( const AABBTree<T,PDIM> &tree, int bin_idx, const AABB &box, int depth );
+
+	template <typename V> bool traverse_stack( V &visitor ) const;
+
+	std::vector<Node> nodes;
+	std::vector<int> prims;
+	AABB root_aabb;
+	int root_code; // leaf code if the whole tree is one leaf, otherwise 0
+	int max_depth;
+
+}; // end class QuantizedTree
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T, short PDIM, typename Q>
+void bvh::QuantizedTree<T,PDIM,Q>::init( const AABBTree<T,PDIM> &tree ){
+
+	nodes.clear();
+	prims.assign( tree.get_prims().begin(), tree.get_prims().end() );
+	root_code = 0;
+	max_depth = 0;
+	const ArrayView< typename AABBTree<T,PDIM>::Node > bin_nodes = tree.get_nodes();
+	if( bin_nodes.size() == 0 ){ root_aabb.setEmpty(); return; }
+
+	for( size_t i=0; i<bin_nodes.size(); ++i ){
+		if( bin_nodes[i].num_prims > MAX_LEAF_SIZE ){
+			throw std::runtime_error("QuantizedTree::init Error: Leaves are larger than MAX_LEAF_SIZE");
+		}
+	}
+	if( prims.size() >= size_t( std::numeric_limits<int>::max()/MAX_LEAF_SIZE ) ){
+		throw std::runtime_error("QuantizedTree::init Error: Too many primitives");
+	}
+
+	root_aabb = bin_nodes[0].aabb;
+	if( bin_nodes[0].is_leaf() ){
+		root_code = leaf_code( bin_nodes[0].offset, bin_nodes[0].num_prims );
+		return;
+	}
+	nodes.reserve( bin_nodes.size()/2 );
+	build( tree, 0, root_aabb, 0 );
+
+} // end init
+
+
+template <typename T, short PDIM, typename Q>
+void bvh::QuantizedTree<T,PDIM,Q>::encode( const AABB &child_box, const AABB &box, Node &node, int c ){
+
+	for( int i=0; i<3; ++i ){
+		const T lo = box.min()[i], hi = box.max()[i];
+		int qmin = 0, qmax = QMAX;
+		if( hi > lo ){
+			qmin = std::max( 0, std::min( int(QMAX), int( std::floor( (child_box.min()[i]-lo)/(hi-lo)*T(QMAX) ) ) ) );
+			qmax = std::max( 0, std::min( int(QMAX), int( std::ceil( (child_box.max()[i]-lo)/(hi-lo)*T(QMAX) ) ) ) );
+		}
+
+		// Rounding in decode can still move the bounds in, so step out until
+		// it doesn't. The margin covers decode rounding differently where it's
+		// inlined (e.g. contracted into an FMA).
+		const T margin = std::numeric_limits<T>::epsilon()*( std::abs(lo) + std::abs(hi) );
+		while( qmin > 0 && decode_min( Q(qmin), lo, hi ) > child_box.min()[i] - margin ){ qmin--; }
+		while( qmax < QMAX && decode_max( Q(qmax), lo, hi ) < child_box.max()[i] + margin ){ qmax++; }
+		node.qmin[c][i] = Q(qmin);
+		node.qmax[c][i] = Q(qmax);
+	}
+
+} // end encode
+
+
+template <typename T, short PDIM, typename Q>
+int bvh::QuantizedTree<T,PDIM,Q>::build( const AABBTree<T,PDIM> &tree, int bin_idx, const AABB &box, int depth ){
+
+	const ArrayView< typename AABBTree<T,PDIM>::Node > bin_nodes = tree.get_nodes();
+	max_depth = std::max( max_depth, depth );
+	int node_idx = nodes.size();
+	nodes.emplace_back( Node() );
+
+	// Children are created after this node, so fill it in afterwards
+	Node node;
+	const int kids[2] = { bin_idx+1, bin_nodes[bin_idx].offset };
+	for( int c=0; c<2; ++c ){
+		const typename AABBTree<T,PDIM>::Node &kid = bin_nodes[ kids[c] ];
+		encode( kid.aabb, box, node, c );
+		if( kid.is_leaf() ){ node.child[c] = leaf_code( kid.offset, kid.num_prims ); }
+		else { node.child[c] = build( tree, kids[c], decode( node, c, box ), depth+1 ); }
+	}
+	nodes[node_idx] = node;
+	return node_idx;
+
+} // end build
+
+
+template <typename T, short PDIM, typename Q>
+template <typename V>
+bool bvh::QuantizedTree<T,PDIM,Q>::traverse_stack( V &visitor ) const {
+
+	if( root_aabb.isEmpty() || !visitor.hit_aabb( root_aabb ) ){ return false; }
+	if( root_code < 0 ){
+		const int offset = leaf_offset( root_code );
+		const int n = leaf_num_prims( root_code );
+		for( int i=0; i<n; ++i ){
+			if( visitor.hit_prim( prims[offset+i] ) ){ return true; }
+		}
+		return false;
+	}
+
+	// Nodes on the stack are children that were hit, with their decoded box
+	struct StackEntry {
+		int code;
+		AABB aabb;
+	};
+	StackEntry local_stack[ STACK_SIZE ];
+	std::vector<StackEntry> heap_stack;
+	StackEntry *stack = local_stack;
+	if( max_depth+2 >= STACK_SIZE ){
+		heap_stack.resize( max_depth+3 );
+		stack = &heap_stack[0];
+	}
+
+	int n_stack = 0;
+	int code = 0;
+	AABB aabb = root_aabb;
+	while( true ){
+
+		if( code < 0 ){
+			const int offset = leaf_offset( code );
+			const int n = leaf_num_prims( code );
+			for( int i=0; i<n; ++i ){
+				if( visitor.hit_prim( prims[offset+i] ) ){ return true; }
+			}
+		}
+		else {
+			const Node &node = nodes[code];
+			AABB left = decode( node, 0, aabb );
+			AABB right = decode( node, 1, aabb );
+			bool hit_left = visitor.hit_aabb( left );
+			bool hit_right = visitor.hit_aabb( right );
+			if( hit_left && hit_right ){
+				if( visitor.check_left_first( left, right ) ){
+					stack[n_stack].code = node.child[1];
+					stack[n_stack++].aabb = right;
+					code = node.child[0];
+					aabb = left;
+				} else {
+					stack[n_stack].code = node.child[0];
+					stack[n_stack++].aabb = left;
+					code = node.child[1];
+					aabb = right;
+				}
+				continue;
+			}
+			else if( hit_left ){ code = node.child[0]; aabb = left; continue; }
+			else if( hit_right ){ code = node.child[1]; aabb = right; continue; }
+		}
+
+		// The visitor may have narrowed its query since the entry was
+		// pushed, so its box is tested again, as in AABBTree::traverse_stack
+		bool hit = false;
+		while( n_stack > 0 && !hit ){
+			--n_stack;
+			hit = visitor.hit_aabb( stack[n_stack].aabb );
+		}
+		if( !hit ){ break; }
+		code = stack[n_stack].code;
+		aabb = stack[n_stack].aabb;
+	}
+
+	return false;
+
+} // end traverse
+
+} // end ns mcl
+
+#endif
@@ -0,0 +1,347 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Ray tests on W = 4 or 8 lanes at once: one ray against W triangles or
+// boxes, or W rays against one triangle or box. The lanes are stored as
+// structure-of-arrays. float uses SSE (W=4) or AVX (W=8) when the compiler
+// targets them (e.g. -march=native), everything else or MCL_NO_SIMD uses a
+// loop over the lanes. Each kernel returns a bit mask of the lanes that hit.
+//
+// The math is the same as raycast::ray_triangle and SlabRay::entry, so the
+// hits are the same up to rounding. A box test over [-max(),max()] is the
+// same as raycast::ray_aabb.
+//
+
+#ifndef MCL_RAYPACKET_H
+#define MCL_RAYPACKET_H 1
+
+#include "Raycast.hpp"
+#include <algorithm>
+
+#if !defined(MCL_NO_SIMD) && ( defined(__SSE__) || defined(__AVX__) )
+#include <immintrin.h>
+#endif
+
+namespace mcl {
+namespace raycast {
+
+	// W triangles, stored as p0 and the edges and normal used by ray_triangle.
+	// Lanes past num never hit.
+	template <typename T, int W>
+	struct TrianglePacket {
+		T p0[3][W], e0[3][W], e1[3][W], n[3][W]; // [axis][lane]
+		int num;
+		TrianglePacket();
+		void set( int lane, const Vec3<T> &p0, const Vec3<T> &p1, const Vec3<T> &p2 );
+	};
+
+	// W rays, each with its own [t_min,t_max]. Lanes past num never hit.
+	template <typename T, int W>
+	struct RayPacket {
+		T origin[3][W], dir[3][W], inv_dir[3][W]; // [axis][lane]
+		T t_min[W], t_max[W];
+		int num;
+		RayPacket();
+		void set( int lane, const Ray<T> &ray, T t_min, T t_max );
+	};
+
+	// W values, with the arithmetic and comparisons the kernels need.
+	// Comparisons return a bit mask of the lanes where they are true, and
+	// select_lt/le pick a where x < y (x <= y) and b elsewhere.
+	// min and max return b if either is NaN, like SSE.
+	template <typename T, int W>
+	struct Lanes {
+		T v[W];
+		Lanes(){}
+		explicit Lanes( T s ){ for( int i=0; i<W; ++i ){ v[i] = s; } }
+		static Lanes load( const T *p ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = p[i]; } return r; }
+		void store( T *p ) const { for( int i=0; i<W; ++i ){ p[i] = v[i]; } }
+		friend Lanes operator+( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i]+b.v[i]; } return r; }
+		friend Lanes operator-( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i]-b.v[i]; } return r; }
+		friend Lanes operator*( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i]*b.v[i]; } return r; }
+		friend Lanes operator/( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i]/b.v[i]; } return r; }
+		static Lanes min( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; } return r; }
+		static Lanes max( const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; } return r; }
+		static int lt( const Lanes &a, const Lanes &b ){ int m = 0; for( int i=0; i<W; ++i ){ m |= int( a.v[i] < b.v[i] ) << i; } return m; }
+		static int le( const Lanes &a, const Lanes &b ){ int m = 0; for( int i=0; i<W; ++i ){ m |= int( a.v[i] <= b.v[i] ) << i; } return m; }
+		static Lanes select_lt( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = x.v[i] < y.v[i] ? a.v[i] : b.v[i]; } return r; }
+		static Lanes select_le( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ Lanes r; for( int i=0; i<W; ++i ){ r.v[i] = x.v[i] <= y.v[i] ? a.v[i] : b.v[i]; } return r; }
+		static const char *name(){ return "scalar"; }
+	};
+
+	// The kernels, written once over Lanes
+	template <typename T, int W>
+	struct PacketKernels {
+		typedef Lanes<T,W> L;
+		static const char *name(){ return L::name(); }
+
+		// One ray against W triangles, hits in (t_min,t_max). The distance and
+		// the barycentric coordinates of p1 and p2 of each lane are written
+		// to t, beta and gamma if not nullptr.
+		static int ray_triangles( const Ray<T> &ray, T t_min, T t_max, const TrianglePacket<T,W> &tris,
+			T *t, T *beta = nullptr, T *gamma = nullptr );
+
+		// W rays against one triangle, see ray_triangles
+		static int rays_triangle( const RayPacket<T,W> &rays, const Vec3<T> &p0, const Vec3<T> &p1, const Vec3<T> &p2,
+			T *t, T *beta = nullptr, T *gamma = nullptr );
+
+		// One ray (origin and 1/direction) against W boxes given as arrays of
+		// their bounds. Writes the entry distance of each lane to t_near and
+		// returns the lanes that hit within [t_min,t_max], see SlabRay::entry.
+		static int ray_boxes( const T *origin, const T *inv_dir,
+			const T *min_x, const T *min_y, const T *min_z, const T *max_x, const T *max_y, const T *max_z,
+			T t_min, T t_max, T *t_near );
+
+		// W rays against one box, see ray_boxes
+		static int rays_box( const RayPacket<T,W> &rays, const Vec3<T> &bmin, const Vec3<T> &bmax, T *t_near );
+
+		// Ray-triangle test of ray_triangle on every lane
+		static int triangle_lanes( const L *origin, const L *dir, const L *p0, const L *e0, const L *e1, const L *n,
+			const L &t_min, const L &t_max, T *t, T *beta, T *gamma );
+
+		// Slab test of SlabRay::entry on every lane
+		static int slab_lanes( const L *origin, const L *inv_dir, const L *bmin, const L *bmax,
+			const L &t_min, const L &t_max, T *t_near );
+	};
+
+} // end ns raycast
+
+#if !defined(MCL_NO_SIMD) && defined(__SSE__)
+
+namespace raycast {
+
+template <>
+struct Lanes<float,4> {
+	__m128 v;
+	Lanes(){}
+	Lanes( __m128 v_ ) : v(v_) {}
+	explicit Lanes( float s ) : v( _mm_set1_ps(s) ) {}
+	static Lanes load( const float *p ){ return _mm_loadu_ps(p); }
+	void store( float *p ) const { _mm_storeu_ps( p, v ); }
+	friend Lanes operator+( const Lanes &a, const Lanes &b ){ return _mm_add_ps( a.v, b.v ); }
+	friend Lanes operator-( const Lanes &a, const Lanes &b ){ return _mm_sub_ps( a.v, b.v ); }
+	friend Lanes operator*( const Lanes &a, const Lanes &b ){ return _mm_mul_ps( a.v, b.v ); }
+	friend Lanes operator/( const Lanes &a, const Lanes &b ){ return _mm_div_ps( a.v, b.v ); }
+	static Lanes min( const Lanes &a, const Lanes &b ){ return _mm_min_ps( a.v, b.v ); }
+	static Lanes max( const Lanes &a, const Lanes &b ){ return _mm_max_ps( a.v, b.v ); }
+	static int lt( const Lanes &a, const Lanes &b ){ return _mm_movemask_ps( _mm_cmplt_ps( a.v, b.v ) ); }
+	static int le( const Lanes &a, const Lanes &b ){ return _mm_movemask_ps( _mm_cmple_ps( a.v, b.v ) ); }
+	static Lanes select( __m128 m, const Lanes &a, const Lanes &b ){ return _mm_or_ps( _mm_and_ps( m, a.v ), _mm_andnot_ps( m, b.v ) ); }
+	static Lanes select_lt( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ return select( _mm_cmplt_ps( x.v, y.v ), a, b ); }
+	static Lanes select_le( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ return select( _mm_cmple_ps( x.v, y.v ), a, b ); }
+	static const char *name(){ return "sse"; }
+};
+
+} // end ns raycast
+
+#endif
+
+#if !defined(MCL_NO_SIMD) && defined(__AVX__)
+
+namespace raycast {
+
+template <>
+struct Lanes<float,8> {
+	__m256 v;
+	Lanes(){}
+	Lanes( __m256 v_ ) : v(v_) {}
+	explicit Lanes( float s ) : v( _mm256_set1_ps(s) ) {}
+	static Lanes load( const float *p ){ return _mm256_loadu_ps(p); }
+	void store( float *p ) const { _mm256_storeu_ps( p, v ); }
+	friend Lanes operator+( const Lanes &a, const Lanes &b ){ return _mm256_add_ps( a.v, b.v ); }
+	friend Lanes operator-( const Lanes &a, const Lanes &b ){ return _mm256_sub_ps( a.v, b.v ); }
+	friend Lanes operator*( const Lanes &a, const Lanes &b ){ return _mm256_mul_ps( a.v, b.v ); }
+	friend Lanes operator/( const Lanes &a, const Lanes &b ){ return _mm256_div_ps( a.v, b.v ); }
+	static Lanes min( const Lanes &a, const Lanes &b ){ return _mm256_min_ps( a.v, b.v ); }
+	static Lanes max( const Lanes &a, const Lanes &b ){ return _mm256_max_ps( a.v, b.v ); }
+	static int lt( const Lanes &a, const Lanes &b ){ return _mm256_movemask_ps( _mm256_cmp_ps( a.v, b.v, _CMP_LT_OQ ) ); }
+	static int le( const Lanes &a, const Lanes &b ){ return _mm256_movemask_ps( _mm256_cmp_ps( a.v, b.v, _CMP_LE_OQ ) ); }
+	static Lanes select_lt( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ return _mm256_blendv_ps( b.v, a.v, _mm256_cmp_ps( x.v, y.v, _CMP_LT_OQ ) ); }
+	static Lanes select_le( const Lanes &x, const Lanes &y, const Lanes &a, const Lanes &b ){ return _mm256_blendv_ps( b.v, a.v, _mm256_cmp_ps( x.v, y.v, _CMP_LE_OQ ) ); }
+	static const char *name(){ return "avx"; }
+};
+
+} // end ns raycast
+
+#endif
+
+//
+//	Implementation
+//
+
+template <typename T, int W>
+raycast::TrianglePacket<T,W>::TrianglePacket() : num(0) {
+	for( int i=0; i<3; ++i ){
+		for( int j=0; j<W; ++j ){ p0[i][j] = e0[i][j] = e1[i][j] = n[i][j] = T(0); }
+	}
+}
+
+
+template <typename T, int W>
+void raycast::TrianglePacket<T,W>::set( int lane, const Vec3<T> &p0_, const Vec3<T> &p1, const Vec3<T> &p2 ){
+	const Vec3<T> edge0 = p1 - p0_;
+	const Vec3<T> edge1 = p0_ - p2;
+	const Vec3<T> normal = edge1.cross( edge0 );
+	for( int i=0; i<3; ++i ){
+		p0[i][lane] = p0_[i];
+		e0[i][lane] = edge0[i];
+		e1[i][lane] = edge1[i];
+		n[i][lane] = normal[i];
+	}
+	num = std::max( num, lane+1 );
+}
+
+
+template <typename T, int W>
+raycast::RayPacket<T,W>::RayPacket() : num(0) {
+	for( int j=0; j<W; ++j ){
+		for( int i=0; i<3; ++i ){ origin[i][j] = T(0); dir[i][j] = inv_dir[i][j] = T(1); }
+		t_min[j] = T(1);
+		t_max[j] = T(0);
+	}
+}
+
+
+template <typename T, int W>
+void raycast::RayPacket<T,W>::set( int lane, const Ray<T> &ray, T t_min_, T t_max_ ){
+	for( int i=0; i<3; ++i ){
+		origin[i][lane] = ray.origin[i];
+		dir[i][lane] = ray.direction[i];
+		inv_dir[i][lane] = T(1) / ray.direction[i];
+	}
+	t_min[lane] = t_min_;
+	t_max[lane] = t_max_;
+	num = std::max( num, lane+1 );
+}
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::triangle_lanes( const L *o, const L *d, const L *p0, const L *e0, const L *e1, const L *n,
+	const L &t_min, const L &t_max, T *t_out, T *beta_out, T *gamma_out ){
+
+	// e2 = ( p0 - origin ) / n.dot( dir )
+	const L inv = L(T(1)) / ( n[0]*d[0] + n[1]*d[1] + n[2]*d[2] );
+	const L e2[3] = { (p0[0]-o[0])*inv, (p0[1]-o[1])*inv, (p0[2]-o[2])*inv };
+	const L t = n[0]*e2[0] + n[1]*e2[1] + n[2]*e2[2];
+
+	// i = dir.cross( e2 )
+	const L i[3] = { d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0] };
+	const L beta = i[0]*e1[0] + i[1]*e1[1] + i[2]*e1[2];
+	const L gamma = i[0]*e0[0] + i[1]*e0[1] + i[2]*e0[2];
+	const L zero( T(0) ), one( T(1) );
+	const L alpha = one - beta - gamma;
+	const int mask = L::lt( t, t_max ) & L::lt( t_min, t ) &
+		L::lt( zero, alpha ) & L::lt( zero, beta ) & L::lt( zero, gamma ) & L::le( alpha+beta+gamma, one );
+	if( t_out ){ t.store( t_out ); }
+	if( beta_out ){ beta.store( beta_out ); }
+	if( gamma_out ){ gamma.store( gamma_out ); }
+	return mask;
+
+} // end triangle lanes
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::slab_lanes( const L *o, const L *inv_dir, const L *bmin, const L *bmax,
+	const L &t_min, const L &t_max, T *t_near_out ){
+
+	// As in SlabRay::entry, the near and far planes are picked by the sign of
+	// the direction. A ray with origin on a plane parallel to it gives a NaN,
+	// and min/max return their second operand then, so it's ignored.
+	const L zero( T(0) );
+	L t_near = t_min, t_far = t_max;
+	for( int i=0; i<3; ++i ){
+		const L near_plane = L::select_lt( inv_dir[i], zero, bmax[i], bmin[i] );
+		const L far_plane = L::select_lt( inv_dir[i], zero, bmin[i], bmax[i] );
+		t_near = L::max( ( near_plane-o[i] )*inv_dir[i], t_near );
+		t_far = L::min( ( far_plane-o[i] )*inv_dir[i], t_far );
+	}
+	t_near.store( t_near_out );
+	return L::le( t_near, t_far );
+
+} // end slab lanes
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::ray_triangles( const Ray<T> &ray, T t_min, T t_max, const TrianglePacket<T,W> &tris,
+	T *t, T *beta, T *gamma ){
+	L o[3], d[3], p0[3], e0[3], e1[3], n[3];
+	for( int i=0; i<3; ++i ){
+		o[i] = L( ray.origin[i] );
+		d[i] = L( ray.direction[i] );
+		p0[i] = L::load( tris.p0[i] );
+		e0[i] = L::load( tris.e0[i] );
+		e1[i] = L::load( tris.e1[i] );
+		n[i] = L::load( tris.n[i] );
+	}
+	return triangle_lanes( o, d, p0, e0, e1, n, L(t_min), L(t_max), t, beta, gamma ) & ( (1 << tris.num)-1 );
+}
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::rays_triangle( const RayPacket<T,W> &rays, const Vec3<T> &p0_, const Vec3<T> &p1,
+	const Vec3<T> &p2, T *t, T *beta, T *gamma ){
+	const Vec3<T> edge0 = p1 - p0_;
+	const Vec3<T> edge1 = p0_ - p2;
+	const Vec3<T> normal = edge1.cross( edge0 );
+	L o[3], d[3], p0[3], e0[3], e1[3], n[3];
+	for( int i=0; i<3; ++i ){
+		o[i] = L::load( rays.origin[i] );
+		d[i] = L::load( rays.dir[i] );
+		p0[i] = L( p0_[i] );
+		e0[i] = L( edge0[i] );
+		e1[i] = L( edge1[i] );
+		n[i] = L( normal[i] );
+	}
+	return triangle_lanes( o, d, p0, e0, e1, n, L::load( rays.t_min ), L::load( rays.t_max ), t, beta, gamma ) &
+		( (1 << rays.num)-1 );
+}
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::ray_boxes( const T *origin, const T *inv_dir,
+	const T *min_x, const T *min_y, const T *min_z, const T *max_x, const T *max_y, const T *max_z,
+	T t_min, T t_max, T *t_near ){
+	const L o[3] = { L( origin[0] ), L( origin[1] ), L( origin[2] ) };
+	const L inv[3] = { L( inv_dir[0] ), L( inv_dir[1] ), L( inv_dir[2] ) };
+	const L bmin[3] = { L::load( min_x ), L::load( min_y ), L::load( min_z ) };
+	const L bmax[3] = { L::load( max_x ), L::load( max_y ), L::load( max_z ) };
+	return slab_lanes( o, inv, bmin, bmax, L(t_min), L(t_max), t_near );
+}
+
+
+template <typename T, int W>
+int raycast::PacketKernels<T,W>::rays_box( const RayPacket<T,W> &rays, const Vec3<T> &bmin_, const Vec3<T> &bmax_, T *t_near ){
+	L o[3], inv[3], bmin[3], bmax[3];
+	for( int i=0; i<3; ++i ){
+		o[i] = L::load( rays.origin[i] );
+		inv[i] = L::load( rays.inv_dir[i] );
+		bmin[i] = L( bmin_[i] );
+		bmax[i] = L( bmax_[i] );
+	}
+	return slab_lanes( o, inv, bmin, bmax, L::load( rays.t_min ), L::load( rays.t_max ), t_near ) &
+		( (1 << rays.num)-1 );
+}
+
+} // end ns mcl
+
+#endif
@@ -0,0 +1,356 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Renders RenderMeshes on the CPU, e.g. for saving frames on machines
+// without a GPU. Shading is the same Phong model as the RenderWindow
+// shader (Camera, Light, and each mesh's material::Phong), with shadows.
+// No OpenGL context is needed:
+//
+//	RayTracer tracer;
+//	tracer.add_mesh( RenderMesh::create( mesh ) );
+//	tracer.render( camera, 1920, 1080 );
+//	tracer.save_png( "frame.png" );
+//
+// Each mesh has its own BVH. Meshes with the DYNAMIC flag are refit on
+// every render, and rebuilt when refit says the tree has degraded. The
+// rest are built once (see rebuild). The image is split
+// into tiles that are traced in parallel with OpenMP.
+//
+
+#ifndef MCL_RAYTRACER_H
+#define MCL_RAYTRACER_H 1
+
+#include "RenderMesh.hpp"
+#include "Camera.hpp"
+#include "Light.hpp"
+#include "WideBVH.hpp"
+
+#ifndef MCL_STB_IMAGE_WRITE_IMPLEMENTATION
+#define MCL_STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+#endif
+
+namespace mcl {
+
+class RayTracer {
+public:
+	typedef Eigen::AlignedBox<float,3> AABB;
+
+	struct Settings {
+		int tile_size; // width and height of the tiles in pixels
+		int supersample; // rays per pixel along each axis, on a regular grid
+		bool shadows; // trace shadow rays to each light
+		Vec3f background;
+		Settings() : tile_size(16), supersample(1), shadows(true), background(1,1,1) {}
+	};
+
+	RayTracer() : img_width(0), img_height(0) {}
+
+	Settings settings;
+
+	// If empty, three-point lighting is made on the first
+	// render, the same as RenderWindow.
+	std::vector<Light> lights;
+
+	// Add a mesh to be rendered. Invisible and wireframe meshes are skipped.
+	inline void add_mesh( std::shared_ptr<RenderMesh> mesh );
+
+	// Remove all meshes
+	inline void clear_meshes(){ meshes.clear(); }
+
+	// Rebuilds the BVHs, e.g. after a mesh without the DYNAMIC flag changes.
+	// Otherwise they are built on the first render.
+	inline void rebuild();
+
+	// Renders the meshes from the camera's view into an image of the given
+	// size. The camera's projection is made for the aspect ratio of the image.
+	inline void render( const Camera &camera, int width, int height );
+
+	// Returns the last render as RGB, top row first
+	inline const std::vector<unsigned char> &get_pixels() const { return pixels; }
+	inline int width() const { return img_width; }
+	inline int height() const { return img_height; }
+
+	// Save the last render as a png file
+	inline bool save_png( const std::string &filename ) const;
+
+	// Returns bounding box of the meshes
+	inline AABB bounds() const;
+
+protected:
+	// The vertices and normals of a mesh in world space, with its BVH.
+	// If the model matrix is the identity they point to the mesh's data.
+	struct MeshData {
+		std::shared_ptr<RenderMesh> mesh;
+		std::vector<Vec3f> world_verts, world_normals;
+		const float *verts, *normals; // normals are nullptr if not one per vertex
+		const int *inds;
+		int num_verts, num_tris;
+		bvh::AABBTree<float,3> tree;
+		bvh::WideBVH<float,3,4> wide_tree;
+		bool built;
+		MeshData( std::shared_ptr<RenderMesh> mesh_ ) : mesh(mesh_), verts(nullptr), normals(nullptr),
+			inds(nullptr), num_verts(0), num_tris(0), built(false) {}
+	};
+
+	// Gets the mesh data, then builds or refits the tree as needed
+	inline void update( MeshData &m );
+
+	// Nearest hit along the ray within (t_min,t_max). Returns the mesh index or -1.
+	inline int closest_hit( const raycast::Ray<float> &ray, float t_max, int &tri, Vec3f &bary, float &t ) const;
+
+	// True if anything is hit along the ray within (t_min,t_max)
+	inline bool any_hit( const raycast::Ray<float> &ray, float t_max ) const;
+
+	// Color of a ray from eye, see shaders/shader.frag
+	inline Vec3f trace( const raycast::Ray<float> &ray, float t_max, const Vec3f &eye ) const;
+
+	std::vector< std::unique_ptr<MeshData> > meshes;
+	std::vector<unsigned char> pixels;
+	int img_width, img_height;
+
+}; // end class RayTracer
+
+//
+//	Implementation
+//
+
+inline void RayTracer::add_mesh( std::shared_ptr<RenderMesh> mesh ){
+	if( mesh->flags & ( RenderMesh::INVISIBLE | RenderMesh::WIREFRAME ) ){ return; }
+	meshes.emplace_back( std::unique_ptr<MeshData>( new MeshData( mesh ) ) );
+}
+
+
+inline void RayTracer::rebuild(){
+	for( size_t i=0; i<meshes.size(); ++i ){ meshes[i]->built = false; }
+}
+
+
+inline RayTracer::AABB RayTracer::bounds() const {
+	AABB box;
+	for( size_t i=0; i<meshes.size(); ++i ){
+		const MeshData &m = *meshes[i];
+		for( int j=0; j<m.num_verts; ++j ){ box.extend( Vec3f( m.verts[j*3], m.verts[j*3+1], m.verts[j*3+2] ) ); }
+	}
+	return box;
+}
+
+
+inline void RayTracer::update( MeshData &m ){
+
+	const bool dynamic = m.mesh->flags & RenderMesh::DYNAMIC;
+	if( m.built && !dynamic ){ return; }
+
+	RenderMesh &mesh = *m.mesh;
+	mesh.get_data();
+	const int prev_tris = m.num_tris;
+	m.num_verts = mesh.num_vertices;
+	m.num_tris = mesh.num_prims;
+	m.inds = mesh.prims;
+	m.verts = mesh.vertices;
+	m.normals = mesh.num_normals == mesh.num_vertices ? mesh.normals : nullptr;
+
+	// Move to world space if there is a model matrix
+	const Eigen::Matrix4f &model = mesh.get_model().matrix();
+	if( ( model - Eigen::Matrix4f::Identity() ).squaredNorm() > 1e-10 ){
+		const Eigen::Matrix3f linear = model.block<3,3>(0,0);
+		const Eigen::Matrix3f normal_xf = linear.inverse().transpose();
+		const Vec3f trans = model.block<3,1>(0,3);
+		m.world_verts.resize( m.num_verts );
+		for( int i=0; i<m.num_verts; ++i ){
+			m.world_verts[i] = linear * Vec3f( mesh.vertices[i*3], mesh.vertices[i*3+1], mesh.vertices[i*3+2] ) + trans;
+		}
+		m.verts = &m.world_verts[0][0];
+		if( m.normals ){
+			m.world_normals.resize( m.num_verts );
+			for( int i=0; i<m.num_verts; ++i ){
+				m.world_normals[i] = normal_xf * Vec3f( mesh.normals[i*3], mesh.normals[i*3+1], mesh.normals[i*3+2] );
+			}
+			m.normals = &m.world_normals[0][0];
+		}
+	}
+
+	if( m.num_tris <= 0 ){ m.built = true; return; }
+	if( !m.built || prev_tris != m.num_tris ){ m.tree.init( m.inds, m.verts, m.num_tris ); }
+	else if( m.tree.refit( m.verts ) ){ m.tree.init( m.inds, m.verts, m.num_tris ); }
+	m.wide_tree.init( m.tree );
+	m.built = true;
+
+} // end update
+
+
+inline int RayTracer::closest_hit( const raycast::Ray<float> &ray, float t_max, int &tri, Vec3f &bary, float &t ) const {
+	int hit_mesh = -1;
+	for( size_t i=0; i<meshes.size(); ++i ){
+		const MeshData &m = *meshes[i];
+		if( m.num_tris <= 0 ){ continue; }
+		bvh::RayClosestHit<float> visitor( ray, m.verts, m.inds );
+		visitor.payload.t_max = t_max;
+		m.wide_tree.traverse_ray( visitor );
+		if( visitor.hit_tri >= 0 ){
+			hit_mesh = i;
+			tri = visitor.hit_tri;
+			bary = visitor.payload.bary;
+			t_max = visitor.payload.t_max;
+		}
+	}
+	t = t_max;
+	return hit_mesh;
+}
+
+
+inline bool RayTracer::any_hit( const raycast::Ray<float> &ray, float t_max ) const {
+	for( size_t i=0; i<meshes.size(); ++i ){
+		const MeshData &m = *meshes[i];
+		if( m.num_tris <= 0 ){ continue; }
+		bvh::RayAnyHit<float> visitor( ray, m.verts, m.inds );
+		visitor.payload.t_max = t_max;
+		if( m.wide_tree.traverse_ray( visitor ) ){ return true; }
+	}
+	return false;
+}
+
+
+inline Vec3f RayTracer::trace( const raycast::Ray<float> &ray, float t_max, const Vec3f &eye ) const {
+
+	int tri = -1;
+	Vec3f bary;
+	float t = 0.f;
+	const int hit_mesh = closest_hit( ray, t_max, tri, bary, t );
+	if( hit_mesh < 0 ){ return settings.background; }
+
+	// Interpolated vertex normals, or the face normal if there are none
+	const MeshData &m = *meshes[hit_mesh];
+	const int *f = &m.inds[tri*3];
+	Vec3f v[3], normal;
+	for( int i=0; i<3; ++i ){ v[i] = Vec3f( m.verts[f[i]*3], m.verts[f[i]*3+1], m.verts[f[i]*3+2] ); }
+	if( m.normals ){
+		normal.setZero();
+		for( int i=0; i<3; ++i ){ normal += bary[i] * Vec3f( m.normals[f[i]*3], m.normals[f[i]*3+1], m.normals[f[i]*3+2] ); }
+	}
+	else { normal = ( v[1]-v[0] ).cross( v[2]-v[0] ); }
+	normal.normalize();
+
+	// Vertex colors scale the ambient and diffuse
+	const RenderMesh &mesh = *m.mesh;
+	Vec3f color(1,1,1);
+	if( mesh.colors && mesh.num_colors == m.num_verts ){
+		color.setZero();
+		for( int i=0; i<3; ++i ){ color += bary[i] * Vec3f( mesh.colors[f[i]*3], mesh.colors[f[i]*3+1], mesh.colors[f[i]*3+2] ); }
+	}
+
+	// Shadow rays start a little off the surface, on the side of the light
+	const Vec3f point = ray.origin + ray.direction*t;
+	const float offset = 1e-4f * std::max( 1.f, point.cwiseAbs().maxCoeff() );
+	const material::Phong &phong = mesh.phong;
+	const Vec3f amb = color.cwiseProduct( phong.amb ), diff = color.cwiseProduct( phong.diff );
+	const Vec3f e = ( eye - point ).normalized();
+	Vec3f result(0,0,0);
+	for( size_t i=0; i<lights.size(); ++i ){
+		const Light &light = lights[i];
+		result += amb.cwiseProduct( light.color );
+		Vec3f l = light.pos - point;
+		const float light_dist = l.norm();
+		l /= light_dist;
+		const float ndotl = normal.dot( l );
+		if( ndotl <= 0.f ){ continue; }
+		if( settings.shadows ){
+			raycast::Ray<float> shadow_ray( point + normal*offset, l, 0.f );
+			if( any_hit( shadow_ray, light_dist ) ){ continue; }
+		}
+		result += diff.cwiseProduct( light.color )*ndotl;
+		if( phong.shini > 0.f ){
+			const Vec3f r = ( 2.f*ndotl*normal - l ).normalized();
+			result += std::pow( std::max( r.dot(e), 0.f ), phong.shini ) * phong.spec.cwiseProduct( light.color );
+		}
+	}
+	return result;
+
+} // end trace
+
+
+inline void RayTracer::render( const Camera &camera_, int width, int height ){
+
+	if( width <= 0 || height <= 0 ){
+		throw std::runtime_error("RayTracer::render Error: Image size must be positive");
+	}
+	img_width = width;
+	img_height = height;
+	pixels.resize( width*height*3 );
+	for( size_t i=0; i<meshes.size(); ++i ){ update( *meshes[i] ); }
+
+	Camera camera = camera_;
+	camera.update_projection( width, height );
+	if( lights.size()==0 ){ lights = Light::create_3pt( camera.eye(), bounds() ); }
+
+	// Rays go from the near plane to the far plane through each pixel
+	const Eigen::Matrix4f inv_view_proj = ( camera.projection().matrix() * camera.view().matrix() ).inverse();
+	const Vec3f eye = camera.view().matrix().inverse().block<3,1>(0,3);
+	const int ss = std::max( 1, settings.supersample );
+	const int tile_size = std::max( 1, settings.tile_size );
+	const int tiles_x = ( width + tile_size-1 ) / tile_size;
+	const int tiles_y = ( height + tile_size-1 ) / tile_size;
+
+	#pragma omp parallel for schedule(dynamic,1)
+	for( int tile=0; tile<tiles_x*tiles_y; ++tile ){
+		const int x0 = ( tile % tiles_x ) * tile_size;
+		const int y0 = ( tile / tiles_x ) * tile_size;
+		const int x1 = std::min( x0+tile_size, width );
+		const int y1 = std::min( y0+tile_size, height );
+		for( int y=y0; y<y1; ++y ){
+			for( int x=x0; x<x1; ++x ){
+				Vec3f color(0,0,0);
+				for( int s=0; s<ss*ss; ++s ){
+					const float ndc_x = 2.f*( x + ( s%ss + 0.5f )/ss )/width - 1.f;
+					const float ndc_y = 1.f - 2.f*( y + ( s/ss + 0.5f )/ss )/height;
+					Eigen::Vector4f near_pt = inv_view_proj * Eigen::Vector4f( ndc_x, ndc_y, -1.f, 1.f );
+					Eigen::Vector4f far_pt = inv_view_proj * Eigen::Vector4f( ndc_x, ndc_y, 1.f, 1.f );
+					const Vec3f origin = near_pt.head<3>() / near_pt[3];
+					Vec3f dir = far_pt.head<3>() / far_pt[3] - origin;
+					const float t_max = dir.norm();
+					dir /= t_max;
+					color += trace( raycast::Ray<float>( origin, dir, 0.f ), t_max, eye );
+				}
+				color /= float(ss*ss);
+				unsigned char *p = &pixels[ ( y*width + x )*3 ];
+				for( int i=0; i<3; ++i ){
+					p[i] = (unsigned char)( std::max( 0.f, std::min( 1.f, color[i] ) )*255.f + 0.5f );
+				}
+			}
+		}
+	}
+
+} // end render
+
+
+inline bool RayTracer::save_png( const std::string &filename ) const {
+	if( pixels.size()==0 ){ return false; }
+	int success = stbi_write_png( filename.c_str(), img_width, img_height, 3, &pixels[0], img_width*3 );
+	if( !success ){ std::cerr << "**stbi_write_png error" << std::endl; }
+	return success != 0;
+}
+
+} // ns mcl
+
+#endif
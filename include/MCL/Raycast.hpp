@@ -27,6 +27,7 @@
 #define MCL_RAYINTERSECT_H 1
 
 #include <memory>
+#include <limits>
 #include "Vec.hpp"
 
 namespace mcl {
@@ -41,6 +42,18 @@ namespace raycast {
 		T eps;
 	};
 
+	// Ray with the inverse direction and its signs precomputed for box tests.
+	// The signs pick the near and far planes of each slab, so there is no
+	// min/max per axis.
+	template<typename T> class SlabRay {
+	public:
+		SlabRay( const Ray<T> &ray );
+		Vec3<T> origin, inv_dir;
+		int sign[3]; // 1 if the direction is negative along the axis
+		// Distance at which the ray enters the box within [t_min,t_max], or max() if it misses
+		T entry( const Vec3<T> &bmin, const Vec3<T> &bmax, T t_min, T t_max ) const;
+	};
+
 	// Payload
 	template<typename T> class Payload {
 	public:
@@ -87,6 +100,28 @@ namespace raycast {
 //	Implementation below
 //
 
+template<typename T> mcl::raycast::SlabRay<T>::SlabRay( const Ray<T> &ray ) : origin(ray.origin) {
+	for( int i=0; i<3; ++i ){
+		inv_dir[i] = T(1) / ray.direction[i];
+		sign[i] = inv_dir[i] < T(0) ? 1 : 0;
+	}
+}
+
+
+template<typename T> T mcl::raycast::SlabRay<T>::entry( const Vec3<T> &bmin, const Vec3<T> &bmax, T t_min, T t_max ) const {
+	const Vec3<T> *bounds[2] = { &bmin, &bmax };
+	T t_near = t_min, t_far = t_max;
+	for( int i=0; i<3; ++i ){
+		T t0 = ( (*bounds[ sign[i] ])[i] - origin[i] ) * inv_dir[i];
+		T t1 = ( (*bounds[ 1-sign[i] ])[i] - origin[i] ) * inv_dir[i];
+		// Written so a NaN (origin on a plane parallel to the ray) is ignored
+		t_near = t0 > t_near ? t0 : t_near;
+		t_far = t1 < t_far ? t1 : t_far;
+	}
+	return t_near <= t_far ? t_near : std::numeric_limits<T>::max();
+} // end slab ray entry
+
+
 // ray -> axis aligned bounding box
 template<typename T> static bool mcl::raycast::ray_aabb( const Ray<T> *ray,
 	const Vec3<T> &min, const Vec3<T> &max ){
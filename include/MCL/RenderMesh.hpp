@@ -45,12 +45,12 @@ public:
 
 	static inline std::shared_ptr<RenderMesh> create(
 		std::shared_ptr<TriangleMesh> mesh, int options=DEFAULT ){
-		return std::make_shared<RenderMesh>( mesh, options );
+		return std::shared_ptr<RenderMesh>( new RenderMesh( mesh, options ) );
 	}
 
 	static inline std::shared_ptr<RenderMesh> create(
 		std::shared_ptr<TetMesh> mesh, int options=DEFAULT ){
-		return std::make_shared<RenderMesh>( mesh, options );
+		return std::shared_ptr<RenderMesh>( new RenderMesh( mesh, options ) );
 	}
 
 	enum {
@@ -76,6 +76,15 @@ public:
 	};
 	inline void load_buffers( int load=ALL );
 
+	// Gets the vertex and primitive pointers from the mesh without
+	// touching the GPU. Called by load_buffers.
+	inline void get_data();
+
+	// Per-vertex colors that scale the material's ambient and diffuse,
+	// e.g. from bvh::AmbientOcclusion. They are copied, so call
+	// load_buffers(COLORS) to upload them. Defaults to white.
+	inline void set_colors( const std::vector<Vec3f> &colors_ );
+
 	// Get the model matrix.
 	inline const mcl::XForm<float> &get_model() const { return model; }
 
@@ -104,6 +113,9 @@ public:
 	// Material info
 	material::Phong phong;
 
+	// The model matrix may need more alignment than make_shared gives, e.g. with AVX
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
 private:
 
 	// I could use a base class for meshes, but I don't really want to.
@@ -117,7 +129,6 @@ private:
 
 	int last_prim_size;
 	inline void init(); // called by constructors
-	inline void get_data(); // gets data from the mesh ptr
 	inline void subdivide_mesh();
 	inline void make_flat();
 };
@@ -190,8 +201,7 @@ inline void RenderMesh::get_data(){
 
 	// Fill colors if none exist
 	if( num_colors != num_vertices ){
-		if( flags & WIREFRAME ){ colors_data.resize( num_vertices, Vec3f(0,0,0) ); }
-		else{ colors_data.resize( num_vertices, Vec3f(1,0,0) ); }
+		colors_data.resize( num_vertices, Vec3f(1,1,1) );
 		colors = &colors_data[0][0];
 		num_colors = colors_data.size();
 	}
@@ -206,6 +216,13 @@ inline void RenderMesh::get_data(){
 } // end get data
 
 
+inline void RenderMesh::set_colors( const std::vector<Vec3f> &colors_ ){
+	colors_data = colors_;
+	colors = colors_data.size() ? &colors_data[0][0] : nullptr;
+	num_colors = colors_data.size();
+}
+
+
 inline void RenderMesh::load_buffers( int load ){
 
 	get_data();
@@ -25,9 +25,13 @@
 #include "Shader.hpp"
 #include "RenderMesh.hpp"
 #include "Controller.hpp"
+#include "Light.hpp"
 
+#ifndef MCL_STB_IMAGE_WRITE_IMPLEMENTATION
+#define MCL_STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+#endif
 
 namespace mcl {
 
@@ -40,25 +44,6 @@ const std::string mcl_frag_src =
 ;
 }
 
-// 0 = point (TODO add more later), and a nice class
-// that manages things like sampling and whatnot
-class Light {
-public:
-	short type;
-	Vec3f color;
-	Vec3f pos;
-	Vec3f dir;
-	float rad;
-
-	static inline Light create_point( const Vec3f &p, const Vec3f &c=Vec3f(1,1,1) ){
-		return Light( 0, c, p, Vec3f(0,0,0), 0 );
-	}
-
-	Light( short type_, const Vec3f &color_, const Vec3f &pos_, const Vec3f &dir_, float rad_ ) :
-		type(type_), color(color_), pos(pos_), dir(dir_), rad(rad_) {}
-};
-
-
 class RenderWindow {
 public:
 	typedef Eigen::AlignedBox<float,3> AABB;
@@ -301,26 +286,7 @@ inline void RenderWindow::draw(){
 
 
 inline void RenderWindow::make_3pt_lighting( const Vec3f &eye, const AABB &aabb ){
-
-	const Vec3f center = aabb.center();
-//	const float rad = aabb.sizes().maxCoeff()*0.5; // for falloff
-	const float top = aabb.max()[1] - center[1];
-	const Vec3f up(0,1,0);
-
-	Vec3f w = eye-center;
-	float dist = std::max( 0.1f, w.norm() );
-	w /= dist;
-	Vec3f u = up.cross(w); // right
-	u.normalize();
-
-	Vec3f key = center + w*dist + up*eye[1] - u*dist; // left of camera
-	Vec3f fill = center + w*(dist*0.5f) + up*top + u*dist; // right of camera
-	Vec3f back = center - w*dist + up*top + u*(dist*0.5f); // opposite of key
-
-	m_lights.clear();
-	m_lights.emplace_back( Light::create_point( key, Vec3f(1.f,1.f,1.f) ) );
-	m_lights.emplace_back( Light::create_point( fill, Vec3f(0.8,0.8,0.8) ) );
-	m_lights.emplace_back( Light::create_point( back, Vec3f(0.6,0.6,0.6) ) );
+	m_lights = Light::create_3pt( eye, aabb );
 }
 
 
@@ -0,0 +1,242 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Signed distance from points to a closed, consistently oriented triangle
+// mesh, negative inside. The nearest point is found with an AABBTree and
+// the sign from the angle-weighted pseudonormal of the nearest feature
+// (face, edge, or vertex), see Baerentzen and Aanaes, "Signed Distance
+// Computation Using the Angle Weighted Pseudonormal". The pseudonormals
+// are computed once in init (and again in refit), so a query costs the
+// same as a nearest triangle query.
+//
+// Example:
+//
+//	bvh::SignedDistance<float> sdf;
+//	sdf.init( verts, num_verts, faces, num_faces );
+//	float d = sdf.distance( point ); // < 0 inside
+//	sdf.distance( points, num_points, dists ); // in parallel
+//
+// The verts and faces are not copied, so they must outlive the object.
+//
+
+#ifndef MCL_SIGNEDDISTANCE_H
+#define MCL_SIGNEDDISTANCE_H 1
+
+#include "BatchQuery.hpp"
+#include "HashKeys.hpp"
+
+namespace mcl {
+namespace bvh {
+
+template <typename T>
+class SignedDistance {
+public:
+	SignedDistance() : verts(nullptr), inds(nullptr), num_verts(0), num_tris(0), num_open_edges(0) {}
+
+	// Builds the tree and pseudonormals. Throws if the mesh is empty.
+	void init( const T *verts, int num_verts, const int *inds, int num_tris,
+		const Settings &settings = Settings() );
+
+	// New vertex positions, same faces. Refits the tree (rebuilding it if
+	// refit suggests so) and recomputes the pseudonormals.
+	void refit( const T *verts );
+
+	// Signed distance to the mesh, negative inside. The nearest point
+	// and triangle are also returned if not nullptr.
+	T distance( const Vec3<T> &point, Vec3<T> *nearest = nullptr, int *tri = nullptr ) const;
+
+	// Signed distances of interleaved xyz points in parallel, see BatchQuery.hpp.
+	// tris is the nearest triangle of each point if not nullptr.
+	void distance( const T *points, int num_points, T *dists, int *tris = nullptr,
+		bool morton_order = true ) const;
+
+	bool inside( const Vec3<T> &point ) const { return distance( point ) < T(0); }
+
+	// Edges with one triangle. The sign is only reliable if this is zero.
+	int open_edges() const { return num_open_edges; }
+
+	const AABBTree<T,3> &get_tree() const { return tree; }
+
+private:
+	// Face normals and the angle-weighted pseudonormals of the verts and
+	// of edge j (verts j and j+1) of each triangle.
+	void compute_normals();
+
+	// Sign of (point - nearest) against the pseudonormal of the feature
+	// of tri that nearest is on, with nearest = p0 + s*(p1-p0) + t*(p2-p0).
+	T sign( const Vec3<T> &point, const Vec3<T> &nearest, int tri, T s, T t ) const;
+
+	Vec3<T> vert( int idx ) const { return Vec3<T>( verts[idx*3], verts[idx*3+1], verts[idx*3+2] ); }
+
+	AABBTree<T,3> tree;
+	Settings settings;
+	const T *verts;
+	const int *inds;
+	int num_verts, num_tris, num_open_edges;
+	std::vector< Vec3<T> > face_normals, vert_normals, edge_normals;
+	std::vector<int> edge_tris; // for each tri edge, tri*3+edge of the same edge in the other tri, or -1
+
+}; // end class SignedDistance
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T>
+void bvh::SignedDistance<T>::init( const T *verts_, int num_verts_, const int *inds_, int num_tris_,
+	const Settings &settings ){
+
+	if( num_verts_ <= 0 || num_tris_ <= 0 ){
+		throw std::runtime_error("SignedDistance::init Error: No triangles");
+	}
+	verts = verts_;
+	inds = inds_;
+	num_verts = num_verts_;
+	num_tris = num_tris_;
+	this->settings = settings;
+	tree.init( inds, verts, num_tris, settings );
+
+	// Pair up the two triangles of each edge
+	edge_tris.assign( num_tris*3, -1 );
+	std::unordered_map< hashkey::sint2, int > edges;
+	edges.reserve( num_tris*3/2 );
+	for( int i=0; i<num_tris; ++i ){
+		for( int j=0; j<3; ++j ){
+			hashkey::sint2 key( inds[i*3+j], inds[i*3+(j+1)%3] );
+			auto it = edges.find( key );
+			if( it == edges.end() ){ edges.emplace( key, i*3+j ); continue; }
+			edge_tris[ i*3+j ] = it->second;
+			edge_tris[ it->second ] = i*3+j;
+			edges.erase( it );
+		}
+	}
+	num_open_edges = edges.size();
+	compute_normals();
+
+} // end init
+
+
+template <typename T>
+void bvh::SignedDistance<T>::refit( const T *verts_ ){
+
+	verts = verts_;
+	if( tree.refit( verts ) ){ tree.init( inds, verts, num_tris, settings ); }
+	compute_normals();
+
+} // end refit
+
+
+template <typename T>
+void bvh::SignedDistance<T>::compute_normals(){
+
+	face_normals.resize( num_tris );
+	#pragma omp parallel for
+	for( int i=0; i<num_tris; ++i ){
+		const int *f = &inds[i*3];
+		Vec3<T> n = ( vert(f[1]) - vert(f[0]) ).cross( vert(f[2]) - vert(f[0]) );
+		T len = n.norm();
+		face_normals[i] = len > T(0) ? Vec3<T>( n/len ) : Vec3<T>( 0, 0, 0 );
+	}
+
+	// Each face adds its normal weighted by its angle at the vert
+	vert_normals.assign( num_verts, Vec3<T>( 0, 0, 0 ) );
+	for( int i=0; i<num_tris; ++i ){
+		const int *f = &inds[i*3];
+		for( int j=0; j<3; ++j ){
+			Vec3<T> e0 = vert( f[(j+1)%3] ) - vert( f[j] );
+			Vec3<T> e1 = vert( f[(j+2)%3] ) - vert( f[j] );
+			T angle = std::atan2( e0.cross( e1 ).norm(), e0.dot( e1 ) );
+			vert_normals[ f[j] ] += angle * face_normals[i];
+		}
+	}
+
+	// Both faces of an edge have an angle of pi
+	edge_normals.resize( num_tris*3 );
+	#pragma omp parallel for
+	for( int i=0; i<num_tris*3; ++i ){
+		edge_normals[i] = face_normals[i/3];
+		if( edge_tris[i] >= 0 ){ edge_normals[i] += face_normals[ edge_tris[i]/3 ]; }
+	}
+
+} // end compute normals
+
+
+template <typename T>
+T bvh::SignedDistance<T>::sign( const Vec3<T> &point, const Vec3<T> &nearest, int tri, T s, T t ) const {
+
+	const int *f = &inds[tri*3];
+	const Vec3<T> *n = &face_normals[tri];
+	if( t == T(0) ){
+		if( s == T(0) ){ n = &vert_normals[ f[0] ]; }
+		else if( s == T(1) ){ n = &vert_normals[ f[1] ]; }
+		else { n = &edge_normals[ tri*3 ]; }
+	}
+	else if( s == T(0) ){
+		if( t == T(1) ){ n = &vert_normals[ f[2] ]; }
+		else { n = &edge_normals[ tri*3+2 ]; }
+	}
+	else if( s + t >= T(1) ){ n = &edge_normals[ tri*3+1 ]; }
+	return ( point - nearest ).dot( *n ) < T(0) ? T(-1) : T(1);
+
+} // end sign
+
+
+template <typename T>
+T bvh::SignedDistance<T>::distance( const Vec3<T> &point, Vec3<T> *nearest, int *tri ) const {
+
+	NearestTriangle<T> visitor( point, verts, inds );
+	tree.traverse_static( visitor );
+	if( tri ){ *tri = visitor.hit_tri; }
+	if( visitor.hit_tri < 0 ){ return std::numeric_limits<T>::max(); }
+
+	// Again for the coordinates of the nearest point
+	const int *f = &inds[ visitor.hit_tri*3 ];
+	T s = 0, t = 0;
+	Vec3<T> proj = projection::point_on_triangle( point, vert(f[0]), vert(f[1]), vert(f[2]), s, t );
+	if( nearest ){ *nearest = proj; }
+	return sign( point, proj, visitor.hit_tri, s, t ) * std::sqrt( visitor.curr_nearest );
+
+} // end distance
+
+
+template <typename T>
+void bvh::SignedDistance<T>::distance( const T *points, int num_points, T *dists, int *tris,
+	bool morton_order ) const {
+
+	std::vector<int> order;
+	query_order( points, num_points, morton_order, order );
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int j=0; j<num_points; ++j ){
+		const int i = order[j];
+		dists[i] = distance( Vec3<T>( points[i*3], points[i*3+1], points[i*3+2] ),
+			nullptr, tris ? &tris[i] : nullptr );
+	}
+
+} // end batch distance
+
+} // end ns mcl
+
+#endif
@@ -0,0 +1,228 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// The inverse rest matrix of every tet, for point-in-tet tests and
+// barycentric coordinates without the cross products of
+// projection::point_in_tet and vec::barycoords. For tet (x0,x1,x2,x3),
+//
+//	(b1,b2,b3) = inv([x1-x0, x2-x0, x3-x0]) * (p - x0), b0 = 1-b1-b2-b3
+//
+// and p is inside if all four are positive. The matrices and x0 are
+// stored as structure-of-arrays, so W tets (or W points in one tet) are
+// tested at once with the lanes of RayPacket.hpp (SSE or AVX for float).
+//
+//	projection::TetInverse<float> inv;
+//	inv.init( verts, tets, num_tets );
+//	int tet = inv.find( point, 0, num_tets, &bary ); // brute force over all tets
+//
+// Or pass it to PointInTet (or bvh::point_in_tet) to test the tets at the
+// leaves of a tree. Barycentric coordinates are the same as vec::barycoords
+// up to rounding. Degenerate tets contain nothing.
+//
+// Only the rest pose is stored, so call init again if the verts move.
+//
+
+#ifndef MCL_TETINVERSE_H
+#define MCL_TETINVERSE_H 1
+
+#include "RayPacket.hpp"
+#include <vector>
+
+namespace mcl {
+namespace projection {
+
+template <typename T, int W=4>
+class TetInverse {
+public:
+	typedef raycast::Lanes<T,W> L;
+	static const char *name(){ return L::name(); }
+
+	TetInverse() : num_tets(0) {}
+
+	// Computes the inverse matrix of each tet
+	void init( const T *verts, const int *inds, int num_tets );
+
+	int size() const { return num_tets; }
+
+	// Barycentric coordinates of a point in a tet
+	Vec4<T> barycoords( int tet, const Vec3<T> &point ) const;
+
+	// True if all barycentric coordinates are positive, like point_in_tet
+	bool contains( int tet, const Vec3<T> &point ) const;
+
+	// First tet in [first,first+n) that contains the point, or -1. Its
+	// barycentric coordinates are written to bary if not nullptr.
+	int find( const Vec3<T> &point, int first, int n, Vec4<T> *bary=nullptr ) const;
+
+	// Barycentric coordinates of n points (px[i],py[i],pz[i]) in one tet,
+	// written to b0, b1, b2, and b3. Returns the number of points inside.
+	int barycoords( int tet, int n, const T *px, const T *py, const T *pz,
+		T *b0, T *b1, T *b2, T *b3 ) const;
+
+private:
+	// b1, b2, and b3 of W lanes, with the matrix and x0 in lanes
+	static void bary_lanes( const L *m, const L *x0, const L *point, L *b );
+
+	// Lanes where all barycentric coordinates are positive
+	static int inside_lanes( const L *b ){
+		const L zero(0), one(1);
+		return L::lt( zero, b[0] ) & L::lt( zero, b[1] ) & L::lt( zero, b[2] ) & L::lt( b[0]+b[1]+b[2], one );
+	}
+
+	static int num_bits( int mask ){ int n = 0; for( ; mask; mask &= mask-1 ){ ++n; } return n; }
+
+	// [row*3+col][tet] and [axis][tet], padded by W zero matrices
+	// so any W tets from a valid index can be loaded
+	std::vector<T> m[9], x0[3];
+	int num_tets;
+
+}; // end class TetInverse
+
+} // end ns projection
+
+//
+//	Implementation
+//
+
+template <typename T, int W>
+void projection::TetInverse<T,W>::init( const T *verts, const int *inds, int num_tets_ ){
+
+	num_tets = num_tets_;
+	for( int i=0; i<9; ++i ){ m[i].assign( num_tets+W, T(0) ); }
+	for( int i=0; i<3; ++i ){ x0[i].assign( num_tets+W, T(0) ); }
+
+	#pragma omp parallel for
+	for( int i=0; i<num_tets; ++i ){
+		const int *tet = &inds[i*4];
+		const Vec3<T> p0( verts[tet[0]*3], verts[tet[0]*3+1], verts[tet[0]*3+2] );
+		Eigen::Matrix<T,3,3> edges;
+		for( int j=0; j<3; ++j ){
+			const int v = tet[j+1];
+			edges.col(j) = Vec3<T>( verts[v*3], verts[v*3+1], verts[v*3+2] ) - p0;
+		}
+		for( int j=0; j<3; ++j ){ x0[j][i] = p0[j]; }
+
+		// A zero matrix gives b0 = 1 and b1 = b2 = b3 = 0, which is outside
+		const T det = edges.determinant();
+		if( !( std::abs(det) > T(0) ) ){ continue; }
+		const Eigen::Matrix<T,3,3> inv = edges.inverse();
+		for( int r=0; r<3; ++r ){
+			for( int c=0; c<3; ++c ){ m[r*3+c][i] = inv(r,c); }
+		}
+	}
+
+} // end init
+
+
+template <typename T, int W>
+Vec4<T> projection::TetInverse<T,W>::barycoords( int tet, const Vec3<T> &point ) const {
+	const Vec3<T> d( point[0]-x0[0][tet], point[1]-x0[1][tet], point[2]-x0[2][tet] );
+	Vec4<T> b;
+	for( int r=0; r<3; ++r ){ b[r+1] = m[r*3][tet]*d[0] + m[r*3+1][tet]*d[1] + m[r*3+2][tet]*d[2]; }
+	b[0] = T(1) - b[1] - b[2] - b[3];
+	return b;
+}
+
+
+template <typename T, int W>
+bool projection::TetInverse<T,W>::contains( int tet, const Vec3<T> &point ) const {
+	const Vec4<T> b = barycoords( tet, point );
+	return b[1] > T(0) && b[2] > T(0) && b[3] > T(0) && b[1]+b[2]+b[3] < T(1);
+}
+
+
+template <typename T, int W>
+void projection::TetInverse<T,W>::bary_lanes( const L *m, const L *x0, const L *point, L *b ){
+	const L d[3] = { point[0]-x0[0], point[1]-x0[1], point[2]-x0[2] };
+	for( int r=0; r<3; ++r ){ b[r] = m[r*3]*d[0] + m[r*3+1]*d[1] + m[r*3+2]*d[2]; }
+}
+
+
+template <typename T, int W>
+int projection::TetInverse<T,W>::find( const Vec3<T> &point_, int first, int n, Vec4<T> *bary ) const {
+
+	const int last = std::min( first+n, num_tets );
+	const L point[3] = { L( point_[0] ), L( point_[1] ), L( point_[2] ) };
+	L mat[9], origin[3], b[3];
+	for( int i=std::max( first, 0 ); i<last; i += W ){
+		for( int j=0; j<9; ++j ){ mat[j] = L::load( &m[j][i] ); }
+		for( int j=0; j<3; ++j ){ origin[j] = L::load( &x0[j][i] ); }
+		bary_lanes( mat, origin, point, b );
+		int mask = inside_lanes( b );
+		if( last-i < W ){ mask &= ( 1 << (last-i) )-1; }
+		if( mask == 0 ){ continue; }
+		int k = 0;
+		while( !( mask & (1 << k) ) ){ ++k; }
+		if( bary ){ *bary = barycoords( i+k, point_ ); }
+		return i+k;
+	}
+	return -1;
+
+} // end find
+
+
+template <typename T, int W>
+int projection::TetInverse<T,W>::barycoords( int tet, int n, const T *px, const T *py, const T *pz,
+	T *b0, T *b1, T *b2, T *b3 ) const {
+
+	L mat[9], origin[3], point[3], b[3];
+	for( int j=0; j<9; ++j ){ mat[j] = L( m[j][tet] ); }
+	for( int j=0; j<3; ++j ){ origin[j] = L( x0[j][tet] ); }
+	const T *p[3] = { px, py, pz };
+	T *b_out[3] = { b1, b2, b3 };
+	const L one(1);
+	int n_inside = 0;
+
+	int i = 0;
+	for( ; i+W <= n; i += W ){
+		for( int j=0; j<3; ++j ){ point[j] = L::load( p[j]+i ); }
+		bary_lanes( mat, origin, point, b );
+		for( int j=0; j<3; ++j ){ b[j].store( b_out[j]+i ); }
+		( one - b[0] - b[1] - b[2] ).store( b0+i );
+		n_inside += num_bits( inside_lanes( b ) );
+	}
+
+	// The rest are padded with the last point
+	if( i < n ){
+		const int rem = n-i;
+		T buf[W], b_buf[4][W];
+		for( int j=0; j<3; ++j ){
+			for( int k=0; k<W; ++k ){ buf[k] = p[j][ i + std::min( k, rem-1 ) ]; }
+			point[j] = L::load( buf );
+		}
+		bary_lanes( mat, origin, point, b );
+		for( int j=0; j<3; ++j ){ b[j].store( b_buf[j+1] ); }
+		( one - b[0] - b[1] - b[2] ).store( b_buf[0] );
+		n_inside += num_bits( inside_lanes( b ) & ( ( 1 << rem )-1 ) );
+		for( int k=0; k<rem; ++k ){
+			b0[i+k] = b_buf[0][k];
+			for( int j=0; j<3; ++j ){ b_out[j][i+k] = b_buf[j+1][k]; }
+		}
+	}
+	return n_inside;
+
+} // end barycoords
+
+} // end ns mcl
+
+#endif
@@ -0,0 +1,212 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+//
+// Finds the tet containing a point by walking from a nearby tet through
+// the tet-to-tet neighbors, which is much cheaper than a PointInTet
+// traversal when the point was near the start tet last time (e.g. embedded
+// verts that moved a little since the last frame). From each tet the walk
+// steps through the face with the most negative barycentric coordinate.
+// If it leaves the mesh, takes more than max_steps, or has no start tet,
+// an AABBTree is used instead.
+//
+// Example:
+//
+//	bvh::TetLocator<float> locator;
+//	locator.init( verts, tets, num_tets );
+//	std::vector<int> tet( num_points, -1 ); // -1 starts from the tree
+//	for( each frame ){
+//		locator.refit( verts ); // if the tets moved
+//		locator.locate( points, num_points, &tet[0] ); // tet[i] is the start, then the result
+//	}
+//
+// The verts and tets are not copied, so they must outlive the locator.
+//
+
+#ifndef MCL_TETLOCATOR_H
+#define MCL_TETLOCATOR_H 1
+
+#include "BVH.hpp"
+#include "HashKeys.hpp"
+
+namespace mcl {
+namespace bvh {
+
+template <typename T>
+class TetLocator {
+public:
+	int max_steps; // walk length before giving up and using the tree
+
+	TetLocator() : max_steps(64), verts(nullptr), inds(nullptr), num_tets(0) {}
+
+	// Builds the neighbor table and the tree. Throws if there are no tets.
+	void init( const T *verts, const int *inds, int num_tets, const Settings &settings = Settings() );
+
+	// New vertex positions with the same tets. The tree is refit, or rebuilt
+	// with the settings given to init if refit says it has degraded too much
+	// (see AABBTree::refit).
+	void refit( const T *verts );
+
+	// Tet containing the point, walking from start (or using the tree if start
+	// is -1). Returns -1 if the point is outside the mesh. If bary is not
+	// nullptr it is set to the barycentric coordinates in the tet.
+	int locate( const Vec3<T> &point, int start = -1, Vec4<T> *bary = nullptr ) const;
+
+	// locate for interleaved xyz points in parallel. tets[i] is the start for
+	// point i and is set to the tet that contains it. barys (4 per point) are
+	// set if not nullptr. Returns the number of points that used the tree.
+	int locate( const T *points, int num_points, int *tets, T *barys = nullptr ) const;
+
+	// Tet across the face opposite vert j of tet i is neighbors[i*4+j], or -1
+	const std::vector<int> &get_neighbors() const { return neighbors; }
+
+	const AABBTree<T,4> &get_tree() const { return tree; }
+
+private:
+	Vec3<T> vert( int idx ) const { return Vec3<T>( verts[idx*3], verts[idx*3+1], verts[idx*3+2] ); }
+
+	// Walks from start. Returns the tet, or -1 if the walk failed.
+	int walk( const Vec3<T> &point, int start, Vec4<T> &bary ) const;
+
+	AABBTree<T,4> tree;
+	const T *verts;
+	const int *inds;
+	int num_tets;
+	Settings settings;
+	std::vector<int> neighbors;
+
+}; // end class TetLocator
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T>
+void bvh::TetLocator<T>::init( const T *verts_, const int *inds_, int num_tets_, const Settings &settings_ ){
+
+	if( num_tets_ <= 0 ){
+		throw std::runtime_error("TetLocator::init Error: No tets");
+	}
+	verts = verts_;
+	inds = inds_;
+	num_tets = num_tets_;
+	settings = settings_;
+	tree.init( inds, verts, num_tets, settings );
+
+	// Pair up the two tets of each face
+	neighbors.assign( num_tets*4, -1 );
+	std::unordered_map< hashkey::sint3, int > faces;
+	faces.reserve( num_tets*2 );
+	for( int i=0; i<num_tets; ++i ){
+		const int *tet = &inds[i*4];
+		for( int j=0; j<4; ++j ){
+			hashkey::sint3 key( tet[(j+1)%4], tet[(j+2)%4], tet[(j+3)%4] );
+			auto it = faces.find( key );
+			if( it == faces.end() ){ faces.emplace( key, i*4+j ); continue; }
+			neighbors[ i*4+j ] = it->second/4;
+			neighbors[ it->second ] = i;
+			faces.erase( it );
+		}
+	}
+
+} // end init
+
+
+template <typename T>
+void bvh::TetLocator<T>::refit( const T *verts_ ){
+
+	verts = verts_;
+	if( tree.refit( verts ) ){ tree.init( inds, verts, num_tets, settings ); }
+
+} // end refit
+
+
+template <typename T>
+int bvh::TetLocator<T>::walk( const Vec3<T> &point, int start, Vec4<T> &bary ) const {
+
+	// Points on a shared face may be slightly outside both tets
+	const T eps = T(16)*std::numeric_limits<T>::epsilon();
+	int curr = start;
+	for( int step=0; step<max_steps && curr >= 0; ++step ){
+		const int *tet = &inds[curr*4];
+		bary = vec::barycoords( point, vert(tet[0]), vert(tet[1]), vert(tet[2]), vert(tet[3]) );
+		int j = 0;
+		const T min_bary = bary.minCoeff( &j );
+		if( min_bary >= -eps ){ return curr; }
+		if( !( min_bary < T(0) ) ){ return -1; } // NaN, degenerate tet
+		curr = neighbors[ curr*4+j ];
+	}
+	return -1;
+
+} // end walk
+
+
+template <typename T>
+int bvh::TetLocator<T>::locate( const Vec3<T> &point, int start, Vec4<T> *bary ) const {
+
+	Vec4<T> coords;
+	int tet = -1;
+	if( start >= 0 && start < num_tets ){ tet = walk( point, start, coords ); }
+	if( tet < 0 ){
+		PointInTet<T> visitor( point, verts, inds );
+		tree.traverse_static( visitor );
+		tet = visitor.hit_tet;
+		if( tet >= 0 ){
+			const int *t = &inds[tet*4];
+			coords = vec::barycoords( point, vert(t[0]), vert(t[1]), vert(t[2]), vert(t[3]) );
+		}
+	}
+	if( bary && tet >= 0 ){ *bary = coords; }
+	return tet;
+
+} // end locate
+
+
+template <typename T>
+int bvh::TetLocator<T>::locate( const T *points, int num_points, int *tets, T *barys ) const {
+
+	int n_tree = 0;
+	#pragma omp parallel for schedule(dynamic,64) reduction(+:n_tree)
+	for( int i=0; i<num_points; ++i ){
+		const Vec3<T> point( points[i*3], points[i*3+1], points[i*3+2] );
+		Vec4<T> bary( -1, -1, -1, -1 );
+		int tet = -1;
+		const int start = tets[i];
+		if( start >= 0 && start < num_tets ){ tet = walk( point, start, bary ); }
+		if( tet < 0 ){
+			n_tree++;
+			tet = locate( point, -1, &bary );
+		}
+		tets[i] = tet;
+		if( barys ){
+			for( int j=0; j<4; ++j ){ barys[i*4+j] = tet >= 0 ? bary[j] : T(-1); }
+		}
+	}
+	return n_tree;
+
+} // end batch locate
+
+} // end ns mcl
+
+#endif
@@ -25,6 +25,9 @@
 #include "Vec.hpp"
 #include "Projection.hpp"
 #include "Raycast.hpp"
+#include "CCD.hpp"
+#include "TetInverse.hpp"
+#include <algorithm>
 
 namespace mcl {
 namespace bvh {
@@ -57,6 +60,7 @@ public:
 	std::vector<int> skip_vert_idx;  // vert index to skip (for self collision)
 	const T *verts;
 	const int *inds;
+	const projection::TetInverse<T> *inverse; // if set, used instead of point_in_tet
 	PointInTet( Vec3<T> point_, const T *verts_, const int *inds_ );
 	bool hit_aabb( const AABB &aabb );
 	bool hit_prim( int prim );
@@ -82,23 +86,159 @@ public:
 	bool check_left_first( const AABB &left, const AABB &right );
 };
 
-/*
-// Raycast with multi-hit (counter)
+// Closest ray-triangle intersection. Boxes are visited nearest
+// entry first and t_max shrinks to the closest hit found so far.
 template <typename T>
-class RayMultiHit : public Visitor<T,3> {
+class RayClosestHit : public Visitor<T,3> {
 typedef Eigen::AlignedBox<T,3> AABB;
 public:
 	raycast::Ray<T> ray;
-	int skip_vert_idx; // vert index to skip (for self collision)
-	int hit_count; // number of intersections
+	raycast::Payload<T> payload; // t_max is the nearest hit so far
+	int hit_tri; // triangle idx
+	const T *verts;
+	const int *inds;
+	RayClosestHit( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ );
+	bool hit_aabb( const AABB &aabb );
+	bool hit_prim( int prim );
+	bool check_left_first( const AABB &left, const AABB &right );
+private:
+	raycast::SlabRay<T> slab_ray;
+};
+
+// Any ray-triangle intersection in (t_min,t_max), e.g. for shadow rays.
+// Traversal stops at the first hit.
+template <typename T>
+class RayAnyHit : public Visitor<T,3> {
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	raycast::Ray<T> ray;
+	raycast::Payload<T> payload; // set t_max to the distance to the light
+	int hit_tri; // triangle idx, -1 if unoccluded
+	const T *verts;
+	const int *inds;
+	RayAnyHit( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ );
+	bool hit_aabb( const AABB &aabb );
+	bool hit_prim( int prim );
+	bool check_left_first( const AABB &left, const AABB &right );
+private:
+	raycast::SlabRay<T> slab_ray;
+};
+
+// A ray-triangle intersection
+template <typename T>
+struct RayHit {
+	T t;
+	int prim;
+	RayHit( T t_=0, int prim_=-1 ) : t(t_), prim(prim_) {}
+	bool operator<( const RayHit &h ) const { return t < h.t || ( t == h.t && prim < h.prim ); }
+};
+
+// All ray-triangle intersections in (t_min,t_max). Call sort() after
+// traversal to order them by t. An odd number of hits along a ray from
+// a point means it's inside a closed mesh, as long as the ray doesn't
+// graze an edge (which can count as zero or two hits).
+template <typename T>
+class RayAllHits : public Visitor<T,3> {
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	raycast::Ray<T> ray;
+	raycast::Payload<T> payload; // only t_min and t_max are used
+	std::vector< RayHit<T> > hits;
+	std::vector<int> skip_vert_idx; // vert index to skip (for self collision)
+	const T *verts;
+	const int *inds;
+	RayAllHits( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ );
+	bool hit_aabb( const AABB &aabb );
+	bool hit_prim( int prim );
+	bool check_left_first( const AABB &left, const AABB &right );
+	void sort(){ std::sort( hits.begin(), hits.end() ); }
+private:
+	raycast::SlabRay<T> slab_ray;
+};
+
+// Earliest time of impact of a moving point with moving triangles.
+// Vertices move linearly from verts0 (t=0) to verts1 (t=1) and the tree
+// must have swept bounds, see AABBTree::init.
+template <typename T>
+class VertexTriangleTOI : public Visitor<T,3> {
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	Vec3<T> p0, p1; // query point at t=0 and t=1
+	T eps; // contact distance
+	T toi; // earliest time of impact, 1 if none
+	int hit_tri; // triangle idx
+	std::vector<int> skip_vert_idx; // vert index to skip (for self collision)
+	const T *verts0, *verts1;
+	const int *inds;
+	VertexTriangleTOI( Vec3<T> p0_, Vec3<T> p1_, const T *verts0_, const T *verts1_, const int *inds_, T eps_ );
+	bool hit_aabb( const AABB &aabb );
+	bool hit_prim( int prim );
+	bool check_left_first( const AABB &left, const AABB &right );
+};
+
+
+// Earliest time of impact of a moving edge with moving edges,
+// see VertexTriangleTOI.
+template <typename T>
+class EdgeEdgeTOI : public Visitor<T,2> {
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	Vec3<T> p0, q0, p1, q1; // query edge (p,q) at t=0 and t=1
+	T eps; // contact distance
+	T toi; // earliest time of impact, 1 if none
+	int hit_edge; // edge idx
+	std::vector<int> skip_vert_idx; // vert index to skip (for self collision)
+	const T *verts0, *verts1;
+	const int *inds;
+	EdgeEdgeTOI( Vec3<T> p0_, Vec3<T> q0_, Vec3<T> p1_, Vec3<T> q1_,
+		const T *verts0_, const T *verts1_, const int *inds_, T eps_ );
+	bool hit_aabb( const AABB &aabb );
+	bool hit_prim( int prim );
+	bool check_left_first( const AABB &left, const AABB &right );
+};
+
+// A primitive and its squared distance to a query point
+template <typename T>
+struct Neighbor {
+	int prim;
+	T dist2;
+	Neighbor( int prim_=-1, T dist2_=0 ) : prim(prim_), dist2(dist2_) {}
+	// Nearer first, ties by primitive index
+	bool operator<( const Neighbor &n ) const { return dist2 < n.dist2 || ( dist2 == n.dist2 && prim < n.prim ); }
+};
+
+// The k nearest verts (PDIM=1), edges (2), or triangles (3) to a point,
+// optionally only those within max_dist. The nearest found so far are
+// kept in a max-heap, so once there are k of them any box farther than
+// the k-th is skipped. Call sort() after traversal to order them nearest first.
+template <typename T, short PDIM>
+class KNearest : public Visitor<T,PDIM> {
+static_assert( PDIM >= 1 && PDIM <= 3, "KNearest primitives must be verts, edges, or triangles" );
+typedef Eigen::AlignedBox<T,3> AABB;
+public:
+	Vec3<T> point; // query point
+	int k; // max number of neighbors
+	std::vector< Neighbor<T> > neighbors; // max-heap on distance until sorted
+	std::vector<int> skip_vert_idx; // vert index to skip (for self collision)
 	const T *verts;
 	const int *inds;
-	RayMultiHit( Vec3<T> point_, const T *verts_, const int *inds_ );
+	KNearest( Vec3<T> point_, int k_, const T *verts_, const int *inds_,
+		T max_dist = std::numeric_limits<T>::max() );
 	bool hit_aabb( const AABB &aabb );
 	bool hit_prim( int prim );
 	bool check_left_first( const AABB &left, const AABB &right );
+	void sort(){ std::sort_heap( neighbors.begin(), neighbors.end() ); }
+protected:
+	T bound; // squared distance a primitive must be within to be added
+};
+
+// All verts, edges, or triangles within radius of a point, see KNearest
+template <typename T, short PDIM>
+class RadiusSearch : public KNearest<T,PDIM> {
+public:
+	RadiusSearch( Vec3<T> point_, T radius, const T *verts_, const int *inds_ ) :
+		KNearest<T,PDIM>( point_, std::numeric_limits<int>::max(), verts_, inds_, radius ) {}
 };
-*/
 
 //
 //	Implementation
@@ -110,7 +250,7 @@ public:
 
 template <typename T> 
 PointInTet<T>::PointInTet( Vec3<T> point_, const T *verts_, const int *inds_ ) :
-	point(point_), verts(verts_), inds(inds_), hit_tet(-1) {}
+	point(point_), verts(verts_), inds(inds_), inverse(nullptr), hit_tet(-1) {}
 
 template <typename T> 
 bool PointInTet<T>::hit_aabb( const AABB &aabb ){
@@ -127,6 +267,11 @@ bool PointInTet<T>::hit_prim( int prim ){
 			if( skip_vert_idx[i]==tet[j] ){ return false; }
 		}
 	}
+	if( inverse ){
+		if( !inverse->contains( prim, point ) ){ return false; }
+		hit_tet = prim;
+		return true;
+	}
 	Vec3<T> v0( verts[tet[0]*3+0], verts[tet[0]*3+1], verts[tet[0]*3+2] );
 	Vec3<T> v1( verts[tet[1]*3+0], verts[tet[1]*3+1], verts[tet[1]*3+2] );
 	Vec3<T> v2( verts[tet[2]*3+0], verts[tet[2]*3+1], verts[tet[2]*3+2] );
@@ -188,41 +333,259 @@ bool NearestTriangle<T>::check_left_first( const AABB &left, const AABB &right )
 }
 
 //
-// RayMultiHit
+// RayClosestHit
 //
-/*
-template <typename T> 
-RayMultiHit<T>::RayMultiHit( Vec3<T> point_, const T *verts_, const int *inds_ ) :
-	ray(point_, Vec3<T>(0,1,0)), verts(verts_), inds(inds_), skip_vert_idx(-1), hit_count(0) {}
 
-template <typename T> 
-bool RayMultiHit<T>::hit_aabb( const AABB &aabb ){
-	return raycast::ray_aabb( &ray, aabb.min(), aabb.max() );
+template <typename T>
+RayClosestHit<T>::RayClosestHit( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ ) :
+	ray(ray_), hit_tri(-1), verts(verts_), inds(inds_), slab_ray(ray_) {
+	payload.t_min = ray.eps;
 }
 
-template <typename T> 
-bool RayMultiHit<T>::hit_prim( int prim ){
+template <typename T>
+bool RayClosestHit<T>::hit_aabb( const AABB &aabb ){
+	return slab_ray.entry( aabb.min(), aabb.max(), payload.t_min, payload.t_max ) < std::numeric_limits<T>::max();
+}
 
+template <typename T>
+bool RayClosestHit<T>::hit_prim( int prim ){
 	Vec3i tri( inds[prim*3+0], inds[prim*3+1], inds[prim*3+2] );
-	for( int i=0; i<3; ++i ){ if( tri[i]==skip_vert_idx ){ return false; } }
 	Vec3<T> v0( verts[tri[0]*3+0], verts[tri[0]*3+1], verts[tri[0]*3+2] );
 	Vec3<T> v1( verts[tri[1]*3+0], verts[tri[1]*3+1], verts[tri[1]*3+2] );
 	Vec3<T> v2( verts[tri[2]*3+0], verts[tri[2]*3+1], verts[tri[2]*3+2] );
+	if( raycast::ray_triangle( &ray, v0, v1, v2, &payload ) ){ hit_tri = prim; }
+	return false; // keep looking for a closer hit
+}
 
-	// We'll use a fresh payload each time so we don't only find
-	// nearest intersections. This lets us count how many times we
-	// hit a surface, and sort them from nearest to furthest.
-	raycast::Payload<T> tmpPayload;
-	bool hit = raycast::ray_triangle( &ray, v0, v1, v2, &tmpPayload );
-	if( hit ){ hit_count++; }
-	return false; // return false to keep checking other tris
+template <typename T>
+bool RayClosestHit<T>::check_left_first( const AABB &left, const AABB &right ){
+	return slab_ray.entry( left.min(), left.max(), payload.t_min, payload.t_max ) <=
+		slab_ray.entry( right.min(), right.max(), payload.t_min, payload.t_max );
 }
 
-template <typename T> 
-bool RayMultiHit<T>::check_left_first( const AABB &left, const AABB &right ){
-	return raycast::ray_aabb( &ray, left.min(), left.max() );
+//
+// RayAnyHit
+//
+
+template <typename T>
+RayAnyHit<T>::RayAnyHit( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ ) :
+	ray(ray_), hit_tri(-1), verts(verts_), inds(inds_), slab_ray(ray_) {
+	payload.t_min = ray.eps;
+}
+
+template <typename T>
+bool RayAnyHit<T>::hit_aabb( const AABB &aabb ){
+	return slab_ray.entry( aabb.min(), aabb.max(), payload.t_min, payload.t_max ) < std::numeric_limits<T>::max();
+}
+
+template <typename T>
+bool RayAnyHit<T>::hit_prim( int prim ){
+	Vec3i tri( inds[prim*3+0], inds[prim*3+1], inds[prim*3+2] );
+	Vec3<T> v0( verts[tri[0]*3+0], verts[tri[0]*3+1], verts[tri[0]*3+2] );
+	Vec3<T> v1( verts[tri[1]*3+0], verts[tri[1]*3+1], verts[tri[1]*3+2] );
+	Vec3<T> v2( verts[tri[2]*3+0], verts[tri[2]*3+1], verts[tri[2]*3+2] );
+	if( raycast::ray_triangle( &ray, v0, v1, v2, &payload ) ){
+		hit_tri = prim;
+		return true; // any hit will do
+	}
+	return false;
+}
+
+template <typename T>
+bool RayAnyHit<T>::check_left_first( const AABB &left, const AABB &right ){
+	// The nearer box is more likely to block the ray before t_max
+	return slab_ray.entry( left.min(), left.max(), payload.t_min, payload.t_max ) <=
+		slab_ray.entry( right.min(), right.max(), payload.t_min, payload.t_max );
+}
+
+//
+// RayAllHits
+//
+
+template <typename T>
+RayAllHits<T>::RayAllHits( const raycast::Ray<T> &ray_, const T *verts_, const int *inds_ ) :
+	ray(ray_), verts(verts_), inds(inds_), slab_ray(ray_) {
+	payload.t_min = ray.eps;
+}
+
+template <typename T>
+bool RayAllHits<T>::hit_aabb( const AABB &aabb ){
+	return slab_ray.entry( aabb.min(), aabb.max(), payload.t_min, payload.t_max ) < std::numeric_limits<T>::max();
+}
+
+template <typename T>
+bool RayAllHits<T>::hit_prim( int prim ){
+	Vec3i tri( inds[prim*3+0], inds[prim*3+1], inds[prim*3+2] );
+	int n_skip = skip_vert_idx.size();
+	for( int i=0; i<n_skip; ++i ){
+		for( int j=0; j<3; ++j ){
+			if( skip_vert_idx[i]==tri[j] ){ return false; }
+		}
+	}
+	Vec3<T> v0( verts[tri[0]*3+0], verts[tri[0]*3+1], verts[tri[0]*3+2] );
+	Vec3<T> v1( verts[tri[1]*3+0], verts[tri[1]*3+1], verts[tri[1]*3+2] );
+	Vec3<T> v2( verts[tri[2]*3+0], verts[tri[2]*3+1], verts[tri[2]*3+2] );
+
+	// A fresh payload for each triangle so farther hits aren't culled
+	raycast::Payload<T> tri_payload;
+	tri_payload.t_min = payload.t_min;
+	tri_payload.t_max = payload.t_max;
+	if( raycast::ray_triangle( &ray, v0, v1, v2, &tri_payload ) ){
+		hits.emplace_back( tri_payload.t_max, prim );
+	}
+	return false; // keep looking for more hits
+}
+
+template <typename T>
+bool RayAllHits<T>::check_left_first( const AABB &left, const AABB &right ){
+	return slab_ray.entry( left.min(), left.max(), payload.t_min, payload.t_max ) <=
+		slab_ray.entry( right.min(), right.max(), payload.t_min, payload.t_max );
+}
+
+//
+// KNearest
+//
+
+template <typename T, short PDIM>
+KNearest<T,PDIM>::KNearest( Vec3<T> point_, int k_, const T *verts_, const int *inds_, T max_dist ) :
+	point(point_), k(k_), verts(verts_), inds(inds_),
+	bound( max_dist < std::sqrt( std::numeric_limits<T>::max() ) ? max_dist*max_dist : std::numeric_limits<T>::max() ) {
+	neighbors.reserve( std::max( 0, std::min( k, 64 ) ) );
+}
+
+template <typename T, short PDIM>
+bool KNearest<T,PDIM>::hit_aabb( const AABB &aabb ){
+	return k > 0 && aabb.squaredExteriorDistance(point) <= bound;
+}
+
+template <typename T, short PDIM>
+bool KNearest<T,PDIM>::hit_prim( int prim ){
+	const int *prim_inds = &inds[prim*PDIM];
+	int n_skip = skip_vert_idx.size();
+	for( int i=0; i<n_skip; ++i ){
+		for( int j=0; j<PDIM; ++j ){
+			if( skip_vert_idx[i]==prim_inds[j] ){ return false; }
+		}
+	}
+	Vec3<T> v[3];
+	for( int j=0; j<PDIM; ++j ){
+		v[j] = Vec3<T>( verts[prim_inds[j]*3+0], verts[prim_inds[j]*3+1], verts[prim_inds[j]*3+2] );
+	}
+	Vec3<T> p = v[0];
+	if( PDIM == 2 ){ p = projection::point_on_segment( point, v[0], v[1] ); }
+	else if( PDIM == 3 ){ p = projection::point_on_triangle( point, v[0], v[1], v[2] ); }
+
+	Neighbor<T> n( prim, (p-point).squaredNorm() );
+	if( n.dist2 > bound ){ return false; }
+	if( (int)neighbors.size() == k ){
+		if( !( n < neighbors.front() ) ){ return false; }
+		std::pop_heap( neighbors.begin(), neighbors.end() );
+		neighbors.back() = n;
+	}
+	else { neighbors.emplace_back( n ); }
+	std::push_heap( neighbors.begin(), neighbors.end() );
+	if( (int)neighbors.size() == k ){ bound = std::min( bound, neighbors.front().dist2 ); }
+	return false; // keep looking for nearer prims
+}
+
+template <typename T, short PDIM>
+bool KNearest<T,PDIM>::check_left_first( const AABB &left, const AABB &right ){
+	T left_ed = left.squaredExteriorDistance( point );
+	return left_ed <= right.squaredExteriorDistance( point );
+}
+
+//
+// VertexTriangleTOI
+//
+
+template <typename T>
+VertexTriangleTOI<T>::VertexTriangleTOI( Vec3<T> p0_, Vec3<T> p1_, const T *verts0_, const T *verts1_,
+	const int *inds_, T eps_ ) : p0(p0_), p1(p1_), eps(eps_), toi(1), hit_tri(-1),
+	verts0(verts0_), verts1(verts1_), inds(inds_) {}
+
+template <typename T>
+bool VertexTriangleTOI<T>::hit_aabb( const AABB &aabb ){
+	// Only the motion before the current earliest hit matters
+	AABB swept( p0 );
+	swept.extend( Vec3<T>( p0 + toi*(p1-p0) ) );
+	return ( aabb.min().array() <= swept.max().array() + eps ).all() &&
+		( swept.min().array() <= aabb.max().array() + eps ).all();
+}
+
+template <typename T>
+bool VertexTriangleTOI<T>::hit_prim( int prim ){
+	Vec3i tri( inds[prim*3+0], inds[prim*3+1], inds[prim*3+2] );
+	int n_skip = skip_vert_idx.size();
+	for( int i=0; i<n_skip; ++i ){
+		for( int j=0; j<3; ++j ){
+			if( skip_vert_idx[i]==tri[j] ){ return false; }
+		}
+	}
+	Vec3<T> a0( verts0[tri[0]*3+0], verts0[tri[0]*3+1], verts0[tri[0]*3+2] );
+	Vec3<T> b0( verts0[tri[1]*3+0], verts0[tri[1]*3+1], verts0[tri[1]*3+2] );
+	Vec3<T> c0( verts0[tri[2]*3+0], verts0[tri[2]*3+1], verts0[tri[2]*3+2] );
+	Vec3<T> a1( verts1[tri[0]*3+0], verts1[tri[0]*3+1], verts1[tri[0]*3+2] );
+	Vec3<T> b1( verts1[tri[1]*3+0], verts1[tri[1]*3+1], verts1[tri[1]*3+2] );
+	Vec3<T> c1( verts1[tri[2]*3+0], verts1[tri[2]*3+1], verts1[tri[2]*3+2] );
+	T t = 1;
+	if( ccd::vertex_triangle( p0, a0, b0, c0, p1, a1, b1, c1, eps, t ) && ( t < toi || hit_tri < 0 ) ){
+		toi = t;
+		hit_tri = prim;
+	}
+	return false; // keep looking for an earlier hit
+}
+
+template <typename T>
+bool VertexTriangleTOI<T>::check_left_first( const AABB &left, const AABB &right ){
+	return left.squaredExteriorDistance( p0 ) <= right.squaredExteriorDistance( p0 );
+}
+
+//
+// EdgeEdgeTOI
+//
+
+template <typename T>
+EdgeEdgeTOI<T>::EdgeEdgeTOI( Vec3<T> p0_, Vec3<T> q0_, Vec3<T> p1_, Vec3<T> q1_,
+	const T *verts0_, const T *verts1_, const int *inds_, T eps_ ) :
+	p0(p0_), q0(q0_), p1(p1_), q1(q1_), eps(eps_), toi(1), hit_edge(-1),
+	verts0(verts0_), verts1(verts1_), inds(inds_) {}
+
+template <typename T>
+bool EdgeEdgeTOI<T>::hit_aabb( const AABB &aabb ){
+	AABB swept( p0 );
+	swept.extend( q0 );
+	// Only the motion before the current earliest hit matters
+	swept.extend( Vec3<T>( p0 + toi*(p1-p0) ) );
+	swept.extend( Vec3<T>( q0 + toi*(q1-q0) ) );
+	return ( aabb.min().array() <= swept.max().array() + eps ).all() &&
+		( swept.min().array() <= aabb.max().array() + eps ).all();
+}
+
+template <typename T>
+bool EdgeEdgeTOI<T>::hit_prim( int prim ){
+	Vec2i edge( inds[prim*2+0], inds[prim*2+1] );
+	int n_skip = skip_vert_idx.size();
+	for( int i=0; i<n_skip; ++i ){
+		if( skip_vert_idx[i]==edge[0] || skip_vert_idx[i]==edge[1] ){ return false; }
+	}
+	Vec3<T> a0( verts0[edge[0]*3+0], verts0[edge[0]*3+1], verts0[edge[0]*3+2] );
+	Vec3<T> b0( verts0[edge[1]*3+0], verts0[edge[1]*3+1], verts0[edge[1]*3+2] );
+	Vec3<T> a1( verts1[edge[0]*3+0], verts1[edge[0]*3+1], verts1[edge[0]*3+2] );
+	Vec3<T> b1( verts1[edge[1]*3+0], verts1[edge[1]*3+1], verts1[edge[1]*3+2] );
+	T t = 1;
+	if( ccd::edge_edge( p0, q0, a0, b0, p1, q1, a1, b1, eps, t ) && ( t < toi || hit_edge < 0 ) ){
+		toi = t;
+		hit_edge = prim;
+	}
+	return false; // keep looking for an earlier hit
+}
+
+template <typename T>
+bool EdgeEdgeTOI<T>::check_left_first( const AABB &left, const AABB &right ){
+	Vec3<T> mid = T(0.5)*(p0+q0);
+	return left.squaredExteriorDistance( mid ) <= right.squaredExteriorDistance( mid );
 }
-*/
+
 //
 // End
 //
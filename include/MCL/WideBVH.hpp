@@ -0,0 +1,419 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// A 4 or 8-wide BVH made by collapsing an AABBTree. The bounds of a node's
+// children are stored as arrays (min_x[W], ..., max_z[W]) so all children
+// are tested at once. For float trees the tests use SSE (W=4) or AVX (W=8)
+// when the compiler targets them (e.g. -march=native, see MCL_BUILD_NATIVE
+// in CMakeLists.txt). Everything else, or MCL_NO_SIMD, uses a scalar loop.
+//
+// Instead of the Visitor interface the wide tree has two fixed queries:
+//
+//	traverse_nearest: Visits primitives nearest to visitor.point first and
+//	skips children farther than visitor.curr_nearest (a squared distance).
+//	Works with NearestTriangle.
+//
+//	traverse_ray: Visits primitives along visitor.ray in order and skips
+//	children outside [visitor.payload.t_min, visitor.payload.t_max].
+//	Works with RayClosestHit, RayAnyHit, and RayAllHits.
+//
+// In both, visitor.hit_prim(prim) is called for primitives in the leaves
+// and returns true to stop.
+//
+
+#ifndef MCL_WIDEBVH_H
+#define MCL_WIDEBVH_H 1
+
+#include "BVH.hpp"
+#include "RayPacket.hpp"
+
+#if !defined(MCL_NO_SIMD) && ( defined(__SSE__) || defined(__AVX__) )
+#include <immintrin.h>
+#endif
+
+namespace mcl {
+namespace bvh {
+
+// Node with W children. Children [0,num_children) are used.
+template <typename T, int W>
+struct WideNode {
+	T min_x[W], min_y[W], min_z[W];
+	T max_x[W], max_y[W], max_z[W];
+	int child[W]; // index of the child node if interior, index into prims if leaf
+	int num_prims[W]; // zero for interior children
+	int num_children;
+	WideNode();
+};
+
+// Tests all children of a node at once.
+// The generic version is the scalar fallback.
+template <typename T, int W>
+struct WideKernels {
+	static const char *name(){ return "scalar"; }
+
+	// Squared distance from p to each child box. Returns a bit mask
+	// of the children nearer than bound.
+	static int point_dist2( const WideNode<T,W> &node, const T *p, T bound, T *dist );
+
+	// Entry distance of the ray into each child box, with inv_dir = 1/direction.
+	// Returns a bit mask of the children the ray hits within [t_min,t_max].
+	static int ray_slab( const WideNode<T,W> &node, const T *origin, const T *inv_dir,
+		T t_min, T t_max, T *dist );
+};
+
+template <typename T, short PDIM, int W=4>
+class WideBVH {
+static_assert( W==4 || W==8, "WideBVH width must be 4 or 8" );
+public:
+	typedef WideNode<T,W> Node;
+	typedef WideKernels<T,W> Kernels;
+
+	WideBVH() : max_depth(0) {}
+
+	// Builds an AABBTree with the given settings and collapses it
+	void init( const int *inds, const T *verts, int num_prims,
+		const Settings &settings = Settings() );
+
+	// Collapses an existing binary tree. Each wide node takes the children
+	// of the binary node, then repeatedly replaces the interior child with
+	// the largest surface area by its two children until W are used.
+	void init( const AABBTree<T,PDIM> &tree );
+
+	// Nearest point queries, see above
+	template <typename V> bool traverse_nearest( V &visitor ) const;
+
+	// Ray queries, see above
+	template <typename V> bool traverse_ray( V &visitor ) const;
+
+	// Nodes in depth-first order, root at index 0
+	const std::vector<Node> &get_nodes() const { return nodes; }
+
+	// Primitive indices in leaf order, same as the binary tree
+	const std::vector<int> &get_prims() const { return prims; }
+
+private:
+	// A child waiting to be visited, and its distance to the query
+	struct StackEntry {
+		int child;
+		int num_prims;
+		T dist;
+	};
+	enum { STACK_SIZE = 256 };
+
+	// Creates the wide node for the binary node bin_idx and returns its index
+	int collapse( const AABBTree<T,PDIM> &tree, int bin_idx, int depth );
+
+	// Pushes the children in mask so the nearest is on top
+	static int push_sorted( const Node &node, int mask, const T *dist, StackEntry *stack, int n_stack );
+
+	// A node pushes at most W children and pops itself
+	int stack_size() const { return max_depth*(W-1) + W + 1; }
+
+	std::vector<Node> nodes;
+	std::vector<int> prims;
+	int max_depth;
+
+}; // end class WideBVH
+
+} // end ns bvh
+
+//
+//	Implementation
+//
+
+template <typename T, int W>
+bvh::WideNode<T,W>::WideNode() : num_children(0) {
+	for( int i=0; i<W; ++i ){
+		min_x[i] = min_y[i] = min_z[i] = std::numeric_limits<T>::max();
+		max_x[i] = max_y[i] = max_z[i] = -std::numeric_limits<T>::max();
+		child[i] = -1;
+		num_prims[i] = 0;
+	}
+}
+
+
+template <typename T, int W>
+int bvh::WideKernels<T,W>::point_dist2( const WideNode<T,W> &node, const T *p, T bound, T *dist ){
+	int mask = 0;
+	for( int i=0; i<W; ++i ){
+		T dx = std::max( std::max( node.min_x[i]-p[0], p[0]-node.max_x[i] ), T(0) );
+		T dy = std::max( std::max( node.min_y[i]-p[1], p[1]-node.max_y[i] ), T(0) );
+		T dz = std::max( std::max( node.min_z[i]-p[2], p[2]-node.max_z[i] ), T(0) );
+		dist[i] = dx*dx + dy*dy + dz*dz;
+		mask |= int( dist[i] < bound ) << i;
+	}
+	return mask;
+}
+
+
+template <typename T, int W>
+int bvh::WideKernels<T,W>::ray_slab( const WideNode<T,W> &node, const T *origin, const T *inv_dir,
+	T t_min, T t_max, T *dist ){
+	return raycast::PacketKernels<T,W>::ray_boxes( origin, inv_dir, node.min_x, node.min_y, node.min_z,
+		node.max_x, node.max_y, node.max_z, t_min, t_max, dist );
+}
+
+#if !defined(MCL_NO_SIMD) && defined(__SSE__)
+
+namespace bvh {
+
+template <>
+struct WideKernels<float,4> {
+	static const char *name(){ return "sse"; }
+
+	static int point_dist2( const WideNode<float,4> &node, const float *p, float bound, float *dist ){
+		const __m128 zero = _mm_setzero_ps();
+		__m128 px = _mm_set1_ps( p[0] ), py = _mm_set1_ps( p[1] ), pz = _mm_set1_ps( p[2] );
+		__m128 dx = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps(node.min_x), px ), _mm_sub_ps( px, _mm_loadu_ps(node.max_x) ) ), zero );
+		__m128 dy = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps(node.min_y), py ), _mm_sub_ps( py, _mm_loadu_ps(node.max_y) ) ), zero );
+		__m128 dz = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps(node.min_z), pz ), _mm_sub_ps( pz, _mm_loadu_ps(node.max_z) ) ), zero );
+		__m128 d = _mm_add_ps( _mm_add_ps( _mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy) ), _mm_mul_ps(dz,dz) );
+		_mm_storeu_ps( dist, d );
+		return _mm_movemask_ps( _mm_cmplt_ps( d, _mm_set1_ps(bound) ) );
+	}
+
+	static int ray_slab( const WideNode<float,4> &node, const float *origin, const float *inv_dir,
+		float t_min, float t_max, float *dist ){
+		return raycast::PacketKernels<float,4>::ray_boxes( origin, inv_dir, node.min_x, node.min_y, node.min_z,
+			node.max_x, node.max_y, node.max_z, t_min, t_max, dist );
+	}
+};
+
+} // end ns bvh
+
+#endif
+
+#if !defined(MCL_NO_SIMD) && defined(__AVX__)
+
+namespace bvh {
+
+template <>
+struct WideKernels<float,8> {
+	static const char *name(){ return "avx"; }
+
+	static int point_dist2( const WideNode<float,8> &node, const float *p, float bound, float *dist ){
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 px = _mm256_set1_ps( p[0] ), py = _mm256_set1_ps( p[1] ), pz = _mm256_set1_ps( p[2] );
+		__m256 dx = _mm256_max_ps( _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps(node.min_x), px ), _mm256_sub_ps( px, _mm256_loadu_ps(node.max_x) ) ), zero );
+		__m256 dy = _mm256_max_ps( _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps(node.min_y), py ), _mm256_sub_ps( py, _mm256_loadu_ps(node.max_y) ) ), zero );
+		__m256 dz = _mm256_max_ps( _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps(node.min_z), pz ), _mm256_sub_ps( pz, _mm256_loadu_ps(node.max_z) ) ), zero );
+		__m256 d = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps(dx,dx), _mm256_mul_ps(dy,dy) ), _mm256_mul_ps(dz,dz) );
+		_mm256_storeu_ps( dist, d );
+		return _mm256_movemask_ps( _mm256_cmp_ps( d, _mm256_set1_ps(bound), _CMP_LT_OQ ) );
+	}
+
+	static int ray_slab( const WideNode<float,8> &node, const float *origin, const float *inv_dir,
+		float t_min, float t_max, float *dist ){
+		return raycast::PacketKernels<float,8>::ray_boxes( origin, inv_dir, node.min_x, node.min_y, node.min_z,
+			node.max_x, node.max_y, node.max_z, t_min, t_max, dist );
+	}
+};
+
+} // end ns bvh
+
+#endif
+
+
+template <typename T, short PDIM, int W>
+void bvh::WideBVH<T,PDIM,W>::init( const int *inds, const T *verts, int num_prims, const Settings &settings ){
+	AABBTree<T,PDIM> tree;
+	tree.init( inds, verts, num_prims, settings );
+	init( tree );
+}
+
+
+template <typename T, short PDIM, int W>
+void bvh::WideBVH<T,PDIM,W>::init( const AABBTree<T,PDIM> &tree ){
+	nodes.clear();
+	prims.assign( tree.get_prims().begin(), tree.get_prims().end() );
+	max_depth = 0;
+	if( tree.get_nodes().size() == 0 ){ return; }
+	nodes.reserve( tree.get_nodes().size()/(W-1) + 1 );
+	collapse( tree, 0, 0 );
+}
+
+
+template <typename T, short PDIM, int W>
+int bvh::WideBVH<T,PDIM,W>::collapse( const AABBTree<T,PDIM> &tree, int bin_idx, int depth ){
+
+	typedef typename AABBTree<T,PDIM>::Node BinNode;
+	const ArrayView<BinNode> bin_nodes = tree.get_nodes();
+	max_depth = std::max( max_depth, depth );
+
+	// Open up the interior children with the largest area
+	int slots[W];
+	int n_slots = 0;
+	const BinNode &bin_node = bin_nodes[bin_idx];
+	if( bin_node.is_leaf() ){ slots[n_slots++] = bin_idx; }
+	else {
+		slots[n_slots++] = bin_idx+1;
+		slots[n_slots++] = bin_node.offset;
+	}
+	while( n_slots < W ){
+		int best = -1;
+		T best_area = T(-1);
+		for( int i=0; i<n_slots; ++i ){
+			const BinNode &c = bin_nodes[ slots[i] ];
+			if( c.is_leaf() ){ continue; }
+			T area = AABBTree<T,PDIM>::surface_area( c.aabb );
+			if( area > best_area ){ best_area = area; best = i; }
+		}
+		if( best < 0 ){ break; }
+		int s = slots[best];
+		slots[best] = s+1;
+		slots[n_slots++] = bin_nodes[s].offset;
+	}
+
+	// Children are created after this node, so fill it in afterwards
+	int node_idx = nodes.size();
+	nodes.emplace_back( Node() );
+	Node node;
+	node.num_children = n_slots;
+	for( int i=0; i<n_slots; ++i ){
+		const BinNode &c = bin_nodes[ slots[i] ];
+		node.min_x[i] = c.aabb.min()[0]; node.max_x[i] = c.aabb.max()[0];
+		node.min_y[i] = c.aabb.min()[1]; node.max_y[i] = c.aabb.max()[1];
+		node.min_z[i] = c.aabb.min()[2]; node.max_z[i] = c.aabb.max()[2];
+		if( c.is_leaf() ){
+			node.child[i] = c.offset;
+			node.num_prims[i] = c.num_prims;
+		} else {
+			node.child[i] = collapse( tree, slots[i], depth+1 );
+		}
+	}
+	nodes[node_idx] = node;
+	return node_idx;
+
+} // end collapse
+
+
+template <typename T, short PDIM, int W>
+int bvh::WideBVH<T,PDIM,W>::push_sorted( const Node &node, int mask, const T *dist, StackEntry *stack, int n_stack ){
+
+	// Insertion sort, farthest first
+	int order[W];
+	int n = 0;
+	for( int i=0; i<W; ++i ){
+		if( !( (mask >> i) & 1 ) ){ continue; }
+		int j = n++;
+		for( ; j>0 && dist[ order[j-1] ] < dist[i]; --j ){ order[j] = order[j-1]; }
+		order[j] = i;
+	}
+	for( int j=0; j<n; ++j ){
+		int i = order[j];
+		StackEntry &e = stack[ n_stack++ ];
+		e.child = node.child[i];
+		e.num_prims = node.num_prims[i];
+		e.dist = dist[i];
+	}
+	return n_stack;
+}
+
+
+template <typename T, short PDIM, int W>
+template <typename V>
+bool bvh::WideBVH<T,PDIM,W>::traverse_nearest( V &visitor ) const {
+
+	if( nodes.size() == 0 ){ return false; }
+
+	StackEntry local_stack[ STACK_SIZE ];
+	std::vector<StackEntry> heap_stack;
+	StackEntry *stack = local_stack;
+	if( stack_size() > STACK_SIZE ){
+		heap_stack.resize( stack_size() );
+		stack = &heap_stack[0];
+	}
+
+	const T p[3] = { visitor.point[0], visitor.point[1], visitor.point[2] };
+	T dist[W];
+	int n_stack = 1;
+	stack[0].child = 0;
+	stack[0].num_prims = 0;
+	stack[0].dist = T(0);
+
+	while( n_stack > 0 ){
+		const StackEntry e = stack[ --n_stack ];
+		if( !( e.dist < visitor.curr_nearest ) ){ continue; }
+
+		if( e.num_prims > 0 ){
+			for( int i=0; i<e.num_prims; ++i ){
+				if( visitor.V::hit_prim( prims[ e.child+i ] ) ){ return true; }
+			}
+			continue;
+		}
+
+		const Node &node = nodes[ e.child ];
+		int mask = Kernels::point_dist2( node, p, visitor.curr_nearest, dist ) & ( (1 << node.num_children)-1 );
+		n_stack = push_sorted( node, mask, dist, stack, n_stack );
+	}
+
+	return false;
+
+} // end traverse nearest
+
+
+template <typename T, short PDIM, int W>
+template <typename V>
+bool bvh::WideBVH<T,PDIM,W>::traverse_ray( V &visitor ) const {
+
+	if( nodes.size() == 0 ){ return false; }
+
+	StackEntry local_stack[ STACK_SIZE ];
+	std::vector<StackEntry> heap_stack;
+	StackEntry *stack = local_stack;
+	if( stack_size() > STACK_SIZE ){
+		heap_stack.resize( stack_size() );
+		stack = &heap_stack[0];
+	}
+
+	const T origin[3] = { visitor.ray.origin[0], visitor.ray.origin[1], visitor.ray.origin[2] };
+	const T inv_dir[3] = { T(1)/visitor.ray.direction[0], T(1)/visitor.ray.direction[1], T(1)/visitor.ray.direction[2] };
+	T dist[W];
+	int n_stack = 1;
+	stack[0].child = 0;
+	stack[0].num_prims = 0;
+	stack[0].dist = visitor.payload.t_min;
+
+	while( n_stack > 0 ){
+		const StackEntry e = stack[ --n_stack ];
+		if( e.dist > visitor.payload.t_max ){ continue; }
+
+		if( e.num_prims > 0 ){
+			for( int i=0; i<e.num_prims; ++i ){
+				if( visitor.V::hit_prim( prims[ e.child+i ] ) ){ return true; }
+			}
+			continue;
+		}
+
+		const Node &node = nodes[ e.child ];
+		int mask = Kernels::ray_slab( node, origin, inv_dir, visitor.payload.t_min,
+			visitor.payload.t_max, dist ) & ( (1 << node.num_children)-1 );
+		n_stack = push_sorted( node, mask, dist, stack, n_stack );
+	}
+
+	return false;
+
+} // end traverse ray
+
+} // end ns mcl
+
+#endif
@@ -18,6 +18,7 @@ layout(location=0) out vec4 out_fragcolor;
 
 in vec3 vposition;
 in vec3 vnormal;
+in vec3 vcolor; // scales amb and diff
 in mat4 mv_mat;
 
 uniform Light lights[8];
@@ -29,14 +30,14 @@ uniform int num_lights;
 //	Calculate light contribution from a point light
 //
 vec3 point_light( int lightIdx, vec3 normal ){
-	vec3 result = material.amb * lights[lightIdx].color; // start with ambient
+	vec3 result = vcolor * material.amb * lights[lightIdx].color; // start with ambient
 	vec4 lp = mv_mat * vec4(lights[lightIdx].position,1);
 	vec3 l = normalize(vec3(lp) - vposition);
 	float ndotl = dot(normal, l);
 	if( ndotl > 0.0 ){
 
 		// Diffuse component:
-		vec3 diffuse = material.diff * lights[lightIdx].color;
+		vec3 diffuse = vcolor * material.diff * lights[lightIdx].color;
 		result += diffuse*ndotl;
 
 		// Specular component:
@@ -7,6 +7,7 @@ layout(location=2) in vec3 in_normal;
 
 out vec3 vposition;
 out vec3 vnormal;
+out vec3 vcolor;
 out mat4 mv_mat;
 
 uniform mat4 model;
@@ -20,6 +21,7 @@ void main() {
 	vposition = ( mv_mat * pos ).xyz;
 	vec4 mv_normal = invmv * vec4(in_normal,0.0);
 	vnormal = normalize( mv_normal.xyz );
+	vcolor = in_color;
 	gl_Position = projection * mv_mat * pos;
 }
 
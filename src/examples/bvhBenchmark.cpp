@@ -0,0 +1,1174 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+//
+// Times tree construction and queries on the meshes in src/data.
+// Usage: bvhBenchmark [num queries]
+//
+
+#include <iostream>
+#include <random>
+#include "MCL/MeshIO.hpp"
+#include "MCL/MicroTimer.hpp"
+#include "MCL/BatchQuery.hpp"
+#include "MCL/WideBVH.hpp"
+#include "MCL/Broadphase.hpp"
+#include "MCL/QuantizedBVH.hpp"
+#include "MCL/DynamicTree.hpp"
+#include "MCL/SignedDistance.hpp"
+#include "MCL/TetLocator.hpp"
+#include "MCL/RayPacket.hpp"
+#include "MCL/ProjectionPacket.hpp"
+#include "MCL/TetInverse.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace mcl;
+
+// Random points in a slightly enlarged box around the mesh
+static void make_points( const Eigen::AlignedBox<float,3> &aabb, int n, std::vector<Vec3f> &points ){
+	std::mt19937 gen(1234);
+	Vec3f pad = aabb.sizes()*0.1f;
+	std::uniform_real_distribution<float> dx( aabb.min()[0]-pad[0], aabb.max()[0]+pad[0] );
+	std::uniform_real_distribution<float> dy( aabb.min()[1]-pad[1], aabb.max()[1]+pad[1] );
+	std::uniform_real_distribution<float> dz( aabb.min()[2]-pad[2], aabb.max()[2]+pad[2] );
+	points.resize(n);
+	for( int i=0; i<n; ++i ){ points[i] = Vec3f( dx(gen), dy(gen), dz(gen) ); }
+}
+
+// Points inside random tets
+static void make_tet_points( const TetMesh *mesh, int n, std::vector<Vec3f> &points ){
+	std::mt19937 gen(1234);
+	std::uniform_int_distribution<int> dt( 0, mesh->tets.size()-1 );
+	std::uniform_real_distribution<float> db( 0.05f, 1.f );
+	points.resize(n);
+	for( int i=0; i<n; ++i ){
+		const Vec4i &tet = mesh->tets[ dt(gen) ];
+		Vec4f b( db(gen), db(gen), db(gen), db(gen) );
+		b /= b.sum();
+		points[i] = b[0]*mesh->vertices[tet[0]] + b[1]*mesh->vertices[tet[1]] +
+			b[2]*mesh->vertices[tet[2]] + b[3]*mesh->vertices[tet[3]];
+	}
+}
+
+// Counts the nodes visited per query
+template <typename V> class Counting : public V {
+public:
+	template <typename... Args> Counting( Args... args ) : V(args...), n_visited(0) {}
+	bool hit_aabb( const Eigen::AlignedBox<float,3> &aabb ){ n_visited++; return V::hit_aabb(aabb); }
+	long n_visited;
+};
+
+static std::string method_name( int method ){
+	switch( method ){
+		case bvh::Settings::MIDPOINT: return "midpoint";
+		case bvh::Settings::SAH: return "sah";
+		case bvh::Settings::LBVH: return "lbvh";
+	}
+	return "unknown";
+}
+
+static void bench_triangles( const std::string &name, TriangleMesh *mesh, int n_queries,
+	const bvh::Settings &settings ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	int n_tris = mesh->faces.size();
+
+	bvh::AABBTree<float,3> tree;
+	MicroTimer t;
+	tree.init( inds, verts, n_tris, settings );
+	double build_ms = t.elapsed_ms();
+
+	std::vector<Vec3f> points;
+	make_points( mesh->bounds(), n_queries, points );
+
+	int n_hit = 0;
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+		if( visitor.hit_tri >= 0 ){ n_hit++; }
+	}
+	double query_s = t.elapsed_s();
+
+	// Same queries through the virtual Visitor interface
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		tree.traverse( visitor );
+	}
+	double virtual_s = t.elapsed_s();
+
+	long n_visited = 0;
+	for( int i=0; i<n_queries; ++i ){
+		Counting< bvh::NearestTriangle<float> > visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+		n_visited += visitor.n_visited;
+	}
+
+	std::cout << name << " (" << n_tris << " tris, " << method_name(settings.method) <<
+		", leaf size " << settings.max_leaf_size << ")" <<
+		"\n\tbuild: " << build_ms << " ms, " << tree.get_nodes().size() << " nodes (" <<
+		tree.get_nodes().size()*sizeof(tree.get_nodes()[0])/1024 << " KB)" <<
+		"\n\tNearestTriangle: " << double(n_queries)/query_s << " queries/s" <<
+		", " << double(n_visited)/double(n_queries) << " nodes/query" <<
+		" (" << n_hit << " hits)" <<
+		"\n\tNearestTriangle (virtual): " << double(n_queries)/virtual_s << " queries/s" << std::endl;
+}
+
+static void bench_tets( const std::string &name, TetMesh *mesh, int n_queries,
+	const bvh::Settings &settings ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+
+	bvh::AABBTree<float,4> tree;
+	MicroTimer t;
+	tree.init( inds, verts, n_tets, settings );
+	double build_ms = t.elapsed_ms();
+
+	std::vector<Vec3f> points;
+	make_tet_points( mesh, n_queries, points );
+
+	int n_hit = 0;
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::PointInTet<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+		if( visitor.hit_tet >= 0 ){ n_hit++; }
+	}
+	double query_s = t.elapsed_s();
+
+	long n_visited = 0;
+	for( int i=0; i<n_queries; ++i ){
+		Counting< bvh::PointInTet<float> > visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+		n_visited += visitor.n_visited;
+	}
+
+	std::cout << name << " (" << n_tets << " tets, " << method_name(settings.method) <<
+		", leaf size " << settings.max_leaf_size << ")" <<
+		"\n\tbuild: " << build_ms << " ms, " << tree.get_nodes().size() << " nodes (" <<
+		tree.get_nodes().size()*sizeof(tree.get_nodes()[0])/1024 << " KB)" <<
+		"\n\tPointInTet: " << double(n_queries)/query_s << " queries/s" <<
+		", " << double(n_visited)/double(n_queries) << " nodes/query" <<
+		" (" << n_hit << " hits)" << std::endl;
+}
+
+// Refit after a deformation compared to rebuilding the tree
+static void bench_refit( TetMesh *mesh ){
+
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, &mesh->vertices[0][0], n_tets );
+
+	std::vector<Vec3f> verts = mesh->vertices;
+	Eigen::AlignedBox<float,3> aabb = mesh->bounds();
+	float height = aabb.sizes()[1];
+	std::cout << "refit (" << n_tets << " tets, bending)" << std::endl;
+	for( int frame=1; frame<=4; ++frame ){
+		for( size_t i=0; i<verts.size(); ++i ){
+			float y = ( mesh->vertices[i][1] - aabb.min()[1] ) / height;
+			verts[i] = mesh->vertices[i] + Vec3f( 0.1f*frame*height*y*y, 0, 0 );
+		}
+		MicroTimer t;
+		bool rebuild = tree.refit( &verts[0][0] );
+		double refit_ms = t.elapsed_ms();
+		std::cout << "\tframe " << frame << ": refit " << refit_ms << " ms, sah ratio " <<
+			tree.sah_ratio() << ( rebuild ? " (rebuild suggested)" : "" ) << std::endl;
+	}
+
+	const int methods[2] = { bvh::Settings::SAH, bvh::Settings::LBVH };
+	for( int i=0; i<2; ++i ){
+		bvh::Settings settings;
+		settings.method = methods[i];
+		bvh::AABBTree<float,4> rebuilt;
+		MicroTimer t;
+		rebuilt.init( inds, &verts[0][0], n_tets, settings );
+		std::cout << "\trebuild " << method_name(methods[i]) << ": " << t.elapsed_ms() << " ms" << std::endl;
+	}
+}
+
+// Build times of the SAH tree for an increasing number of threads
+static void bench_build_scaling( TetMesh *mesh ){
+#ifdef _OPENMP
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	int max_threads = omp_get_num_procs();
+
+	std::cout << "SAH build scaling (" << n_tets << " tets)" << std::endl;
+	std::vector<int> thread_counts;
+	for( int n=1; n<max_threads; n*=2 ){ thread_counts.emplace_back(n); }
+	thread_counts.emplace_back( max_threads );
+
+	double t1 = 0.0;
+	for( size_t j=0; j<thread_counts.size(); ++j ){
+		int n_threads = thread_counts[j];
+		omp_set_num_threads( n_threads );
+		bvh::AABBTree<float,4> tree;
+		double best_ms = std::numeric_limits<double>::max();
+		for( int i=0; i<5; ++i ){
+			MicroTimer t;
+			tree.init( inds, verts, n_tets );
+			best_ms = std::min( best_ms, t.elapsed_ms() );
+		}
+		if( j == 0 ){ t1 = best_ms; }
+		std::cout << "\t" << n_threads << " threads: " << best_ms << " ms (" <<
+			t1/best_ms << "x)" << std::endl;
+	}
+	omp_set_num_threads( max_threads );
+#else
+	MCL_UNUSED(mesh);
+#endif
+}
+
+// A parallel loop of single queries compared to the batched queries,
+// with and without Morton ordering of the (random) query points.
+static void bench_batch( TriangleMesh *tris, TetMesh *tets, int n_queries ){
+
+	std::vector<Vec3f> points;
+	make_points( tets->bounds(), n_queries, points );
+	std::vector<int> prim( n_queries );
+	std::vector<float> x( n_queries ), y( n_queries ), z( n_queries ), d( n_queries );
+	bvh::QueryResults<float> results;
+	results.prim = &prim[0];
+	results.x = &x[0]; results.y = &y[0]; results.z = &z[0];
+	results.dist = &d[0];
+
+	const float *tri_verts = &tris->vertices[0][0];
+	const int *tri_inds = &tris->faces[0][0];
+	bvh::AABBTree<float,3> tri_tree;
+	tri_tree.init( tri_inds, tri_verts, tris->faces.size() );
+
+	const float *tet_verts = &tets->vertices[0][0];
+	const int *tet_inds = &tets->tets[0][0];
+	bvh::AABBTree<float,4> tet_tree;
+	tet_tree.init( tet_inds, tet_verts, tets->tets.size() );
+
+	std::cout << "batched queries (" << n_queries << " points)" << std::endl;
+
+	MicroTimer t;
+	#pragma omp parallel for
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], tri_verts, tri_inds );
+		tri_tree.traverse_static( visitor );
+		prim[i] = visitor.hit_tri;
+	}
+	double loop_s = t.elapsed_s();
+	t.reset();
+	bvh::nearest_triangle( tri_tree, tri_verts, tri_inds, &points[0][0], n_queries, results, false );
+	double batch_s = t.elapsed_s();
+	t.reset();
+	bvh::nearest_triangle( tri_tree, tri_verts, tri_inds, &points[0][0], n_queries, results, true );
+	double morton_s = t.elapsed_s();
+	std::cout << "	NearestTriangle: loop " << double(n_queries)/loop_s << ", batch " <<
+		double(n_queries)/batch_s << ", batch morton " << double(n_queries)/morton_s << " queries/s" << std::endl;
+
+	t.reset();
+	#pragma omp parallel for
+	for( int i=0; i<n_queries; ++i ){
+		bvh::PointInTet<float> visitor( points[i], tet_verts, tet_inds );
+		tet_tree.traverse_static( visitor );
+		prim[i] = visitor.hit_tet;
+	}
+	loop_s = t.elapsed_s();
+	t.reset();
+	bvh::point_in_tet( tet_tree, tet_verts, tet_inds, &points[0][0], n_queries, results, false );
+	batch_s = t.elapsed_s();
+	t.reset();
+	bvh::point_in_tet( tet_tree, tet_verts, tet_inds, &points[0][0], n_queries, results, true );
+	morton_s = t.elapsed_s();
+	std::cout << "	PointInTet: loop " << double(n_queries)/loop_s << ", batch " <<
+		double(n_queries)/batch_s << ", batch morton " << double(n_queries)/morton_s << " queries/s" << std::endl;
+}
+
+// Random rays from outside the mesh through points in its box
+static void make_rays( const Eigen::AlignedBox<float,3> &aabb, int n, std::vector< raycast::Ray<float> > &rays ){
+	std::vector<Vec3f> points;
+	make_points( aabb, n, points );
+	std::mt19937 gen(4321);
+	std::uniform_real_distribution<float> dd( -1.f, 1.f );
+	rays.resize(n);
+	for( int i=0; i<n; ++i ){
+		Vec3f dir( dd(gen), dd(gen), dd(gen) );
+		dir.normalize();
+		rays[i] = raycast::Ray<float>( points[i] - dir*aabb.sizes().norm(), dir );
+	}
+}
+
+// Single threaded rays per second for each kind of ray query
+static void bench_rays( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, mesh->faces.size() );
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh->vertices.size(); ++i ){ aabb.extend( mesh->vertices[i] ); }
+	std::vector< raycast::Ray<float> > rays;
+	make_rays( aabb, n_queries, rays );
+
+	MicroTimer t;
+	int n_hit = 0;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::RayClosestHit<float> visitor( rays[i], verts, inds );
+		tree.traverse_static( visitor );
+		n_hit += visitor.hit_tri >= 0;
+	}
+	double closest_s = t.elapsed_s();
+
+	// Shadow rays toward the sample point
+	t.reset();
+	int n_occluded = 0;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::RayAnyHit<float> visitor( rays[i], verts, inds );
+		visitor.payload.t_max = aabb.sizes().norm();
+		tree.traverse_static( visitor );
+		n_occluded += visitor.hit_tri >= 0;
+	}
+	double any_s = t.elapsed_s();
+
+	t.reset();
+	long n_hits = 0;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::RayAllHits<float> visitor( rays[i], verts, inds );
+		tree.traverse_static( visitor );
+		visitor.sort();
+		n_hits += visitor.hits.size();
+	}
+	double all_s = t.elapsed_s();
+
+	std::cout << "rays, " << name << " (" << mesh->faces.size() << " tris)" <<
+		"\n\tRayClosestHit: " << double(n_queries)/closest_s << " rays/s, " << n_hit << " hit" <<
+		"\n\tRayAnyHit: " << double(n_queries)/any_s << " rays/s, " << n_occluded << " occluded" <<
+		"\n\tRayAllHits: " << double(n_queries)/all_s << " rays/s, " <<
+		double(n_hits)/double(n_queries) << " hits/ray" << std::endl;
+}
+
+template <int W>
+static void bench_wide_queries( const bvh::AABBTree<float,3> &tree, const std::vector<Vec3f> &points,
+	const std::vector< raycast::Ray<float> > &rays, const float *verts, const int *inds ){
+
+	bvh::WideBVH<float,3,W> wide;
+	MicroTimer t;
+	wide.init( tree );
+	double collapse_ms = t.elapsed_ms();
+	int n_queries = points.size();
+
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		wide.traverse_nearest( visitor );
+	}
+	double nearest_s = t.elapsed_s();
+
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::RayClosestHit<float> visitor( rays[i], verts, inds );
+		wide.traverse_ray( visitor );
+	}
+	double ray_s = t.elapsed_s();
+
+	std::cout << "	" << W << "-wide (" << bvh::WideKernels<float,W>::name() << "): " <<
+		wide.get_nodes().size() << " nodes (" << wide.get_nodes().size()*sizeof(wide.get_nodes()[0])/1024 <<
+		" KB), collapse " << collapse_ms << " ms" <<
+		"\n\t\tNearestTriangle: " << double(n_queries)/nearest_s << " queries/s" <<
+		"\n\t\tRayClosestHit: " << double(n_queries)/ray_s << " rays/s" << std::endl;
+}
+
+// Binary tree compared to 4 and 8-wide trees collapsed from it
+static void bench_wide( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, mesh->faces.size() );
+
+	Eigen::AlignedBox<float,3> aabb = mesh->bounds();
+	std::vector<Vec3f> points;
+	make_points( aabb, n_queries, points );
+	std::vector< raycast::Ray<float> > rays;
+	make_rays( aabb, n_queries, rays );
+
+	MicroTimer t;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+	}
+	double nearest_s = t.elapsed_s();
+
+	t.reset();
+	int n_hits = 0;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::RayClosestHit<float> visitor( rays[i], verts, inds );
+		tree.traverse_static( visitor );
+		n_hits += visitor.hit_tri >= 0;
+	}
+	double ray_s = t.elapsed_s();
+
+	std::cout << "wide trees, " << name << " (" << mesh->faces.size() << " tris, " << n_hits << " ray hits)" <<
+		"\n\tbinary: " << tree.get_nodes().size() << " nodes (" <<
+		tree.get_nodes().size()*sizeof(tree.get_nodes()[0])/1024 << " KB)" <<
+		"\n\t\tNearestTriangle: " << double(n_queries)/nearest_s << " queries/s" <<
+		"\n\t\tRayClosestHit: " << double(n_queries)/ray_s << " rays/s" << std::endl;
+	bench_wide_queries<4>( tree, points, rays, verts, inds );
+	bench_wide_queries<8>( tree, points, rays, verts, inds );
+}
+
+// Primitives whose boxes overlap a query box
+struct BoxOverlap {
+	typedef Eigen::AlignedBox<float,3> AABB;
+	AABB box;
+	const std::vector<AABB> *prim_boxes;
+	std::vector<int> hits;
+	bool hit_aabb( const AABB &aabb ){ return box.intersects( aabb ); }
+	bool check_left_first( const AABB &, const AABB & ){ return true; }
+	bool hit_prim( int prim ){
+		if( box.intersects( (*prim_boxes)[prim] ) ){ hits.emplace_back( prim ); }
+		return false;
+	}
+};
+
+// Self collision pairs from one query per triangle compared to a dual traversal
+static void bench_self_pairs( const std::string &name, TriangleMesh *mesh ){
+
+	typedef Eigen::AlignedBox<float,3> AABB;
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	const int n_tris = mesh->faces.size();
+	const float thickness = mesh->bounds().sizes().norm()*1e-3f;
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris );
+
+	MicroTimer t;
+	std::vector<AABB> boxes( n_tris );
+	for( int i=0; i<n_tris; ++i ){
+		for( int j=0; j<3; ++j ){ boxes[i].extend( mesh->vertices[ mesh->faces[i][j] ] ); }
+	}
+	long n_query_pairs = 0;
+	#pragma omp parallel for reduction(+:n_query_pairs)
+	for( int i=0; i<n_tris; ++i ){
+		BoxOverlap visitor;
+		visitor.box = AABB( boxes[i].min()-Vec3f::Constant(thickness), boxes[i].max()+Vec3f::Constant(thickness) );
+		visitor.prim_boxes = &boxes;
+		tree.traverse_static( visitor );
+		for( size_t j=0; j<visitor.hits.size(); ++j ){
+			int k = visitor.hits[j];
+			if( k <= i ){ continue; }
+			const Vec3i &a = mesh->faces[i];
+			const Vec3i &b = mesh->faces[k];
+			bool adjacent = false;
+			for( int l=0; l<9; ++l ){ adjacent |= a[l/3] == b[l%3]; }
+			if( !adjacent ){ n_query_pairs++; }
+		}
+	}
+	double query_ms = t.elapsed_ms();
+
+	t.reset();
+	std::vector<bvh::PrimPair> pairs;
+	bvh::self_overlap_pairs( tree, verts, inds, thickness, pairs );
+	double dual_ms = t.elapsed_ms();
+
+	std::cout << "self pairs, " << name << " (" << n_tris << " tris)" <<
+		"\n\tper-triangle queries: " << query_ms << " ms, " << n_query_pairs << " pairs" <<
+		"\n\tdual traversal: " << dual_ms << " ms, " << pairs.size() << " pairs" << std::endl;
+}
+
+template <typename TreeT>
+static void bench_point_in_tet( const std::string &name, const TreeT &tree, size_t bytes,
+	const std::vector<Vec3f> &points, const float *verts, const int *inds ){
+
+	int n_queries = points.size();
+	MicroTimer t;
+	for( int i=0; i<n_queries; ++i ){
+		bvh::PointInTet<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+	}
+	double query_s = t.elapsed_s();
+	long n_visited = 0;
+	for( int i=0; i<n_queries; ++i ){
+		Counting< bvh::PointInTet<float> > visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+		n_visited += visitor.n_visited;
+	}
+	std::cout << "\t" << name << ": " << bytes/1024 << " KB, " << double(n_queries)/query_s << " queries/s, " <<
+		double(n_visited)/double(n_queries) << " box tests/query" << std::endl;
+}
+
+// Full precision tree compared to 16 and 8-bit quantized bounds
+static void bench_quantized( const std::string &name, TetMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, verts, n_tets );
+	bvh::QuantizedTree<float,4,uint16_t> tree16;
+	tree16.init( tree );
+	bvh::QuantizedTree<float,4,uint8_t> tree8;
+	tree8.init( tree );
+
+	std::vector<Vec3f> points;
+	make_tet_points( mesh, n_queries, points );
+	std::cout << "quantized PointInTet, " << name << " (" << n_tets << " tets, " <<
+		mesh->vertices.size()*sizeof(Vec3f)/1024 << " KB verts, " << n_tets*sizeof(Vec4i)/1024 << " KB tets)" << std::endl;
+	bench_point_in_tet( "full", tree, tree.get_nodes().size()*sizeof(tree.get_nodes()[0]), points, verts, inds );
+	bench_point_in_tet( "16-bit", tree16, tree16.node_bytes(), points, verts, inds );
+	bench_point_in_tet( "8-bit", tree8, tree8.node_bytes(), points, verts, inds );
+}
+
+// Moving one object in a dynamic tree compared to rebuilding a static one
+static void bench_dynamic( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	const int n_tris = mesh->faces.size();
+	std::vector< Eigen::AlignedBox<float,3> > boxes( n_tris );
+	Eigen::AlignedBox<float,3> aabb;
+	for( int i=0; i<n_tris; ++i ){
+		for( int j=0; j<3; ++j ){ boxes[i].extend( mesh->vertices[ mesh->faces[i][j] ] ); }
+		aabb.extend( boxes[i] );
+	}
+
+	MicroTimer t;
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris );
+	double build_ms = t.elapsed_ms();
+
+	t.reset();
+	bvh::DynamicTree<float,3> dtree( 0.001f*aabb.sizes().norm() );
+	for( int i=0; i<n_tris; ++i ){ dtree.insert( i, boxes[i] ); }
+	double insert_ms = t.elapsed_ms();
+
+	// One triangle moving back and forth across the mesh. Only its box
+	// changes, so queries on its verts would be wrong, but the tree work is real.
+	const int n_updates = 10000;
+	const Vec3f step = aabb.sizes()/float(n_updates/10);
+	t.reset();
+	int n_reinserted = 0;
+	for( int i=0; i<n_updates; ++i ){
+		Vec3f offset = step*float( (i/10)%2 == 0 ? i%10 : 10-i%10 );
+		n_reinserted += dtree.update( 0, Eigen::AlignedBox<float,3>( boxes[0].min()+offset, boxes[0].max()+offset ) );
+	}
+	double update_us = t.elapsed_us()/double(n_updates);
+	dtree.update( 0, boxes[0] );
+
+	std::vector<Vec3f> points;
+	make_points( aabb, n_queries, points );
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+	}
+	double static_s = t.elapsed_s();
+	t.reset();
+	for( int i=0; i<n_queries; ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		dtree.traverse_static( visitor );
+	}
+	double dynamic_s = t.elapsed_s();
+
+	std::cout << "dynamic tree, " << name << " (" << n_tris << " tris)" <<
+		"\n\tstatic SAH build: " << build_ms << " ms, " << double(n_queries)/static_s << " queries/s" <<
+		"\n\tdynamic inserts: " << insert_ms << " ms, height " << dtree.height() << ", " <<
+		double(n_queries)/dynamic_s << " queries/s" <<
+		"\n\tupdate one object: " << update_us << " us (" << n_reinserted << "/" << n_updates << " reinserted)" << std::endl;
+}
+
+// Neighbors of every vert (particle neighbor search) compared to brute force
+static void bench_knn( const std::string &name, TriangleMesh *mesh ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int n_verts = mesh->vertices.size();
+	std::vector<int> inds( n_verts );
+	std::iota( inds.begin(), inds.end(), 0 );
+	bvh::AABBTree<float,1> tree;
+	tree.init( &inds[0], verts, n_verts );
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( int i=0; i<n_verts; ++i ){ aabb.extend( mesh->vertices[i] ); }
+	const float radius = 0.01f*aabb.sizes().norm();
+	const int k = 16;
+
+	MicroTimer t;
+	std::vector<int> knn_prims( n_verts*k );
+	std::vector<float> knn_dists( n_verts*k );
+	bvh::k_nearest( tree, verts, &inds[0], verts, n_verts, k, &knn_prims[0], &knn_dists[0],
+		std::numeric_limits<float>::max(), true );
+	double knn_s = t.elapsed_s();
+
+	t.reset();
+	std::vector<int> offsets, rad_prims;
+	std::vector<float> rad_dists;
+	bvh::radius_search( tree, verts, &inds[0], verts, n_verts, radius, offsets, rad_prims, rad_dists, true );
+	double radius_s = t.elapsed_s();
+
+	// Single threaded brute force on a few verts
+	const int n_brute = std::min( n_verts, 1000 );
+	t.reset();
+	long n_found = 0;
+	for( int i=0; i<n_brute; ++i ){
+		bvh::KNearest<float,1> visitor( mesh->vertices[i], k, verts, &inds[0] );
+		visitor.skip_vert_idx.emplace_back( i );
+		for( int j=0; j<n_verts; ++j ){ visitor.hit_prim( j ); }
+		n_found += visitor.neighbors.size();
+	}
+	double brute_s = t.elapsed_s();
+
+	std::cout << "neighbor search, " << name << " (" << n_verts << " verts)" <<
+		"\n\tk_nearest (k=" << k << "): " << double(n_verts)/knn_s << " queries/s" <<
+		"\n\tradius_search: " << double(n_verts)/radius_s << " queries/s, " <<
+		double(rad_prims.size())/double(n_verts) << " neighbors/query" <<
+		"\n\tbrute force k nearest (1 thread): " << double(n_brute)/brute_s << " queries/s" << std::endl;
+}
+
+// SAH build compared to loading a saved tree, which is mostly hashing the mesh
+static void bench_save_load( const std::string &name, TetMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	const std::string path = "bvhBenchmark.bvh";
+
+	MicroTimer t;
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, verts, n_tets );
+	double build_ms = t.elapsed_ms();
+	if( !tree.save( path, verts ) ){ return; }
+
+	t.reset();
+	bvh::AABBTree<float,4> loaded;
+	bool success = loaded.load_mmap( path, inds, verts, n_tets );
+	double load_ms = t.elapsed_ms();
+	if( !success ){ std::remove( path.c_str() ); return; }
+
+	std::vector<Vec3f> points;
+	make_tet_points( mesh, n_queries, points );
+	std::cout << "save/load, " << name << " (" << n_tets << " tets)" <<
+		"\n\tbuild: " << build_ms << " ms, load_mmap: " << load_ms << " ms" << std::endl;
+	bench_point_in_tet( "built", tree, tree.get_nodes().size()*sizeof(tree.get_nodes()[0]), points, verts, inds );
+	bench_point_in_tet( "mapped", loaded, loaded.get_nodes().size()*sizeof(loaded.get_nodes()[0]), points, verts, inds );
+	std::remove( path.c_str() );
+}
+
+// Queries per second of NearestTriangle
+static double nearest_rate( const bvh::AABBTree<float,3> &tree, const std::vector<Vec3f> &points,
+	const float *verts, const int *inds ){
+	MicroTimer t;
+	for( size_t i=0; i<points.size(); ++i ){
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		tree.traverse_static( visitor );
+	}
+	return double(points.size())/t.elapsed_s();
+}
+
+// LBVH with treelet optimization compared to SAH, and how much
+// of the cost lost to bending optimize gets back after each refit
+static void bench_optimize( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	int n_tris = mesh->faces.size();
+	std::vector<Vec3f> points;
+	make_points( mesh->bounds(), n_queries, points );
+
+	bvh::Settings settings;
+	settings.method = bvh::Settings::LBVH;
+	bvh::AABBTree<float,3> lbvh;
+	MicroTimer t;
+	lbvh.init( inds, verts, n_tris, settings );
+	double lbvh_ms = t.elapsed_ms();
+	double lbvh_cost = lbvh.sah_cost();
+	double lbvh_rate = nearest_rate( lbvh, points, verts, inds );
+	t.reset();
+	lbvh.optimize();
+	double opt_ms = t.elapsed_ms();
+
+	// Single prim leaves, collapsed by optimize
+	settings.optimize_passes = 3;
+	bvh::AABBTree<float,3> lbvh1;
+	t.reset();
+	lbvh1.init( inds, verts, n_tris, settings );
+	double lbvh1_ms = t.elapsed_ms();
+
+	bvh::AABBTree<float,3> sah;
+	t.reset();
+	sah.init( inds, verts, n_tris );
+	double sah_ms = t.elapsed_ms();
+
+	std::cout << "optimize, " << name << " (" << n_tris << " tris)" <<
+		"\n\tlbvh: " << lbvh_ms << " ms, sah cost " << lbvh_cost << ", " << lbvh_rate << " queries/s" <<
+		"\n\tlbvh + optimize: " << lbvh_ms+opt_ms << " ms, sah cost " << lbvh.sah_cost() << ", " <<
+		nearest_rate( lbvh, points, verts, inds ) << " queries/s" <<
+		"\n\tlbvh, optimize_passes = 3: " << lbvh1_ms << " ms, sah cost " << lbvh1.sah_cost() << ", " <<
+		nearest_rate( lbvh1, points, verts, inds ) << " queries/s" <<
+		"\n\tsah: " << sah_ms << " ms, sah cost " << sah.sah_cost() << ", " <<
+		nearest_rate( sah, points, verts, inds ) << " queries/s" << std::endl;
+
+	std::vector<Vec3f> bent = mesh->vertices;
+	Eigen::AlignedBox<float,3> aabb = mesh->bounds();
+	float height = aabb.sizes()[1];
+	bvh::AABBTree<float,3> refit = sah;
+	for( int frame=1; frame<=4; ++frame ){
+		for( size_t i=0; i<bent.size(); ++i ){
+			float y = ( mesh->vertices[i][1] - aabb.min()[1] ) / height;
+			bent[i] = mesh->vertices[i] + Vec3f( 0.25f*frame*height*y*y, 0, 0 );
+		}
+		sah.refit( &bent[0][0] );
+		refit.refit( &bent[0][0] );
+		double refit_cost = refit.sah_cost();
+		t.reset();
+		refit.optimize( 1 );
+		opt_ms = t.elapsed_ms();
+		t.reset();
+		bvh::AABBTree<float,3> rebuilt;
+		rebuilt.init( inds, &bent[0][0], n_tris );
+		double rebuild_ms = t.elapsed_ms();
+		std::cout << "\tbend " << frame << ": sah cost refit " << refit_cost <<
+			", refit + optimize " << refit.sah_cost() << " (" << opt_ms << " ms)" <<
+			", rebuild " << rebuilt.sah_cost() << " (" << rebuild_ms << " ms)" << std::endl;
+	}
+}
+
+// Signed distance compared to the unsigned nearest triangle query it uses
+static void bench_signed_distance( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	int n_tris = mesh->faces.size();
+	std::vector<Vec3f> points;
+	make_points( mesh->bounds(), n_queries, points );
+	std::vector<float> dists( n_queries );
+
+	MicroTimer t;
+	bvh::SignedDistance<float> sdf;
+	sdf.init( verts, mesh->vertices.size(), inds, n_tris );
+	double init_ms = t.elapsed_ms();
+
+	std::vector<float> d( n_queries );
+	bvh::QueryResults<float> results;
+	results.dist = &d[0];
+	t.reset();
+	bvh::nearest_triangle( sdf.get_tree(), verts, inds, &points[0][0], n_queries, results );
+	double nearest_s = t.elapsed_s();
+	t.reset();
+	sdf.distance( &points[0][0], n_queries, &dists[0] );
+	double sdf_s = t.elapsed_s();
+	int n_inside = 0;
+	for( int i=0; i<n_queries; ++i ){ n_inside += dists[i] < 0.f; }
+
+	std::cout << "signed distance, " << name << " (" << n_tris << " tris)" <<
+		"\n\tinit: " << init_ms << " ms, " << sdf.open_edges() << " open edges" <<
+		"\n\tnearest triangle (batch): " << double(n_queries)/nearest_s << " queries/s" <<
+		"\n\tsigned distance (batch): " << double(n_queries)/sdf_s << " queries/s (" <<
+		n_inside << " inside)" << std::endl;
+}
+
+// Points that move a little each frame, located from scratch
+// with PointInTet or by walking from their last tet
+static void bench_tet_locator( const std::string &name, TetMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	std::vector<Vec3f> points;
+	make_tet_points( mesh, n_queries, points );
+
+	MicroTimer t;
+	bvh::TetLocator<float> locator;
+	locator.init( verts, inds, n_tets );
+	double init_ms = t.elapsed_ms();
+
+	std::vector<int> tets( n_queries, -1 ), hit( n_queries );
+	bvh::QueryResults<float> results;
+	results.prim = &hit[0];
+	locator.locate( &points[0][0], n_queries, &tets[0] );
+
+	std::mt19937 gen(1234);
+	const float step = 1e-3f*mesh->bounds().sizes().norm();
+	std::uniform_real_distribution<float> move_dist( -step, step );
+	double tree_s = 0, walk_s = 0;
+	int n_tree = 0;
+	const int n_frames = 10;
+	for( int frame=0; frame<n_frames; ++frame ){
+		for( int i=0; i<n_queries; ++i ){ points[i] += Vec3f( move_dist(gen), move_dist(gen), move_dist(gen) ); }
+		t.reset();
+		bvh::point_in_tet( locator.get_tree(), verts, inds, &points[0][0], n_queries, results );
+		tree_s += t.elapsed_s();
+		t.reset();
+		n_tree += locator.locate( &points[0][0], n_queries, &tets[0] );
+		walk_s += t.elapsed_s();
+	}
+
+	std::cout << "tet locator, " << name << " (" << n_tets << " tets, " << n_frames << " frames)" <<
+		"\n\tinit: " << init_ms << " ms" <<
+		"\n\tPointInTet (batch): " << double(n_queries*n_frames)/tree_s << " queries/s" <<
+		"\n\twalk from last tet: " << double(n_queries*n_frames)/walk_s << " queries/s, " <<
+		100.0*n_tree/double(n_queries*n_frames) << "% used the tree" << std::endl;
+}
+
+// Quality of each build method and the traversal counts of NearestTriangle,
+// with the time it takes to count them
+static void bench_stats( const std::string &name, TriangleMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->faces[0][0];
+	int n_tris = mesh->faces.size();
+	std::vector<Vec3f> points;
+	make_points( mesh->bounds(), n_queries, points );
+
+	const int methods[3] = { bvh::Settings::MIDPOINT, bvh::Settings::SAH, bvh::Settings::LBVH };
+	for( int m=0; m<3; ++m ){
+		bvh::Settings settings;
+		settings.method = methods[m];
+		bvh::AABBTree<float,3> tree;
+		tree.init( inds, verts, n_tris, settings );
+
+		MicroTimer t;
+		for( int i=0; i<n_queries; ++i ){
+			bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+			tree.traverse_static( visitor );
+		}
+		double query_s = t.elapsed_s();
+
+		bvh::TraversalStats stats;
+		t.reset();
+		for( int i=0; i<n_queries; ++i ){
+			bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+			tree.traverse_static( visitor, stats );
+		}
+		double stats_s = t.elapsed_s();
+
+		std::cout << "stats, " << name << " (" << n_tris << " tris, " << method_name(settings.method) << ")" <<
+			"\n\ttree: " << bvh::tree_quality( tree ).to_json() <<
+			"\n\tNearestTriangle: " << stats.to_json() <<
+			"\n\tcounting: " << double(n_queries)/stats_s << " queries/s, " <<
+			double(n_queries)/query_s << " without" << std::endl;
+	}
+}
+
+// Brute force closest hit of a few rays against every triangle, one at
+// a time and W at a time, and the same for the triangle boxes.
+template <int W>
+static void bench_packet_width( TriangleMesh *mesh, const std::vector< raycast::Ray<float> > &rays, double scalar_s, double box_s ){
+
+	typedef raycast::PacketKernels<float,W> Kernels;
+	int n_tris = mesh->faces.size();
+	int n_packs = ( n_tris + W-1 ) / W;
+	std::vector< raycast::TrianglePacket<float,W> > packs( n_packs );
+	std::vector<float> bounds( n_packs*W*6, 0.f );
+	for( int i=0; i<n_tris; ++i ){
+		const Vec3i &f = mesh->faces[i];
+		packs[i/W].set( i%W, mesh->vertices[f[0]], mesh->vertices[f[1]], mesh->vertices[f[2]] );
+		Eigen::AlignedBox<float,3> box;
+		for( int j=0; j<3; ++j ){ box.extend( mesh->vertices[f[j]] ); }
+		for( int j=0; j<3; ++j ){
+			bounds[ (i/W)*W*6 + j*W + i%W ] = box.min()[j];
+			bounds[ (i/W)*W*6 + (j+3)*W + i%W ] = box.max()[j];
+		}
+	}
+
+	MicroTimer t;
+	int n_hits = 0;
+	for( size_t i=0; i<rays.size(); ++i ){
+		float t_max = std::numeric_limits<float>::max();
+		float dist[W];
+		for( int j=0; j<n_packs; ++j ){
+			int mask = Kernels::ray_triangles( rays[i], rays[i].eps, t_max, packs[j], dist );
+			for( ; mask; mask &= mask-1 ){ t_max = std::min( t_max, dist[ __builtin_ctz(mask) ] ); }
+		}
+		n_hits += int( t_max < std::numeric_limits<float>::max() );
+	}
+	double tri_s = t.elapsed_s();
+
+	t.reset();
+	int n_box_hits = 0;
+	for( size_t i=0; i<rays.size(); ++i ){
+		raycast::SlabRay<float> slab( rays[i] );
+		float dist[W];
+		for( int j=0; j<n_packs; ++j ){
+			const float *b = &bounds[ j*W*6 ];
+			int mask = Kernels::ray_boxes( slab.origin.data(), slab.inv_dir.data(), b, b+W, b+2*W, b+3*W, b+4*W, b+5*W,
+				-std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), dist );
+			n_box_hits += __builtin_popcount( mask );
+		}
+	}
+	double packet_box_s = t.elapsed_s();
+
+	double n_tests = double(rays.size())*n_tris;
+	std::cout << "\t" << W << "-wide (" << Kernels::name() << "): ray_triangles " << n_tests/tri_s/1e6 << " M tests/s (" <<
+		scalar_s/tri_s << "x), ray_boxes " << n_tests/packet_box_s/1e6 << " M tests/s (" << box_s/packet_box_s << "x), " <<
+		n_hits << " rays hit, " << n_box_hits << " boxes hit" << std::endl;
+}
+
+static void bench_ray_packets( const std::string &name, TriangleMesh *mesh, int n_rays ){
+
+	int n_tris = mesh->faces.size();
+	std::vector< raycast::Ray<float> > rays;
+	make_rays( mesh->bounds(), n_rays, rays );
+
+	MicroTimer t;
+	int n_hits = 0;
+	for( int i=0; i<n_rays; ++i ){
+		raycast::Payload<float> payload;
+		payload.t_min = rays[i].eps;
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh->faces[j];
+			raycast::ray_triangle( &rays[i], mesh->vertices[f[0]], mesh->vertices[f[1]], mesh->vertices[f[2]], &payload );
+		}
+		n_hits += int( payload.t_max < std::numeric_limits<float>::max() );
+	}
+	double scalar_s = t.elapsed_s();
+
+	std::vector< Eigen::AlignedBox<float,3> > boxes( n_tris );
+	for( int i=0; i<n_tris; ++i ){
+		boxes[i].setEmpty();
+		for( int j=0; j<3; ++j ){ boxes[i].extend( mesh->vertices[ mesh->faces[i][j] ] ); }
+	}
+	t.reset();
+	int n_box_hits = 0;
+	for( int i=0; i<n_rays; ++i ){
+		for( int j=0; j<n_tris; ++j ){
+			n_box_hits += int( raycast::ray_aabb( &rays[i], boxes[j].min(), boxes[j].max() ) );
+		}
+	}
+	double box_s = t.elapsed_s();
+
+	double n_tests = double(n_rays)*n_tris;
+	std::cout << "ray packets, " << name << " (" << n_rays << " rays against all " << n_tris << " triangles)" <<
+		"\n\tscalar: ray_triangle " << n_tests/scalar_s/1e6 << " M tests/s, ray_aabb " << n_tests/box_s/1e6 <<
+		" M tests/s, " << n_hits << " rays hit, " << n_box_hits << " boxes hit" << std::endl;
+	bench_packet_width<4>( mesh, rays, scalar_s, box_s );
+	bench_packet_width<8>( mesh, rays, scalar_s, box_s );
+}
+
+template <int W>
+static void bench_projection_width( TriangleMesh *mesh, const std::vector<Vec3f> &points,
+	const std::vector<float> *p, const std::vector<float> *corners, double scalar_pts_s, double scalar_tris_s ){
+
+	typedef projection::PacketProjection<float,W> Proj;
+	const int n_points = points.size();
+	const int n_tris = mesh->faces.size();
+	std::vector<float> q[3], dist2( std::max( n_points, n_tris ) );
+	for( int i=0; i<3; ++i ){ q[i].resize( dist2.size() ); }
+
+	MicroTimer t;
+	double sum = 0.0;
+	for( int i=0; i<n_tris; ++i ){
+		const Vec3i &f = mesh->faces[i];
+		Proj::points_triangle( n_points, &p[0][0], &p[1][0], &p[2][0],
+			mesh->vertices[f[0]], mesh->vertices[f[1]], mesh->vertices[f[2]], &q[0][0], &q[1][0], &q[2][0], &dist2[0] );
+		sum += dist2[i % n_points];
+	}
+	double pts_s = t.elapsed_s();
+
+	const float *c1[3] = { &corners[0][0], &corners[1][0], &corners[2][0] };
+	const float *c2[3] = { &corners[3][0], &corners[4][0], &corners[5][0] };
+	const float *c3[3] = { &corners[6][0], &corners[7][0], &corners[8][0] };
+	t.reset();
+	for( int i=0; i<n_points; ++i ){
+		Proj::point_triangles( n_tris, points[i], c1, c2, c3, &q[0][0], &q[1][0], &q[2][0], &dist2[0] );
+		sum += dist2[i % n_tris];
+	}
+	double tris_s = t.elapsed_s();
+
+	double n_tests = double(n_points)*n_tris;
+	std::cout << "\t" << W << "-wide (" << Proj::name() << "): points_triangle " << n_tests/pts_s/1e6 << " M/s (" <<
+		scalar_pts_s/pts_s << "x), point_triangles " << n_tests/tris_s/1e6 << " M/s (" <<
+		scalar_tris_s/tris_s << "x), checksum " << sum << std::endl;
+}
+
+static void bench_projection_packets( const std::string &name, TriangleMesh *mesh, int n_points ){
+
+	const int n_tris = mesh->faces.size();
+	std::vector<Vec3f> points;
+	make_points( mesh->bounds(), n_points, points );
+	std::vector<float> p[3];
+	for( int i=0; i<n_points; ++i ){
+		for( int j=0; j<3; ++j ){ p[j].push_back( points[i][j] ); }
+	}
+	std::vector<float> corners[9];
+	for( int i=0; i<n_tris; ++i ){
+		for( int c=0; c<3; ++c ){
+			for( int j=0; j<3; ++j ){ corners[c*3+j].push_back( mesh->vertices[ mesh->faces[i][c] ][j] ); }
+		}
+	}
+
+	// Scalar, in the same loop orders as the packets
+	std::vector<float> dist2( std::max( n_points, n_tris ) );
+	MicroTimer t;
+	double sum = 0.0;
+	for( int i=0; i<n_tris; ++i ){
+		const Vec3i &f = mesh->faces[i];
+		for( int j=0; j<n_points; ++j ){
+			Vec3f q = projection::point_on_triangle( points[j], mesh->vertices[f[0]], mesh->vertices[f[1]], mesh->vertices[f[2]] );
+			dist2[j] = ( q - points[j] ).squaredNorm();
+		}
+		sum += dist2[i % n_points];
+	}
+	double scalar_pts_s = t.elapsed_s();
+
+	t.reset();
+	for( int i=0; i<n_points; ++i ){
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh->faces[j];
+			Vec3f q = projection::point_on_triangle( points[i], mesh->vertices[f[0]], mesh->vertices[f[1]], mesh->vertices[f[2]] );
+			dist2[j] = ( q - points[i] ).squaredNorm();
+		}
+		sum += dist2[i % n_tris];
+	}
+	double scalar_tris_s = t.elapsed_s();
+
+	double n_tests = double(n_points)*n_tris;
+	std::cout << "projection packets, " << name << " (" << n_points << " points against all " << n_tris << " triangles)" <<
+		"\n\tscalar: point_on_triangle " << n_tests/scalar_pts_s/1e6 << " M/s over points, " <<
+		n_tests/scalar_tris_s/1e6 << " M/s over triangles, checksum " << sum << std::endl;
+	bench_projection_width<4>( mesh, points, p, corners, scalar_pts_s, scalar_tris_s );
+	bench_projection_width<8>( mesh, points, p, corners, scalar_pts_s, scalar_tris_s );
+}
+
+template <int W>
+static void bench_tet_inverse_width( TetMesh *mesh, const std::vector<Vec3f> &points, int n_brute, double scalar_s ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	MicroTimer t;
+	projection::TetInverse<float,W> inverse;
+	inverse.init( verts, inds, n_tets );
+	double init_ms = t.elapsed_ms();
+
+	t.reset();
+	int n_found = 0;
+	for( int i=0; i<n_brute; ++i ){ n_found += int( inverse.find( points[i], 0, n_tets ) >= 0 ); }
+	double find_s = t.elapsed_s();
+
+	double n_tests = double(n_brute)*n_tets;
+	std::cout << "\t" << W << "-wide (" << inverse.name() << "): init " << init_ms << " ms, find " <<
+		n_tests/find_s/1e6 << " M tets/s (" << scalar_s/find_s << "x), " << n_found << " found" << std::endl;
+}
+
+// Point-in-tet against every tet (like EmbeddedMesh::gen_lattice)
+// and at the leaves of a tree, with and without TetInverse
+static void bench_tet_inverse( const std::string &name, TetMesh *mesh, int n_queries ){
+
+	const float *verts = &mesh->vertices[0][0];
+	const int *inds = &mesh->tets[0][0];
+	int n_tets = mesh->tets.size();
+	std::vector<Vec3f> points;
+	make_tet_points( mesh, n_queries, points );
+
+	// Stops at the first tet like find
+	const int n_brute = std::min( n_queries, 1000 );
+	MicroTimer t;
+	int n_found = 0;
+	for( int i=0; i<n_brute; ++i ){
+		for( int j=0; j<n_tets; ++j ){
+			const Vec4i &tet = mesh->tets[j];
+			if( projection::point_in_tet( points[i], mesh->vertices[tet[0]], mesh->vertices[tet[1]],
+				mesh->vertices[tet[2]], mesh->vertices[tet[3]] ) ){ n_found++; break; }
+		}
+	}
+	double scalar_s = t.elapsed_s();
+
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, verts, n_tets );
+	projection::TetInverse<float> inverse;
+	inverse.init( verts, inds, n_tets );
+	std::vector<int> hit( n_queries );
+	bvh::QueryResults<float> results;
+	results.prim = &hit[0];
+	t.reset();
+	bvh::point_in_tet( tree, verts, inds, &points[0][0], n_queries, results );
+	double tree_s = t.elapsed_s();
+	t.reset();
+	bvh::point_in_tet( tree, verts, inds, &points[0][0], n_queries, results, true, &inverse );
+	double tree_inv_s = t.elapsed_s();
+
+	double n_tests = double(n_brute)*n_tets;
+	std::cout << "tet inverse, " << name << " (" << n_brute << " points against all " << n_tets << " tets)" <<
+		"\n\tscalar point_in_tet: " << n_tests/scalar_s/1e6 << " M tets/s, " << n_found << " found" << std::endl;
+	bench_tet_inverse_width<4>( mesh, points, n_brute, scalar_s );
+	bench_tet_inverse_width<8>( mesh, points, n_brute, scalar_s );
+	std::cout << "\tPointInTet (batch): " << double(n_queries)/tree_s << " queries/s, with TetInverse " <<
+		double(n_queries)/tree_inv_s << " queries/s (" << tree_s/tree_inv_s << "x)" << std::endl;
+}
+
+int main( int argc, char *argv[] ){
+
+	int n_queries = 100000;
+	if( argc > 1 ){ n_queries = std::max( 1, atoi(argv[1]) ); }
+
+	std::stringstream bunnyfile;
+	bunnyfile << MCLSCENE_ROOT_DIR << "/src/data/bunny.obj";
+	TriangleMesh bunny;
+	if( !meshio::load_obj( &bunny, bunnyfile.str() ) ){ return EXIT_FAILURE; }
+
+	std::stringstream armafile;
+	armafile << MCLSCENE_ROOT_DIR << "/src/data/armadillo_10k";
+	TetMesh arma;
+	if( !meshio::load_elenode( &arma, armafile.str() ) ){ return EXIT_FAILURE; }
+	arma.need_faces();
+	TriangleMesh arma_surf;
+	arma_surf.vertices = arma.vertices;
+	arma_surf.faces = arma.faces;
+
+	const int methods[4] = { bvh::Settings::MIDPOINT, bvh::Settings::SAH, bvh::Settings::LBVH, bvh::Settings::SAH };
+	const int leaf_sizes[4] = { 4, 4, 4, 1 };
+	for( int i=0; i<4; ++i ){
+		bvh::Settings settings;
+		settings.method = methods[i];
+		settings.max_leaf_size = leaf_sizes[i];
+		bench_triangles( "bunny", &bunny, n_queries, settings );
+		bench_triangles( "armadillo_10k surface", &arma_surf, n_queries, settings );
+		bench_tets( "armadillo_10k", &arma, n_queries, settings );
+	}
+	bench_refit( &arma );
+	bench_batch( &arma_surf, &arma, n_queries*10 );
+	bench_wide( "bunny", &bunny, n_queries );
+	bench_wide( "armadillo_10k surface", &arma_surf, n_queries );
+	bench_self_pairs( "bunny", &bunny );
+	bench_self_pairs( "armadillo_10k surface", &arma_surf );
+	bench_quantized( "armadillo_10k", &arma, n_queries );
+	bench_save_load( "armadillo_10k", &arma, n_queries );
+	bench_rays( "bunny", &bunny, n_queries );
+	bench_rays( "armadillo_10k surface", &arma_surf, n_queries );
+	bench_dynamic( "armadillo_10k surface", &arma_surf, n_queries );
+	bench_knn( "bunny", &bunny );
+	bench_knn( "armadillo_10k surface", &arma_surf );
+	bench_stats( "bunny", &bunny, n_queries );
+	bench_stats( "armadillo_10k surface", &arma_surf, n_queries );
+	bench_optimize( "bunny", &bunny, n_queries );
+	bench_optimize( "armadillo_10k surface", &arma_surf, n_queries );
+	bench_signed_distance( "armadillo_10k surface", &arma_surf, n_queries*10 );
+	bench_tet_locator( "armadillo_10k", &arma, n_queries*10 );
+	bench_ray_packets( "armadillo_10k surface", &arma_surf, 200 );
+	bench_projection_packets( "armadillo_10k surface", &arma_surf, 200 );
+	bench_tet_inverse( "armadillo_10k", &arma, n_queries*10 );
+	bench_build_scaling( &arma );
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2017 University of Minnesota
+//
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#include "MCL/ArgParser.hpp"
+#include "MCL/MeshIO.hpp"
+#include "MCL/ShapeFactory.hpp"
+#include "MCL/MicroTimer.hpp"
+#include "MCL/RayTracer.hpp"
+#include "MCL/AmbientOcclusion.hpp"
+
+using namespace mcl;
+
+void help(){
+	std::stringstream ss;
+	ss << "\n==========================================\nArgs:\n" <<
+		"\t-f: obj file to render (default bunny)\n" <<
+		"\t-o: png file to save (default raytrace.png)\n" <<
+		"\t-width, -height: image size (default 1920 x 1080)\n" <<
+		"\t-tess: tessellation of the sphere next to the mesh, 708 is about 1M triangles (default 64)\n" <<
+		"\t-ss: rays per pixel along each axis (default 1)\n" <<
+		"\t-frames: number of times to render, for timing (default 1)\n" <<
+		"\t-ao: ambient occlusion rays per vertex of the mesh, 0 for none (default 0)\n" <<
+	"==========================================\n";
+	printf( "%s", ss.str().c_str() );
+}
+
+int main(int argc, char *argv[]){
+
+	ArgParser parser(argc,argv);
+	if(	parser.exists("-h") || parser.exists("-help") ||
+		parser.exists("--h") || parser.exists("--help") ){
+		help();
+		return 0;
+	}
+
+	std::stringstream meshfile;
+	meshfile << MCLSCENE_ROOT_DIR << "/src/data/bunny.obj";
+	std::string filename = meshfile.str();
+	std::string outfile = "raytrace.png";
+	int width = 1920, height = 1080, tess = 64, frames = 1, ao_samples = 0;
+	RayTracer tracer;
+	parser.get<std::string>( "-f", &filename );
+	parser.get<std::string>( "-o", &outfile );
+	parser.get<int>( "-width", &width );
+	parser.get<int>( "-height", &height );
+	parser.get<int>( "-tess", &tess );
+	parser.get<int>( "-frames", &frames );
+	parser.get<int>( "-ao", &ao_samples );
+	parser.get<int>( "-ss", &tracer.settings.supersample );
+
+	// The mesh, scaled to about unit size, on top of a sphere
+	std::shared_ptr<TriangleMesh> mesh = TriangleMesh::create();
+	if( !meshio::load_obj( mesh.get(), filename ) ){ return EXIT_FAILURE; }
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh->vertices.size(); ++i ){ aabb.extend( mesh->vertices[i] ); }
+	float scale = 1.f / aabb.sizes().maxCoeff();
+	mesh->apply_xform( xform::make_scale(scale,scale,scale) * xform::make_trans<float>( -aabb.center()[0], -aabb.min()[1], -aabb.center()[2] ) );
+	std::shared_ptr<TriangleMesh> sphere = factory::make_sphere( Vec3f(0,-2.f,0), 2.f, std::max( 3, tess ) );
+
+	std::shared_ptr<RenderMesh> rm_mesh = RenderMesh::create( mesh );
+	std::shared_ptr<RenderMesh> rm_sphere = RenderMesh::create( sphere );
+	rm_mesh->phong = material::Phong::create( material::Preset::Bronze );
+	rm_sphere->phong = material::Phong::create( material::Preset::WhitePlastic );
+
+	// Darken the mesh's creases
+	if( ao_samples > 0 ){
+		MicroTimer ao_t;
+		bvh::AmbientOcclusion<float> ao;
+		ao.init( &mesh->vertices[0][0], mesh->vertices.size(), &mesh->faces[0][0], mesh->faces.size() );
+		ao.sample( ao_samples );
+		std::vector<Vec3f> colors;
+		ao.get_colors( colors );
+		rm_mesh->set_colors( colors );
+		std::cout << "Ambient occlusion with " << ao_samples << " rays per vertex in " << ao_t.elapsed_ms() << " ms" << std::endl;
+	}
+
+	tracer.add_mesh( rm_mesh );
+	tracer.add_mesh( rm_sphere );
+	std::cout << mesh->faces.size() + sphere->faces.size() << " triangles" << std::endl;
+
+	// Look at the mesh from the front and a little above
+	Camera camera;
+	camera.lookat() = Vec3f(0,0.4f,0);
+	camera.eye() = Vec3f(0.8f,1.2f,2.5f);
+	camera.nearfar() = Vec2f(0.01f,100.f);
+	camera.update_view(0.f);
+
+	// The first render also builds the BVHs
+	MicroTimer t;
+	tracer.render( camera, width, height );
+	std::cout << "Rendered " << width << "x" << height << " in " << t.elapsed_ms() << " ms" << std::endl;
+	if( frames > 1 ){
+		t.reset();
+		for( int i=1; i<frames; ++i ){ tracer.render( camera, width, height ); }
+		std::cout << "Without building: " << t.elapsed_ms()/double(frames-1) << " ms per frame" << std::endl;
+	}
+
+	if( !tracer.save_png( outfile ) ){ return EXIT_FAILURE; }
+	std::cout << "Saved " << outfile << std::endl;
+	return EXIT_SUCCESS;
+}
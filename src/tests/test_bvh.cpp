@@ -0,0 +1,2508 @@
+// Copyright (c) 2017 University of Minnesota
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+#include <iostream>
+#include <random>
+#include <set>
+#include "MCL/MeshIO.hpp"
+#include "MCL/ShapeFactory.hpp"
+#include "MCL/BatchQuery.hpp"
+#include "MCL/WideBVH.hpp"
+#include "MCL/Broadphase.hpp"
+#include "MCL/QuantizedBVH.hpp"
+#include "MCL/DynamicTree.hpp"
+#include "MCL/SignedDistance.hpp"
+#include "MCL/TetLocator.hpp"
+#include "MCL/RayPacket.hpp"
+#include "MCL/AmbientOcclusion.hpp"
+#include "MCL/ProjectionPacket.hpp"
+#include "MCL/TetInverse.hpp"
+
+using namespace mcl;
+
+bool test_nearest_triangle( const TriangleMesh &mesh, const bvh::Settings &settings );
+bool test_nearest_triangle_tree( const bvh::AABBTree<float,3> &tree, const TriangleMesh &mesh );
+bool test_point_in_tet( const TetMesh &mesh, const bvh::Settings &settings );
+bool test_degenerate();
+bool test_radix_sort();
+bool test_nested_lbvh( const TetMesh &mesh );
+bool test_refit( const TriangleMesh &mesh );
+bool test_deep_tree();
+bool test_batch( const TriangleMesh &tris, const TetMesh &tets );
+bool test_nested_batch( const TriangleMesh &tris, const TetMesh &tets );
+template <typename T, int W> bool test_wide( const TriangleMesh &mesh, const bvh::Settings &settings );
+bool test_overlap_pairs( const TriangleMesh &mesh, const bvh::Settings &settings );
+bool test_ccd( const TriangleMesh &mesh );
+template <typename Q> bool test_quantized( const TriangleMesh &mesh, const bvh::Settings &settings );
+bool test_save_load( const TriangleMesh &mesh );
+bool test_knn( const TriangleMesh &mesh );
+bool test_rays( const TriangleMesh &mesh );
+bool test_dynamic( const TriangleMesh &mesh );
+bool test_stats( const TriangleMesh &tris, const TetMesh &tets );
+bool test_optimize( const TriangleMesh &mesh );
+bool test_signed_distance( const TetMesh &mesh );
+bool test_tet_locator( const TetMesh &mesh );
+template <typename T, int W> bool test_ray_packets( const TriangleMesh &mesh );
+bool test_ambient_occlusion();
+template <typename T, int W> bool test_projection_packets( const TriangleMesh &mesh );
+template <typename T, int W> bool test_tet_inverse( const TetMesh &mesh );
+
+int main(void){
+
+	TriangleMesh bunny;
+	std::stringstream bunnyfile;
+	bunnyfile << MCLSCENE_ROOT_DIR << "/src/data/bunny.obj";
+	if( !meshio::load_obj( &bunny, bunnyfile.str() ) ){ return EXIT_FAILURE; }
+
+	TetMesh arma;
+	std::stringstream armafile;
+	armafile << MCLSCENE_ROOT_DIR << "/src/data/armadillo_10k";
+	if( !meshio::load_elenode( &arma, armafile.str() ) ){ return EXIT_FAILURE; }
+
+	// Midpoint, SAH, LBVH, SAH/LBVH with tasks spawned for small
+	// subtrees, and single/large primitive leaves.
+	std::vector<bvh::Settings> settings(8);
+	settings[0].method = bvh::Settings::MIDPOINT;
+	settings[2].method = bvh::Settings::LBVH;
+	settings[3].parallel_threshold = 64;
+	settings[4].method = bvh::Settings::LBVH;
+	settings[4].parallel_threshold = 64;
+	settings[5].max_leaf_size = 1;
+	settings[6].max_leaf_size = 8;
+	settings[6].method = bvh::Settings::MIDPOINT;
+	settings[7].max_leaf_size = 8;
+	settings[7].method = bvh::Settings::LBVH;
+	settings[7].parallel_threshold = 64;
+	for( size_t i=0; i<settings.size(); ++i ){
+		if( !test_nearest_triangle( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+		if( !test_point_in_tet( arma, settings[i] ) ){ return EXIT_FAILURE; }
+	}
+	if( !test_degenerate() ){ return EXIT_FAILURE; }
+	if( !test_radix_sort() ){ return EXIT_FAILURE; }
+	if( !test_nested_lbvh( arma ) ){ return EXIT_FAILURE; }
+	if( !test_refit( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_deep_tree() ){ return EXIT_FAILURE; }
+	if( !test_batch( bunny, arma ) ){ return EXIT_FAILURE; }
+	if( !test_nested_batch( bunny, arma ) ){ return EXIT_FAILURE; }
+	for( size_t i=0; i<settings.size(); ++i ){
+		if( !test_wide<float,4>( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+		if( !test_wide<float,8>( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+	}
+	if( !test_wide<double,4>( bunny, bvh::Settings() ) ){ return EXIT_FAILURE; }
+	for( size_t i=0; i<settings.size(); ++i ){
+		if( !test_overlap_pairs( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+	}
+	if( !test_ccd( bunny ) ){ return EXIT_FAILURE; }
+	for( size_t i=0; i<settings.size(); ++i ){
+		if( !test_quantized<uint8_t>( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+		if( !test_quantized<uint16_t>( bunny, settings[i] ) ){ return EXIT_FAILURE; }
+	}
+	if( !test_save_load( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_knn( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_rays( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_dynamic( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_stats( bunny, arma ) ){ return EXIT_FAILURE; }
+	if( !test_optimize( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_signed_distance( arma ) ){ return EXIT_FAILURE; }
+	if( !test_tet_locator( arma ) ){ return EXIT_FAILURE; }
+	if( !test_ray_packets<float,4>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_ray_packets<float,8>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_ray_packets<double,4>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_ambient_occlusion() ){ return EXIT_FAILURE; }
+	if( !test_projection_packets<float,4>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_projection_packets<float,8>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_projection_packets<double,4>( bunny ) ){ return EXIT_FAILURE; }
+	if( !test_tet_inverse<float,4>( arma ) ){ return EXIT_FAILURE; }
+	if( !test_tet_inverse<float,8>( arma ) ){ return EXIT_FAILURE; }
+	if( !test_tet_inverse<double,4>( arma ) ){ return EXIT_FAILURE; }
+
+	std::cout << "Success" << std::endl;
+	return EXIT_SUCCESS;
+}
+
+// Compares tree results against a brute force search
+bool test_nearest_triangle( const TriangleMesh &mesh, const bvh::Settings &settings ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris, settings );
+
+	if( (int)tree.get_prims().size() != n_tris ){
+		std::cerr << "NearestTriangle: tree has " << tree.get_prims().size() <<
+			" prims, expected " << n_tris << std::endl;
+		return false;
+	}
+
+	// Leaves must cover every primitive exactly once
+	const bvh::ArrayView<bvh::AABBTree<float,3>::Node> nodes = tree.get_nodes();
+	std::vector<int> prim_count( n_tris, 0 );
+	for( size_t i=0; i<nodes.size(); ++i ){
+		if( !nodes[i].is_leaf() ){ continue; }
+		if( nodes[i].num_prims > std::max( 1, settings.max_leaf_size ) ){
+			std::cerr << "NearestTriangle: leaf with " << nodes[i].num_prims << " prims" << std::endl;
+			return false;
+		}
+		for( int j=0; j<nodes[i].num_prims; ++j ){ prim_count[ tree.get_prims()[nodes[i].offset+j] ]++; }
+	}
+	if( *std::min_element( prim_count.begin(), prim_count.end() ) != 1 ||
+		*std::max_element( prim_count.begin(), prim_count.end() ) != 1 ){
+		std::cerr << "NearestTriangle: leaves do not cover the prims" << std::endl;
+		return false;
+	}
+
+	return test_nearest_triangle_tree( tree, mesh );
+}
+
+bool test_nearest_triangle_tree( const bvh::AABBTree<float,3> &tree, const TriangleMesh &mesh ){
+
+	struct CountingNearest : public bvh::NearestTriangle<float> {
+		int n_prims;
+		CountingNearest( const Vec3f &p, const float *v, const int *i ) :
+			bvh::NearestTriangle<float>( p, v, i ), n_prims(0) {}
+		bool hit_prim( int prim ){ n_prims++; return bvh::NearestTriangle<float>::hit_prim( prim ); }
+	};
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+
+	for( int i=0; i<500; ++i ){
+		Vec3f r( dist(gen), dist(gen), dist(gen) );
+		Vec3f point = aabb.min() + r.cwiseProduct( aabb.sizes() );
+
+		bvh::NearestTriangle<float> visitor( point, verts, inds );
+		tree.traverse_static( visitor );
+
+		float brute_dist = std::numeric_limits<float>::max();
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh.faces[j];
+			Vec3f p = projection::point_on_triangle( point,
+				mesh.vertices[f[0]], mesh.vertices[f[1]], mesh.vertices[f[2]] );
+			brute_dist = std::min( brute_dist, (p-point).squaredNorm() );
+		}
+
+		if( visitor.hit_tri < 0 || std::abs( visitor.curr_nearest - brute_dist ) > 1e-8f ){
+			std::cerr << "NearestTriangle: tree dist " << visitor.curr_nearest <<
+				" but brute force dist " << brute_dist << std::endl;
+			return false;
+		}
+
+		// Virtual dispatch must give the same result
+		bvh::NearestTriangle<float> virtual_visitor( point, verts, inds );
+		tree.traverse( virtual_visitor );
+		if( virtual_visitor.hit_tri != visitor.hit_tri ){
+			std::cerr << "NearestTriangle: virtual traversal hit " << virtual_visitor.hit_tri <<
+				" but static traversal hit " << visitor.hit_tri << std::endl;
+			return false;
+		}
+
+		// Overrides must be called when passed by a base class reference
+		CountingNearest counting( point, verts, inds );
+		bvh::NearestTriangle<float> &base = counting;
+		tree.traverse( base );
+		if( counting.n_prims == 0 || counting.hit_tri != visitor.hit_tri ){
+			std::cerr << "NearestTriangle: traversal by base class reference skipped the override" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Every point sampled inside a tet must be found
+bool test_point_in_tet( const TetMesh &mesh, const bvh::Settings &settings ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.tets[0][0];
+	const int n_tets = mesh.tets.size();
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, verts, n_tets, settings );
+
+	std::mt19937 gen(1234);
+	std::uniform_int_distribution<int> tet_dist(0,n_tets-1);
+	std::uniform_real_distribution<float> dist(0.1f,1.f);
+
+	for( int i=0; i<1000; ++i ){
+		const Vec4i &tet = mesh.tets[ tet_dist(gen) ];
+		Vec4f b( dist(gen), dist(gen), dist(gen), dist(gen) );
+		b /= b.sum();
+		Vec3f point = b[0]*mesh.vertices[tet[0]] + b[1]*mesh.vertices[tet[1]] +
+			b[2]*mesh.vertices[tet[2]] + b[3]*mesh.vertices[tet[3]];
+
+		bvh::PointInTet<float> visitor( point, verts, inds );
+		tree.traverse_static( visitor );
+		if( visitor.hit_tet < 0 ){
+			std::cerr << "PointInTet: missed point " << point.transpose() << std::endl;
+			return false;
+		}
+		const Vec4i &hit = mesh.tets[ visitor.hit_tet ];
+		if( !projection::point_in_tet( point, mesh.vertices[hit[0]], mesh.vertices[hit[1]],
+			mesh.vertices[hit[2]], mesh.vertices[hit[3]] ) ){
+			std::cerr << "PointInTet: returned tet " << visitor.hit_tet <<
+				" does not contain the point" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Triangles that share a centroid can't be split spatially
+bool test_degenerate(){
+
+	const int n_tris = 64;
+	std::vector<Vec3f> verts;
+	std::vector<Vec3i> tris;
+	for( int i=0; i<n_tris; ++i ){
+		float a = float(i)/float(n_tris) * 2.f * M_PI;
+		Vec3f d( std::cos(a), std::sin(a), 0.f );
+		int nv = verts.size();
+		verts.emplace_back( d );
+		verts.emplace_back( -d );
+		verts.emplace_back( Vec3f(0,0,0) );
+		tris.emplace_back( Vec3i(nv,nv+1,nv+2) );
+	}
+
+	bvh::Settings settings;
+	for( int i=0; i<3; ++i ){
+		settings.method = i;
+		bvh::AABBTree<float,3> tree;
+		try {
+			tree.init( &tris[0][0], &verts[0][0], n_tris, settings );
+		} catch( const std::exception &e ){
+			std::cerr << "Degenerate: " << e.what() << std::endl;
+			return false;
+		}
+		bvh::NearestTriangle<float> visitor( Vec3f(0,0,1), &verts[0][0], &tris[0][0] );
+		tree.traverse_static( visitor );
+		if( visitor.hit_tri < 0 || std::abs( visitor.curr_nearest - 1.f ) > 1e-6f ){
+			std::cerr << "Degenerate: bad nearest triangle" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Radix sort must match a stable std::sort
+bool test_radix_sort(){
+
+	std::mt19937 gen(1234);
+	std::uniform_int_distribution<uint64_t> dist( 0, (uint64_t(1) << 63)-1 );
+	const int n = 100000;
+	std::vector<uint64_t> keys( n );
+	std::vector<int> vals( n );
+	for( int i=0; i<n; ++i ){ keys[i] = dist(gen) >> (i%2 ? 0 : 40); vals[i] = i; }
+
+	std::vector< std::pair<uint64_t,int> > expected( n );
+	for( int i=0; i<n; ++i ){ expected[i] = std::make_pair( keys[i], vals[i] ); }
+	std::stable_sort( expected.begin(), expected.end(),
+		[]( const std::pair<uint64_t,int> &a, const std::pair<uint64_t,int> &b ){ return a.first < b.first; } );
+
+	bvh::radix_sort( keys, vals, 63 );
+	for( int i=0; i<n; ++i ){
+		if( keys[i] != expected[i].first || vals[i] != expected[i].second ){
+			std::cerr << "radix_sort: wrong order at " << i << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Runs f(i) for i in [0,n) on an outer team of two threads, asking for
+// more in nested regions. Nesting is off, so those get only one thread.
+template <typename F>
+static void nested_parallel_for( int n, const F &f ){
+#ifdef _OPENMP
+	const int max_threads = omp_get_max_threads();
+	omp_set_num_threads( std::max( max_threads, 4 ) );
+	#pragma omp parallel for num_threads(2) schedule(static,1)
+	for( int i=0; i<n; ++i ){ f(i); }
+	omp_set_num_threads( max_threads );
+#else
+	for( int i=0; i<n; ++i ){ f(i); }
+#endif
+}
+
+// An LBVH built inside a parallel loop must match one built outside
+bool test_nested_lbvh( const TetMesh &mesh ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.tets[0][0];
+	const int n_tets = mesh.tets.size();
+	bvh::Settings settings;
+	settings.method = bvh::Settings::LBVH;
+	bvh::AABBTree<float,4> tree;
+	tree.init( inds, verts, n_tets, settings );
+
+	std::vector<int> ok( 4, 0 );
+	nested_parallel_for( 4, [&]( int i ){
+		bvh::AABBTree<float,4> nested;
+		nested.init( inds, verts, n_tets, settings );
+		ok[i] = int( nested.get_prims().size() == tree.get_prims().size() &&
+			nested.get_nodes().size() == tree.get_nodes().size() &&
+			std::equal( nested.get_prims().begin(), nested.get_prims().end(), tree.get_prims().begin() ) );
+	});
+	for( int i=0; i<4; ++i ){
+		if( !ok[i] ){
+			std::cerr << "LBVH: tree built in a parallel region differs" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Refit after deformation must give the same answers as a rebuild
+bool test_refit( const TriangleMesh &mesh ){
+
+	TriangleMesh deformed = mesh;
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, &mesh.vertices[0][0], n_tris );
+
+	// Twist about the y axis
+	const int nv = deformed.vertices.size();
+	for( int i=0; i<nv; ++i ){
+		Vec3f &v = deformed.vertices[i];
+		float a = v[1]*10.f;
+		v = Vec3f( std::cos(a)*v[0] - std::sin(a)*v[2], v[1], std::sin(a)*v[0] + std::cos(a)*v[2] );
+	}
+	bool rebuild = tree.refit( &deformed.vertices[0][0] );
+	if( rebuild ){
+		std::cerr << "refit: rebuild suggested for a mild twist, sah ratio " << tree.sah_ratio() << std::endl;
+		return false;
+	}
+
+	// Every node must contain its children
+	const bvh::ArrayView<bvh::AABBTree<float,3>::Node> nodes = tree.get_nodes();
+	for( size_t i=0; i<nodes.size(); ++i ){
+		if( nodes[i].is_leaf() ){ continue; }
+		if( !nodes[i].aabb.contains( nodes[i+1].aabb ) || !nodes[i].aabb.contains( nodes[nodes[i].offset].aabb ) ){
+			std::cerr << "refit: node " << i << " does not contain its children" << std::endl;
+			return false;
+		}
+	}
+
+	if( !test_nearest_triangle_tree( tree, deformed ) ){ return false; }
+
+	// Moving each triangle of a soup to a random spot makes a terrible tree
+	std::vector<Vec3f> soup( n_tris*3 );
+	std::vector<int> soup_inds( n_tris*3 );
+	std::iota( soup_inds.begin(), soup_inds.end(), 0 );
+	for( int i=0; i<n_tris*3; ++i ){ soup[i] = mesh.vertices[ inds[i] ]; }
+	bvh::AABBTree<float,3> soup_tree;
+	soup_tree.init( &soup_inds[0], &soup[0][0], n_tris );
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(-0.1f,0.1f);
+	for( int i=0; i<n_tris; ++i ){
+		Vec3f offset( dist(gen), dist(gen), dist(gen) );
+		for( int j=0; j<3; ++j ){ soup[i*3+j] += offset; }
+	}
+	if( !soup_tree.refit( &soup[0][0] ) ){
+		std::cerr << "refit: no rebuild suggested for scattered tris, sah ratio " << soup_tree.sah_ratio() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Nearest vertex, which doesn't derive from bvh::Visitor
+struct NearestVert {
+	typedef Eigen::AlignedBox<double,3> AABB;
+	Vec3d point;
+	const double *verts;
+	int hit_vert;
+	double curr_nearest;
+	NearestVert( const Vec3d &p, const double *v ) : point(p), verts(v), hit_vert(-1),
+		curr_nearest(std::numeric_limits<double>::max()) {}
+	bool hit_aabb( const AABB &aabb ){ return aabb.squaredExteriorDistance(point) < curr_nearest; }
+	bool check_left_first( const AABB &left, const AABB &right ){
+		return left.squaredExteriorDistance(point) < right.squaredExteriorDistance(point);
+	}
+	bool hit_prim( int prim ){
+		double d = ( Vec3d( verts[prim*3], verts[prim*3+1], verts[prim*3+2] ) - point ).squaredNorm();
+		if( d < curr_nearest ){ curr_nearest = d; hit_vert = prim; }
+		return false;
+	}
+};
+
+// Exponentially spaced points make midpoint splits peel off one point
+// at a time, so the tree is deeper than the fixed traversal stack.
+bool test_deep_tree(){
+
+	const int n_verts = 100;
+	std::vector<Vec3d> verts( n_verts );
+	std::vector<int> inds( n_verts );
+	for( int i=0; i<n_verts; ++i ){
+		verts[i] = Vec3d( std::pow( 2.0, double(i) ), 0, 0 );
+		inds[i] = i;
+	}
+
+	bvh::Settings settings;
+	settings.method = bvh::Settings::MIDPOINT;
+	settings.max_leaf_size = 1;
+	bvh::AABBTree<double,1> tree;
+	tree.init( &inds[0], &verts[0][0], n_verts, settings );
+
+	for( int i=0; i<n_verts; ++i ){
+		NearestVert visitor( verts[i]*1.1, &verts[0][0] );
+		tree.traverse_static( visitor );
+		if( visitor.hit_vert != i ){
+			std::cerr << "Deep tree: nearest to vert " << i << " was " << visitor.hit_vert << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Batched queries must match one-at-a-time queries, in any order
+bool test_batch( const TriangleMesh &tris, const TetMesh &tets ){
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<tets.vertices.size(); ++i ){ aabb.extend( tets.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	const int n = 2000;
+	std::vector<Vec3f> points( n );
+	for( int i=0; i<n; ++i ){
+		Vec3f r( dist(gen), dist(gen), dist(gen) );
+		points[i] = aabb.min() + r.cwiseProduct( aabb.sizes() );
+	}
+
+	std::vector<int> prim( n );
+	std::vector<float> x( n ), y( n ), z( n ), d( n );
+	bvh::QueryResults<float> results;
+	results.prim = &prim[0];
+	results.x = &x[0]; results.y = &y[0]; results.z = &z[0];
+	results.dist = &d[0];
+
+	const float *tri_verts = &tris.vertices[0][0];
+	const int *tri_inds = &tris.faces[0][0];
+	bvh::AABBTree<float,3> tri_tree;
+	tri_tree.init( tri_inds, tri_verts, tris.faces.size() );
+
+	const float *tet_verts = &tets.vertices[0][0];
+	const int *tet_inds = &tets.tets[0][0];
+	bvh::AABBTree<float,4> tet_tree;
+	tet_tree.init( tet_inds, tet_verts, tets.tets.size() );
+
+	for( int morton=0; morton<2; ++morton ){
+
+		bvh::nearest_triangle( tri_tree, tri_verts, tri_inds, &points[0][0], n, results, morton );
+		for( int i=0; i<n; ++i ){
+			bvh::NearestTriangle<float> visitor( points[i], tri_verts, tri_inds );
+			tri_tree.traverse_static( visitor );
+			Vec3f proj( x[i], y[i], z[i] );
+			if( prim[i] != visitor.hit_tri || (proj-visitor.proj).norm() > 1e-6f ||
+				std::abs( d[i] - std::sqrt( visitor.curr_nearest ) ) > 1e-6f ){
+				std::cerr << "Batch NearestTriangle: point " << i << " hit " << prim[i] <<
+					" but expected " << visitor.hit_tri << std::endl;
+				return false;
+			}
+		}
+
+		int n_hits = 0;
+		bvh::point_in_tet( tet_tree, tet_verts, tet_inds, &points[0][0], n, results, morton );
+		for( int i=0; i<n; ++i ){
+			bvh::PointInTet<float> visitor( points[i], tet_verts, tet_inds );
+			tet_tree.traverse_static( visitor );
+			float expected_d = visitor.hit_tet < 0 ? std::numeric_limits<float>::max() : 0.f;
+			if( prim[i] != visitor.hit_tet || d[i] != expected_d ){
+				std::cerr << "Batch PointInTet: point " << i << " hit " << prim[i] <<
+					" but expected " << visitor.hit_tet << std::endl;
+				return false;
+			}
+			n_hits += prim[i] >= 0;
+		}
+		if( n_hits == 0 ){
+			std::cerr << "Batch PointInTet: no points inside the mesh" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Batches run inside a parallel loop (e.g. one per object) must give
+// the same results as run outside, where the query order is sorted
+// with every thread
+bool test_nested_batch( const TriangleMesh &tris, const TetMesh &tets ){
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<tets.vertices.size(); ++i ){ aabb.extend( tets.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	const int n = 20000; // enough for radix_sort to split
+	std::vector<Vec3f> points( n );
+	for( int i=0; i<n; ++i ){
+		points[i] = aabb.min() + Vec3f( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+	}
+
+	const float *tri_verts = &tris.vertices[0][0];
+	const int *tri_inds = &tris.faces[0][0];
+	bvh::AABBTree<float,3> tri_tree;
+	tri_tree.init( tri_inds, tri_verts, tris.faces.size() );
+	const float *tet_verts = &tets.vertices[0][0];
+	const int *tet_inds = &tets.tets[0][0];
+	bvh::AABBTree<float,4> tet_tree;
+	tet_tree.init( tet_inds, tet_verts, tets.tets.size() );
+	const int k = 4;
+	const float radius = 0.02f*aabb.sizes().norm();
+
+	// Each of the four query types, run once outside and four times inside
+	struct Batch {
+		std::vector<int> tri, tet, knn, offsets, prims;
+		std::vector<float> knn_dists, dists;
+	};
+	auto run = [&]( Batch &b ){
+		bvh::QueryResults<float> results;
+		b.tri.resize( n );
+		results.prim = &b.tri[0];
+		bvh::nearest_triangle( tri_tree, tri_verts, tri_inds, &points[0][0], n, results );
+		b.tet.resize( n );
+		results.prim = &b.tet[0];
+		bvh::point_in_tet( tet_tree, tet_verts, tet_inds, &points[0][0], n, results );
+		b.knn.resize( n*k );
+		b.knn_dists.resize( n*k );
+		bvh::k_nearest( tri_tree, tri_verts, tri_inds, &points[0][0], n, k, &b.knn[0], &b.knn_dists[0] );
+		bvh::radius_search( tri_tree, tri_verts, tri_inds, &points[0][0], n, radius, b.offsets, b.prims, b.dists );
+	};
+	Batch expected;
+	run( expected );
+	std::vector<Batch> nested( 4 );
+	std::vector< std::vector<int> > orders( 4 );
+	nested_parallel_for( 4, [&]( int i ){
+		run( nested[i] );
+		bvh::query_order( &points[0][0], n, true, orders[i] );
+	});
+
+	// The query order must still be sorted by Morton code
+	std::vector<int> order;
+	bvh::query_order( &points[0][0], n, true, order );
+	for( int i=0; i<4; ++i ){
+		if( orders[i] != order ){
+			std::cerr << "Batch queries: query order differs when sorted in a parallel region" << std::endl;
+			return false;
+		}
+	}
+
+	for( int i=0; i<4; ++i ){
+		const Batch &b = nested[i];
+		if( b.tri != expected.tri || b.tet != expected.tet || b.knn != expected.knn ||
+			b.offsets != expected.offsets || b.prims != expected.prims ){
+			std::cerr << "Batch queries: results differ when run in a parallel region" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Wide tree queries must match the binary tree
+template <typename T, int W>
+bool test_wide( const TriangleMesh &mesh, const bvh::Settings &settings ){
+
+	std::vector<Vec3<T> > verts( mesh.vertices.size() );
+	for( size_t i=0; i<verts.size(); ++i ){ verts[i] = mesh.vertices[i].cast<T>(); }
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::AABBTree<T,3> tree;
+	tree.init( inds, &verts[0][0], n_tris, settings );
+	bvh::WideBVH<T,3,W> wide;
+	wide.init( tree );
+
+	// Every leaf of the binary tree ends up in a wide node
+	int n_prims = 0;
+	for( size_t i=0; i<wide.get_nodes().size(); ++i ){
+		const typename bvh::WideBVH<T,3,W>::Node &node = wide.get_nodes()[i];
+		for( int j=0; j<node.num_children; ++j ){ n_prims += node.num_prims[j]; }
+	}
+	if( n_prims != n_tris ){
+		std::cerr << "WideBVH<" << W << ">: leaves hold " << n_prims << " prims, expected " << n_tris << std::endl;
+		return false;
+	}
+
+	Eigen::AlignedBox<T,3> aabb;
+	for( size_t i=0; i<verts.size(); ++i ){ aabb.extend( verts[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<T> dist(0,1);
+
+	for( int i=0; i<500; ++i ){
+		Vec3<T> r( dist(gen), dist(gen), dist(gen) );
+		Vec3<T> point = aabb.min() + r.cwiseProduct( aabb.sizes() );
+
+		bvh::NearestTriangle<T> visitor( point, &verts[0][0], inds );
+		tree.traverse_static( visitor );
+		bvh::NearestTriangle<T> wide_visitor( point, &verts[0][0], inds );
+		wide.traverse_nearest( wide_visitor );
+		if( wide_visitor.hit_tri < 0 || wide_visitor.curr_nearest != visitor.curr_nearest ){
+			std::cerr << "WideBVH<" << W << ">: nearest dist " << wide_visitor.curr_nearest <<
+				" but binary tree dist " << visitor.curr_nearest << std::endl;
+			return false;
+		}
+
+		// Rays from outside the mesh through the sample point
+		Vec3<T> dir = Vec3<T>( dist(gen), dist(gen), dist(gen) ) - Vec3<T>::Constant(0.5);
+		dir.normalize();
+		raycast::Ray<T> ray( point - dir*aabb.sizes().norm(), dir );
+		bvh::RayClosestHit<T> ray_visitor( ray, &verts[0][0], inds );
+		tree.traverse_static( ray_visitor );
+		bvh::RayClosestHit<T> wide_ray_visitor( ray, &verts[0][0], inds );
+		wide.traverse_ray( wide_ray_visitor );
+
+		T brute_t = std::numeric_limits<T>::max();
+		raycast::Payload<T> payload;
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh.faces[j];
+			raycast::ray_triangle( &ray, verts[f[0]], verts[f[1]], verts[f[2]], &payload );
+			brute_t = payload.t_max;
+		}
+		if( ray_visitor.payload.t_max != brute_t || wide_ray_visitor.payload.t_max != brute_t ){
+			std::cerr << "WideBVH<" << W << ">: ray hit at " << wide_ray_visitor.payload.t_max <<
+				", binary tree " << ray_visitor.payload.t_max << ", brute force " << brute_t << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Broadphase pairs must match a brute force search
+bool test_overlap_pairs( const TriangleMesh &mesh, const bvh::Settings &settings ){
+
+	typedef Eigen::AlignedBox<float,3> AABB;
+	const float thickness = 1e-3f;
+	const int n_tris = mesh.faces.size();
+	const int *inds = &mesh.faces[0][0];
+
+	// The mesh against itself and against a shifted copy of its vertices
+	std::vector<Vec3f> shifted = mesh.vertices;
+	for( size_t i=0; i<shifted.size(); ++i ){ shifted[i] += Vec3f(0.005f,0.002f,0.f); }
+	std::vector<int> vert_inds( shifted.size() );
+	std::iota( vert_inds.begin(), vert_inds.end(), 0 );
+
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, &mesh.vertices[0][0], n_tris, settings );
+	bvh::AABBTree<float,1> vert_tree;
+	vert_tree.init( &vert_inds[0], &shifted[0][0], shifted.size(), settings );
+
+	std::vector<AABB> boxes( n_tris );
+	for( int i=0; i<n_tris; ++i ){
+		for( int j=0; j<3; ++j ){ boxes[i].extend( mesh.vertices[ mesh.faces[i][j] ] ); }
+	}
+	const Vec3f pad = Vec3f::Constant( thickness );
+
+	std::vector<bvh::PrimPair> pairs;
+	bvh::self_overlap_pairs( tree, &mesh.vertices[0][0], inds, thickness, pairs );
+	std::sort( pairs.begin(), pairs.end() );
+	std::vector<bvh::PrimPair> expected;
+	for( int i=0; i<n_tris; ++i ){
+		AABB box( boxes[i].min()-pad, boxes[i].max()+pad );
+		for( int j=i+1; j<n_tris; ++j ){
+			if( !box.intersects( boxes[j] ) ){ continue; }
+			bool adjacent = false;
+			for( int k=0; k<9; ++k ){ adjacent |= mesh.faces[i][k/3] == mesh.faces[j][k%3]; }
+			if( !adjacent ){ expected.emplace_back( i, j ); }
+		}
+	}
+	if( pairs != expected ){
+		std::cerr << "self_overlap_pairs: found " << pairs.size() << " pairs, expected " << expected.size() << std::endl;
+		return false;
+	}
+
+	bvh::overlap_pairs( tree, &mesh.vertices[0][0], inds, vert_tree, &shifted[0][0], &vert_inds[0], thickness, pairs );
+	std::sort( pairs.begin(), pairs.end() );
+	expected.clear();
+	for( int i=0; i<n_tris; ++i ){
+		AABB box( boxes[i].min()-pad, boxes[i].max()+pad );
+		for( size_t j=0; j<shifted.size(); ++j ){
+			if( box.contains( shifted[j] ) ){ expected.emplace_back( i, j ); }
+		}
+	}
+	if( pairs != expected || pairs.size() == 0 ){
+		std::cerr << "overlap_pairs: found " << pairs.size() << " pairs, expected " << expected.size() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Points and edges falling through a moving mesh must hit
+// at the same time as a brute force search
+bool test_ccd( const TriangleMesh &mesh ){
+
+	const float eps = 1e-6f;
+
+	// Point through a triangle and a triangle through a point
+	Vec3f a(0,0,0), b(1,0,0), c(0,1,0), up(0,0,1);
+	float toi = -1;
+	if( !ccd::vertex_triangle( Vec3f(0.2f,0.2f,1.f), a, b, c, Vec3f(0.2f,0.2f,-1.f), a, b, c, eps, toi ) ||
+		std::abs( toi-0.5f ) > 1e-6f ){
+		std::cerr << "ccd::vertex_triangle: static triangle toi " << toi << std::endl;
+		return false;
+	}
+	Vec3f p(0.2f,0.2f,0.5f);
+	if( !ccd::vertex_triangle( p, Vec3f(a-up), Vec3f(b-up), Vec3f(c-up), p, Vec3f(a+up), Vec3f(b+up), Vec3f(c+up), eps, toi ) ||
+		std::abs( toi-0.75f ) > 1e-6f ){
+		std::cerr << "ccd::vertex_triangle: moving triangle toi " << toi << std::endl;
+		return false;
+	}
+	if( ccd::vertex_triangle( Vec3f(2.f,2.f,1.f), a, b, c, Vec3f(2.f,2.f,-1.f), a, b, c, eps, toi ) ){
+		std::cerr << "ccd::vertex_triangle: hit outside the triangle" << std::endl;
+		return false;
+	}
+	if( !ccd::edge_edge( Vec3f(-1,0,1), Vec3f(1,0,1), Vec3f(0,-1,0), Vec3f(0,1,0),
+		Vec3f(-1,0,-1), Vec3f(1,0,-1), Vec3f(0,-1,0), Vec3f(0,1,0), eps, toi ) || std::abs( toi-0.5f ) > 1e-6f ){
+		std::cerr << "ccd::edge_edge: toi " << toi << std::endl;
+		return false;
+	}
+
+	// Small points that stay in a tilted plane are coplanar for the whole
+	// step even though rounding makes the volume slightly nonzero
+	Eigen::Matrix3f rot = Eigen::AngleAxisf( 0.7f, Vec3f(1,2,3).normalized() ).toRotationMatrix();
+	const float s = 1e-3f;
+	Vec3f in_plane[8] = { Vec3f(0,0,0), Vec3f(1,0.1f,0), Vec3f(0.3f,1,0), Vec3f(0.2f,0.3f,0),
+		Vec3f(0.1f,0,0), Vec3f(1,0.4f,0), Vec3f(0.2f,0.9f,0), Vec3f(0.6f,0.1f,0) };
+	for( int i=0; i<8; ++i ){ in_plane[i] = s*( rot*in_plane[i] ); }
+	float times[3];
+	int n_times = ccd::coplanar_times( in_plane[0], in_plane[1], in_plane[2], in_plane[3],
+		in_plane[4], in_plane[5], in_plane[6], in_plane[7], times );
+	if( n_times != 1 || times[0] != 0.f ){
+		std::cerr << "ccd::coplanar_times: " << n_times << " times for points that stay coplanar" << std::endl;
+		return false;
+	}
+
+	// Roots near zero are refined past the bisection width
+	const float root = 1e-3f/1.001f;
+	n_times = ccd::coplanar_times( Vec3f(0.2f,0.2f,1e-3f), a, b, c, Vec3f(0.2f,0.2f,-1.f), a, b, c, times );
+	if( n_times != 1 || std::abs( times[0]-root ) > 4.f*std::numeric_limits<float>::epsilon()*root ){
+		std::cerr << "ccd::coplanar_times: root " << ( n_times > 0 ? times[0] : -1.f ) << ", expected " << root << std::endl;
+		return false;
+	}
+
+	// Contacts that never cross the triangle or edge: sliding in the plane,
+	// sliding just above it, stopping just above it, and edges crossing in
+	// a shared plane. toi is the first time within eps, or up to eps/32
+	// early in distance.
+	{
+		const double deps = 1e-3;
+		const Vec3d da(0,0,0), db(1,0,0), dc(0,1,0);
+		double dtoi = -1;
+		struct Case { const char *name; bool hit; double toi, expected, speed; };
+		Case cases[4];
+		cases[0].name = "sliding in the plane";
+		cases[0].hit = ccd::vertex_triangle( Vec3d(-1,0.25,0), da, db, dc, Vec3d(0.5,0.25,0), da, db, dc, deps, dtoi );
+		cases[0].toi = dtoi; cases[0].expected = (1.0-deps)/1.5; cases[0].speed = 1.5;
+		cases[1].name = "sliding above the plane";
+		cases[1].hit = ccd::vertex_triangle( Vec3d(-1,0.25,1e-4), da, db, dc, Vec3d(0.5,0.25,1e-4), da, db, dc, deps, dtoi );
+		cases[1].toi = dtoi; cases[1].expected = (1.0-std::sqrt(deps*deps-1e-8))/1.5; cases[1].speed = 1.5;
+		cases[2].name = "stopping above the triangle";
+		cases[2].hit = ccd::vertex_triangle( Vec3d(0.25,0.25,1), da, db, dc, Vec3d(0.25,0.25,5e-4), da, db, dc, deps, dtoi );
+		cases[2].toi = dtoi; cases[2].expected = (1.0-deps)/(1.0-5e-4); cases[2].speed = 1.0-5e-4;
+		cases[3].name = "edges crossing in a plane";
+		cases[3].hit = ccd::edge_edge( Vec3d(-2,-1,0), Vec3d(-1,1,0), Vec3d(0,-1,0), Vec3d(0,1,0),
+			Vec3d(1,-1,0), Vec3d(2,1,0), Vec3d(0,-1,0), Vec3d(0,1,0), deps, dtoi );
+		cases[3].toi = dtoi; cases[3].expected = (1.0-deps)/3.0; cases[3].speed = 3.0;
+		for( int i=0; i<4; ++i ){
+			const Case &c = cases[i];
+			if( !c.hit || c.toi > c.expected + 1e-9 || c.toi < c.expected - deps/(32.0*c.speed) - 1e-9 ){
+				std::cerr << "ccd: " << c.name << " toi " << ( c.hit ? c.toi : -1.0 ) <<
+					", expected " << c.expected << std::endl;
+				return false;
+			}
+		}
+	}
+
+	// A point passing 1e-5 of its travel above the triangle is not coplanar
+	// with it for the whole step, and is caught
+	if( !ccd::vertex_triangle( Vec3f(-5.f,0.25f,1e-4f), a, b, c, Vec3f(5.f,0.25f,1e-4f), a, b, c, 2e-4f, toi ) ||
+		toi < 0.4999f || toi > 0.5f ){
+		std::cerr << "ccd::vertex_triangle: toi " << toi << " for a point passing just above" << std::endl;
+		return false;
+	}
+
+	// The mesh moves a little while the queries fall through it
+	const int n_tris = mesh.faces.size();
+	const int *inds = &mesh.faces[0][0];
+	std::vector<Vec3f> verts1 = mesh.vertices;
+	for( size_t i=0; i<verts1.size(); ++i ){ verts1[i] += Vec3f(0.f,0.01f,0.f); }
+	const float *v0 = &mesh.vertices[0][0];
+	const float *v1 = &verts1[0][0];
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, v0, v1, n_tris );
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); aabb.extend( verts1[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	const int n = 200;
+	std::vector<Vec3f> x0( n ), x1( n );
+	for( int i=0; i<n; ++i ){
+		Vec3f r( dist(gen), 0.f, dist(gen) );
+		x0[i] = aabb.min() + r.cwiseProduct( aabb.sizes() ) + Vec3f(0.f,aabb.sizes()[1]*1.1f,0.f);
+		x1[i] = x0[i] - Vec3f(0.f,aabb.sizes()[1]*1.2f,0.f);
+	}
+
+	std::vector<float> tois( n );
+	std::vector<int> hits( n );
+	bvh::vertex_triangle_toi( tree, v0, v1, inds, &x0[0][0], &x1[0][0], n, eps, &tois[0], &hits[0] );
+	int n_hits = 0;
+	for( int i=0; i<n; ++i ){
+		float brute_toi = 1.f;
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh.faces[j];
+			float t = 1.f;
+			if( ccd::vertex_triangle( x0[i], mesh.vertices[f[0]], mesh.vertices[f[1]], mesh.vertices[f[2]],
+				x1[i], verts1[f[0]], verts1[f[1]], verts1[f[2]], eps, t ) ){ brute_toi = std::min( brute_toi, t ); }
+		}
+		if( tois[i] != brute_toi ){
+			std::cerr << "VertexTriangleTOI: toi " << tois[i] << " but brute force toi " << brute_toi << std::endl;
+			return false;
+		}
+		n_hits += hits[i] >= 0;
+	}
+	if( n_hits == 0 ){
+		std::cerr << "VertexTriangleTOI: no points hit the mesh" << std::endl;
+		return false;
+	}
+
+	// Same for edges, with the refit tree
+	std::vector<int> edges;
+	for( int i=0; i<n_tris; ++i ){
+		for( int j=0; j<3; ++j ){
+			int e0 = mesh.faces[i][j], e1 = mesh.faces[i][(j+1)%3];
+			if( e0 < e1 ){ edges.emplace_back( e0 ); edges.emplace_back( e1 ); }
+		}
+	}
+	const int n_edges = edges.size()/2;
+	bvh::AABBTree<float,2> edge_tree;
+	edge_tree.init( &edges[0], v0, n_edges );
+	edge_tree.refit( v0, v1 );
+
+	std::vector<int> query_edges( n*2 );
+	std::vector<Vec3f> q0( n*2 ), q1( n*2 );
+	for( int i=0; i<n; ++i ){
+		Vec3f d( 0.f, 0.f, aabb.sizes()[2]*0.2f );
+		q0[i*2] = x0[i] - d; q0[i*2+1] = x0[i] + d;
+		q1[i*2] = x1[i] - d; q1[i*2+1] = x1[i] + d;
+		query_edges[i*2] = i*2; query_edges[i*2+1] = i*2+1;
+	}
+	bvh::edge_edge_toi( edge_tree, v0, v1, &edges[0], &q0[0][0], &q1[0][0], &query_edges[0], n, eps, &tois[0], &hits[0] );
+	n_hits = 0;
+	for( int i=0; i<n; ++i ){
+		float brute_toi = 1.f;
+		for( int j=0; j<n_edges; ++j ){
+			int e0 = edges[j*2], e1 = edges[j*2+1];
+			float t = 1.f;
+			if( ccd::edge_edge( q0[i*2], q0[i*2+1], mesh.vertices[e0], mesh.vertices[e1],
+				q1[i*2], q1[i*2+1], verts1[e0], verts1[e1], eps, t ) ){ brute_toi = std::min( brute_toi, t ); }
+		}
+		if( tois[i] != brute_toi ){
+			std::cerr << "EdgeEdgeTOI: toi " << tois[i] << " but brute force toi " << brute_toi << std::endl;
+			return false;
+		}
+		n_hits += hits[i] >= 0;
+	}
+	if( n_hits == 0 ){
+		std::cerr << "EdgeEdgeTOI: no edges hit the mesh" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Finds a primitive through boxes that contain its own box
+struct FindPrim {
+	typedef Eigen::AlignedBox<float,3> AABB;
+	AABB box;
+	int prim;
+	bool found;
+	FindPrim( const AABB &b, int p ) : box(b), prim(p), found(false) {}
+	bool hit_aabb( const AABB &aabb ){ return aabb.contains( box ); }
+	bool check_left_first( const AABB &, const AABB & ){ return true; }
+	bool hit_prim( int p ){ found = p == prim; return found; }
+};
+
+// Misses every box after the first primitive
+struct FirstLeaf {
+	typedef Eigen::AlignedBox<float,3> AABB;
+	int n_prims;
+	FirstLeaf() : n_prims(0) {}
+	bool hit_aabb( const AABB & ){ return n_prims == 0; }
+	bool check_left_first( const AABB &, const AABB & ){ return true; }
+	bool hit_prim( int ){ n_prims++; return false; }
+};
+
+// Compressed boxes must contain every primitive, and
+// queries must match the full precision tree
+template <typename Q>
+bool test_quantized( const TriangleMesh &mesh, const bvh::Settings &settings ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris, settings );
+	bvh::QuantizedTree<float,3,Q> qtree;
+	qtree.init( tree );
+
+	for( int i=0; i<n_tris; ++i ){
+		Eigen::AlignedBox<float,3> box;
+		for( int j=0; j<3; ++j ){ box.extend( mesh.vertices[ mesh.faces[i][j] ] ); }
+		FindPrim visitor( box, i );
+		qtree.traverse_static( visitor );
+		if( !visitor.found ){
+			std::cerr << "QuantizedTree<" << sizeof(Q)*8 << ">: decoded boxes do not contain prim " << i << std::endl;
+			return false;
+		}
+	}
+
+	// Boxes left on the stack must be tested again when popped
+	FirstLeaf first_leaf;
+	qtree.traverse_static( first_leaf );
+	if( first_leaf.n_prims == 0 || first_leaf.n_prims > std::max( 1, settings.max_leaf_size ) ){
+		std::cerr << "QuantizedTree<" << sizeof(Q)*8 << ">: visited " << first_leaf.n_prims <<
+			" prims after the query was done" << std::endl;
+		return false;
+	}
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	for( int i=0; i<500; ++i ){
+		Vec3f r( dist(gen), dist(gen), dist(gen) );
+		Vec3f point = aabb.min() + r.cwiseProduct( aabb.sizes() );
+		bvh::NearestTriangle<float> visitor( point, verts, inds );
+		tree.traverse_static( visitor );
+		bvh::NearestTriangle<float> qvisitor( point, verts, inds );
+		qtree.traverse( qvisitor );
+		if( qvisitor.curr_nearest != visitor.curr_nearest ){
+			std::cerr << "QuantizedTree<" << sizeof(Q)*8 << ">: nearest dist " << qvisitor.curr_nearest <<
+				" but full tree dist " << visitor.curr_nearest << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// A saved and mapped tree must match the built one, and
+// files for other meshes or damaged files must be rejected.
+bool test_save_load( const TriangleMesh &mesh ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	const std::string path = "test_bvh_save.bvh";
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris );
+	if( !tree.save( path, verts ) ){ return false; }
+
+	bvh::AABBTree<float,3> loaded;
+	{
+		// Keep only a copy to check the mapping is shared, not unmapped
+		bvh::AABBTree<float,3> tmp;
+		if( !tmp.load_mmap( path, inds, verts, n_tris ) || !tmp.is_mapped() ){
+			std::cerr << "save/load: could not load " << path << std::endl;
+			return false;
+		}
+		loaded = tmp;
+	}
+
+	bvh::ArrayView<bvh::AABBTree<float,3>::Node> nodes = tree.get_nodes();
+	bvh::ArrayView<bvh::AABBTree<float,3>::Node> mapped_nodes = loaded.get_nodes();
+	if( mapped_nodes.size() != nodes.size() || !std::equal( tree.get_prims().begin(), tree.get_prims().end(), loaded.get_prims().begin() ) ){
+		std::cerr << "save/load: loaded tree differs in size or prims" << std::endl;
+		return false;
+	}
+	for( size_t i=0; i<nodes.size(); ++i ){
+		if( mapped_nodes[i].offset != nodes[i].offset || mapped_nodes[i].num_prims != nodes[i].num_prims ||
+			!mapped_nodes[i].aabb.isApprox( nodes[i].aabb, 0.f ) ){
+			std::cerr << "save/load: node " << i << " differs" << std::endl;
+			return false;
+		}
+	}
+	if( std::abs( loaded.sah_cost() - tree.sah_cost() ) > 1e-4f*tree.sah_cost() ){
+		std::cerr << "save/load: sah cost " << loaded.sah_cost() << " but built " << tree.sah_cost() << std::endl;
+		return false;
+	}
+	if( !test_nearest_triangle_tree( loaded, mesh ) ){ return false; }
+
+	bool threw = false;
+	try { loaded.refit( verts ); } catch( const std::runtime_error & ){ threw = true; }
+	if( !threw ){
+		std::cerr << "save/load: refit of a mapped tree should throw" << std::endl;
+		return false;
+	}
+
+	// Moved verts or a different count make the file stale
+	std::vector<float> moved( verts, verts + mesh.vertices.size()*3 );
+	moved[ inds[n_tris-1]*3 ] += 1e-3f;
+	bvh::AABBTree<float,3> stale;
+	if( stale.load_mmap( path, inds, &moved[0], n_tris ) || stale.load_mmap( path, inds, verts, n_tris-1 ) ||
+		stale.load_mmap( path + ".missing", inds, verts, n_tris ) ){
+		std::cerr << "save/load: loaded a stale or missing file" << std::endl;
+		return false;
+	}
+
+	// A failed load must not change the tree
+	bvh::AABBTree<double,3> wrong_type;
+	std::vector<double> dverts( verts, verts + mesh.vertices.size()*3 );
+	wrong_type.init( inds, &dverts[0], n_tris );
+	if( wrong_type.load_mmap( path, inds, &dverts[0], n_tris ) || wrong_type.is_mapped() ||
+		wrong_type.get_nodes().size() == 0 ){
+		std::cerr << "save/load: loaded a file saved with a different type" << std::endl;
+		return false;
+	}
+
+	// Truncated file
+	const std::string cut_path = path + ".cut";
+	{
+		std::ifstream in( path.c_str(), std::ios::binary );
+		std::string contents( (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>() );
+		std::ofstream out( cut_path.c_str(), std::ios::binary | std::ios::trunc );
+		out.write( contents.data(), contents.size()/2 );
+	}
+	bool loaded_cut = stale.load_mmap( cut_path, inds, verts, n_tris );
+	std::remove( cut_path.c_str() );
+	if( loaded_cut ){
+		std::cerr << "save/load: loaded a truncated file" << std::endl;
+		return false;
+	}
+
+	// Damaged nodes, prims, or max depth with the right hash. The arrays are
+	// found by their contents so the test doesn't depend on the file layout.
+	std::string contents;
+	{
+		std::ifstream in( path.c_str(), std::ios::binary );
+		contents.assign( (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>() );
+	}
+	const size_t nodes_at = contents.find( std::string( reinterpret_cast<const char*>( &nodes[0] ), nodes.size()*sizeof(nodes[0]) ) );
+	const size_t prims_at = contents.find( std::string( reinterpret_cast<const char*>( tree.get_prims().data() ), n_tris*sizeof(int) ) );
+	const int counts[3] = { n_tris, int(nodes.size()), tree.get_max_depth() };
+	const size_t depth_at = contents.find( std::string( reinterpret_cast<const char*>( counts ), sizeof(counts) ) ) + 2*sizeof(int);
+	if( nodes_at == std::string::npos || prims_at == std::string::npos || depth_at < 2*sizeof(int) ){
+		std::cerr << "save/load: could not find the arrays in the file" << std::endl;
+		return false;
+	}
+	int first_leaf = 0;
+	while( !nodes[first_leaf].is_leaf() ){ first_leaf++; }
+	const size_t num_prims_at = reinterpret_cast<const char*>( &nodes[first_leaf].num_prims ) -
+		reinterpret_cast<const char*>( &nodes[0] ) + nodes_at;
+	const size_t offset_at = reinterpret_cast<const char*>( &nodes[0].offset ) -
+		reinterpret_cast<const char*>( &nodes[0] ) + nodes_at;
+	struct Damage { const char *what; size_t at; int value; };
+	const Damage damages[4] = {
+		{ "child out of range", offset_at, int(nodes.size()) },
+		{ "leaf past the prims", num_prims_at, n_tris+1 },
+		{ "prim out of range", prims_at, n_tris },
+		{ "max depth too small", depth_at, tree.get_max_depth()-1 } };
+	const std::string bad_path = path + ".bad";
+	for( int i=0; i<4; ++i ){
+		std::string bad = contents;
+		std::memcpy( &bad[ damages[i].at ], &damages[i].value, sizeof(int) );
+		{
+			std::ofstream out( bad_path.c_str(), std::ios::binary | std::ios::trunc );
+			out.write( bad.data(), bad.size() );
+		}
+		bool loaded_bad = stale.load_mmap( bad_path, inds, verts, n_tris );
+		std::remove( bad_path.c_str() );
+		if( loaded_bad ){
+			std::cerr << "save/load: loaded a file with a " << damages[i].what << std::endl;
+			return false;
+		}
+	}
+
+	// Saving over a mapped file or removing it must not affect the mapping
+	tree.refit( &moved[0] );
+	if( !tree.save( path, &moved[0] ) ){ return false; }
+	std::remove( path.c_str() );
+	return test_nearest_triangle_tree( loaded, mesh );
+}
+
+// k nearest and radius search compared against testing every primitive
+template <short PDIM>
+bool test_knn_prims( const TriangleMesh &mesh, const std::vector<int> &prim_inds, const std::string &name ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &prim_inds[0];
+	const int n_prims = prim_inds.size()/PDIM;
+	bvh::AABBTree<float,PDIM> tree;
+	tree.init( inds, verts, n_prims );
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); }
+	const float radius = 0.05f*aabb.sizes().norm();
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	const int n_points = 200;
+	std::vector<float> points( n_points*3 );
+	for( int i=0; i<n_points; ++i ){
+		Vec3f r( dist(gen), dist(gen), dist(gen) );
+		Vec3f point = aabb.min() + r.cwiseProduct( aabb.sizes() );
+		for( int j=0; j<3; ++j ){ points[i*3+j] = point[j]; }
+	}
+
+	const int k = 8;
+	std::vector<int> knn_prims( n_points*k );
+	std::vector<float> knn_dists( n_points*k );
+	bvh::k_nearest( tree, verts, inds, &points[0], n_points, k, &knn_prims[0], &knn_dists[0] );
+	std::vector<int> offsets, rad_prims;
+	std::vector<float> rad_dists;
+	bvh::radius_search( tree, verts, inds, &points[0], n_points, radius, offsets, rad_prims, rad_dists );
+
+	for( int i=0; i<n_points; ++i ){
+		Vec3f point( points[i*3], points[i*3+1], points[i*3+2] );
+		bvh::KNearest<float,PDIM> brute( point, n_prims, verts, inds );
+		for( int j=0; j<n_prims; ++j ){ brute.hit_prim( j ); }
+		brute.sort();
+
+		for( int kk=1; kk<=k; kk+=k-1 ){
+			bvh::KNearest<float,PDIM> visitor( point, kk, verts, inds );
+			tree.traverse_static( visitor );
+			visitor.sort();
+			for( int j=0; j<kk; ++j ){
+				if( visitor.neighbors[j].prim != brute.neighbors[j].prim ){
+					std::cerr << "KNearest " << name << ": neighbor " << j << " of " << kk << " is " <<
+						visitor.neighbors[j].prim << " but brute force found " << brute.neighbors[j].prim << std::endl;
+					return false;
+				}
+			}
+		}
+		for( int j=0; j<k; ++j ){
+			if( knn_prims[i*k+j] != brute.neighbors[j].prim ||
+				knn_dists[i*k+j] != std::sqrt( brute.neighbors[j].dist2 ) ){
+				std::cerr << "k_nearest " << name << ": batched neighbor " << j << " is " << knn_prims[i*k+j] <<
+					" but brute force found " << brute.neighbors[j].prim << std::endl;
+				return false;
+			}
+		}
+
+		int n_within = 0;
+		while( n_within < n_prims && brute.neighbors[n_within].dist2 <= radius*radius ){ n_within++; }
+		if( offsets[i+1]-offsets[i] != n_within ){
+			std::cerr << "radius_search " << name << ": found " << offsets[i+1]-offsets[i] <<
+				" but brute force found " << n_within << std::endl;
+			return false;
+		}
+		for( int j=0; j<n_within; ++j ){
+			if( rad_prims[offsets[i]+j] != brute.neighbors[j].prim ){
+				std::cerr << "radius_search " << name << ": results are not sorted by distance" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	// Fewer than k within range are padded
+	bvh::k_nearest( tree, verts, inds, &points[0], n_points, k, &knn_prims[0], &knn_dists[0], radius );
+	for( int i=0; i<n_points*k; ++i ){
+		if( knn_dists[i] > radius && ( knn_prims[i] != -1 || knn_dists[i] != std::numeric_limits<float>::max() ) ){
+			std::cerr << "k_nearest " << name << ": neighbor beyond max_dist" << std::endl;
+			return false;
+		}
+	}
+
+	// Self queries skip primitives that use the query vert
+	const int n_verts = mesh.vertices.size();
+	std::vector<int> self_prims( n_verts );
+	std::vector<float> self_dists( n_verts );
+	bvh::k_nearest( tree, verts, inds, verts, n_verts, 1, &self_prims[0], &self_dists[0],
+		std::numeric_limits<float>::max(), true );
+	for( int i=0; i<n_verts; ++i ){
+		for( int j=0; j<PDIM && self_prims[i] >= 0; ++j ){
+			if( inds[ self_prims[i]*PDIM+j ] == i ){
+				std::cerr << "k_nearest " << name << ": self query found its own vert" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool test_knn( const TriangleMesh &mesh ){
+
+	std::vector<int> vert_inds( mesh.vertices.size() );
+	std::iota( vert_inds.begin(), vert_inds.end(), 0 );
+	std::vector<int> tri_inds( &mesh.faces[0][0], &mesh.faces[0][0] + mesh.faces.size()*3 );
+	std::set< std::pair<int,int> > edges;
+	for( size_t i=0; i<mesh.faces.size(); ++i ){
+		for( int j=0; j<3; ++j ){
+			int a = mesh.faces[i][j], b = mesh.faces[i][(j+1)%3];
+			edges.insert( std::make_pair( std::min(a,b), std::max(a,b) ) );
+		}
+	}
+	std::vector<int> edge_inds;
+	for( std::set< std::pair<int,int> >::iterator it = edges.begin(); it != edges.end(); ++it ){
+		edge_inds.emplace_back( it->first );
+		edge_inds.emplace_back( it->second );
+	}
+
+	if( !test_knn_prims<1>( mesh, vert_inds, "verts" ) ){ return false; }
+	if( !test_knn_prims<2>( mesh, edge_inds, "edges" ) ){ return false; }
+	if( !test_knn_prims<3>( mesh, tri_inds, "triangles" ) ){ return false; }
+	return true;
+}
+
+// Closest, any, and all hits compared against testing every triangle,
+// and inside tests by the parity of the hits on a closed mesh.
+bool test_rays( const TriangleMesh &mesh ){
+
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, n_tris );
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	for( int i=0; i<500; ++i ){
+		Vec3f r( dist(gen), dist(gen), dist(gen) );
+		Vec3f point = aabb.min() + r.cwiseProduct( aabb.sizes() );
+		Vec3f dir = Vec3f( dist(gen), dist(gen), dist(gen) ) - Vec3f::Constant(0.5f);
+		dir.normalize();
+		raycast::Ray<float> ray( point - dir*aabb.sizes().norm(), dir );
+
+		std::vector< bvh::RayHit<float> > brute_hits;
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &f = mesh.faces[j];
+			raycast::Payload<float> payload;
+			payload.t_min = ray.eps;
+			if( raycast::ray_triangle( &ray, mesh.vertices[f[0]], mesh.vertices[f[1]], mesh.vertices[f[2]], &payload ) ){
+				brute_hits.emplace_back( payload.t_max, j );
+			}
+		}
+		std::sort( brute_hits.begin(), brute_hits.end() );
+
+		bvh::RayClosestHit<float> closest( ray, verts, inds );
+		tree.traverse_static( closest );
+		bvh::RayAllHits<float> all( ray, verts, inds );
+		tree.traverse( all );
+		all.sort();
+		bool all_match = all.hits.size() == brute_hits.size();
+		for( size_t j=0; all_match && j<all.hits.size(); ++j ){
+			all_match = all.hits[j].t == brute_hits[j].t && all.hits[j].prim == brute_hits[j].prim;
+		}
+		if( !all_match ){
+			std::cerr << "RayAllHits: " << all.hits.size() << " hits but brute force found " << brute_hits.size() << std::endl;
+			return false;
+		}
+		if( brute_hits.size() > 0 && closest.payload.t_max != brute_hits[0].t ){
+			std::cerr << "RayClosestHit: hit at " << closest.payload.t_max << " but brute force " << brute_hits[0].t << std::endl;
+			return false;
+		}
+
+		// Occluded only if something is hit before the point
+		const float t_point = aabb.sizes().norm();
+		bvh::RayAnyHit<float> any( ray, verts, inds );
+		any.payload.t_max = t_point;
+		tree.traverse_static( any );
+		bool occluded = brute_hits.size() > 0 && brute_hits[0].t < t_point;
+		if( occluded != ( any.hit_tri >= 0 ) ){
+			std::cerr << "RayAnyHit: occluded is " << ( any.hit_tri >= 0 ) << " but brute force says " << occluded << std::endl;
+			return false;
+		}
+	}
+
+	// Parity of the hits tells inside from outside on a closed sphere
+	std::shared_ptr<TriangleMesh> sphere = factory::make_sphere( Vec3f(0,0,0), 1.f, 32 );
+	bvh::AABBTree<float,3> sphere_tree;
+	const int n_sphere_tris = sphere->faces.size();
+	sphere_tree.init( &sphere->faces[0][0], &sphere->vertices[0][0], n_sphere_tris );
+	for( int i=0; i<500; ++i ){
+		Vec3f point = 2.4f*( Vec3f( dist(gen), dist(gen), dist(gen) ) - Vec3f::Constant(0.5f) );
+		float r = point.norm();
+		if( r > 0.9f && r < 1.1f ){ continue; }
+		Vec3f dir = Vec3f( dist(gen), dist(gen), dist(gen) ) - Vec3f::Constant(0.5f);
+		dir.normalize();
+		bvh::RayAllHits<float> all( raycast::Ray<float>( point, dir ), &sphere->vertices[0][0], &sphere->faces[0][0] );
+		sphere_tree.traverse_static( all );
+		if( ( all.hits.size() % 2 == 1 ) != ( r < 1.f ) ){
+			std::cerr << "RayAllHits: " << all.hits.size() << " hits from a point at radius " << r << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Structure of a dynamic tree: links, heights, and boxes
+bool check_dynamic( const bvh::DynamicTree<float,3> &tree, const std::vector<float> &verts, const std::vector<bool> &live ){
+
+	typedef bvh::DynamicTree<float,3>::Node Node;
+	const std::vector<Node> &nodes = tree.get_nodes();
+	int n_leaves = 0;
+	std::vector<int> stack;
+	if( tree.get_root() >= 0 ){
+		stack.emplace_back( tree.get_root() );
+		if( nodes[ tree.get_root() ].parent != -1 ){ std::cerr << "DynamicTree: root has a parent" << std::endl; return false; }
+	}
+	while( stack.size() > 0 ){
+		int idx = stack.back();
+		stack.pop_back();
+		const Node &node = nodes[idx];
+		if( node.is_leaf() ){
+			Eigen::AlignedBox<float,3> box;
+			for( int j=0; j<3; ++j ){ box.extend( Vec3f( &verts[ (node.prim*3+j)*3 ] ) ); }
+			if( node.height != 0 || !live[node.prim] || !node.aabb.contains( box ) ){
+				std::cerr << "DynamicTree: bad leaf for prim " << node.prim << std::endl;
+				return false;
+			}
+			n_leaves++;
+			continue;
+		}
+		const Node &c0 = nodes[ node.child[0] ], &c1 = nodes[ node.child[1] ];
+		if( c0.parent != idx || c1.parent != idx || node.height != 1 + std::max( c0.height, c1.height ) ||
+			!node.aabb.contains( c0.aabb ) || !node.aabb.contains( c1.aabb ) ){
+			std::cerr << "DynamicTree: bad interior node " << idx << std::endl;
+			return false;
+		}
+		stack.emplace_back( node.child[0] );
+		stack.emplace_back( node.child[1] );
+	}
+	if( n_leaves != tree.num_prims() || n_leaves != std::count( live.begin(), live.end(), true ) ){
+		std::cerr << "DynamicTree: " << n_leaves << " leaves for " << tree.num_prims() << " prims" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Inserts, removes, and moves triangles, and checks the tree and
+// nearest triangle queries against brute force along the way.
+bool test_dynamic( const TriangleMesh &mesh ){
+
+	// Separate verts for each triangle so they can move on their own
+	const int n_tris = mesh.faces.size();
+	std::vector<float> verts( n_tris*9 );
+	std::vector<int> inds( n_tris*3 );
+	for( int i=0; i<n_tris; ++i ){
+		for( int j=0; j<3; ++j ){
+			for( int k=0; k<3; ++k ){ verts[ (i*3+j)*3+k ] = mesh.vertices[ mesh.faces[i][j] ][k]; }
+			inds[i*3+j] = i*3+j;
+		}
+	}
+	auto tri_box = [&verts]( int tri ){
+		Eigen::AlignedBox<float,3> box;
+		for( int j=0; j<3; ++j ){ box.extend( Vec3f( &verts[ (tri*3+j)*3 ] ) ); }
+		return box;
+	};
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<mesh.vertices.size(); ++i ){ aabb.extend( mesh.vertices[i] ); }
+	const float margin = 0.002f*aabb.sizes().norm();
+	bvh::DynamicTree<float,3> tree( margin );
+	std::vector<bool> live( n_tris, false );
+	for( int i=0; i<n_tris; ++i ){
+		tree.insert( i, tri_box(i) );
+		live[i] = true;
+	}
+	if( !check_dynamic( tree, verts, live ) ){ return false; }
+
+	// Rotations keep the height near log2(n)
+	if( tree.height() > 2.0*std::log2( double(n_tris) ) ){
+		std::cerr << "DynamicTree: height " << tree.height() << " for " << n_tris << " prims" << std::endl;
+		return false;
+	}
+
+	bool threw = false;
+	try { tree.insert( 0, tri_box(0) ); } catch( const std::runtime_error & ){ threw = true; }
+	if( !threw ){ std::cerr << "DynamicTree: inserting a prim twice should throw" << std::endl; return false; }
+
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+	std::uniform_int_distribution<int> pick( 0, n_tris-1 );
+	const size_t n_nodes = tree.get_nodes().size();
+	for( int round=0; round<10; ++round ){
+
+		// Remove some, move some, and put some back
+		for( int i=0; i<200; ++i ){
+			int tri = pick(gen);
+			if( live[tri] ){ tree.remove( tri ); live[tri] = false; }
+		}
+		int n_reinserted = 0;
+		for( int i=0; i<200; ++i ){
+			int tri = pick(gen);
+			Vec3f move = 0.05f*aabb.sizes().norm()*( Vec3f( dist(gen), dist(gen), dist(gen) ) - Vec3f::Constant(0.5f) );
+			if( i % 2 == 0 ){ move *= 0.01f; } // small moves stay within the margin
+			for( int j=0; j<9; ++j ){ verts[ tri*9+j ] += move[j%3]; }
+			if( live[tri] ){ n_reinserted += tree.update( tri, tri_box(tri) ); }
+			else { tree.insert( tri, tri_box(tri) ); live[tri] = true; }
+		}
+		if( n_reinserted == 0 ){ std::cerr << "DynamicTree: no leaves were reinserted" << std::endl; return false; }
+		if( !check_dynamic( tree, verts, live ) ){ return false; }
+		if( tree.height() > 2.0*std::log2( double(n_tris) ) ){
+			std::cerr << "DynamicTree: height " << tree.height() << " after updates" << std::endl;
+			return false;
+		}
+
+		for( int i=0; i<50; ++i ){
+			Vec3f point = aabb.min() + Vec3f( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+			bvh::NearestTriangle<float> visitor( point, &verts[0], &inds[0] );
+			tree.traverse_static( visitor );
+			bvh::NearestTriangle<float> brute( point, &verts[0], &inds[0] );
+			for( int j=0; j<n_tris; ++j ){
+				if( live[j] ){ brute.hit_prim( j ); }
+			}
+			if( visitor.curr_nearest != brute.curr_nearest ){
+				std::cerr << "DynamicTree: nearest dist " << visitor.curr_nearest <<
+					" but brute force dist " << brute.curr_nearest << std::endl;
+				return false;
+			}
+		}
+	}
+
+	// Removed nodes are reused
+	if( tree.get_nodes().size() > n_nodes + 2*200 ){
+		std::cerr << "DynamicTree: node pool grew from " << n_nodes << " to " << tree.get_nodes().size() << std::endl;
+		return false;
+	}
+
+	for( int i=0; i<n_tris; ++i ){
+		if( live[i] ){ tree.remove( i ); live[i] = false; }
+	}
+	if( tree.get_root() != -1 || tree.num_prims() != 0 || !check_dynamic( tree, verts, live ) ){
+		std::cerr << "DynamicTree: not empty after removing everything" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Counts calls to the visitor, to check against the traversal stats
+template <typename V>
+struct CountingVisitor : public V {
+	long n_aabb, n_aabb_hit, n_prim;
+	template <typename... Args> CountingVisitor( Args&&... args ) :
+		V( std::forward<Args>(args)... ), n_aabb(0), n_aabb_hit(0), n_prim(0) {}
+	bool hit_aabb( const Eigen::AlignedBox<float,3> &aabb ){
+		n_aabb++;
+		bool hit = V::hit_aabb( aabb );
+		n_aabb_hit += hit;
+		return hit;
+	}
+	bool hit_prim( int prim ){ n_prim++; return V::hit_prim( prim ); }
+};
+
+// Traversal counts match the visitor calls, and the quality report adds up
+bool test_stats( const TriangleMesh &tris, const TetMesh &tets ){
+
+	const float *verts = &tris.vertices[0][0];
+	const int *inds = &tris.faces[0][0];
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, verts, tris.faces.size() );
+
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<tris.vertices.size(); ++i ){ aabb.extend( tris.vertices[i] ); }
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(0.f,1.f);
+
+	bvh::TraversalStats stats;
+	long n_aabb = 0, n_aabb_hit = 0, n_prim = 0;
+	const int n_queries = 200;
+	for( int i=0; i<n_queries; ++i ){
+		Vec3f point = aabb.min() + Vec3f( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+		CountingVisitor< bvh::NearestTriangle<float> > visitor( point, verts, inds );
+		tree.traverse_static( visitor, stats );
+		n_aabb += visitor.n_aabb;
+		n_aabb_hit += visitor.n_aabb_hit;
+		n_prim += visitor.n_prim;
+	}
+	if( stats.queries != n_queries || stats.aabb_tests != n_aabb ||
+		stats.nodes_visited != n_aabb_hit || stats.prim_tests != n_prim || stats.early_exits != 0 ){
+		std::cerr << "TraversalStats: counts " << stats.to_json() << " but visitor saw " <<
+			n_aabb << " aabb tests, " << n_aabb_hit << " hits, " << n_prim << " prim tests" << std::endl;
+		return false;
+	}
+	if( stats.max_stack <= 0 || stats.max_stack > tree.get_max_depth() ){
+		std::cerr << "TraversalStats: max stack " << stats.max_stack <<
+			" for tree depth " << tree.get_max_depth() << std::endl;
+		return false;
+	}
+
+	// Every point inside a tet stops the traversal early
+	const float *tet_verts = &tets.vertices[0][0];
+	const int *tet_inds = &tets.tets[0][0];
+	bvh::AABBTree<float,4> tet_tree;
+	tet_tree.init( tet_inds, tet_verts, tets.tets.size() );
+	bvh::TraversalStats tet_stats;
+	for( int i=0; i<100; ++i ){
+		const Vec4i &tet = tets.tets[ ( i*97 ) % tets.tets.size() ];
+		Vec3f point = 0.25f*( tets.vertices[tet[0]] + tets.vertices[tet[1]] +
+			tets.vertices[tet[2]] + tets.vertices[tet[3]] );
+		bvh::PointInTet<float> visitor( point, tet_verts, tet_inds );
+		tet_tree.traverse_static( visitor, tet_stats );
+	}
+	if( tet_stats.queries != 100 || tet_stats.early_exits != 100 ){
+		std::cerr << "TraversalStats: " << tet_stats.early_exits << " early exits of " <<
+			tet_stats.queries << " queries, expected 100" << std::endl;
+		return false;
+	}
+
+	// Without MCL_BVH_STATS the tree doesn't count
+	bvh::NearestTriangle<float> visitor( aabb.center(), verts, inds );
+	tree.traverse_static( visitor );
+#ifdef MCL_BVH_STATS
+	if( tree.get_stats().queries != 1 ){
+#else
+	if( tree.get_stats().queries != 0 ){
+#endif
+		std::cerr << "TraversalStats: tree counted " << tree.get_stats().queries << " queries" << std::endl;
+		return false;
+	}
+	tree.reset_stats();
+
+	bvh::TreeQuality q = bvh::tree_quality( tree );
+	int n_leaves = 0, n_depth = 0, n_prims = 0;
+	for( size_t i=0; i<q.leaf_size_histogram.size(); ++i ){
+		n_leaves += q.leaf_size_histogram[i];
+		n_prims += i*q.leaf_size_histogram[i];
+	}
+	for( size_t i=0; i<q.depth_histogram.size(); ++i ){ n_depth += q.depth_histogram[i]; }
+	if( q.num_nodes != (int)tree.get_nodes().size() || q.num_leaves != n_leaves || q.num_leaves != n_depth ||
+		q.num_nodes != 2*q.num_leaves-1 || n_prims != (int)tris.faces.size() || q.max_depth != tree.get_max_depth() ||
+		(int)q.depth_histogram.size() != q.max_depth+1 || q.sah_cost != double( tree.sah_cost() ) ){
+		std::cerr << "TreeQuality: report doesn't match tree " << q.to_json() << std::endl;
+		return false;
+	}
+	if( q.mean_overlap < 0.0 || q.mean_overlap > q.max_overlap || q.max_overlap > 1.0 ){
+		std::cerr << "TreeQuality: bad overlap " << q.mean_overlap << " " << q.max_overlap << std::endl;
+		return false;
+	}
+	std::string json = q.to_json();
+	if( json.empty() || json[0] != '{' || json[ json.size()-1 ] != '}' ){
+		std::cerr << "TreeQuality: bad json " << json << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Checks that an optimized tree is a valid, depth-first tree over every prim
+static bool check_optimized( const bvh::AABBTree<float,3> &tree, int n_tris, int max_leaf_size ){
+
+	const bvh::ArrayView<bvh::AABBTree<float,3>::Node> nodes = tree.get_nodes();
+	std::vector<int> prims( tree.get_prims().begin(), tree.get_prims().end() );
+	std::sort( prims.begin(), prims.end() );
+	for( int i=0; i<n_tris; ++i ){
+		if( (int)prims.size() != n_tris || prims[i] != i ){
+			std::cerr << "optimize: prims are not a permutation" << std::endl;
+			return false;
+		}
+	}
+
+	int n_prims = 0;
+	for( size_t i=0; i<nodes.size(); ++i ){
+		if( nodes[i].is_leaf() ){
+			if( nodes[i].offset != n_prims ){
+				std::cerr << "optimize: leaf " << i << " prims are not in leaf order" << std::endl;
+				return false;
+			}
+			if( nodes[i].num_prims > max_leaf_size ){
+				std::cerr << "optimize: leaf " << i << " has " << nodes[i].num_prims << " prims" << std::endl;
+				return false;
+			}
+			n_prims += nodes[i].num_prims;
+			continue;
+		}
+		if( nodes[i].offset <= int(i+1) || nodes[i].offset >= (int)nodes.size() ||
+			!nodes[i].aabb.contains( nodes[i+1].aabb ) || !nodes[i].aabb.contains( nodes[nodes[i].offset].aabb ) ){
+			std::cerr << "optimize: bad interior node " << i << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Optimizing lowers the SAH cost and gives the same query results
+bool test_optimize( const TriangleMesh &mesh ){
+
+	const int *inds = &mesh.faces[0][0];
+	const int n_tris = mesh.faces.size();
+	bvh::Settings settings;
+	settings.method = bvh::Settings::LBVH;
+	bvh::AABBTree<float,3> tree;
+	tree.init( inds, &mesh.vertices[0][0], n_tris, settings );
+
+	float lbvh_cost = tree.sah_cost();
+	tree.optimize();
+	float opt_cost = tree.sah_cost();
+	if( !( opt_cost < 0.95f*lbvh_cost ) || std::abs( tree.sah_ratio() - opt_cost/lbvh_cost ) > 1e-4f ){
+		std::cerr << "optimize: LBVH cost " << lbvh_cost << " went to " << opt_cost <<
+			", sah ratio " << tree.sah_ratio() << std::endl;
+		return false;
+	}
+	if( !check_optimized( tree, n_tris, settings.max_leaf_size ) || !test_nearest_triangle_tree( tree, mesh ) ){ return false; }
+
+	// Nothing left to improve with a second call
+	tree.optimize( 1 );
+	if( tree.sah_cost() > opt_cost*1.0001f ){
+		std::cerr << "optimize: cost went up from " << opt_cost << " to " << tree.sah_cost() << std::endl;
+		return false;
+	}
+
+	// Built with single prim leaves that are then collapsed, which
+	// comes close to the SAH build
+	bvh::AABBTree<float,3> sah_tree;
+	sah_tree.init( inds, &mesh.vertices[0][0], n_tris );
+	settings.optimize_passes = 3;
+	tree.init( inds, &mesh.vertices[0][0], n_tris, settings );
+	if( !( tree.sah_cost() < 1.1f*sah_tree.sah_cost() ) || tree.sah_ratio() != 1.f ){
+		std::cerr << "optimize: LBVH cost " << tree.sah_cost() << " with optimize_passes, SAH cost " <<
+			sah_tree.sah_cost() << ", sah ratio " << tree.sah_ratio() << std::endl;
+		return false;
+	}
+	if( !check_optimized( tree, n_tris, settings.max_leaf_size ) || !test_nearest_triangle_tree( tree, mesh ) ){ return false; }
+
+	// Optimize after a refit recovers some of the quality lost to a twist,
+	// and refit still works on the optimized tree
+	TriangleMesh deformed = mesh;
+	for( int step=1; step<=4; ++step ){
+		for( size_t i=0; i<mesh.vertices.size(); ++i ){
+			const Vec3f &v = mesh.vertices[i];
+			float a = v[1]*10.f*step;
+			deformed.vertices[i] = Vec3f( std::cos(a)*v[0] - std::sin(a)*v[2], v[1], std::sin(a)*v[0] + std::cos(a)*v[2] );
+		}
+		sah_tree.refit( &deformed.vertices[0][0] );
+		float refit_cost = sah_tree.sah_cost();
+		sah_tree.optimize();
+		if( sah_tree.sah_cost() > refit_cost || !check_optimized( sah_tree, n_tris, settings.max_leaf_size ) ){
+			std::cerr << "optimize: refit cost " << refit_cost << " went to " << sah_tree.sah_cost() << std::endl;
+			return false;
+		}
+	}
+	if( !test_nearest_triangle_tree( sah_tree, deformed ) ){ return false; }
+	return true;
+}
+
+// The sign must agree with the tets the surface came from
+bool test_signed_distance( const TetMesh &tets ){
+
+	TetMesh mesh = tets;
+	mesh.need_faces();
+	const float *verts = &mesh.vertices[0][0];
+	const int *inds = &mesh.faces[0][0];
+	const int n_verts = mesh.vertices.size();
+	const int n_tris = mesh.faces.size();
+	bvh::SignedDistance<float> sdf;
+	sdf.init( verts, n_verts, inds, n_tris );
+	if( sdf.open_edges() != 0 ){
+		std::cerr << "SignedDistance: " << sdf.open_edges() << " open edges on a closed mesh" << std::endl;
+		return false;
+	}
+
+	bvh::AABBTree<float,4> tet_tree;
+	tet_tree.init( &mesh.tets[0][0], verts, mesh.tets.size() );
+	Eigen::AlignedBox<float,3> aabb;
+	for( int i=0; i<n_verts; ++i ){ aabb.extend( mesh.vertices[i] ); }
+	const float diag = aabb.sizes().norm();
+	const float eps = 1e-4f*diag;
+
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<float> dist(-0.1f,1.1f);
+	const int n_points = 2000;
+	std::vector<Vec3f> points( n_points );
+	std::vector<float> dists( n_points );
+	int n_inside = 0;
+	for( int i=0; i<n_points; ++i ){
+		points[i] = aabb.min() + Vec3f( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+		Vec3f nearest;
+		int tri = -1;
+		dists[i] = sdf.distance( points[i], &nearest, &tri );
+
+		bvh::NearestTriangle<float> visitor( points[i], verts, inds );
+		sdf.get_tree().traverse_static( visitor );
+		if( tri != visitor.hit_tri || std::abs( std::abs( dists[i] ) - (nearest-points[i]).norm() ) > 1e-6f*diag ||
+			std::abs( dists[i]*dists[i] - visitor.curr_nearest ) > 1e-6f*diag*diag ){
+			std::cerr << "SignedDistance: distance " << dists[i] << " to tri " << tri <<
+				" but nearest triangle " << visitor.hit_tri << " at " << std::sqrt( visitor.curr_nearest ) << std::endl;
+			return false;
+		}
+
+		bvh::PointInTet<float> tet_visitor( points[i], verts, &mesh.tets[0][0] );
+		tet_tree.traverse_static( tet_visitor );
+		bool inside = tet_visitor.hit_tet >= 0;
+		n_inside += inside;
+		if( std::abs( dists[i] ) > eps && inside != sdf.inside( points[i] ) ){
+			std::cerr << "SignedDistance: point " << points[i].transpose() << " has distance " << dists[i] <<
+				" but is " << ( inside ? "inside" : "outside" ) << " the tets" << std::endl;
+			return false;
+		}
+	}
+	if( n_inside == 0 ){
+		std::cerr << "SignedDistance: no points inside" << std::endl;
+		return false;
+	}
+
+	// Batched is the same
+	std::vector<float> batch_dists( n_points );
+	sdf.distance( &points[0][0], n_points, &batch_dists[0] );
+	for( int i=0; i<n_points; ++i ){
+		if( batch_dists[i] != dists[i] ){
+			std::cerr << "SignedDistance: batch distance " << batch_dists[i] << " but " << dists[i] << std::endl;
+			return false;
+		}
+	}
+
+	// Points just off the surface, nearest to a vert or edge. The vertex
+	// normal of the tet mesh is close enough to the pseudonormal.
+	mesh.need_normals();
+	for( int i=0; i<n_tris; i+=7 ){
+		const Vec3i &f = mesh.faces[i];
+		const Vec3f edge_mid = 0.5f*( mesh.vertices[f[0]] + mesh.vertices[f[1]] );
+		const Vec3f normal = ( mesh.vertices[f[1]]-mesh.vertices[f[0]] ).cross( mesh.vertices[f[2]]-mesh.vertices[f[0]] ).normalized();
+		const Vec3f &v = mesh.vertices[f[0]];
+		const Vec3f &vn = mesh.normals[f[0]];
+		if( sdf.distance( v + eps*vn ) <= 0.f || sdf.distance( v - eps*vn ) >= 0.f ||
+			sdf.distance( edge_mid + eps*normal ) <= 0.f || sdf.distance( edge_mid - eps*normal ) >= 0.f ){
+			std::cerr << "SignedDistance: wrong sign next to tri " << i << std::endl;
+			return false;
+		}
+	}
+
+	// Moved verts
+	std::vector<Vec3f> moved = mesh.vertices;
+	for( int i=0; i<n_verts; ++i ){ moved[i] += Vec3f( 0.5f*diag, 0, 0 ); }
+	sdf.refit( &moved[0][0] );
+	for( int i=0; i<n_points; ++i ){
+		float d = sdf.distance( points[i] + Vec3f( 0.5f*diag, 0, 0 ) );
+		if( std::abs( d - dists[i] ) > 1e-4f*diag ){
+			std::cerr << "SignedDistance: distance " << d << " after refit, expected " << dists[i] << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// True if tet contains the point, allowing for rounding on its faces
+static bool tet_contains( const TetMesh &mesh, const std::vector<Vec3f> &verts, int tet, const Vec3f &point ){
+	if( tet < 0 || tet >= (int)mesh.tets.size() ){ return false; }
+	const Vec4i &t = mesh.tets[tet];
+	Vec4f bary = vec::barycoords( point, verts[t[0]], verts[t[1]], verts[t[2]], verts[t[3]] );
+	return bary.minCoeff() >= -1e-5f;
+}
+
+// Walks find a tet containing the point, from near or far starts
+bool test_tet_locator( const TetMesh &mesh ){
+
+	const int n_tets = mesh.tets.size();
+	std::vector<Vec3f> verts = mesh.vertices;
+	bvh::TetLocator<float> locator;
+	locator.init( &verts[0][0], &mesh.tets[0][0], n_tets );
+
+	// Every interior face has a neighbor on both sides,
+	// and the rest are the surface.
+	const std::vector<int> &neighbors = locator.get_neighbors();
+	int n_boundary = 0;
+	for( int i=0; i<n_tets*4; ++i ){
+		const int nbr = neighbors[i];
+		if( nbr < 0 ){ n_boundary++; continue; }
+		const int *back = &neighbors[nbr*4];
+		if( back[0] != i/4 && back[1] != i/4 && back[2] != i/4 && back[3] != i/4 ){
+			std::cerr << "TetLocator: tet " << nbr << " is a neighbor of " << i/4 << " but not the other way" << std::endl;
+			return false;
+		}
+	}
+	TetMesh surface = mesh;
+	surface.need_faces( true );
+	if( n_boundary != (int)surface.faces.size() ){
+		std::cerr << "TetLocator: " << n_boundary << " boundary faces, expected " << surface.faces.size() << std::endl;
+		return false;
+	}
+
+	std::mt19937 gen(1234);
+	std::uniform_int_distribution<int> tet_dist(0,n_tets-1);
+	std::uniform_real_distribution<float> dist(0.1f,1.f);
+	const int n_points = 2000;
+	std::vector<Vec3f> points( n_points );
+	for( int i=0; i<n_points; ++i ){
+		const Vec4i &tet = mesh.tets[ tet_dist(gen) ];
+		Vec4f b( dist(gen), dist(gen), dist(gen), dist(gen) );
+		b /= b.sum();
+		points[i] = b[0]*verts[tet[0]] + b[1]*verts[tet[1]] + b[2]*verts[tet[2]] + b[3]*verts[tet[3]];
+	}
+
+	// From the tree and from random tets (which often leave the mesh)
+	for( int i=0; i<n_points; ++i ){
+		Vec4f bary;
+		int tree_tet = locator.locate( points[i], -1, &bary );
+		int walk_tet = locator.locate( points[i], tet_dist(gen) );
+		if( !tet_contains( mesh, verts, tree_tet, points[i] ) || !tet_contains( mesh, verts, walk_tet, points[i] ) ||
+			std::abs( bary.sum()-1.f ) > 1e-4f || bary.minCoeff() < -1e-5f ){
+			std::cerr << "TetLocator: point " << i << " not in tet " << tree_tet << " or " << walk_tet << std::endl;
+			return false;
+		}
+	}
+
+	// Small moves from the last tets barely need the tree
+	std::vector<int> tets( n_points, -1 );
+	locator.locate( &points[0][0], n_points, &tets[0] );
+	Eigen::AlignedBox<float,3> aabb;
+	for( size_t i=0; i<verts.size(); ++i ){ aabb.extend( verts[i] ); }
+	const float step = 1e-3f*aabb.sizes().norm();
+	std::uniform_real_distribution<float> move_dist(-step,step);
+	int n_tree = 0, n_outside = 0;
+	for( int frame=0; frame<10; ++frame ){
+		for( int i=0; i<n_points; ++i ){ points[i] += Vec3f( move_dist(gen), move_dist(gen), move_dist(gen) ); }
+		std::vector<float> barys( n_points*4 );
+		n_tree += locator.locate( &points[0][0], n_points, &tets[0], &barys[0] );
+		for( int i=0; i<n_points; ++i ){
+			if( tets[i] < 0 ){
+				n_outside++;
+				bvh::PointInTet<float> visitor( points[i], &verts[0][0], &mesh.tets[0][0] );
+				locator.get_tree().traverse_static( visitor );
+				if( visitor.hit_tet >= 0 ){
+					std::cerr << "TetLocator: missed point " << i << " in tet " << visitor.hit_tet << std::endl;
+					return false;
+				}
+				tets[i] = -1;
+				continue;
+			}
+			if( !tet_contains( mesh, verts, tets[i], points[i] ) || barys[i*4] < -1e-5f ){
+				std::cerr << "TetLocator: moved point " << i << " not in tet " << tets[i] << std::endl;
+				return false;
+			}
+		}
+	}
+	if( n_tree > n_outside + n_points/10 ){
+		std::cerr << "TetLocator: " << n_tree << " tree queries for small moves" << std::endl;
+		return false;
+	}
+
+	// After the tets move
+	for( size_t i=0; i<verts.size(); ++i ){ verts[i] *= 1.1f; }
+	for( int i=0; i<n_points; ++i ){ points[i] *= 1.1f; }
+	locator.refit( &verts[0][0] );
+	locator.locate( &points[0][0], n_points, &tets[0] );
+	for( int i=0; i<n_points; ++i ){
+		if( tets[i] >= 0 && !tet_contains( mesh, verts, tets[i], points[i] ) ){
+			std::cerr << "TetLocator: point " << i << " not in tet " << tets[i] << " after refit" << std::endl;
+			return false;
+		}
+	}
+
+	// Outside the mesh
+	if( locator.locate( Vec3f( aabb.max() + aabb.sizes() ), 0 ) != -1 ){
+		std::cerr << "TetLocator: found a tet for a point outside the mesh" << std::endl;
+		return false;
+	}
+
+	// With a rebuild ratio of zero every refit rebuilds the tree,
+	// which resets its SAH ratio to one.
+	bvh::Settings settings;
+	settings.rebuild_ratio = 0;
+	bvh::TetLocator<float> rebuilt;
+	rebuilt.init( &verts[0][0], &mesh.tets[0][0], n_tets, settings );
+	for( size_t i=0; i<verts.size(); ++i ){
+		float a = 4.f * ( verts[i][1] - aabb.min()[1] ) / aabb.sizes()[1];
+		verts[i] = Vec3f( std::cos(a)*verts[i][0] - std::sin(a)*verts[i][2], verts[i][1],
+			std::sin(a)*verts[i][0] + std::cos(a)*verts[i][2] );
+	}
+	rebuilt.refit( &verts[0][0] );
+	if( rebuilt.get_tree().sah_ratio() != 1.f ){
+		std::cerr << "TetLocator: tree not rebuilt, SAH ratio " << rebuilt.get_tree().sah_ratio() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Packet hits must match ray_triangle and SlabRay::entry except
+// where rounding can go either way.
+template <typename T, int W>
+bool test_ray_packets( const TriangleMesh &mesh ){
+
+	typedef raycast::PacketKernels<T,W> Kernels;
+	const int n_tris = mesh.faces.size();
+	std::vector<Vec3<T> > verts( mesh.vertices.size() );
+	Eigen::AlignedBox<T,3> aabb;
+	for( size_t i=0; i<verts.size(); ++i ){
+		verts[i] = mesh.vertices[i].template cast<T>();
+		aabb.extend( verts[i] );
+	}
+	const T scale = aabb.sizes().norm();
+	const T tol = T(1e-4);
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<T> dist(0,1);
+	std::uniform_int_distribution<int> rand_tri(0,n_tris-1);
+
+	// Rays toward points near a random triangle, so about half hit.
+	// Some start past the point, so the triangle is behind them.
+	auto random_ray = [&]( const Vec3<T> &target ){
+		Vec3<T> r( dist(gen), dist(gen), dist(gen) );
+		Vec3<T> origin = aabb.min() - aabb.sizes()*T(0.5) + r.cwiseProduct( aabb.sizes()*T(2) );
+		Vec3<T> dir = ( target - origin ).normalized();
+		if( dist(gen) < T(0.25) ){ origin = target + dir*scale*dist(gen); }
+		return raycast::Ray<T>( origin, dir );
+	};
+	auto near_tri = [&]( int tri ){
+		const Vec3i &f = mesh.faces[tri];
+		Vec3<T> b( dist(gen), dist(gen), dist(gen) );
+		b = b*T(1.5) - Vec3<T>::Constant(T(0.25));
+		return ( verts[f[0]]*b[0] + verts[f[1]]*b[1] + verts[f[2]]*b[2] ) / b.sum();
+	};
+
+	// The scalar test, and whether the ray is close enough to an edge
+	// or the ends of the range that the packet may disagree.
+	auto check_triangle = [&]( const raycast::Ray<T> &ray, T t_min, T t_max, int tri, bool hit,
+		T t, T beta, T gamma, const char *name ){
+		const Vec3i &f = mesh.faces[tri];
+		raycast::Payload<T> payload;
+		payload.t_min = t_min;
+		payload.t_max = t_max;
+		bool ref_hit = raycast::ray_triangle( &ray, verts[f[0]], verts[f[1]], verts[f[2]], &payload );
+
+		// Rounding error grows as the ray gets closer to the plane
+		// and farther from the triangle
+		const Vec3<T> e0 = verts[f[1]]-verts[f[0]], e1 = verts[f[0]]-verts[f[2]];
+		const Vec3<T> n = e1.cross( e0 );
+		const T scaled_dist = T(64)*std::numeric_limits<T>::epsilon()*( verts[f[0]]-ray.origin ).norm() /
+			std::abs( n.dot( ray.direction ) );
+		const T err = scaled_dist*std::max( e0.norm(), e1.norm() )*ray.direction.norm();
+		const T t_err = scaled_dist*n.norm();
+		if( hit && ref_hit ){
+			if( std::abs( t - payload.t_max ) > t_err ||
+				std::abs( beta - payload.bary[1] ) > err || std::abs( gamma - payload.bary[2] ) > err ){
+				std::cerr << name << ": hit at t = " << t << " but ray_triangle at " << payload.t_max << std::endl;
+				return false;
+			}
+		}
+		if( hit != ref_hit ){
+			const T alpha = T(1) - beta - gamma;
+			const T margin = std::min( std::min( std::abs(alpha), std::abs(beta) ), std::abs(gamma) );
+			// alpha+beta+gamma <= 1 only fails by rounding, which either may do
+			const bool sum_test = alpha > T(0) && beta > T(0) && gamma > T(0) && t > t_min && t < t_max;
+			if( !( margin < err ) && !( std::min( std::abs(t-t_min), std::abs(t-t_max) ) < t_err ) && !sum_test ){
+				std::cerr << name << ": " << ( hit ? "hit" : "missed" ) << " triangle " << tri <<
+					" but ray_triangle " << ( ref_hit ? "hit" : "missed" ) << std::endl;
+				
+				return false;
+			}
+		}
+		return true;
+	};
+
+	int n_hits = 0;
+	for( int i=0; i<500; ++i ){
+
+		// One ray against W triangles, with a short range on some
+		const int base_tri = rand_tri(gen);
+		raycast::Ray<T> ray = random_ray( near_tri( base_tri ) );
+		const T t_min = ray.eps;
+		const T t_max = i%4 == 0 ? dist(gen)*scale : std::numeric_limits<T>::max();
+		raycast::TrianglePacket<T,W> tris;
+		int tri_inds[W];
+		const int num = i%5 == 0 ? 1 + i%W : W; // partly filled packets
+		for( int j=0; j<num; ++j ){
+			tri_inds[j] = j == 0 ? base_tri : rand_tri(gen);
+			const Vec3i &f = mesh.faces[ tri_inds[j] ];
+			tris.set( j, verts[f[0]], verts[f[1]], verts[f[2]] );
+		}
+		T t[W], beta[W], gamma[W];
+		int mask = Kernels::ray_triangles( ray, t_min, t_max, tris, t, beta, gamma );
+		if( mask >> num ){
+			std::cerr << "ray_triangles: hit an unused lane" << std::endl;
+			return false;
+		}
+		for( int j=0; j<num; ++j ){
+			bool hit = ( mask >> j ) & 1;
+			n_hits += int(hit);
+			if( !check_triangle( ray, t_min, t_max, tri_inds[j], hit, t[j], beta[j], gamma[j], "ray_triangles" ) ){ return false; }
+		}
+
+		// W rays against one triangle, each with its own range
+		raycast::RayPacket<T,W> rays;
+		raycast::Ray<T> lane_rays[W];
+		for( int j=0; j<num; ++j ){
+			lane_rays[j] = random_ray( near_tri( base_tri ) );
+			rays.set( j, lane_rays[j], lane_rays[j].eps, j%2 == 0 ? dist(gen)*scale : std::numeric_limits<T>::max() );
+		}
+		const Vec3i &base_f = mesh.faces[base_tri];
+		mask = Kernels::rays_triangle( rays, verts[base_f[0]], verts[base_f[1]], verts[base_f[2]], t, beta, gamma );
+		if( mask >> num ){
+			std::cerr << "rays_triangle: hit an unused lane" << std::endl;
+			return false;
+		}
+		for( int j=0; j<num; ++j ){
+			bool hit = ( mask >> j ) & 1;
+			n_hits += int(hit);
+			if( !check_triangle( lane_rays[j], rays.t_min[j], rays.t_max[j], base_tri, hit, t[j], beta[j], gamma[j], "rays_triangle" ) ){ return false; }
+		}
+
+		// One ray against W boxes around triangles. A mismatch has to flip
+		// when the box grows or shrinks a little.
+		T min_x[W], min_y[W], min_z[W], max_x[W], max_y[W], max_z[W];
+		Eigen::AlignedBox<T,3> boxes[W];
+		for( int j=0; j<W; ++j ){
+			const Vec3i &f = mesh.faces[ rand_tri(gen) ];
+			boxes[j].setEmpty();
+			for( int k=0; k<3; ++k ){ boxes[j].extend( verts[f[k]] ); }
+			boxes[j].extend( boxes[j].center() + aabb.sizes()*T(0.05)*( dist(gen)-T(0.5) ) );
+			min_x[j] = boxes[j].min()[0]; min_y[j] = boxes[j].min()[1]; min_z[j] = boxes[j].min()[2];
+			max_x[j] = boxes[j].max()[0]; max_y[j] = boxes[j].max()[1]; max_z[j] = boxes[j].max()[2];
+		}
+		raycast::SlabRay<T> slab( ray );
+		T t_near[W];
+		mask = Kernels::ray_boxes( slab.origin.data(), slab.inv_dir.data(), min_x, min_y, min_z, max_x, max_y, max_z,
+			t_min, t_max, t_near );
+		T line_near[W];
+		const int line_mask = Kernels::ray_boxes( slab.origin.data(), slab.inv_dir.data(), min_x, min_y, min_z,
+			max_x, max_y, max_z, -std::numeric_limits<T>::max(), std::numeric_limits<T>::max(), line_near );
+		const T pad = tol*scale;
+		for( int j=0; j<W; ++j ){
+			bool hit = ( mask >> j ) & 1;
+			n_hits += int(hit);
+			T entry = slab.entry( boxes[j].min(), boxes[j].max(), t_min, t_max );
+			bool ref_hit = entry < std::numeric_limits<T>::max();
+			bool outer = slab.entry( boxes[j].min() - Vec3<T>::Constant(pad), boxes[j].max() + Vec3<T>::Constant(pad), t_min, t_max ) <
+				std::numeric_limits<T>::max();
+			bool inner = slab.entry( boxes[j].min() + Vec3<T>::Constant(pad), boxes[j].max() - Vec3<T>::Constant(pad), t_min, t_max ) <
+				std::numeric_limits<T>::max();
+			if( hit != ref_hit && inner == outer ){
+				std::cerr << "ray_boxes: " << ( hit ? "hit" : "missed" ) << " a box SlabRay::entry " <<
+					( ref_hit ? "hit" : "missed" ) << std::endl;
+				return false;
+			}
+			if( hit && ref_hit && std::abs( t_near[j] - entry ) > pad ){
+				std::cerr << "ray_boxes: entered at " << t_near[j] << " but SlabRay::entry at " << entry << std::endl;
+				return false;
+			}
+
+			// Over the whole line it's the same as ray_aabb
+			bool line_ref = raycast::ray_aabb( &ray, boxes[j].min(), boxes[j].max() );
+			if( bool( ( line_mask >> j ) & 1 ) != line_ref && inner == outer ){
+				std::cerr << "ray_boxes: does not match ray_aabb over the whole line" << std::endl;
+				return false;
+			}
+		}
+
+		// W rays against one box
+		T ray_near[W];
+		mask = Kernels::rays_box( rays, boxes[0].min(), boxes[0].max(), ray_near );
+		if( mask >> num ){
+			std::cerr << "rays_box: hit an unused lane" << std::endl;
+			return false;
+		}
+		for( int j=0; j<num; ++j ){
+			bool hit = ( mask >> j ) & 1;
+			raycast::SlabRay<T> lane_slab( lane_rays[j] );
+			T entry = lane_slab.entry( boxes[0].min(), boxes[0].max(), rays.t_min[j], rays.t_max[j] );
+			bool ref_hit = entry < std::numeric_limits<T>::max();
+			bool outer = lane_slab.entry( boxes[0].min() - Vec3<T>::Constant(pad), boxes[0].max() + Vec3<T>::Constant(pad),
+				rays.t_min[j], rays.t_max[j] ) < std::numeric_limits<T>::max();
+			bool inner = lane_slab.entry( boxes[0].min() + Vec3<T>::Constant(pad), boxes[0].max() - Vec3<T>::Constant(pad),
+				rays.t_min[j], rays.t_max[j] ) < std::numeric_limits<T>::max();
+			if( hit != ref_hit && inner == outer ){
+				std::cerr << "rays_box: " << ( hit ? "hit" : "missed" ) << " a box SlabRay::entry " <<
+					( ref_hit ? "hit" : "missed" ) << std::endl;
+				return false;
+			}
+		}
+	}
+
+	// Axis-parallel rays with the origin on a face plane of the box give
+	// 0*inf = NaN in that slab, which SlabRay::entry ignores. Lanes cover
+	// origins on the min and max planes and directions of +0 and -0.
+	const Vec3<T> face_min( 0, 0, 0 ), face_max( 1, 1, 1 );
+	raycast::RayPacket<T,W> face_rays;
+	raycast::Ray<T> face_lanes[W];
+	T fmin[3][W], fmax[3][W];
+	for( int j=0; j<W; ++j ){
+		Vec3<T> origin( j%2 == 0 ? T(0) : T(1), T(0.5), T(-1) );
+		Vec3<T> dir( (j/2)%2 == 0 ? T(0) : -T(0), T(0), T(1) );
+		face_lanes[j] = raycast::Ray<T>( origin, dir );
+		face_rays.set( j, face_lanes[j], T(0), std::numeric_limits<T>::max() );
+		for( int k=0; k<3; ++k ){ fmin[k][j] = face_min[k]; fmax[k][j] = face_max[k]; }
+	}
+	T face_near[W];
+	const int face_mask = Kernels::rays_box( face_rays, face_min, face_max, face_near );
+	for( int j=0; j<W; ++j ){
+		raycast::SlabRay<T> face_slab( face_lanes[j] );
+		const T entry = face_slab.entry( face_min, face_max, T(0), std::numeric_limits<T>::max() );
+		T box_near[W];
+		const int box_mask = Kernels::ray_boxes( face_slab.origin.data(), face_slab.inv_dir.data(),
+			fmin[0], fmin[1], fmin[2], fmax[0], fmax[1], fmax[2], T(0), std::numeric_limits<T>::max(), box_near );
+		if( entry != T(1) || !( ( face_mask >> j ) & 1 ) || face_near[j] != entry ||
+			box_mask != ( 1 << W )-1 || box_near[0] != entry ){
+			std::cerr << "Ray packets (" << Kernels::name() << "): ray on a face plane entered at " <<
+				face_near[j] << " and " << box_near[0] << " but SlabRay::entry at " << entry << std::endl;
+			return false;
+		}
+	}
+
+	if( n_hits == 0 ){
+		std::cerr << "Ray packets (" << Kernels::name() << "): nothing was hit" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+bool test_ambient_occlusion(){
+
+	// A grid on z=0 from -2 to 2, facing up, and a square of half size a
+	// at height h over the middle, facing down.
+	const int n = 21;
+	const float a = 0.5f, h = 0.5f;
+	std::vector<Vec3f> verts;
+	std::vector<Vec3i> faces;
+	for( int i=0; i<n; ++i ){
+		for( int j=0; j<n; ++j ){ verts.emplace_back( -2.f + 4.f*j/(n-1), -2.f + 4.f*i/(n-1), 0.f ); }
+	}
+	for( int i=0; i<n-1; ++i ){
+		for( int j=0; j<n-1; ++j ){
+			const int v = i*n+j;
+			faces.emplace_back( v, v+1, v+n+1 );
+			faces.emplace_back( v, v+n+1, v+n );
+		}
+	}
+	const int center = (n/2)*n + n/2;
+	const int n_plane_verts = verts.size();
+	const int n_plane_faces = faces.size();
+	verts.emplace_back( -a, -a, h );
+	verts.emplace_back( a, -a, h );
+	verts.emplace_back( a, a, h );
+	verts.emplace_back( -a, a, h );
+	faces.emplace_back( n_plane_verts, n_plane_verts+2, n_plane_verts+1 );
+	faces.emplace_back( n_plane_verts, n_plane_verts+3, n_plane_verts+2 );
+
+	// Nothing can block the plane on its own
+	bvh::AmbientOcclusion<float> plane;
+	plane.max_dist = 10.f;
+	plane.init( &verts[0][0], n_plane_verts, &faces[0][0], n_plane_faces );
+	plane.sample( 64 );
+	for( int i=0; i<n_plane_verts; ++i ){
+		if( plane.get_visibility()[i] != 1.f || plane.get_num_samples()[i] != 64 ){
+			std::cerr << "Ambient occlusion: vertex " << i << " of an open plane has visibility " <<
+				plane.get_visibility()[i] << std::endl;
+			return false;
+		}
+	}
+
+	// Under the square, visibility is 1 minus its view factor,
+	// which is four times that of a corner rectangle.
+	const float ab = a/h;
+	const float f_corner = ( 2.f * ab/std::sqrt(1.f+ab*ab) * std::atan( ab/std::sqrt(1.f+ab*ab) ) ) / float(2.0*M_PI);
+	const float expected = 1.f - 4.f*f_corner;
+
+	// Progressive sampling gives the same result as all at once
+	bvh::AmbientOcclusion<float> ao, ao_once;
+	ao.max_dist = 10.f;
+	ao.init( &verts[0][0], verts.size(), &faces[0][0], faces.size() );
+	ao.sample( 256 );
+	ao.sample( 768 );
+	ao_once.max_dist = 10.f;
+	ao_once.init( &verts[0][0], verts.size(), &faces[0][0], faces.size() );
+	ao_once.sample( 1024 );
+	const float vis = ao.get_visibility()[center];
+	if( ao.get_num_samples()[center] != 1024 || std::abs( vis - expected ) > 0.02f ){
+		std::cerr << "Ambient occlusion: visibility under a square is " << vis <<
+			" with " << ao.get_num_samples()[center] << " samples, expected " << expected << std::endl;
+		return false;
+	}
+	for( size_t i=0; i<verts.size(); ++i ){
+		if( std::abs( ao.get_visibility()[i] - ao_once.get_visibility()[i] ) > 1e-5f ){
+			std::cerr << "Ambient occlusion: progressive visibility " << ao.get_visibility()[i] <<
+				" != " << ao_once.get_visibility()[i] << std::endl;
+			return false;
+		}
+	}
+
+	std::vector<Vec3f> colors;
+	ao.get_colors( colors, Vec3f(1,0.5f,0) );
+	if( colors.size() != verts.size() || ( colors[center] - Vec3f(vis,0.5f*vis,0) ).norm() > 1e-6f ){
+		std::cerr << "Ambient occlusion: bad colors" << std::endl;
+		return false;
+	}
+
+	// Move the square out of range. The last result is kept as a
+	// starting point and new samples bring it back toward open.
+	for( int i=n_plane_verts; i<(int)verts.size(); ++i ){ verts[i][2] += 100.f; }
+	ao.refit( &verts[0][0], 16 );
+	if( ao.get_num_samples()[center] != 16 || ao.get_visibility()[center] != vis ){
+		std::cerr << "Ambient occlusion: refit did not keep the history" << std::endl;
+		return false;
+	}
+	ao.sample( 48 );
+	const float vis_refit = ao.get_visibility()[center];
+	const float expected_refit = ( 16.f*vis + 48.f ) / 64.f;
+	if( ao.get_num_samples()[center] != 64 || std::abs( vis_refit - expected_refit ) > 1e-5f ){
+		std::cerr << "Ambient occlusion: visibility after refit is " << vis_refit <<
+			", expected " << expected_refit << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+// Packet projections must match point_on_triangle up to rounding. Where two
+// edges are about as near, either can be picked, so those points only need
+// to be as near as the scalar one.
+template <typename T, int W>
+bool test_projection_packets( const TriangleMesh &mesh ){
+
+	typedef projection::PacketProjection<T,W> Proj;
+	const int n_tris = mesh.faces.size();
+	std::vector<Vec3<T> > verts( mesh.vertices.size() );
+	for( size_t i=0; i<verts.size(); ++i ){ verts[i] = mesh.vertices[i].template cast<T>(); }
+	const T eps = std::numeric_limits<T>::epsilon();
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<T> dist(-1,1);
+	std::uniform_int_distribution<int> rand_tri(0,n_tris-1);
+
+	int n_inside = 0, n_tested = 0;
+	auto check = [&]( const Vec3<T> &p, const Vec3<T> &p1, const Vec3<T> &p2, const Vec3<T> &p3,
+		const Vec3<T> &q, T d2 ){
+		T s, t;
+		const Vec3<T> q_ref = projection::point_on_triangle( p, p1, p2, p3, s, t );
+		const T d2_ref = ( q_ref - p ).squaredNorm();
+		const T r = std::max( (p-p1).norm(), std::max( (p2-p1).norm(), std::max( (p3-p1).norm(), (p3-p2).norm() ) ) );
+		const T d2_tol = T(64)*eps*r*r;
+		n_inside += int( s > T(0) && t > T(0) && s+t < T(1) );
+		n_tested++;
+		if( std::abs( d2 - d2_ref ) > d2_tol || std::abs( d2 - (q-p).squaredNorm() ) > d2_tol ||
+			( (q-q_ref).norm() > T(64)*eps*r && std::abs( d2 - d2_ref ) > T(4)*eps*r*r ) ){
+			std::cerr << "Projection packets (" << Proj::name() << "): point " << p.transpose() <<
+				" projects to " << q.transpose() << " (" << d2 << "), expected " << q_ref.transpose() <<
+				" (" << d2_ref << ")" << std::endl;
+			return false;
+		}
+		return true;
+	};
+
+	// Many points on one triangle, scattered around it so every region is hit,
+	// and half of them above or below it
+	const int n_points = 4*W+3; // not a multiple of W
+	std::vector<T> p[3], q[3], d2( n_points );
+	for( int i=0; i<3; ++i ){ p[i].resize( n_points ); q[i].resize( n_points ); }
+	for( int i=0; i<200; ++i ){
+		const Vec3i &f = mesh.faces[ rand_tri(gen) ];
+		const Vec3<T> &p1 = verts[f[0]], &p2 = verts[f[1]], &p3 = verts[f[2]];
+		const Vec3<T> center = ( p1+p2+p3 ) / T(3);
+		const T size = std::max( (p2-p1).norm(), (p3-p1).norm() );
+		const Vec3<T> normal = ( p2-p1 ).cross( p3-p1 ).normalized();
+		for( int j=0; j<n_points; ++j ){
+			Vec3<T> pt = center + Vec3<T>( dist(gen), dist(gen), dist(gen) )*size*T(1.5);
+			if( j % 2 ){
+				const Vec3<T> b = Vec3<T>( dist(gen), dist(gen), dist(gen) ).cwiseAbs() + Vec3<T>::Constant(T(1e-3));
+				pt = ( p1*b[0] + p2*b[1] + p3*b[2] ) / b.sum() + normal*size*dist(gen);
+			}
+			for( int k=0; k<3; ++k ){ p[k][j] = pt[k]; }
+		}
+		Proj::points_triangle( n_points, &p[0][0], &p[1][0], &p[2][0], p1, p2, p3, &q[0][0], &q[1][0], &q[2][0], &d2[0] );
+		for( int j=0; j<n_points; ++j ){
+			const Vec3<T> pt( p[0][j], p[1][j], p[2][j] ), qt( q[0][j], q[1][j], q[2][j] );
+			if( !check( pt, p1, p2, p3, qt, d2[j] ) ){ return false; }
+		}
+	}
+
+	if( n_inside < n_tested/10 ){
+		std::cerr << "Projection packets (" << Proj::name() << "): only " << n_inside << " of " <<
+			n_tested << " points were inside their triangle" << std::endl;
+		return false;
+	}
+
+	// One point on every triangle, skipping degenerate ones where the scalar
+	// version divides by zero
+	std::vector<T> corners[3][3];
+	for( int c=0; c<3; ++c ){
+		for( int i=0; i<3; ++i ){ corners[c][i].resize( n_tris ); }
+	}
+	for( int i=0; i<n_tris; ++i ){
+		for( int c=0; c<3; ++c ){
+			for( int j=0; j<3; ++j ){ corners[c][j][i] = verts[ mesh.faces[i][c] ][j]; }
+		}
+	}
+	const T *c1[3] = { &corners[0][0][0], &corners[0][1][0], &corners[0][2][0] };
+	const T *c2[3] = { &corners[1][0][0], &corners[1][1][0], &corners[1][2][0] };
+	const T *c3[3] = { &corners[2][0][0], &corners[2][1][0], &corners[2][2][0] };
+	for( int i=0; i<3; ++i ){ q[i].resize( n_tris ); }
+	d2.resize( n_tris );
+	for( int i=0; i<10; ++i ){
+		const Vec3i &f = mesh.faces[ rand_tri(gen) ];
+		const Vec3<T> pt = verts[f[0]] + Vec3<T>( dist(gen), dist(gen), dist(gen) )*T(0.01);
+		Proj::point_triangles( n_tris, pt, c1, c2, c3, &q[0][0], &q[1][0], &q[2][0], &d2[0] );
+		for( int j=0; j<n_tris; ++j ){
+			const Vec3i &g = mesh.faces[j];
+			const T area2 = ( verts[g[1]]-verts[g[0]] ).cross( verts[g[2]]-verts[g[0]] ).squaredNorm();
+			if( area2 <= T(0) ){ continue; }
+			const Vec3<T> qt( q[0][j], q[1][j], q[2][j] );
+			if( !check( pt, verts[g[0]], verts[g[1]], verts[g[2]], qt, d2[j] ) ){ return false; }
+		}
+	}
+
+	// A sliver, where the scalar version divides by zero, still gives a point
+	// on the triangle as near as its nearest vertex or better
+	const Vec3<T> s1(0,0,0), s2(1,0,0), s3(2,0,0), sp(0.5,1,0);
+	T sx = sp[0], sy = sp[1], sz = sp[2], qx, qy, qz, sd2;
+	Proj::points_triangle( 1, &sx, &sy, &sz, s1, s2, s3, &qx, &qy, &qz, &sd2 );
+	if( std::abs( qx - T(0.5) ) > T(1e-6) || std::abs( qy ) > T(1e-6) || std::abs( sd2 - T(1) ) > T(1e-6) ){
+		std::cerr << "Projection packets (" << Proj::name() << "): degenerate triangle gave " <<
+			qx << " " << qy << " " << qz << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+// TetInverse must agree with point_in_tet and vec::barycoords, except
+// for points so close to a face that rounding can put them on either side
+template <typename T, int W>
+bool test_tet_inverse( const TetMesh &mesh ){
+
+	typedef projection::TetInverse<T,W> Inverse;
+	const int n_tets = mesh.tets.size();
+	std::vector<Vec3<T> > verts( mesh.vertices.size() );
+	Eigen::AlignedBox<T,3> aabb;
+	for( size_t i=0; i<verts.size(); ++i ){
+		verts[i] = mesh.vertices[i].template cast<T>();
+		aabb.extend( verts[i] );
+	}
+	const T *vert_data = &verts[0][0];
+	const int *inds = &mesh.tets[0][0];
+	Inverse inverse;
+	inverse.init( vert_data, inds, n_tets );
+	const T tol = T(1e4)*std::numeric_limits<T>::epsilon();
+
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<T> dist(0,1);
+	std::uniform_int_distribution<int> tet_dist(0,n_tets-1);
+	auto tet_vert = [&]( int tet, int i ){ return verts[ mesh.tets[tet][i] ]; };
+	auto in_tet = [&]( int tet, const Vec3<T> &p ){
+		return projection::point_in_tet( p, tet_vert(tet,0), tet_vert(tet,1), tet_vert(tet,2), tet_vert(tet,3) );
+	};
+	auto ref_bary = [&]( int tet, const Vec3<T> &p ){
+		return vec::barycoords( p, tet_vert(tet,0), tet_vert(tet,1), tet_vert(tet,2), tet_vert(tet,3) );
+	};
+
+	// One point against all tets, from a subrange that isn't a multiple of W
+	int n_found = 0;
+	for( int i=0; i<200; ++i ){
+		const Vec3<T> p = aabb.min() + Vec3<T>( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+		const int first = i % 3;
+		const int n = n_tets - first - (i % 5);
+		int ref = -1;
+		for( int j=first; j<first+n && ref < 0; ++j ){
+			if( in_tet( j, p ) ){ ref = j; }
+		}
+		Vec4<T> bary;
+		const int tet = inverse.find( p, first, n, &bary );
+		if( tet == ref ){
+			if( tet >= 0 && ( bary - ref_bary( tet, p ) ).cwiseAbs().maxCoeff() > tol ){
+				std::cerr << "TetInverse (" << Inverse::name() << "): barycoords " << bary.transpose() <<
+					" != " << ref_bary( tet, p ).transpose() << std::endl;
+				return false;
+			}
+			n_found += int( tet >= 0 );
+			continue;
+		}
+		const T min_ref = ref >= 0 ? ref_bary( ref, p ).minCoeff() : T(0);
+		const T min_tet = tet >= 0 ? bary.minCoeff() : T(0);
+		if( ( tet >= 0 && ( tet < first || tet >= first+n || !( min_tet < tol ) ) ) || min_ref > tol ){
+			std::cerr << "TetInverse (" << Inverse::name() << "): found tet " << tet << ", expected " << ref << std::endl;
+			return false;
+		}
+	}
+	if( n_found == 0 ){
+		std::cerr << "TetInverse (" << Inverse::name() << "): no points were inside" << std::endl;
+		return false;
+	}
+
+	// Tets past the range are skipped, even in the same W lanes
+	const Vec3<T> last_center = ( tet_vert(n_tets-1,0) + tet_vert(n_tets-1,1) + tet_vert(n_tets-1,2) + tet_vert(n_tets-1,3) ) / T(4);
+	if( inverse.find( last_center, n_tets-2, 1 ) != -1 || inverse.find( last_center, n_tets-2, 2 ) != n_tets-1 ){
+		std::cerr << "TetInverse (" << Inverse::name() << "): find went past the range" << std::endl;
+		return false;
+	}
+
+	// Many points in one tet, about half inside
+	const int n_points = 4*W+3;
+	std::vector<T> p[3], b[4];
+	for( int i=0; i<3; ++i ){ p[i].resize( n_points ); }
+	for( int i=0; i<4; ++i ){ b[i].resize( n_points ); }
+	for( int i=0; i<100; ++i ){
+		const int tet = tet_dist(gen);
+		for( int j=0; j<n_points; ++j ){
+			Vec4<T> w( dist(gen), dist(gen), dist(gen), dist(gen) );
+			w = w*T(1.5) - Vec4<T>::Constant(T(0.1));
+			w /= w.sum();
+			const Vec3<T> pt = w[0]*tet_vert(tet,0) + w[1]*tet_vert(tet,1) + w[2]*tet_vert(tet,2) + w[3]*tet_vert(tet,3);
+			for( int k=0; k<3; ++k ){ p[k][j] = pt[k]; }
+		}
+		const int n_inside = inverse.barycoords( tet, n_points, &p[0][0], &p[1][0], &p[2][0], &b[0][0], &b[1][0], &b[2][0], &b[3][0] );
+		int n_ref = 0;
+		for( int j=0; j<n_points; ++j ){
+			const Vec3<T> pt( p[0][j], p[1][j], p[2][j] );
+			const Vec4<T> bary( b[0][j], b[1][j], b[2][j], b[3][j] );
+			const Vec4<T> ref = ref_bary( tet, pt );
+			if( ( bary - ref ).cwiseAbs().maxCoeff() > tol || inverse.contains( tet, pt ) != ( bary.minCoeff() > T(0) ) ){
+				std::cerr << "TetInverse (" << Inverse::name() << "): barycoords " << bary.transpose() <<
+					" != " << ref.transpose() << std::endl;
+				return false;
+			}
+			n_ref += int( inverse.contains( tet, pt ) );
+		}
+		if( n_inside != n_ref ){
+			std::cerr << "TetInverse (" << Inverse::name() << "): " << n_inside << " points inside, expected " << n_ref << std::endl;
+			return false;
+		}
+	}
+
+	// The same tets from a tree, with and without the inverse
+	{
+		bvh::AABBTree<T,4> tree;
+		tree.init( inds, vert_data, n_tets );
+		const int n = 1000;
+		std::vector<T> points( n*3 );
+		for( int i=0; i<n; ++i ){
+			const Vec3<T> pt = aabb.min() + Vec3<T>( dist(gen), dist(gen), dist(gen) ).cwiseProduct( aabb.sizes() );
+			for( int j=0; j<3; ++j ){ points[i*3+j] = pt[j]; }
+		}
+		std::vector<int> hit( n ), hit_inv( n );
+		bvh::QueryResults<T> results, results_inv;
+		results.prim = &hit[0];
+		results_inv.prim = &hit_inv[0];
+		bvh::point_in_tet( tree, vert_data, inds, &points[0], n, results );
+		projection::TetInverse<T> tree_inverse;
+		tree_inverse.init( vert_data, inds, n_tets );
+		bvh::point_in_tet( tree, vert_data, inds, &points[0], n, results_inv, true, &tree_inverse );
+		for( int i=0; i<n; ++i ){
+			if( hit[i] == hit_inv[i] ){ continue; }
+			const Vec3<T> pt( points[i*3], points[i*3+1], points[i*3+2] );
+			if( ( hit[i] >= 0 && ref_bary( hit[i], pt ).minCoeff() > tol ) ||
+				( hit_inv[i] >= 0 && !inverse.contains( hit_inv[i], pt ) ) ){
+				std::cerr << "TetInverse (" << Inverse::name() << "): point_in_tet found " << hit_inv[i] <<
+					", expected " << hit[i] << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
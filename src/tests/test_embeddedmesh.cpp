@@ -88,7 +88,13 @@ int main(void){
 			return EXIT_FAILURE;
 		}
 	}
-		
+
+	// Mapping the verts into the lattice again finds the same tets
+	std::vector<int> vert_to_tet = mesh.vert_to_tet;
+	if( !mesh.update_lattice() || mesh.vert_to_tet != vert_to_tet ){
+		std::cerr << "update_lattice changed the vert to tet mapping" << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }